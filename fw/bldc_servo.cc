@@ -27,6 +27,8 @@
 #include "mjlib/base/limit.h"
 #include "mjlib/base/windowed_average.h"
 
+#include "fw/bldc_servo_control.h"
+#include "fw/compact_telemetry.h"
 #include "fw/foc.h"
 #include "fw/math.h"
 #include "fw/moteus_hw.h"
@@ -59,13 +61,6 @@ using HardwareUart = Stm32G4AsyncUart;
 
 using mjlib::base::Limit;
 
-float Threshold(float, float, float) MOTEUS_CCM_ATTRIBUTE;
-
-float Threshold(float value, float lower, float upper) {
-  if (value > lower && value < upper) { return 0.0f; }
-  return value;
-}
-
 float Offset(float minval, float blend, float val) MOTEUS_CCM_ATTRIBUTE;
 
 float Offset(float minval, float blend, float val) {
@@ -125,17 +120,13 @@ int MapConfig(const Array& array, int value) {
   return result - 1;
 }
 
-#if MOTEUS_HW_REV >= 3
-// r4.1 and above have more DC-link capacitance and can run at the
-// slower 40kHz PWM frequency.
-constexpr int kIntRateHz = 40000;
-constexpr int kPwmRateHz = 40000;
-#elif MOTEUS_HW_REV <= 2
-constexpr int kIntRateHz = 30000;
-constexpr int kPwmRateHz = 60000;
-#endif
-constexpr int kInterruptDivisor = kPwmRateHz / kIntRateHz;
-static_assert(kPwmRateHz % kIntRateHz == 0);
+// The range of allowed values for servo.pwm_rate_hz.
+constexpr int kMinPwmRateHz = 15000;
+constexpr int kMaxPwmRateHz = 60000;
+
+// The control loop is never run faster than this.  Higher PWM rates
+// are divided down by an integer to reach it.
+constexpr int kMaxIntRateHz = 40000;
 
 // This is used to determine the maximum allowable PWM value so that
 // the current sampling is guaranteed to occur while the FETs are
@@ -148,27 +139,84 @@ static_assert(kPwmRateHz % kIntRateHz == 0);
 // As of 2020-09-13, 0.98 was the highest value that failed.
 constexpr float kCurrentSampleTime = 1.03e-6f;
 
-constexpr float kMinPwm = kCurrentSampleTime / (0.5f / static_cast<float>(kPwmRateHz));
-constexpr float kMaxPwm = 1.0f - kMinPwm;
-
-constexpr float kRateHz = kIntRateHz;
-constexpr float kPeriodS = 1.0f / kRateHz;
-
 constexpr int kCalibrateCount = 256;
 
-// The maximum amount the absolute encoder can change in one cycle
-// without triggering a fault.  Measured as a fraction of a uint16_t
-// and corresponds to roughly 28krpm, which is the limit of the AS5047
-// encoder.
-//  28000 / 60 = 467 Hz
-//  467 Hz * 65536 / kIntRate ~= 763
-constexpr int16_t kMaxPositionDelta = 28000 / 60 * 65536 / kIntRateHz;
+// The number of servo_compactN telemetry channels.
+constexpr int kCompactChannels = 2;
+
+/// All the quantities which depend upon the PWM and control rates.
+/// They are calculated once whenever the configuration changes, so
+/// that the ISR need not.
+struct RateConfig {
+  int pwm_rate_hz;
+  int interrupt_divisor;
+  int int_rate_hz;
+  float rate_hz;
+  float period_s;
+
+  float min_pwm;
+  float max_pwm;
+
+  // The maximum amount the absolute encoder can change in one cycle
+  // without triggering a fault.  Measured as a fraction of a
+  // uint16_t and corresponds to roughly 28krpm, which is the limit
+  // of the AS5047 encoder.
+  //  28000 / 60 = 467 Hz
+  //  467 Hz * 65536 / 40kHz ~= 763
+  int16_t max_position_delta;
+
+  // The smoothing constants for the first order filters applied to
+  // the temperature and bus voltage.
+  float alpha_10ms;
+  float alpha_1ms;
+  float alpha_500ms;
+
+  RateConfig(int pwm_rate_hz_in = 40000) {
+    pwm_rate_hz = std::max(kMinPwmRateHz, std::min(kMaxPwmRateHz, pwm_rate_hz_in));
+    interrupt_divisor = (pwm_rate_hz + kMaxIntRateHz - 1) / kMaxIntRateHz;
+    int_rate_hz = pwm_rate_hz / interrupt_divisor;
+    rate_hz = static_cast<float>(int_rate_hz);
+    period_s = 1.0f / rate_hz;
+
+    min_pwm = kCurrentSampleTime / (0.5f / static_cast<float>(pwm_rate_hz));
+    max_pwm = 1.0f - min_pwm;
+
+    max_position_delta = 28000 / 60 * 65536 / int_rate_hz;
+
+    alpha_10ms = 1.0f / (rate_hz * 0.01f);
+    alpha_1ms = 1.0f / (rate_hz * 0.001f);
+    alpha_500ms = 1.0f / (rate_hz * 0.5f);
+  }
+};
 
 constexpr float kDefaultTorqueConstant = 0.1f;
 constexpr float kMaxUnconfiguredCurrent = 5.0f;
 
 constexpr int kMaxVelocityFilter = 256;
 
+// The velocity PLL bandwidth is limited to this fraction of the
+// control rate.
+constexpr float kMaxVelocityPllBwRatio = 0.05f;
+
+// Commands which are to be applied further in the future than this
+// are assumed to have a bogus time, and are applied immediately.
+constexpr int32_t kMaxApplyDelayUs = 1000000;
+
+// The electrical phase offset table, in units where 2^32 is one
+// electrical revolution.  It has one extra entry duplicating the
+// first, so that interpolation never needs to wrap.  It lives in CCM
+// so that the lookup has a fixed cost.
+int32_t g_offset_table[BldcServo::Motor::kMaxOffsetSize + 1]
+    MOTEUS_CCM_ATTRIBUTE = {};
+
+// The cogging compensation current, laid out as g_offset_table.
+float g_cogging_table[BldcServo::Motor::kMaxCoggingSize + 1]
+    MOTEUS_CCM_ATTRIBUTE = {};
+
+constexpr int kScopeBufferSize = 2048;
+
+float g_scope_buffer[kScopeBufferSize] = {};
+
 IRQn_Type FindUpdateIrq(TIM_TypeDef* timer) {
 #if defined(TARGET_STM32G4)
   if (timer == TIM2) {
@@ -291,6 +339,14 @@ class BldcServo::Impl {
     telemetry_manager->Register("servo_cmd", &telemetry_data_);
     telemetry_manager->Register("servo_control", &control_);
 
+    persistent_config->Register("servo_compact0", &compact_config_[0], [](){});
+    persistent_config->Register("servo_compact1", &compact_config_[1], [](){});
+    telemetry_manager->Register("servo_compact0", compact_[0].record());
+    telemetry_manager->Register("servo_compact1", compact_[1].record());
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+    telemetry_manager->Register("servo_dwt", &dwt_stats_);
+#endif
+
     UpdateConfig();
 
     MJ_ASSERT(!g_impl_);
@@ -298,8 +354,13 @@ class BldcServo::Impl {
   }
 
   void Start() {
+    // The ADC trigger source can only be selected at startup.
+    adc_timer_trigger_ = config_.adc_timer_trigger;
+
     ConfigureADC();
     ConfigurePwmTimer();
+
+    boot_us_ = ms_timer_->read_us();
   }
 
   ~Impl() {
@@ -312,37 +373,80 @@ class BldcServo::Impl {
     MJ_ASSERT(data.mode != kCalibrating);
     MJ_ASSERT(data.mode != kCalibrationComplete);
 
+    // A stop, or a command which has timed out, ends the sequence of
+    // timestamps, so that a host which restarts is not rejected
+    // until its clock overtakes the previous one.
+    if (data.mode == kStopped || status_.mode == kPositionTimeout) {
+      last_host_timestamp_ = {};
+    }
+
+    if (data.host_timestamp) {
+      if (last_host_timestamp_ &&
+          static_cast<int32_t>(
+              *data.host_timestamp - *last_host_timestamp_) <= 0) {
+        // This is a duplicate, or was delivered out of order.
+        status_.stale_commands++;
+        return;
+      }
+      last_host_timestamp_ = data.host_timestamp;
+    }
+
+    // Any command still waiting for its apply time is superseded.
+    // Once this is clear, the ISR will not touch next_data_.
+    pending_apply_ = false;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+
     // Actually setting values will happen in the interrupt routine,
     // so we need to update this atomically.
     CommandData* next = next_data_;
     *next = data;
+    next->sequence = ++command_sequence_;
 
-    // If we have a case where the position is left unspecified, but
-    // we have a velocity and stop condition, then we pick the sign of
-    // the velocity so that we actually move.
-    if (std::isnan(next->position) &&
-        !std::isnan(next->stop_position) &&
-        !std::isnan(next->velocity) &&
-        next->velocity != 0.0f) {
-      next->velocity = std::abs(next->velocity) *
-          ((next->stop_position > status_.unwrapped_position) ?
-           1.0f : -1.0f);
-    }
-
-    if (next->timeout_s == 0.0f) {
-      next->timeout_s = config_.default_timeout_s;
-    }
+    BldcServoPosition::PrepareCommand(
+        next, status_.unwrapped_position, config_.default_timeout_s);
 
     telemetry_data_ = *next;
 
+    if (next->apply_us) {
+      const int32_t delay_us =
+          static_cast<int32_t>(*next->apply_us - ms_timer_->read_us());
+      if (delay_us > 0 && delay_us <= kMaxApplyDelayUs) {
+        // The ISR makes the swap once the time arrives.
+        pending_apply_us_ = *next->apply_us;
+        // The command and its apply time must be complete before the
+        // ISR can see the flag.
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        pending_apply_ = true;
+        return;
+      }
+      if (delay_us <= 0) { status_.late_commands++; }
+    }
+
     std::swap(current_data_, next_data_);
   }
 
+  Scope* scope() { return &scope_; }
+  float scope_rate_hz() const { return rate_config_->rate_hz; }
+  uint32_t isr_cycles() const { return isr_cycles_; }
+
   const Status& status() const { return status_; }
   const Config& config() const { return config_; }
   const Control& control() const { return control_; }
   const Motor& motor() const { return motor_; }
 
+  void SetEncoderCalibration(
+      uint8_t poles, bool invert,
+      const mjlib::base::inplace_function<float (int)>& offset) {
+    motor_.poles = poles;
+    motor_.invert = invert ? 1 : 0;
+    const int size = std::max<uint16_t>(
+        1, std::min<uint16_t>(Motor::kMaxOffsetSize, motor_.offset_size));
+    for (int i = 0; i < size; i++) {
+      motor_.offset[i] = offset(i);
+    }
+    UpdateConfig();
+  }
+
   bool is_torque_constant_configured() const {
     return motor_.v_per_hz != 0.0f;
   }
@@ -364,6 +468,28 @@ class BldcServo::Impl {
   }
 
   void UpdateConfig() {
+    {
+      // The ISR reads the rate configuration at any time, so the new
+      // one is built in the buffer it is not using and then published
+      // with a single pointer store.
+      RateConfig* const next =
+          (rate_config_ == &rate_config_buffers_[0]) ?
+          &rate_config_buffers_[1] : &rate_config_buffers_[0];
+      *next = RateConfig(config_.pwm_rate_hz);
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      rate_config_ = next;
+    }
+
+    if (timer_) {
+      // The ARR register is buffered, so this will take effect at the
+      // next update event.
+      pwm_counts_ = CalculatePwmCounts();
+      timer_->ARR = pwm_counts_;
+      if (adc_timer_trigger_) {
+        timer_->CCR4 = pwm_counts_ - 1;
+      }
+    }
+
     const float kv = 0.5f * 60.0f / motor_.v_per_hz;
 
     // I have no idea why this fudge is necessary, but it seems to be
@@ -377,12 +503,104 @@ class BldcServo::Impl {
 
     position_constant_ = motor_.poles / 2;
 
+    offset_size_ = std::max<uint16_t>(
+        1, std::min<uint16_t>(Motor::kMaxOffsetSize, motor_.offset_size));
+    for (uint32_t i = 0; i < offset_size_; i++) {
+      g_offset_table[i] = RadiansToQ31(motor_.offset[i]);
+    }
+    g_offset_table[offset_size_] = g_offset_table[0];
+
+    {
+      // The ISR may be using the cogging table at any time.  It is
+      // disabled while the table is rewritten, and the new size is
+      // only published once every entry, including the wraparound
+      // one, is in place.
+      const uint32_t cogging_size = std::min<uint16_t>(
+          Motor::kMaxCoggingSize, motor_.cogging_size);
+      cogging_size_ = 0;
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      for (uint32_t i = 0; i < cogging_size; i++) {
+        g_cogging_table[i] = motor_.cogging_A[i];
+      }
+      g_cogging_table[cogging_size] = g_cogging_table[0];
+      cogging_period_ = std::max<uint16_t>(1, motor_.cogging_period);
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      cogging_size_ = cogging_size;
+    }
+
     adc_scale_ = 3.3f / (4096.0f * MOTEUS_CURRENT_SENSE_OHM * config_.i_gain);
 
     velocity_filter_ = {std::min<size_t>(
           kMaxVelocityFilter, config_.velocity_filter_length)};
 
     motor_scale16_ = 65536.0f / motor_.unwrapped_position_scale;
+
+    decoupling_scale_ = BldcServoCurrent::DecouplingScale(
+        config_.feedforward_scale, motor_.inductance_H,
+        position_constant_, motor_.unwrapped_position_scale);
+
+    velocity_to_electrical_hz_ =
+        static_cast<float>(position_constant_) /
+        motor_.unwrapped_position_scale;
+    // For amplitude invariant dq, torque = 1.5 * pole pairs * flux *
+    // q_A.  Without a Kv, there is no flux to observe.
+    flux_observer_.SetMotor(
+        motor_.resistance_ohm, motor_.inductance_H,
+        (is_torque_constant_configured() && position_constant_ > 0) ?
+        (torque_constant_ / (1.5f * static_cast<float>(position_constant_))) :
+        0.0f,
+        rate_config_->period_s);
+
+    // A zero ramp approaches a pure sign function.
+    deadtime_comp_inv_A_ =
+        1.0f / std::max(1e-3f, config_.deadtime_comp_current_A);
+
+    bus_V_compensation_alpha_ =
+        (config_.bus_V_compensation_hz > 0.0f) ?
+        (1.0f - std::exp(-k2Pi * config_.bus_V_compensation_hz *
+                         rate_config_->period_s)) :
+        0.0f;
+    fast_bus_V_ = std::numeric_limits<float>::quiet_NaN();
+
+    // A critically damped second order observer.  The discrete
+    // update is only a good approximation of the continuous one, and
+    // eventually unstable, as the bandwidth approaches the control
+    // rate, so it is limited well below that.
+    velocity_pll_ = config_.velocity_pll_bw_hz > 0.0f;
+    const float pll_w = k2Pi * std::min(
+        config_.velocity_pll_bw_hz,
+        rate_config_->rate_hz * kMaxVelocityPllBwRatio);
+    velocity_pll_kp_dt_ = 2.0f * pll_w * rate_config_->period_s;
+    velocity_pll_ki_dt_ = pll_w * pll_w * rate_config_->period_s;
+    velocity_pll_reset_ = true;
+
+    // The advance uses the same velocity as is reported.  The PLL
+    // holds it in counts per second, while the velocity filter holds
+    // the sum of the per-cycle encoder deltas, so fold the period or
+    // the filter length into the conversion to electrical radians.
+    commutation_advance_scale_ =
+        config_.commutation_advance_cycles *
+        static_cast<float>(position_constant_) * (k2Pi / 65536.0f) *
+        (velocity_pll_ ?
+         rate_config_->period_s :
+         (1.0f / static_cast<float>(velocity_filter_.size())));
+
+    position_loop_divisor_ =
+        std::max<uint16_t>(1, config_.position_loop_divisor);
+    position_rate_hz_ = rate_config_->int_rate_hz / position_loop_divisor_;
+    position_period_s_ = 1.0f / static_cast<float>(position_rate_hz_);
+
+    const auto limit_or_inf = [](float value) {
+      return std::isnan(value) ? std::numeric_limits<float>::infinity() :
+          std::abs(value);
+    };
+    trajectory_velocity_limit_ =
+        limit_or_inf(config_.trajectory_velocity_limit);
+    trajectory_accel_limit_ = limit_or_inf(config_.trajectory_accel_limit);
+    trajectory_ =
+        std::isfinite(trajectory_velocity_limit_) ||
+        std::isfinite(trajectory_accel_limit_);
+    position_loop_phase_ = 0;
   }
 
   void PollMillisecond() {
@@ -393,9 +611,88 @@ class BldcServo::Impl {
       *mode_volatile = kCalibrating;
     }
     startup_count_++;
+
+    PollThermalModel();
+    PollBackgroundCalibration(mode);
+
+    for (auto& compact : compact_) {
+      compact.Update([&](uint8_t signal) { return ScopeSignalValue(signal); });
+    }
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+    dwt_stats_.ForEachStage([](auto* stage) { stage->UpdateMean(); });
+#endif
   }
 
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+  void ResetDwtStats() {
+    dwt_stats_reset_ = true;
+  }
+#endif
+
  private:
+  void PollBackgroundCalibration(Mode mode) {
+    if (!config_.adc_fast_start ||
+        mode != kStopped ||
+        status_.cooldown_count != 0) {
+      stopped_ms_ = 0;
+      return;
+    }
+
+    stopped_ms_++;
+
+    if (!background_cal_done_ &&
+        OffsetsValid(config_.stored_adc_cur1_offset,
+                     config_.stored_adc_cur2_offset,
+                     config_.stored_adc_cur3_offset)) {
+      // The stored offsets are good enough to start from, so the
+      // controller is ready right away, and the first refresh waits
+      // for the usual interval.
+      background_cal_done_ = true;
+      stopped_ms_ = 0;
+      stored_offsets_request_ = true;
+      return;
+    }
+
+    const bool due =
+        !background_cal_done_ ||
+        (config_.adc_fast_start_refresh_s > 0.0f &&
+         static_cast<float>(stopped_ms_) >=
+         config_.adc_fast_start_refresh_s * 1000.0f);
+    // Without a plausible bus voltage, leaving stopped would just
+    // fault.
+    if (!due || status_.bus_V < 4.0f ||
+        status_.bus_V > config_.max_voltage) {
+      return;
+    }
+
+    background_cal_done_ = true;
+    stopped_ms_ = 0;
+    background_cal_request_ = true;
+  }
+
+  void PollThermalModel() {
+    if (!config_.thermal.enable ||
+        std::isnan(status_.filt_fet_temp_C)) {
+      thermal_limit_A_ = std::numeric_limits<float>::infinity();
+      return;
+    }
+
+    // The ISR published the mean over the previous millisecond when
+    // we last asked.
+    thermal_model_.Update(thermal_i2_mean_, motor_.resistance_ohm,
+                          status_.filt_fet_temp_C, 0.001f,
+                          config_.max_current_A);
+    thermal_take_ = true;
+
+    thermal_limit_A_ = thermal_model_.current_limit_A();
+    status_.thermal = thermal_model_.status();
+  }
+
+  uint32_t CalculatePwmCounts() const {
+    return HAL_RCC_GetPCLK1Freq() * 2 / (2 * rate_config_->pwm_rate_hz);
+  }
+
   void ConfigurePwmTimer() {
     const auto pwm1_timer = pinmap_peripheral(options_.pwm1, PinMap_PWM);
     const auto pwm2_timer = pinmap_peripheral(options_.pwm2, PinMap_PWM);
@@ -415,8 +712,9 @@ class BldcServo::Impl {
     pwm3_ccr_ = FindCcr(timer_, options_.pwm3);
 
 
-    // Enable the update interrupt.
-    timer_->DIER = TIM_DIER_UIE;
+    // Enable the update interrupt, unless the ADC will be driving our
+    // control cycle instead.
+    timer_->DIER = adc_timer_trigger_ ? 0 : TIM_DIER_UIE;
 
     // Enable the update interrupt.
     timer_->CR1 =
@@ -435,15 +733,24 @@ class BldcServo::Impl {
     // Set up PWM.
 
     timer_->PSC = 0; // No prescaler.
-    pwm_counts_ = HAL_RCC_GetPCLK1Freq() * 2 / (2 * kPwmRateHz);
+    pwm_counts_ = CalculatePwmCounts();
     timer_->ARR = pwm_counts_;
 
     // NOTE: We don't use micro::CallbackTable here because we need the
     // absolute minimum latency possible.
-    const auto irqn = FindUpdateIrq(timer_);
-    NVIC_SetVector(irqn, reinterpret_cast<uint32_t>(&Impl::GlobalInterrupt));
-    HAL_NVIC_SetPriority(irqn, 0, 0);
-    NVIC_EnableIRQ(irqn);
+    if (adc_timer_trigger_) {
+      ConfigureAdcTimerTrigger();
+
+      const auto irqn = ADC3_IRQn;
+      NVIC_SetVector(irqn, reinterpret_cast<uint32_t>(&Impl::GlobalAdcInterrupt));
+      HAL_NVIC_SetPriority(irqn, 0, 0);
+      NVIC_EnableIRQ(irqn);
+    } else {
+      const auto irqn = FindUpdateIrq(timer_);
+      NVIC_SetVector(irqn, reinterpret_cast<uint32_t>(&Impl::GlobalInterrupt));
+      HAL_NVIC_SetPriority(irqn, 0, 0);
+      NVIC_EnableIRQ(irqn);
+    }
 
     // Reinitialize the counter and update all registers.
     timer_->EGR |= TIM_EGR_UG;
@@ -452,6 +759,56 @@ class BldcServo::Impl {
     timer_->CR1 |= TIM_CR1_CEN;
   }
 
+  void ConfigureAdcTimerTrigger() {
+    // The EXTSEL selection below is only valid for TIM2.
+    MJ_ASSERT(timer_ == TIM2);
+
+    // Channel 4 is not connected to any output.  In PWM mode 2 its
+    // OC4REF rises just before the counter reaches its maximum, when
+    // all the low side FETs are on.  That edge is routed to TRGO and
+    // starts the current conversions with no software latency.
+    timer_->CCMR2 =
+        (timer_->CCMR2 & ~(TIM_CCMR2_OC4M | TIM_CCMR2_CC4S)) |
+        (7 << TIM_CCMR2_OC4M_Pos);
+    timer_->CCR4 = pwm_counts_ - 1;
+    timer_->CR2 =
+        (timer_->CR2 & ~TIM_CR2_MMS) |
+        (7 << TIM_CR2_MMS_Pos);  // OC4REF is TRGO
+
+    // RM0440 Table 163 and 164: EXT11 is TIM2_TRGO for both ADC12
+    // and ADC345.  Trigger on the rising edge.  Conversions on cycles
+    // skipped due to the interrupt divisor are never read, so always
+    // let new results overwrite old ones.
+    constexpr uint32_t kTim2Trgo = 11;
+    auto set_trigger = [&](auto* adc) {
+      adc->CFGR =
+          (adc->CFGR & ~(ADC_CFGR_EXTSEL | ADC_CFGR_EXTEN)) |
+          (kTim2Trgo << ADC_CFGR_EXTSEL_Pos) |
+          (1 << ADC_CFGR_EXTEN_Pos) |
+          ADC_CFGR_OVRMOD;
+    };
+    set_trigger(ADC1);
+    set_trigger(ADC2);
+    set_trigger(ADC3);
+
+    // ADC3 is the last to finish, so its end of sequence is when our
+    // control cycle can begin.
+    ADC3->ISR = ADC_ISR_EOS;
+    ADC3->IER = ADC_IER_EOSIE;
+
+    // With a hardware trigger, ADSTART just arms the ADCs.  They
+    // remain armed for every subsequent trigger.
+    ADC1->CR |= ADC_CR_ADSTART;
+    ADC2->CR |= ADC_CR_ADSTART;
+    ADC3->CR |= ADC_CR_ADSTART;
+
+    // The auxiliary channels are sampled in the background, a cycle
+    // ahead of when they are used.  Prime them now so that the first
+    // control cycle has valid data.
+    ADC4->CR |= ADC_CR_ADSTART;
+    ADC5->CR |= ADC_CR_ADSTART;
+  }
+
   void ConfigureADC() {
     constexpr uint16_t kCycleMap[] = {
       2, 6, 12, 24, 47, 92, 247, 640,
@@ -630,6 +987,20 @@ class BldcServo::Impl {
     g_impl_->ISR_HandleTimer();
   }
 
+  // CALLED IN INTERRUPT CONTEXT.
+  static void GlobalAdcInterrupt() MOTEUS_CCM_ATTRIBUTE {
+    g_impl_->ISR_HandleAdc();
+  }
+
+  // CALLED IN INTERRUPT CONTEXT.
+  void ISR_HandleAdc() __attribute__((always_inline)) MOTEUS_CCM_ATTRIBUTE {
+    // The current samples are already complete, so there is nothing
+    // to wait for.
+    ADC3->ISR = ADC_ISR_EOS;
+
+    ISR_DoCycle();
+  }
+
   // CALLED IN INTERRUPT CONTEXT.
   void ISR_HandleTimer() __attribute__((always_inline)) MOTEUS_CCM_ATTRIBUTE {
     // From here, until when we finish sampling the ADC has a critical
@@ -659,15 +1030,26 @@ class BldcServo::Impl {
     ADC4->CR |= ADC_CR_ADSTART;
     ADC5->CR |= ADC_CR_ADSTART;
 
-    if constexpr (kInterruptDivisor != 1) {
-      phase_ = (phase_ + 1) % kInterruptDivisor;
+    ISR_DoCycle();
+  }
+
+  void ISR_DoCycle() __attribute__((always_inline)) MOTEUS_CCM_ATTRIBUTE {
+    if (rate_config_->interrupt_divisor != 1) {
+      phase_++;
+      if (phase_ >= rate_config_->interrupt_divisor) { phase_ = 0; }
 
       if (phase_ != 0) { return; }
     }
 
 #ifdef MOTEUS_PERFORMANCE_MEASURE
     DWT->CYCCNT = 0;
+
+    // These stages are only reached in some modes.  Zero them so
+    // that stale values are not accumulated into the statistics.
+    status_.dwt.control_done_pos = 0;
+    status_.dwt.control_done_cur = 0;
 #endif
+    const uint32_t start_cycles = DWT->CYCCNT;
 
     // No matter what mode we are in, always sample our ADC and
     // position sensors.
@@ -685,14 +1067,31 @@ class BldcServo::Impl {
     status_.dwt.curstate = DWT->CYCCNT;
 #endif
 
-    ISR_DoControl(sin_cos);
+    // The currents were transformed with the angle they were sampled
+    // at, but the voltages only take effect once the PWM updates, so
+    // they alone are modulated with the extrapolated angle.
+    const SinCos output_sin_cos =
+        (commutation_advance_scale_ == 0.0f) ? sin_cos :
+        cordic_(RadiansToQ31(
+                    BldcServoCurrent::CommutationTheta(
+                        status_.electrical_theta,
+                        commutation_advance_scale_,
+                        velocity_pll_ ?
+                        velocity_pll_velocity_ :
+                        static_cast<float>(velocity_filter_.total()))));
+
+    ISR_DoControl(output_sin_cos);
 
 #ifdef MOTEUS_PERFORMANCE_MEASURE
     status_.dwt.control = DWT->CYCCNT;
 #endif
 
+    ISR_DoScope();
+
 #ifdef MOTEUS_PERFORMANCE_MEASURE
     status_.dwt.done = DWT->CYCCNT;
+
+    ISR_UpdateDwtStats();
 #endif
 
     const uint32_t cnt = timer_->CNT;
@@ -702,11 +1101,38 @@ class BldcServo::Impl {
         (pwm_counts_ + cnt);
     status_.total_timer = 2 * pwm_counts_;
     debug_out_ = 0;
+
+    isr_cycles_ += DWT->CYCCNT - start_cycles;
   }
 
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+  void ISR_UpdateDwtStats() MOTEUS_CCM_ATTRIBUTE {
+    if (dwt_stats_reset_) {
+      dwt_stats_ = {};
+      dwt_stats_reset_ = false;
+    }
+
+    const auto& dwt = status_.dwt;
+    dwt_stats_.adc_done.Add(dwt.adc_done);
+    dwt_stats_.start_pos_sample.Add(dwt.start_pos_sample);
+    dwt_stats_.done_pos_sample.Add(dwt.done_pos_sample);
+    dwt_stats_.done_temp_sample.Add(dwt.done_temp_sample);
+    dwt_stats_.sense.Add(dwt.sense);
+    dwt_stats_.curstate.Add(dwt.curstate);
+    dwt_stats_.control_sel_mode.Add(dwt.control_sel_mode);
+    dwt_stats_.control_done_pos.Add(dwt.control_done_pos);
+    dwt_stats_.control_done_cur.Add(dwt.control_done_cur);
+    dwt_stats_.control.Add(dwt.control);
+    dwt_stats_.done.Add(dwt.done);
+  }
+#endif
+
   void ISR_DoSense() __attribute__((always_inline)) MOTEUS_CCM_ATTRIBUTE {
-    // Wait for sampling to complete.
-    while ((ADC3->ISR & ADC_ISR_EOS) == 0);
+    // Wait for sampling to complete.  When timer triggered, this
+    // cycle only starts once it has.
+    if (!adc_timer_trigger_) {
+      while ((ADC3->ISR & ADC_ISR_EOS) == 0);
+    }
 
     // We would like to set this debug pin as soon as possible.
     // However, if we flip it while the current ADCs are sampling,
@@ -736,57 +1162,44 @@ class BldcServo::Impl {
 
     // Do a bit more rarely needed bookeeping while we let the ADCs
     // finish.
+    if (pending_apply_ &&
+        static_cast<int32_t>(ms_timer_->read_us() - pending_apply_us_) >= 0) {
+      std::swap(current_data_, next_data_);
+      pending_apply_ = false;
+    }
+
     if (current_data_->rezero_position) {
       status_.position_to_set = *current_data_->rezero_position;
       status_.rezeroed = true;
       current_data_->rezero_position = {};
     }
 
-    if (std::isnan(current_data_->timeout_s) ||
-        current_data_->timeout_s != 0.0f) {
-      status_.timeout_s = current_data_->timeout_s;
-      current_data_->timeout_s = 0.0;
+    {
+      // Everything else which should only happen once per command is
+      // keyed off the sequence number.  The one-shot fields cleared
+      // above, rezero_position here and set_position in
+      // ISR_DoControl, are the only writes the ISR makes to
+      // current_data_.  Command() only ever fills next_data_, so
+      // they do not race.
+      const CommandData* const data = current_data_;
+      if (data->sequence != status_.command_sequence) {
+        status_.command_sequence = data->sequence;
+        status_.timeout_s = data->timeout_s;
+      }
     }
 
-    // And now, wait for the entire conversion to complete.  We
-    // started ADC3 last, so we just wait for it.
-    WaitForAdc(ADC3);
-
-#ifdef MOTEUS_PERFORMANCE_MEASURE
-    status_.dwt.adc_done = DWT->CYCCNT;
-#endif
-
-    status_.adc_cur1_raw = ADC3->DR;
-    status_.adc_cur2_raw = ADC1->DR;
-    status_.adc_cur3_raw = ADC2->DR;
-
-    // TODO: Since we have to let ADC4/5 sample for much longer, we
-    // could save a lot of time by switching ADC5's targets every
-    // other cycle and not even reading it until the position sampling
-    // was done.  For now though, we read all the things every cycle.
-    WaitForAdc(ADC4);
-    WaitForAdc(ADC5);
-
-    if (hw_rev_ <= 4) {
-      status_.adc_motor_temp_raw = ADC4->DR;
-      status_.adc_voltage_sense_raw = ADC5->DR;
+    if (adc_timer_trigger_) {
+      ISR_ReadTriggeredAdcs();
     } else {
-      status_.adc_voltage_sense_raw = ADC4->DR;
-      status_.adc_fet_temp_raw = ADC5->DR;
+      ISR_ReadAdcs();
     }
 
-    // Start sampling the other thing on ADC5, what that is depends
-    // upon our board version.
-    if (hw_rev_ <= 4) {
-      ADC5->SQR1 =
-          (0 << ADC_SQR1_L_Pos) |  // length 1
-          tsense_sqr_ << ADC_SQR1_SQ1_Pos;
-    } else {
-      ADC5->SQR1 =
-          (0 << ADC_SQR1_L_Pos) |  // length 1
-          msense_sqr_ << ADC_SQR1_SQ1_Pos;
+    // None of these depend upon the encoder, so we do them while the
+    // SPI transaction is still in progress.
+    ISR_CalculatePhaseCurrents();
+    if (adc_timer_trigger_) {
+      ISR_CalculateFetTemperature();
     }
-    ADC5->CR |= ADC_CR_ADSTART;
 
     // Wait for the position sample to finish.
     const uint16_t old_position = status_.position;
@@ -804,20 +1217,32 @@ class BldcServo::Impl {
     status_.position =
         (motor_.invert ? (65536 - status_.position_raw) : status_.position_raw);
 
-    const int offset_size = motor_.offset.size();
-    const int offset_index = status_.position * offset_size / 65536;
-    MJ_ASSERT(offset_index >= 0 && offset_index < offset_size);
+    // Interpolate the offset table in fixed point.  Since the table
+    // is scaled so that 2^32 is one electrical revolution, the
+    // addition below wraps without any further work.
+    const uint32_t scaled_position = status_.position * offset_size_;
+    const uint32_t offset_index = scaled_position >> 16;
+    const int32_t offset_fraction = scaled_position & 0xffff;
+    const int32_t offset_base = g_offset_table[offset_index];
+    const int32_t offset_delta = static_cast<int32_t>(
+        static_cast<uint32_t>(g_offset_table[offset_index + 1]) -
+        static_cast<uint32_t>(offset_base));
+    const int32_t offset =
+        offset_base +
+        static_cast<int32_t>(
+            (static_cast<int64_t>(offset_delta) * offset_fraction) >> 16);
 
-    constexpr float kU16ToTheta = k2Pi / 65536.0f;
+    const uint32_t electrical_u32 =
+        ((static_cast<uint32_t>(position_constant_) * status_.position) << 16) +
+        static_cast<uint32_t>(offset);
+    constexpr float kU32ToTheta = k2Pi / 4294967296.0f;
     status_.electrical_theta =
-        WrapZeroToTwoPi(
-            ((position_constant_ * status_.position) % 65536) * kU16ToTheta +
-            motor_.offset[offset_index]);
+        static_cast<float>(electrical_u32) * kU32ToTheta;
 
     const int16_t delta_position =
         static_cast<int16_t>(status_.position - old_position);
     if ((status_.mode != kStopped && status_.mode != kFault) &&
-        std::abs(delta_position) > kMaxPositionDelta) {
+        std::abs(delta_position) > rate_config_->max_position_delta) {
       // We probably had an error when reading the position.  We must fault.
       status_.mode = kFault;
       status_.fault = errc::kEncoderFault;
@@ -831,13 +1256,11 @@ class BldcServo::Impl {
           static_cast<int16_t>(
               static_cast<int32_t>(status_.position) +
               motor_.position_offset * (motor_.invert ? -1 : 1));
-      const float error = status_.position_to_set -
-                          zero_position / motor_scale16_;
-      const float integral_offsets =
-          std::round(error / motor_.unwrapped_position_scale);
-      status_.unwrapped_position_raw =
-          zero_position + integral_offsets * 65536.0f;
+      status_.unwrapped_position_raw = BldcServoPosition::Rezero(
+          status_.position_to_set, zero_position,
+          motor_scale16_, motor_.unwrapped_position_scale);
       status_.position_to_set = std::numeric_limits<float>::quiet_NaN();
+      velocity_pll_reset_ = true;
     } else {
       status_.unwrapped_position_raw += delta_position;
     }
@@ -848,83 +1271,235 @@ class BldcServo::Impl {
       // losslessly.  Then, the average is conducted in the floating
       // point domain, so as to not suffer from rounding error.
       velocity_filter_.Add(delta_position);
-      status_.velocity =
-          ((static_cast<float>(velocity_filter_.total()) / motor_scale16_) *
-           kRateHz) /
-          static_cast<float>(velocity_filter_.size());
+      if (velocity_pll_) {
+        ISR_UpdateVelocityPll();
+        status_.velocity = velocity_pll_velocity_ / motor_scale16_;
+      } else {
+        status_.velocity =
+            ((static_cast<float>(velocity_filter_.total()) / motor_scale16_) *
+             rate_config_->rate_hz) /
+            static_cast<float>(velocity_filter_.size());
+      }
     }
 
     status_.unwrapped_position =
         status_.unwrapped_position_raw / motor_scale16_;
 
-    // The temperature sensing should be done by now, but just double
-    // check.
+    if (config_.flux_observer.enable && flux_observer_.configured() &&
+        torque_on()) {
+      // control_.voltage still holds what was applied over the
+      // period which just ended.
+      status_.electrical_theta = flux_observer_.Update(
+          ClarkTransform(control_.voltage.a,
+                         control_.voltage.b,
+                         control_.voltage.c),
+          ClarkTransform(status_.cur1_A, status_.cur3_A, status_.cur2_A),
+          status_.electrical_theta,
+          status_.velocity * velocity_to_electrical_hz_);
+      status_.flux_observer = flux_observer_.status();
+    } else {
+      flux_observer_.Reset();
+    }
+
+    if (!adc_timer_trigger_) {
+      // The temperature sensing should be done by now, but just double
+      // check.
+      WaitForAdc(ADC5);
+      if (hw_rev_ <= 4) {
+        status_.adc_fet_temp_raw = ADC5->DR;
+      } else {
+        status_.adc_motor_temp_raw = ADC5->DR;
+      }
+
+      if (hw_rev_ <= 4) {
+        // Switch back to the voltage sense resistor.
+        ADC5->SQR1 =
+            (0 << ADC_SQR1_L_Pos) |  // length 1
+            (vsense_sqr_ << ADC_SQR1_SQ1_Pos);
+      } else {
+        // Switch back to FET temp sense.
+        ADC5->SQR1 =
+            (0 << ADC_SQR1_L_Pos) |  // length 1
+            (tsense_sqr_ << ADC_SQR1_SQ1_Pos);
+      }
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+      status_.dwt.done_temp_sample = DWT->CYCCNT;
+#endif
+
+      ISR_CalculateFetTemperature();
+    }
+  }
+
+  // A second order tracking observer on unwrapped_position_raw.  It
+  // has much less group delay than the windowed average for the same
+  // amount of noise rejection.
+  void ISR_UpdateVelocityPll() __attribute__((always_inline)) MOTEUS_CCM_ATTRIBUTE {
+    if (velocity_pll_reset_) {
+      velocity_pll_position_int_ = status_.unwrapped_position_raw;
+      velocity_pll_position_frac_ = 0.0f;
+      velocity_pll_reset_ = false;
+    }
+
+    // The estimated position is kept as an integer and a fractional
+    // part so that no precision is lost at large positions.
+    const int32_t int_error = static_cast<int32_t>(
+        static_cast<uint32_t>(status_.unwrapped_position_raw) -
+        static_cast<uint32_t>(velocity_pll_position_int_));
+    const float error =
+        static_cast<float>(int_error) - velocity_pll_position_frac_;
+
+    velocity_pll_position_frac_ +=
+        velocity_pll_velocity_ * rate_config_->period_s +
+        velocity_pll_kp_dt_ * error;
+    velocity_pll_velocity_ += velocity_pll_ki_dt_ * error;
+
+    const int32_t whole = static_cast<int32_t>(velocity_pll_position_frac_);
+    velocity_pll_position_int_ += whole;
+    velocity_pll_position_frac_ -= static_cast<float>(whole);
+  }
+
+  void ISR_CalculateFetTemperature() __attribute__((always_inline)) MOTEUS_CCM_ATTRIBUTE {
+    constexpr int adc_max = 4096;
+    constexpr size_t size_thermistor_table =
+        sizeof(g_thermistor_lookup) / sizeof(*g_thermistor_lookup);
+    size_t offset = std::max<size_t>(
+        1, std::min<size_t>(
+            size_thermistor_table - 2,
+            status_.adc_fet_temp_raw * size_thermistor_table / adc_max));
+    const int16_t this_value = offset * adc_max / size_thermistor_table;
+    const int16_t next_value = (offset + 1) * adc_max / size_thermistor_table;
+    const float temp1 = g_thermistor_lookup[offset];
+    const float temp2 = g_thermistor_lookup[offset + 1];
+    status_.fet_temp_C = temp1 +
+        (temp2 - temp1) *
+        static_cast<float>(status_.adc_fet_temp_raw - this_value) /
+        static_cast<float>(next_value - this_value);
+    ISR_UpdateFilteredValue(status_.fet_temp_C, &status_.filt_fet_temp_C,
+                            rate_config_->alpha_10ms);
+  }
+
+  void ISR_ReadAdcs() __attribute__((always_inline)) MOTEUS_CCM_ATTRIBUTE {
+    // And now, wait for the entire conversion to complete.  We
+    // started ADC3 last, so we just wait for it.
+    WaitForAdc(ADC3);
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+    status_.dwt.adc_done = DWT->CYCCNT;
+#endif
+
+    status_.adc_cur1_raw = ADC3->DR;
+    status_.adc_cur2_raw = ADC1->DR;
+    status_.adc_cur3_raw = ADC2->DR;
+
+    // NOTE: ISR_ReadTriggeredAdcs avoids waiting here by sampling
+    // ADC4/5 a cycle in advance and switching ADC5's targets every
+    // other cycle.  This path reads all the things every cycle.
+    WaitForAdc(ADC4);
     WaitForAdc(ADC5);
+
     if (hw_rev_ <= 4) {
-      status_.adc_fet_temp_raw = ADC5->DR;
+      status_.adc_motor_temp_raw = ADC4->DR;
+      status_.adc_voltage_sense_raw = ADC5->DR;
     } else {
-      status_.adc_motor_temp_raw = ADC5->DR;
+      status_.adc_voltage_sense_raw = ADC4->DR;
+      status_.adc_fet_temp_raw = ADC5->DR;
     }
 
+    // Start sampling the other thing on ADC5, what that is depends
+    // upon our board version.
     if (hw_rev_ <= 4) {
-      // Switch back to the voltage sense resistor.
       ADC5->SQR1 =
           (0 << ADC_SQR1_L_Pos) |  // length 1
-          (vsense_sqr_ << ADC_SQR1_SQ1_Pos);
+          tsense_sqr_ << ADC_SQR1_SQ1_Pos;
     } else {
-      // Switch back to FET temp sense.
       ADC5->SQR1 =
           (0 << ADC_SQR1_L_Pos) |  // length 1
-          (tsense_sqr_ << ADC_SQR1_SQ1_Pos);
+          msense_sqr_ << ADC_SQR1_SQ1_Pos;
     }
+    ADC5->CR |= ADC_CR_ADSTART;
+  }
 
+  void ISR_ReadTriggeredAdcs() __attribute__((always_inline)) MOTEUS_CCM_ATTRIBUTE {
 #ifdef MOTEUS_PERFORMANCE_MEASURE
-    status_.dwt.done_temp_sample = DWT->CYCCNT;
+    status_.dwt.adc_done = DWT->CYCCNT;
 #endif
 
-    {
-      constexpr int adc_max = 4096;
-      constexpr size_t size_thermistor_table =
-          sizeof(g_thermistor_lookup) / sizeof(*g_thermistor_lookup);
-      size_t offset = std::max<size_t>(
-          1, std::min<size_t>(
-              size_thermistor_table - 2,
-              status_.adc_fet_temp_raw * size_thermistor_table / adc_max));
-      const int16_t this_value = offset * adc_max / size_thermistor_table;
-      const int16_t next_value = (offset + 1) * adc_max / size_thermistor_table;
-      const float temp1 = g_thermistor_lookup[offset];
-      const float temp2 = g_thermistor_lookup[offset + 1];
-      status_.fet_temp_C = temp1 +
-          (temp2 - temp1) *
-          static_cast<float>(status_.adc_fet_temp_raw - this_value) /
-          static_cast<float>(next_value - this_value);
-      ISR_UpdateFilteredValue(status_.fet_temp_C, &status_.filt_fet_temp_C, 0.01f);
-    }
-  }
-
-  static void ISR_UpdateFilteredValue(float input, float* filtered, float period_s) MOTEUS_CCM_ATTRIBUTE {
+    status_.adc_cur1_raw = ADC3->DR;
+    status_.adc_cur2_raw = ADC1->DR;
+    status_.adc_cur3_raw = ADC2->DR;
+
+    // ADC4/5 were started at the end of the previous cycle, so they
+    // are long since complete.  ADC5 alternates between its two
+    // channels, so each is sampled at half the control rate.
+    const uint16_t adc4 = ADC4->DR;
+    const uint16_t adc5 = ADC5->DR;
+
+    if (hw_rev_ <= 4) {
+      status_.adc_motor_temp_raw = adc4;
+      if (aux_phase_ == 0) {
+        status_.adc_voltage_sense_raw = adc5;
+      } else {
+        status_.adc_fet_temp_raw = adc5;
+      }
+    } else {
+      status_.adc_voltage_sense_raw = adc4;
+      if (aux_phase_ == 0) {
+        status_.adc_fet_temp_raw = adc5;
+      } else {
+        status_.adc_motor_temp_raw = adc5;
+      }
+    }
+
+    aux_phase_ ^= 1;
+
+    const uint32_t next_sqr =
+        (hw_rev_ <= 4) ?
+        ((aux_phase_ == 0) ? vsense_sqr_ : tsense_sqr_) :
+        ((aux_phase_ == 0) ? tsense_sqr_ : msense_sqr_);
+    ADC5->SQR1 =
+        (0 << ADC_SQR1_L_Pos) |  // length 1
+        (next_sqr << ADC_SQR1_SQ1_Pos);
+
+    ADC4->CR |= ADC_CR_ADSTART;
+    ADC5->CR |= ADC_CR_ADSTART;
+  }
+
+  static void ISR_UpdateFilteredValue(float input, float* filtered, float alpha) MOTEUS_CCM_ATTRIBUTE {
     if (std::isnan(*filtered)) {
       *filtered = input;
     } else {
-      const float alpha = 1.0f / (kRateHz * period_s);
       *filtered = alpha * input + (1.0f - alpha) * *filtered;
     }
   }
 
-  void ISR_UpdateFilteredBusV(float* filtered, float period_s) const MOTEUS_CCM_ATTRIBUTE {
-    ISR_UpdateFilteredValue(status_.bus_V, filtered, period_s);
+  void ISR_UpdateFilteredBusV(float* filtered, float alpha) const MOTEUS_CCM_ATTRIBUTE {
+    ISR_UpdateFilteredValue(status_.bus_V, filtered, alpha);
   }
 
   // This is called from the ISR.
-  void ISR_CalculateCurrentState(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
+  void ISR_CalculatePhaseCurrents() __attribute__((always_inline)) MOTEUS_CCM_ATTRIBUTE {
     status_.cur1_A = (status_.adc_cur1_raw - status_.adc_cur1_offset) * adc_scale_;
     status_.cur2_A = (status_.adc_cur2_raw - status_.adc_cur2_offset) * adc_scale_;
     status_.cur3_A = (status_.adc_cur3_raw - status_.adc_cur3_offset) * adc_scale_;
     status_.bus_V = status_.adc_voltage_sense_raw * vsense_adc_scale_;
 
-    ISR_UpdateFilteredBusV(&status_.filt_bus_V, 0.5f);
-    ISR_UpdateFilteredBusV(&status_.filt_1ms_bus_V, 0.001f);
+    ISR_UpdateFilteredBusV(&status_.filt_bus_V, rate_config_->alpha_500ms);
+    ISR_UpdateFilteredBusV(&status_.filt_1ms_bus_V, rate_config_->alpha_1ms);
 
+    if (bus_V_compensation_alpha_ == 0.0f) {
+      status_.pwm_bus_V = status_.filt_bus_V;
+    } else {
+      ISR_UpdateFilteredBusV(&fast_bus_V_, bus_V_compensation_alpha_);
+      const float band =
+          config_.bus_V_compensation_max_ratio * status_.filt_bus_V;
+      status_.pwm_bus_V = Limit(fast_bus_V_,
+                                status_.filt_bus_V - band,
+                                status_.filt_bus_V + band);
+    }
+  }
+
+  void ISR_CalculateCurrentState(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
     DqTransform dq{sin_cos,
           status_.cur1_A,
           status_.cur3_A,
@@ -932,6 +1507,18 @@ class BldcServo::Impl {
           };
     status_.d_A = dq.d;
     status_.q_A = dq.q;
+
+    if (config_.thermal.enable) {
+      thermal_i2_sum_ += dq.d * dq.d + dq.q * dq.q;
+      thermal_i2_count_++;
+      if (thermal_take_) {
+        thermal_i2_mean_ =
+            thermal_i2_sum_ / static_cast<float>(thermal_i2_count_);
+        thermal_i2_sum_ = 0.0f;
+        thermal_i2_count_ = 0;
+        thermal_take_ = false;
+      }
+    }
     status_.torque_Nm = torque_on() ? (
         current_to_torque(status_.q_A) /
         motor_.unwrapped_position_scale) : 0.0f;
@@ -958,7 +1545,8 @@ class BldcServo::Impl {
       case kPosition:
       case kPositionTimeout:
       case kZeroVelocity:
-      case kStayWithinBounds: {
+      case kStayWithinBounds:
+      case kMeasureInductance: {
         return true;
       }
     }
@@ -978,7 +1566,13 @@ class BldcServo::Impl {
         return;
       }
       case kStopped: {
-        // It is always valid to enter stopped mode.
+        // It is always valid to enter stopped mode.  A background
+        // calibration drives no current, so is left to finish
+        // first.
+        if (background_cal_ &&
+            (status_.mode == kEnabling || status_.mode == kCalibrating)) {
+          return;
+        }
         status_.mode = kStopped;
         return;
       }
@@ -994,7 +1588,8 @@ class BldcServo::Impl {
       case kPosition:
       case kPositionTimeout:
       case kZeroVelocity:
-      case kStayWithinBounds: {
+      case kStayWithinBounds:
+      case kMeasureInductance: {
         switch (status_.mode) {
           case kNumModes: {
             MJ_ASSERT(false);
@@ -1010,12 +1605,27 @@ class BldcServo::Impl {
             ISR_StartCalibrating();
             return;
           }
-          case kEnabling:
-          case kCalibrating: {
+          case kEnabling: {
             // We can only leave this state when calibration is
             // complete.
             return;
           }
+          case kCalibrating: {
+            // A background calibration gives way to a command, which
+            // continues with the stored offsets from the previous
+            // one.  Otherwise, we can only leave this state when
+            // calibration is complete.
+            if (background_cal_ &&
+                OffsetsValid(config_.stored_adc_cur1_offset,
+                             config_.stored_adc_cur2_offset,
+                             config_.stored_adc_cur3_offset)) {
+              ISR_CalibrationComplete(config_.stored_adc_cur1_offset,
+                                      config_.stored_adc_cur2_offset,
+                                      config_.stored_adc_cur3_offset,
+                                      true);
+            }
+            return;
+          }
           case kCalibrationComplete:
           case kPwm:
           case kVoltage:
@@ -1024,7 +1634,8 @@ class BldcServo::Impl {
           case kCurrent:
           case kPosition:
           case kZeroVelocity:
-          case kStayWithinBounds: {
+          case kStayWithinBounds:
+          case kMeasureInductance: {
             if ((data->mode == kPosition || data->mode == kStayWithinBounds) &&
                 ISR_IsOutsideLimits()) {
               status_.mode = kFault;
@@ -1035,6 +1646,13 @@ class BldcServo::Impl {
 
               // Start from scratch if we are in a new mode.
               ISR_ClearPid(kAlwaysClear);
+
+              if (data->mode == kMeasureInductance) {
+                status_.meas_ind_phase = 0;
+                status_.meas_ind_integrator = 0.0f;
+                status_.meas_ind_count = 0;
+                status_.meas_ind_old_d_A = status_.d_A;
+              }
             }
 
             return;
@@ -1055,8 +1673,10 @@ class BldcServo::Impl {
              status_.unwrapped_position > position_config_.position_max));
   }
 
-  void ISR_StartCalibrating() {
+  void ISR_StartCalibrating(bool background = false) {
     status_.mode = kEnabling;
+    background_cal_ = background;
+    calibrate_start_us_ = ms_timer_->read_us();
 
     // The main context will set our state to kCalibrating when the
     // motor driver is fully enabled.
@@ -1081,66 +1701,61 @@ class BldcServo::Impl {
   };
 
   void ISR_ClearPid(ClearMode force_clear) MOTEUS_CCM_ATTRIBUTE {
-    const bool current_pid_active = [&]() MOTEUS_CCM_ATTRIBUTE {
-      switch (status_.mode) {
-        case kNumModes:
-        case kStopped:
-        case kFault:
-        case kEnabling:
-        case kCalibrating:
-        case kCalibrationComplete:
-        case kPwm:
-        case kVoltage:
-        case kVoltageFoc:
-        case kVoltageDq:
-          return false;
-        case kCurrent:
-        case kPosition:
-        case kPositionTimeout:
-        case kZeroVelocity:
-        case kStayWithinBounds:
-          return true;
-      }
-      return false;
-    }();
+    if (!BldcServoCurrent::PidActive(status_.mode) ||
+        force_clear == kAlwaysClear) {
+      BldcServoCurrent::Clear(&status_);
+    }
 
-    if (!current_pid_active || force_clear == kAlwaysClear) {
-      status_.pid_d.Clear();
-      status_.pid_q.Clear();
-
-      // We always want to start from 0 current when initiating
-      // current control of some form.
-      status_.pid_d.desired = 0.0f;
-      status_.pid_q.desired = 0.0f;
-    }
-
-    const bool position_pid_active = [&]() MOTEUS_CCM_ATTRIBUTE {
-      switch (status_.mode) {
-        case kNumModes:
-        case kStopped:
-        case kFault:
-        case kEnabling:
-        case kCalibrating:
-        case kCalibrationComplete:
-        case kPwm:
-        case kVoltage:
-        case kVoltageFoc:
-        case kVoltageDq:
-        case kCurrent:
-          return false;
-        case kPosition:
-        case kPositionTimeout:
-        case kZeroVelocity:
-        case kStayWithinBounds:
-          return true;
-      }
-      return false;
-    }();
+    if (!BldcServoPosition::PidActive(status_.mode) ||
+        force_clear == kAlwaysClear) {
+      BldcServoPosition::Clear(&status_);
+      position_loop_phase_ = 0;
+    }
+  }
 
-    if (!position_pid_active || force_clear == kAlwaysClear) {
-      status_.pid_position.Clear();
-      status_.control_position = {};
+  void ISR_DoScope() MOTEUS_CCM_ATTRIBUTE {
+    uint8_t events = 0;
+    if (status_.mode != scope_last_mode_) {
+      events |= Scope::kEventModeChange;
+      if (status_.mode == kFault) { events |= Scope::kEventFault; }
+      scope_last_mode_ = status_.mode;
     }
+    if (status_.command_sequence != scope_last_sequence_) {
+      events |= Scope::kEventCommand;
+      scope_last_sequence_ = status_.command_sequence;
+    }
+
+    scope_.ISR_Sample(events, [&](uint8_t signal) MOTEUS_CCM_ATTRIBUTE {
+        return ScopeSignalValue(signal);
+      });
+  }
+
+  float ScopeSignalValue(uint8_t signal) const MOTEUS_CCM_ATTRIBUTE {
+    switch (static_cast<ScopeSignal>(signal)) {
+      case kScopeCur1A: return status_.cur1_A;
+      case kScopeCur2A: return status_.cur2_A;
+      case kScopeCur3A: return status_.cur3_A;
+      case kScopeBusV: return status_.bus_V;
+      case kScopeElectricalTheta: return status_.electrical_theta;
+      case kScopeDA: return status_.d_A;
+      case kScopeQA: return status_.q_A;
+      case kScopeVelocity: return status_.velocity;
+      case kScopePosition: return status_.unwrapped_position;
+      case kScopeTorqueNm: return status_.torque_Nm;
+      case kScopeControlDV: return control_.d_V;
+      case kScopeControlQV: return control_.q_V;
+      case kScopeControlIdA: return control_.i_d_A;
+      case kScopeControlIqA: return control_.i_q_A;
+      case kScopePwmA: return control_.pwm.a;
+      case kScopePwmB: return control_.pwm.b;
+      case kScopePwmC: return control_.pwm.c;
+      case kScopeFetTempC: return status_.fet_temp_C;
+      case kScopePositionRaw: {
+        return static_cast<float>(status_.position_raw);
+      }
+      case kNumScopeSignals: break;
+    }
+    return 0.0f;
   }
 
   void ISR_DoControl(const SinCos& sin_cos) MOTEUS_CCM_ATTRIBUTE {
@@ -1154,10 +1769,11 @@ class BldcServo::Impl {
       status_.unwrapped_position_raw =
           static_cast<int32_t>(*data->set_position * 65536.0f);
       data->set_position = {};
+      velocity_pll_reset_ = true;
     }
 
     if (!std::isnan(status_.timeout_s) && status_.timeout_s > 0.0f) {
-      status_.timeout_s = std::max(0.0f, status_.timeout_s - kPeriodS);
+      status_.timeout_s = std::max(0.0f, status_.timeout_s - rate_config_->period_s);
     }
 
     // See if we need to update our current mode.
@@ -1264,10 +1880,27 @@ class BldcServo::Impl {
         ISR_DoStayWithinBounds(sin_cos, data);
         break;
       }
+      case kMeasureInductance: {
+        ISR_DoMeasureInductance(sin_cos, data);
+        break;
+      }
     }
   }
 
   void ISR_DoStopped() MOTEUS_CCM_ATTRIBUTE {
+    if (stored_offsets_request_) {
+      stored_offsets_request_ = false;
+      ISR_CalibrationComplete(config_.stored_adc_cur1_offset,
+                              config_.stored_adc_cur2_offset,
+                              config_.stored_adc_cur3_offset,
+                              true);
+      return;
+    }
+    if (background_cal_request_ && status_.cooldown_count == 0) {
+      background_cal_request_ = false;
+      ISR_StartCalibrating(true);
+      return;
+    }
     if (status_.cooldown_count == 0) {
       motor_driver_->Enable(false);
       motor_driver_->Power(false);
@@ -1290,7 +1923,41 @@ class BldcServo::Impl {
     *pwm3_ccr_ = 0;
   }
 
+  static bool OffsetsValid(uint16_t adc1, uint16_t adc2, uint16_t adc3) {
+    return (std::abs(static_cast<int>(adc1) - 2048) <= 200 &&
+            std::abs(static_cast<int>(adc2) - 2048) <= 200 &&
+            std::abs(static_cast<int>(adc3) - 2048) <= 200);
+  }
+
+  void ISR_CalibrationComplete(uint16_t adc1, uint16_t adc2, uint16_t adc3,
+                               bool stored) {
+    status_.adc_cur1_offset = adc1;
+    status_.adc_cur2_offset = adc2;
+    status_.adc_cur3_offset = adc3;
+    status_.adc_offsets_stored = stored;
+
+    const uint32_t now_us = ms_timer_->read_us();
+    status_.start_latency_us = now_us - calibrate_start_us_;
+    if (status_.boot_to_ready_us == 0) {
+      status_.boot_to_ready_us = std::max<uint32_t>(1, now_us - boot_us_);
+    }
+
+    background_cal_ = false;
+    status_.mode = kCalibrationComplete;
+  }
+
   void ISR_DoCalibrating() {
+    if (config_.adc_fast_start && !background_cal_ &&
+        OffsetsValid(config_.stored_adc_cur1_offset,
+                     config_.stored_adc_cur2_offset,
+                     config_.stored_adc_cur3_offset)) {
+      ISR_CalibrationComplete(config_.stored_adc_cur1_offset,
+                              config_.stored_adc_cur2_offset,
+                              config_.stored_adc_cur3_offset,
+                              true);
+      return;
+    }
+
     calibrate_adc1_ += status_.adc_cur1_raw;
     calibrate_adc2_ += status_.adc_cur2_raw;
     calibrate_adc3_ += status_.adc_cur3_raw;
@@ -1304,19 +1971,28 @@ class BldcServo::Impl {
     const uint16_t new_adc2_offset = calibrate_adc2_ / kCalibrateCount;
     const uint16_t new_adc3_offset = calibrate_adc3_ / kCalibrateCount;
 
-    if (std::abs(static_cast<int>(new_adc1_offset) - 2048) > 200 ||
-        std::abs(static_cast<int>(new_adc2_offset) - 2048) > 200 ||
-        std::abs(static_cast<int>(new_adc3_offset) - 2048) > 200) {
+    if (!OffsetsValid(new_adc1_offset, new_adc2_offset, new_adc3_offset)) {
+      if (background_cal_) {
+        // Nothing asked for this one, so rather than faulting, the
+        // result is discarded and the previous offsets remain in
+        // use.
+        background_cal_ = false;
+        status_.mode = kStopped;
+        return;
+      }
       // Error calibrating.  Just fault out.
       status_.mode = kFault;
       status_.fault = errc::kCalibrationFault;
       return;
     }
 
-    status_.adc_cur1_offset = new_adc1_offset;
-    status_.adc_cur2_offset = new_adc2_offset;
-    status_.adc_cur3_offset = new_adc3_offset;
-    status_.mode = kCalibrationComplete;
+    // Remember these for the next fast start.
+    config_.stored_adc_cur1_offset = new_adc1_offset;
+    config_.stored_adc_cur2_offset = new_adc2_offset;
+    config_.stored_adc_cur3_offset = new_adc3_offset;
+
+    ISR_CalibrationComplete(new_adc1_offset, new_adc2_offset, new_adc3_offset,
+                            false);
   }
 
   void ISR_DoPwmControl(const Vec3& pwm) MOTEUS_CCM_ATTRIBUTE {
@@ -1341,56 +2017,80 @@ class BldcServo::Impl {
     motor_driver_->Power(true);
   }
 
-  float ISR_VoltageToPwm(float v) const MOTEUS_CCM_ATTRIBUTE {
+  float ISR_VoltageToPwm(float v, float inv_bus_V) const MOTEUS_CCM_ATTRIBUTE {
     return 0.5f + Offset(config_.pwm_min, config_.pwm_min_blend,
-                         v / status_.filt_bus_V);
+                         v * inv_bus_V);
   }
 
   void ISR_DoVoltageControl(const Vec3& voltage) MOTEUS_CCM_ATTRIBUTE {
     control_.voltage = voltage;
 
+    // Only one division is needed for all three phases.
+    const float inv_bus_V = 1.0f / status_.pwm_bus_V;
+
     ISR_DoPwmControl(Vec3{
-        ISR_VoltageToPwm(voltage.a),
-            ISR_VoltageToPwm(voltage.b),
-            ISR_VoltageToPwm(voltage.c)});
+        ISR_VoltageToPwm(voltage.a, inv_bus_V),
+            ISR_VoltageToPwm(voltage.b, inv_bus_V),
+            ISR_VoltageToPwm(voltage.c, inv_bus_V)});
+  }
+
+  // The largest phase voltage amplitude which can be commanded from
+  // the FOC modes.
+  float ISR_MaxPhaseVoltage() const MOTEUS_CCM_ATTRIBUTE {
+    const float max_voltage =
+        (0.5f - rate_config_->min_pwm) * status_.pwm_bus_V;
+    return config_.svpwm ? ((2.0f / kSqrt3) * max_voltage) : max_voltage;
+  }
+
+  float ISR_DeadtimeComp(float current_A) const MOTEUS_CCM_ATTRIBUTE {
+    return config_.deadtime_comp_V *
+        Limit(current_A * deadtime_comp_inv_A_, -1.0f, 1.0f);
+  }
+
+  void ISR_DoPhaseVoltageControl(const InverseDqTransform& idt) MOTEUS_CCM_ATTRIBUTE {
+    Vec3 voltage = [&]() MOTEUS_CCM_ATTRIBUTE {
+      if (config_.svpwm) {
+        SpaceVectorModulation svm(idt.a, idt.b, idt.c);
+        return Vec3{svm.a, svm.b, svm.c};
+      }
+      return Vec3{idt.a, idt.b, idt.c};
+    }();
+
+    if (config_.deadtime_comp_V != 0.0f) {
+      // Phases b and c are sensed by cur3 and cur2 respectively, see
+      // ISR_DoPwmControl.
+      voltage.a += ISR_DeadtimeComp(status_.cur1_A);
+      voltage.b += ISR_DeadtimeComp(status_.cur3_A);
+      voltage.c += ISR_DeadtimeComp(status_.cur2_A);
+    }
+
+    ISR_DoVoltageControl(voltage);
   }
 
   void ISR_DoVoltageFOC(float theta, float voltage) MOTEUS_CCM_ATTRIBUTE {
     SinCos sc = cordic_(RadiansToQ31(theta));
-    const float max_voltage = (0.5f - kMinPwm) * status_.filt_bus_V;
+    const float max_voltage = ISR_MaxPhaseVoltage();
     InverseDqTransform idt(sc, Limit(voltage, -max_voltage, max_voltage), 0);
-    ISR_DoVoltageControl(Vec3{idt.a, idt.b, idt.c});
-  }
-
-  void ISR_DoCurrent(const SinCos& sin_cos, float i_d_A_in, float i_q_A_in) MOTEUS_CCM_ATTRIBUTE {
-    auto limit_q_current = [&](float in) MOTEUS_CCM_ATTRIBUTE {
-      if (!std::isnan(position_config_.position_max) &&
-          status_.unwrapped_position > position_config_.position_max &&
-          in > 0.0f) {
-        // We derate the request in the direction that moves it
-        // further outside the position limits.  This is mostly useful
-        // when feedforward is applied, as otherwise, the position
-        // limits could easily be exceeded.  Without feedforward, we
-        // shouldn't really be trying to push outside the limits
-        // anyhow.
-        return in *
-            std::max(0.0f,
-                     1.0f - (status_.unwrapped_position -
-                             position_config_.position_max) /
-                     config_.position_derate);
-      }
-      if (!std::isnan(position_config_.position_min) &&
-          status_.unwrapped_position < position_config_.position_min &&
-          in < 0.0f) {
-        return in *
-            std::max(0.0f,
-                     1.0f - (position_config_.position_min -
-                             status_.unwrapped_position) /
-                     config_.position_derate);
-      }
+    ISR_DoPhaseVoltageControl(idt);
+  }
 
-      return in;
-    };
+  float ISR_CoggingCurrent() const MOTEUS_CCM_ATTRIBUTE {
+    if (cogging_size_ == 0) { return 0.0f; }
+
+    // The position within one cogging period, as a 16 bit fraction.
+    const uint32_t period_position =
+        (static_cast<uint32_t>(status_.position) * cogging_period_) & 0xffff;
+    const uint32_t scaled_position = period_position * cogging_size_;
+    const uint32_t index = scaled_position >> 16;
+    const float fraction =
+        static_cast<float>(scaled_position & 0xffff) * (1.0f / 65536.0f);
+    const float base = g_cogging_table[index];
+    return base + fraction * (g_cogging_table[index + 1] - base);
+  }
+
+  void ISR_DoCurrent(const SinCos& sin_cos, float i_d_A_in, float i_q_A_in_raw) MOTEUS_CCM_ATTRIBUTE {
+    control_.cogging_A = ISR_CoggingCurrent();
+    const float i_q_A_in = i_q_A_in_raw + control_.cogging_A;
 
     const float derate_fraction = (
         status_.filt_fet_temp_C - config_.derate_temperature) / (
@@ -1404,28 +2104,38 @@ class BldcServo::Impl {
             config_.max_current_A);
 
     const float temp_limit_A = std::min<float>(
-        config_.max_current_A, derate_current_A);
+        std::min<float>(config_.max_current_A, derate_current_A),
+        thermal_limit_A_);
 
     auto limit_either_current = [&](float in) MOTEUS_CCM_ATTRIBUTE {
       return Limit(in, -temp_limit_A, temp_limit_A);
     };
 
-    const float i_q_A = limit_either_current(limit_q_current(i_q_A_in));
     const float i_d_A = limit_either_current(i_d_A_in);
+    const float q_limit_A = BldcServoCurrent::QLimit(
+        temp_limit_A, i_d_A, status_.field_weakening_d_A != 0.0f);
+    const float i_q_A = Limit(
+        BldcServoCurrent::DeratePosition(
+            i_q_A_in, status_.unwrapped_position,
+            position_config_.position_min, position_config_.position_max,
+            config_.position_derate),
+        -q_limit_A, q_limit_A);
 
     control_.i_d_A = i_d_A;
     control_.i_q_A = i_q_A;
 
+    BldcServoCurrent::Feedforward(
+        &control_, status_.velocity, config_.feedforward_scale,
+        decoupling_scale_, motor_.resistance_ohm, motor_.v_per_hz,
+        motor_.unwrapped_position_scale);
+
     const float d_V =
-        (config_.feedforward_scale * i_d_A * motor_.resistance_ohm) +
-        pid_d_.Apply(status_.d_A, i_d_A, 1.0f, 0.0f, kRateHz);
+        control_.d_ff_V +
+        pid_d_.Apply(status_.d_A, i_d_A, 1.0f, 0.0f, rate_config_->int_rate_hz);
 
     const float q_V =
-        (config_.feedforward_scale * (
-            i_q_A * motor_.resistance_ohm +
-            status_.velocity * motor_.v_per_hz /
-            motor_.unwrapped_position_scale)) +
-        pid_q_.Apply(status_.q_A, i_q_A, 0.0f, 0.0f, kRateHz);
+        control_.q_ff_V +
+        pid_q_.Apply(status_.q_A, i_q_A, 0.0f, 0.0f, rate_config_->int_rate_hz);
 
     ISR_DoVoltageDQ(sin_cos, d_V, q_V);
   }
@@ -1441,7 +2151,7 @@ class BldcServo::Impl {
     control_.d_V = d_V;
     control_.q_V = q_V;
 
-    const float max_voltage = (0.5f - kMinPwm) * status_.filt_bus_V;
+    const float max_voltage = ISR_MaxPhaseVoltage();
     auto limit_v = [&](float in) MOTEUS_CCM_ATTRIBUTE {
       return Limit(in, -max_voltage, max_voltage);
     };
@@ -1452,7 +2162,40 @@ class BldcServo::Impl {
     status_.dwt.control_done_cur = DWT->CYCCNT;
 #endif
 
-    ISR_DoVoltageControl(Vec3{idt.a, idt.b, idt.c});
+    ISR_DoPhaseVoltageControl(idt);
+  }
+
+  void ISR_DoMeasureInductance(const SinCos& sin_cos,
+                               CommandData* data) MOTEUS_CCM_ATTRIBUTE {
+    // The current sampled now is the result of the voltage applied
+    // over the previous cycle.
+    const float old_sign = status_.meas_ind_phase > 0 ? 1.0f : -1.0f;
+    if (status_.meas_ind_phase != 0) {
+      status_.meas_ind_integrator +=
+          old_sign * (status_.d_A - status_.meas_ind_old_d_A) *
+          rate_config_->rate_hz;
+      status_.meas_ind_count++;
+    }
+    status_.meas_ind_old_d_A = status_.d_A;
+
+    // Count towards zero, then flip to the opposite polarity.  The
+    // very first half period is only half as long, so that the
+    // current is centered upon zero.
+    if (status_.meas_ind_phase == 0) {
+      status_.meas_ind_phase =
+          static_cast<int8_t>(std::max<int>(1, data->meas_ind_period / 2));
+    } else {
+      status_.meas_ind_phase -= (status_.meas_ind_phase > 0) ? 1 : -1;
+      if (status_.meas_ind_phase == 0) {
+        status_.meas_ind_phase = static_cast<int8_t>(
+            (old_sign > 0.0f ? -1 : 1) *
+            std::max<int>(1, data->meas_ind_period));
+      }
+    }
+
+    const float d_V =
+        data->d_V * (status_.meas_ind_phase > 0 ? 1.0f : -1.0f);
+    ISR_DoVoltageDQ(sin_cos, d_V, 0.0f);
   }
 
   void ISR_DoZeroVelocity(const SinCos& sin_cos, CommandData* data) MOTEUS_CCM_ATTRIBUTE {
@@ -1480,96 +2223,33 @@ class BldcServo::Impl {
       float max_torque_Nm,
       float feedforward_Nm,
       float velocity) MOTEUS_CCM_ATTRIBUTE {
-    // Note that status_.control_position is measured in terms of 1 /
-    // 65536th of unwrapped_position_raw.  This is so that velocities
-    // do not become so small as to result in no change whatsoever at
-    // the control rate.
-    //
-    // We go to some lengths in our conversions to and from
-    // control_position so as to avoid converting a float directly to
-    // an int64, which calls out to a system library that is pretty
-    // slow.
-
-    if (!std::isnan(data->position)) {
-      status_.control_position =
-          static_cast<int64_t>(65536) *
-          static_cast<int64_t>(
-              static_cast<int32_t>(motor_scale16_ * data->position));
-      data->position = std::numeric_limits<float>::quiet_NaN();
-    } else if (!status_.control_position) {
-      status_.control_position =
-          static_cast<int64_t>(65536) *
-          static_cast<int64_t>(status_.unwrapped_position_raw);
-    }
-
-    auto velocity_command = velocity;
-
-    const auto old_position = *status_.control_position;
-    // This limits our usable velocity to 20kHz modulo the position
-    // scale at a 40kHz switching frequency.  1.2 million RPM should
-    // be enough for anybody?
-    status_.control_position =
-        *status_.control_position +
-        static_cast<int32_t>(
-            (65536.0f * motor_scale16_ * velocity_command) /
-            kRateHz);
-
-    const auto saturate = [&](auto value, auto compare) MOTEUS_CCM_ATTRIBUTE {
-      if (std::isnan(value)) { return; }
-      const auto limit_value = (
-          static_cast<int64_t>(65536) *
-          static_cast<int64_t>(
-              static_cast<int32_t>(motor_scale16_ * value)));
-      if (compare(*status_.control_position, limit_value)) {
-        status_.control_position = limit_value;
-      }
-    };
-    saturate(position_config_.position_min, [](auto l, auto r) { return l < r; });
-    saturate(position_config_.position_max, [](auto l, auto r) { return l > r; });
-
-    if (!std::isnan(data->stop_position)) {
-      const int64_t stop_position_raw =
-          static_cast<int64_t>(65536) *
-          static_cast<int64_t>(
-              static_cast<int32_t>(motor_scale16_ * data->stop_position));
-
-      auto sign = [](auto value) MOTEUS_CCM_ATTRIBUTE -> float {
-        if (value < 0) { return -1.0f; }
-        if (value > 0) { return 1.0f; }
-        return 0.0f;
-      };
-      if (sign(*status_.control_position -
-               stop_position_raw) * velocity_command > 0.0f) {
-        // We are moving away from the stop position.  Force it to be there.
-        status_.control_position = stop_position_raw;
-      }
+    if (position_loop_phase_ != 0) {
+      // This is not a position loop cycle.  Just run the current
+      // loop against the most recent position loop output.
+      position_loop_phase_--;
+      control_.torque_Nm = position_loop_torque_Nm_;
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+      status_.dwt.control_done_pos = DWT->CYCCNT;
+#endif
+
+      ISR_DoPositionCurrent(sin_cos, position_loop_d_A_, position_loop_q_A_);
+      return;
     }
-    if (*status_.control_position == old_position) {
-      // We have hit a limit.  Assume a velocity of 0.
-      velocity_command = 0.0f;
-    }
-
-    const float measured_velocity = Threshold(
-        status_.velocity, -config_.velocity_threshold,
-        config_.velocity_threshold);
-
-    // We always control relative to the control position of 0, so
-    // that we get equal performance across the entire viable integral
-    // position range.
-    const int32_t scaled_control =
-        static_cast<int32_t>(*status_.control_position / 65536);
-    const float unlimited_torque_Nm =
-        pid_position_.Apply(
-            (status_.unwrapped_position_raw - scaled_control) /
-            65536.0f * motor_.unwrapped_position_scale,
-            0.0,
-            measured_velocity, velocity_command,
-            kRateHz,
-            pid_options) +
-        feedforward_Nm;
-
-    const float limited_torque_Nm =
-        Limit(unlimited_torque_Nm, -max_torque_Nm, max_torque_Nm);
+    position_loop_phase_ = position_loop_divisor_ - 1;
+
+    BldcServoPosition::Latch(&status_, data, motor_scale16_, trajectory_);
+
+    const float velocity_command = BldcServoPosition::Advance(
+        &status_, *data,
+        trajectory_ ? ISR_UpdateTrajectory(velocity) : velocity,
+        motor_scale16_, position_rate_hz_,
+        position_config_.position_min, position_config_.position_max);
+
+    const float limited_torque_Nm = BldcServoPosition::Torque(
+        status_, &pid_position_, pid_options, velocity_command,
+        feedforward_Nm, max_torque_Nm, config_.velocity_threshold,
+        motor_.unwrapped_position_scale, position_rate_hz_);
 
     control_.torque_Nm = limited_torque_Nm;
 
@@ -1596,11 +2276,93 @@ class BldcServo::Impl {
       return (error / config_.flux_brake_resistance_ohm);
     }();
 
+    position_loop_torque_Nm_ = control_.torque_Nm;
+    position_loop_d_A_ = d_A;
+    position_loop_q_A_ = q_A;
+
 #ifdef MOTEUS_PERFORMANCE_MEASURE
     status_.dwt.control_done_pos = DWT->CYCCNT;
 #endif
 
-    ISR_DoCurrent(sin_cos, d_A, q_A);
+    ISR_DoPositionCurrent(sin_cos, d_A, q_A);
+  }
+
+  // Advance the control velocity by one position loop cycle towards
+  // the trajectory target, subject to the configured limits, and
+  // return it.  The target itself moves at the commanded velocity.
+  float ISR_UpdateTrajectory(float target_velocity) MOTEUS_CCM_ATTRIBUTE {
+    const float dt = position_period_s_;
+    const float max_dv = trajectory_accel_limit_ * dt;
+    const float target_v = Limit(target_velocity,
+                                 -trajectory_velocity_limit_,
+                                 trajectory_velocity_limit_);
+    float& velocity = status_.control_velocity;
+
+    if (!status_.trajectory_target) {
+      // Only a velocity has been commanded.
+      velocity += Limit(target_v - velocity, -max_dv, max_dv);
+      return velocity;
+    }
+
+    const float error =
+        static_cast<float>(
+            static_cast<int32_t>(
+                (*status_.trajectory_target - *status_.control_position) /
+                65536)) / motor_scale16_;
+
+    // Approach the target no faster than we could stop at the
+    // acceleration limit, and no faster than would reach it in a
+    // single cycle.
+    const float abs_error = std::abs(error);
+    const float approach =
+        std::isfinite(trajectory_accel_limit_) ?
+        std::min(std::sqrt(2.0f * trajectory_accel_limit_ * abs_error),
+                 abs_error / dt) :
+        abs_error / dt;
+    const float desired_v = Limit(
+        target_v + std::copysign(approach, error),
+        -trajectory_velocity_limit_, trajectory_velocity_limit_);
+    velocity += Limit(desired_v - velocity, -max_dv, max_dv);
+
+    const float next_error = error - (velocity - target_v) * dt;
+    if ((next_error * error) <= 0.0f &&
+        std::abs(target_v - velocity) <= max_dv) {
+      // We would arrive this cycle.  Lock on to the target from here
+      // on.
+      status_.control_position = *status_.trajectory_target;
+      velocity = target_v;
+    }
+
+    *status_.trajectory_target +=
+        static_cast<int32_t>(
+            (65536.0f * motor_scale16_ * target_v) /
+            static_cast<float>(position_rate_hz_));
+
+    return velocity;
+  }
+
+  void ISR_DoPositionCurrent(const SinCos& sin_cos, float d_A, float q_A) MOTEUS_CCM_ATTRIBUTE {
+    ISR_DoCurrent(sin_cos, d_A + status_.field_weakening_d_A, q_A);
+
+    const float limit_A =
+        std::min(motor_.field_weakening_max_A, config_.max_current_A);
+    if (limit_A <= 0.0f) {
+      status_.field_weakening_d_A = 0.0f;
+      return;
+    }
+
+    // Integrate negative d axis current whenever the voltage vector
+    // is near saturation, and back it off again once there is
+    // headroom.
+    const float voltage_V = std::sqrt(
+        control_.d_V * control_.d_V + control_.q_V * control_.q_V);
+    const float error_V =
+        voltage_V -
+        config_.field_weakening_voltage_ratio * ISR_MaxPhaseVoltage();
+    status_.field_weakening_d_A = Limit(
+        status_.field_weakening_d_A -
+        config_.field_weakening_ki * error_V * rate_config_->period_s,
+        -limit_A, 0.0f);
   }
 
   void ISR_DoStayWithinBounds(const SinCos& sin_cos, CommandData* data) {
@@ -1619,6 +2381,9 @@ class BldcServo::Impl {
     if (!target_position) {
       status_.pid_position.Clear();
       status_.control_position = std::numeric_limits<float>::quiet_NaN();
+      status_.control_velocity = 0.0f;
+      status_.trajectory_target = {};
+      position_loop_phase_ = 0;
 
       // In this region, we still apply feedforward torques if they
       // are present.
@@ -1648,7 +2413,7 @@ class BldcServo::Impl {
   float LimitPwm(float in) MOTEUS_CCM_ATTRIBUTE {
     // We can't go full duty cycle or we wouldn't have time to sample
     // the current.
-    return Limit(in, kMinPwm, kMaxPwm);
+    return Limit(in, rate_config_->min_pwm, rate_config_->max_pwm);
   }
 
   const Options options_;
@@ -1704,9 +2469,31 @@ class BldcServo::Impl {
   DigitalOut debug_out2_;
 
   int32_t phase_ = 0;
+  bool adc_timer_trigger_ = false;
+  // Which of its two channels ADC5 is currently converting when
+  // adc_timer_trigger_ is set.
+  uint8_t aux_phase_ = 0;
 
   CommandData data_buffers_[2] = {};
 
+  Scope scope_{g_scope_buffer, kScopeBufferSize};
+
+  CompactTelemetry::Config compact_config_[kCompactChannels] = {};
+  CompactTelemetry compact_[kCompactChannels] = {
+    CompactTelemetry{&compact_config_[0]},
+    CompactTelemetry{&compact_config_[1]},
+  };
+  Mode scope_last_mode_ = kStopped;
+  uint32_t scope_last_sequence_ = 0;
+  uint32_t command_sequence_ = 0;
+  std::optional<uint32_t> last_host_timestamp_;
+
+  // When set, next_data_ holds a command which the ISR should swap
+  // into current_data_ once the microsecond timer reaches
+  // pending_apply_us_.
+  volatile bool pending_apply_ = false;
+  uint32_t pending_apply_us_ = 0;
+
   // CommandData has its data updated to the ISR by first writing the
   // new command into (*next_data_) and then swapping it with
   // current_data_.
@@ -1722,11 +2509,28 @@ class BldcServo::Impl {
     int16_t, kMaxVelocityFilter, int32_t> velocity_filter_;
   Status status_;
   Control control_;
+  volatile uint32_t isr_cycles_ = 0;
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+  DwtStats dwt_stats_;
+  volatile bool dwt_stats_reset_ = false;
+#endif
   uint32_t calibrate_adc1_ = 0;
   uint32_t calibrate_adc2_ = 0;
   uint32_t calibrate_adc3_ = 0;
   uint16_t calibrate_count_ = 0;
 
+  uint32_t boot_us_ = 0;
+  uint32_t calibrate_start_us_ = 0;
+  // Set while the calibration in progress was started from stopped
+  // to refresh the fast start offsets, rather than by a command.
+  bool background_cal_ = false;
+  volatile bool background_cal_request_ = false;
+  // Set from the main context to have the ISR take the stored offsets
+  // as though they had just been calibrated.
+  volatile bool stored_offsets_request_ = false;
+  bool background_cal_done_ = false;
+  uint32_t stopped_ms_ = 0;
+
   PID pid_d_{&config_.pid_dq, &status_.pid_d};
   PID pid_q_{&config_.pid_dq, &status_.pid_q};
   PID pid_position_{&config_.pid_position, &status_.pid_position};
@@ -1739,8 +2543,66 @@ class BldcServo::Impl {
   int32_t position_constant_ = 0;
   // 65536.0f / unwrapped_position_scale_
   float motor_scale16_ = 0;
+  float decoupling_scale_ = 0.0f;
+  float deadtime_comp_inv_A_ = 1.0f;
+  // The filter constant of the bus voltage used for PWM, or 0 to use
+  // filt_bus_V.
+  float bus_V_compensation_alpha_ = 0.0f;
+  float fast_bus_V_ = std::numeric_limits<float>::quiet_NaN();
   float adc_scale_ = 0.0f;
 
+  RateConfig rate_config_buffers_[2];
+  const RateConfig* volatile rate_config_{&rate_config_buffers_[0]};
+
+  bool velocity_pll_ = false;
+  bool velocity_pll_reset_ = true;
+  float velocity_pll_kp_dt_ = 0.0f;
+  float velocity_pll_ki_dt_ = 0.0f;
+  int32_t velocity_pll_position_int_ = 0;
+  float velocity_pll_position_frac_ = 0.0f;
+  // Measured in unwrapped_position_raw counts per second.
+  float velocity_pll_velocity_ = 0.0f;
+
+  // The number of valid entries in g_offset_table.
+  uint32_t offset_size_ = 1;
+  // The number of valid entries in g_cogging_table, 0 when disabled.
+  uint32_t cogging_size_ = 0;
+  uint32_t cogging_period_ = 1;
+
+  ThermalModel thermal_model_{&config_.thermal};
+  // Set by PollMillisecond to have the ISR publish the mean of the
+  // squared current since it was last set.
+  volatile bool thermal_take_ = false;
+  volatile float thermal_i2_mean_ = 0.0f;
+  float thermal_i2_sum_ = 0.0f;
+  uint32_t thermal_i2_count_ = 0;
+  volatile float thermal_limit_A_ = std::numeric_limits<float>::infinity();
+
+  FluxObserver flux_observer_{&config_.flux_observer};
+  // Converts status_.velocity into electrical Hz.
+  float velocity_to_electrical_hz_ = 0.0f;
+
+  // Converts velocity_pll_velocity_, or velocity_filter_.total()
+  // when the PLL is disabled, into the electrical angle to advance
+  // by.  Zero when disabled.
+  float commutation_advance_scale_ = 0.0f;
+
+  // The position loop runs at the control rate /
+  // position_loop_divisor_.
+  int position_loop_divisor_ = 1;
+  int position_rate_hz_ = 0;
+  float position_period_s_ = 0.0f;
+  // The number of current loop cycles remaining until the next
+  // position loop update.
+  int position_loop_phase_ = 0;
+  float position_loop_torque_Nm_ = 0.0f;
+  float position_loop_d_A_ = 0.0f;
+  float position_loop_q_A_ = 0.0f;
+
+  bool trajectory_ = false;
+  float trajectory_velocity_limit_ = 0.0f;
+  float trajectory_accel_limit_ = 0.0f;
+
   float vsense_adc_scale_ = 0.0f;
 
   uint32_t pwm_counts_ = 0;
@@ -1778,6 +2640,18 @@ void BldcServo::Command(const CommandData& data) {
   impl_->Command(data);
 }
 
+Scope* BldcServo::scope() {
+  return impl_->scope();
+}
+
+float BldcServo::scope_rate_hz() const {
+  return impl_->scope_rate_hz();
+}
+
+uint32_t BldcServo::isr_cycles() const {
+  return impl_->isr_cycles();
+}
+
 const BldcServo::Status& BldcServo::status() const {
   return impl_->status();
 }
@@ -1794,4 +2668,16 @@ const BldcServo::Motor& BldcServo::motor() const {
   return impl_->motor();
 }
 
+void BldcServo::SetEncoderCalibration(
+    uint8_t poles, bool invert,
+    const mjlib::base::inplace_function<float (int)>& offset) {
+  impl_->SetEncoderCalibration(poles, invert, offset);
+}
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+void BldcServo::ResetDwtStats() {
+  impl_->ResetDwtStats();
+}
+#endif
+
 }
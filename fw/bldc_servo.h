@@ -14,10 +14,14 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <limits>
 
 #include "PinNames.h"
 
+#include "mjlib/base/inplace_function.h"
 #include "mjlib/base/visitor.h"
 
 #include "mjlib/micro/persistent_config.h"
@@ -25,11 +29,15 @@
 #include "mjlib/micro/telemetry_manager.h"
 
 #include "fw/as5047.h"
+#include "fw/bldc_servo_structs.h"
 #include "fw/error.h"
+#include "fw/flux_observer.h"
 #include "fw/millisecond_timer.h"
 #include "fw/moteus_hw.h"
 #include "fw/motor_driver.h"
 #include "fw/pid.h"
+#include "fw/scope.h"
+#include "fw/thermal_model.h"
 
 namespace moteus {
 
@@ -71,36 +79,53 @@ class BldcServo {
 
   void PollMillisecond();
 
-  struct Vec3 {
-    float a = 0.0f;
-    float b = 0.0f;
-    float c = 0.0f;
-
-    template <typename Archive>
-    void Serialize(Archive* ar) {
-      ar->Visit(MJ_NVP(a));
-      ar->Visit(MJ_NVP(b));
-      ar->Visit(MJ_NVP(c));
-    }
-  };
+  using Vec3 = BldcServoVec3;
 
   struct Motor {
     uint8_t poles = 0;  // 14
     uint8_t invert = 0;
     float resistance_ohm = 0.0f;  // 0.030
 
+    // The per-phase d and q axis inductance.  When non-zero, the
+    // current loop feeds forward the speed dependent coupling
+    // between the two axes.
+    float inductance_H = 0.0f;
+
     // Hz is electrical
     float v_per_hz = 0.0f;  // 0.15f / 5.0f;
 
+    // The largest negative d axis current which may be applied for
+    // field weakening in the position modes.  0 disables field
+    // weakening.
+    float field_weakening_max_A = 0.0f;
+
     float unwrapped_position_scale = 1.0f;
 
+    static constexpr int kMaxOffsetSize = 256;
+
     // Electrical phase offset in radians as a function of encoder
-    // position.
-    std::array<float, 64> offset = {};
+    // position.  The first offset_size entries are evenly spaced
+    // across one revolution of the encoder, and are linearly
+    // interpolated between.
+    std::array<float, kMaxOffsetSize> offset = {};
+    uint16_t offset_size = 64;
 
     // After applying inversion, add this value to the position.
     uint16_t position_offset = 0;
 
+    static constexpr int kMaxCoggingSize = 64;
+
+    // q axis current to feed forward, as a function of encoder
+    // position, to cancel the cogging torque.  Laid out as for
+    // offset, and 0 entries disables it.
+    std::array<float, kMaxCoggingSize> cogging_A = {};
+    uint16_t cogging_size = 0;
+    // The table spans 1 / cogging_period of a revolution, and is
+    // repeated that many times.  Cogging repeats LCM(slots, poles)
+    // times per revolution, so that is the natural choice, and lets
+    // a small table resolve it.
+    uint16_t cogging_period = 1;
+
     // These control the higher order motor torque model.
     //
     // When above the cutoff current, the torque is calculated as:
@@ -119,10 +144,16 @@ class BldcServo {
       a->Visit(MJ_NVP(poles));
       a->Visit(MJ_NVP(invert));
       a->Visit(MJ_NVP(resistance_ohm));
+      a->Visit(MJ_NVP(inductance_H));
       a->Visit(MJ_NVP(v_per_hz));
+      a->Visit(MJ_NVP(field_weakening_max_A));
       a->Visit(MJ_NVP(unwrapped_position_scale));
       a->Visit(MJ_NVP(offset));
+      a->Visit(MJ_NVP(offset_size));
       a->Visit(MJ_NVP(position_offset));
+      a->Visit(MJ_NVP(cogging_A));
+      a->Visit(MJ_NVP(cogging_size));
+      a->Visit(MJ_NVP(cogging_period));
       a->Visit(MJ_NVP(rotation_current_cutoff_A));
       a->Visit(MJ_NVP(rotation_current_scale));
       a->Visit(MJ_NVP(rotation_torque_scale));
@@ -134,13 +165,39 @@ class BldcServo {
     float pwm_min = 0.006f;  // value below which PWM has no effect
     float pwm_min_blend = 0.01f;  // blend into the full PWM over this region
 
+    // The voltage lost in each phase to the dead time, which always
+    // opposes the current in that phase.  It is added back with the
+    // sign of the phase current, ramping linearly through zero over
+    // +-deadtime_comp_current_A so that sense noise near a zero
+    // crossing does not chatter.  moteus_tool --calibrate measures
+    // it.
+    float deadtime_comp_V = 0.0f;
+    float deadtime_comp_current_A = 0.5f;
+
     // We pick a default maximum voltage based on the board revision.
     float max_voltage = (g_measured_hw_rev <= 5) ? 37.0f : 46.0f;
 
+    // r4.1 and above have enough DC-link capacitance to run at the
+    // slower 40kHz PWM frequency, while earlier boards switch at
+    // 60kHz and control at 30kHz.  The control loop runs at the PWM
+    // rate, or an integer fraction of it if that would exceed 40kHz.
+    int32_t pwm_rate_hz = (MOTEUS_HW_REV <= 2) ? 60000 : 40000;
+
     float derate_temperature = 50.0f;
     float fault_temperature = 75.0f;
 
     float feedforward_scale = 0.5f;
+
+    // Field weakening current is injected when the commanded voltage
+    // exceeds this fraction of the maximum available.  The injected
+    // current is adjusted at field_weakening_ki A/s per volt of error.
+    float field_weakening_voltage_ratio = 0.9f;
+    float field_weakening_ki = 100.0f;
+
+    // If true, min-max zero sequence injection is applied to the
+    // phase voltages in the FOC modes, which permits a 15% higher
+    // effective voltage for a given bus voltage.
+    bool svpwm = false;
     float velocity_threshold = 0.09f;
     float position_derate = 0.02f;
 
@@ -155,6 +212,29 @@ class BldcServo {
     // need a larger sampling time.
     uint16_t adc_aux_cycles = 47;
 
+    // If true, the current conversions are started by the PWM timer
+    // in hardware, and the control cycle begins from the ADC
+    // interrupt once they are complete.  The auxiliary channels are
+    // then sampled in the background at half the control rate.  This
+    // only takes effect at startup.
+    bool adc_timer_trigger = false;
+
+    // If true, leaving stopped uses the stored_adc_cur*_offset values
+    // below rather than averaging the current sense offsets each
+    // time.  Valid stored offsets are also put in use at boot.  The
+    // offsets are re-measured in the background while stopped every
+    // adc_fast_start_refresh_s (0 for never), or shortly after boot if
+    // the stored ones were not valid.
+    bool adc_fast_start = false;
+    float adc_fast_start_refresh_s = 30.0f;
+
+    // The most recently measured current sense offsets, 0 if never
+    // measured.  These are updated by every full calibration, so
+    // they persist across a reboot after a "conf write".
+    uint16_t stored_adc_cur1_offset = 0;
+    uint16_t stored_adc_cur2_offset = 0;
+    uint16_t stored_adc_cur3_offset = 0;
+
     // We use the same PID constants for D and Q current control
     // loops.
     PID::Config pid_dq;
@@ -171,9 +251,52 @@ class BldcServo {
     float max_current_A = 100.0f;
     float derate_current_A = -20.0f;
 
+    // When enabled, the current is further limited so that the
+    // modeled winding and FET temperatures stay within their limits.
+    ThermalModel::Config thermal;
+
     uint16_t velocity_filter_length = 256;
+
+    // When non-zero, voltages are converted to PWM using an estimate
+    // of the bus voltage with this bandwidth in Hz, rather than one
+    // filtered over 0.5s, so that ripple on the supply is compensated
+    // for instead of appearing as torque ripple.  To guard against
+    // sense noise, the estimate may differ from the 0.5s value by no
+    // more than bus_V_compensation_max_ratio of it.
+    float bus_V_compensation_hz = 0.0f;
+    float bus_V_compensation_max_ratio = 0.2f;
+
+    // If non-zero, the velocity is estimated with a second order
+    // tracking observer of this bandwidth, rather than the windowed
+    // average over velocity_filter_length cycles.  It is limited to
+    // 1/20th of the control rate.
+    float velocity_pll_bw_hz = 0.0f;
+
+    // The electrical angle used for commutation is extrapolated
+    // forward by this many control cycles using the measured
+    // velocity, to compensate for the delay between when the encoder
+    // is sampled and when the resulting PWM is applied.  0 disables.
+    float commutation_advance_cycles = 0.0f;
+
+    // When enabled, the electrical angle is blended towards that of a
+    // flux observer at high speed, where the encoder latency and
+    // offset table errors are most significant.
+    FluxObserver::Config flux_observer;
     uint16_t cooldown_cycles = 128;
 
+    // If either is finite, position mode commands are not applied
+    // in a single step.  Instead, the control position follows a
+    // trajectory to the most recently commanded position and
+    // velocity which respects these limits.  Measured in
+    // rotations/s and rotations/s^2 respectively.
+    float trajectory_velocity_limit = std::numeric_limits<float>::quiet_NaN();
+    float trajectory_accel_limit = std::numeric_limits<float>::quiet_NaN();
+
+    // The position/velocity loop is evaluated once every this many
+    // current loop cycles.  In between, the current loop tracks the
+    // most recent current command from the position loop.
+    uint16_t position_loop_divisor = 1;
+
     Config() {
       pid_dq.kp = 0.005f;
       pid_dq.ki = 30.0f;
@@ -193,14 +316,26 @@ class BldcServo {
       a->Visit(MJ_NVP(i_gain));
       a->Visit(MJ_NVP(pwm_min));
       a->Visit(MJ_NVP(pwm_min_blend));
+      a->Visit(MJ_NVP(deadtime_comp_V));
+      a->Visit(MJ_NVP(deadtime_comp_current_A));
       a->Visit(MJ_NVP(max_voltage));
+      a->Visit(MJ_NVP(pwm_rate_hz));
       a->Visit(MJ_NVP(derate_temperature));
       a->Visit(MJ_NVP(fault_temperature));
       a->Visit(MJ_NVP(feedforward_scale));
+      a->Visit(MJ_NVP(field_weakening_voltage_ratio));
+      a->Visit(MJ_NVP(field_weakening_ki));
+      a->Visit(MJ_NVP(svpwm));
       a->Visit(MJ_NVP(velocity_threshold));
       a->Visit(MJ_NVP(position_derate));
       a->Visit(MJ_NVP(adc_cur_cycles));
       a->Visit(MJ_NVP(adc_aux_cycles));
+      a->Visit(MJ_NVP(adc_timer_trigger));
+      a->Visit(MJ_NVP(adc_fast_start));
+      a->Visit(MJ_NVP(adc_fast_start_refresh_s));
+      a->Visit(MJ_NVP(stored_adc_cur1_offset));
+      a->Visit(MJ_NVP(stored_adc_cur2_offset));
+      a->Visit(MJ_NVP(stored_adc_cur3_offset));
       a->Visit(MJ_NVP(pid_dq));
       a->Visit(MJ_NVP(pid_position));
       a->Visit(MJ_NVP(default_timeout_s));
@@ -209,8 +344,17 @@ class BldcServo {
       a->Visit(MJ_NVP(flux_brake_resistance_ohm));
       a->Visit(MJ_NVP(max_current_A));
       a->Visit(MJ_NVP(derate_current_A));
+      a->Visit(MJ_NVP(thermal));
       a->Visit(MJ_NVP(velocity_filter_length));
+      a->Visit(MJ_NVP(bus_V_compensation_hz));
+      a->Visit(MJ_NVP(bus_V_compensation_max_ratio));
+      a->Visit(MJ_NVP(velocity_pll_bw_hz));
+      a->Visit(MJ_NVP(commutation_advance_cycles));
+      a->Visit(MJ_NVP(flux_observer));
       a->Visit(MJ_NVP(cooldown_cycles));
+      a->Visit(MJ_NVP(trajectory_velocity_limit));
+      a->Visit(MJ_NVP(trajectory_accel_limit));
+      a->Visit(MJ_NVP(position_loop_divisor));
     }
   };
 
@@ -228,345 +372,161 @@ class BldcServo {
     }
   };
 
-  enum Mode {
-    // In this mode, the entire motor driver will be disabled.
-    //
-    // When exiting this state, the current offset will be
-    // recalibrated.
-    kStopped = 0,
-
-    // This stage cannot be commanded directly, but will be entered
-    // upon any fault.  Here, the motor driver remains enabled, but
-    // the output stage power is removed.  The only valid transition
-    // from this state is to kStopped.
-    kFault = 1,
-
-    // This mode may not be commanded directly.  It is used when
-    // transitioning from kStopped to another mode.
-    kEnabling = 2,
-
-    // This mode may not be commanded directly, but is used when
-    // transitioning from kStopped to another mode.
-    kCalibrating = 3,
-
-    // This mode may not be commanded directly, but is used when
-    // transitioning from kStopped to another mode.
-    kCalibrationComplete = 4,
-
-    // Directly control the PWM of all 3 phases.
-    kPwm = 5,
-
-    // Control the voltage of all three phases
-    kVoltage = 6,
+  using Mode = BldcServoMode;
 
-    // Control the phase and voltage magnitude
-    kVoltageFoc = 7,
-
-    // Control d and q voltage
-    kVoltageDq = 8,
-
-    // Control d and q current
-    kCurrent = 9,
-
-    // Control absolute position
-    kPosition = 10,
-
-    // This state can be commanded directly, and will also be entered
-    // automatically upon a watchdog timeout from kPosition.  When in
-    // this state, the controller will apply a derivative only
-    // position control to slowly bring the servos to a resting
-    // position.
-    //
-    // The only way to exit this state is through a stop command.
-    kPositionTimeout = 11,
-
-    // This is just like kPositionTimeout, but is not latching.
-    kZeroVelocity = 12,
-
-    // This applies the PID controller only to stay within a
-    // particular position region, and applies 0 torque when within
-    // that region.
-    kStayWithinBounds = 13,
-
-    kNumModes,
-  };
-
-  struct Status {
-    Mode mode = kStopped;
-    errc fault = errc::kSuccess;
-
-    uint16_t adc_cur1_raw = 0;
-    uint16_t adc_cur2_raw = 0;
-    uint16_t adc_cur3_raw = 0;
-    uint16_t adc_voltage_sense_raw = 0;
-    uint16_t adc_fet_temp_raw = 0;
-    uint16_t adc_motor_temp_raw = 0;
-
-    uint16_t position_raw = 0;
-
-    uint16_t adc_cur1_offset = 2048;
-    uint16_t adc_cur2_offset = 2048;
-    uint16_t adc_cur3_offset = 2048;
-
-    float cur1_A = 0.0f;
-    float cur2_A = 0.0f;
-    float cur3_A = 0.0f;
-
-    float bus_V = 0.0f;
-    float filt_bus_V = std::numeric_limits<float>::quiet_NaN();
-    float filt_1ms_bus_V = std::numeric_limits<float>::quiet_NaN();
-    uint16_t position = 0;
-    float fet_temp_C = 0.0f;
-    float filt_fet_temp_C = std::numeric_limits<float>::quiet_NaN();
-
-    float electrical_theta = 0.0f;
-
-    float d_A = 0.0f;
-    float q_A = 0.0f;
-
-    int32_t unwrapped_position_raw = 0;
-    float unwrapped_position = 0.0f;
-    float velocity = 0.0f;
-    float torque_Nm = 0.0f;
-
-    PID::State pid_d;
-    PID::State pid_q;
-    PID::State pid_position;
-
-    // This is scaled to be 65536 larger than unwrapped_position_raw.
-    std::optional<int64_t> control_position;
-    float position_to_set = 0.0;
-    float timeout_s = 0.0;
-    bool rezeroed = false;
-
-    float sin = 0.0f;
-    float cos = 0.0f;
-    uint16_t cooldown_count = 0;
-    uint32_t final_timer = 0;
-    uint32_t total_timer = 0;
+  using Status = BldcServoStatus;
 
 #ifdef MOTEUS_PERFORMANCE_MEASURE
-    struct Dwt {
-      uint32_t adc_done = 0;
-      uint32_t start_pos_sample = 0;
-      uint32_t done_pos_sample = 0;
-      uint32_t done_temp_sample = 0;
-      uint32_t sense = 0;
-      uint32_t curstate = 0;
-      uint32_t control_sel_mode = 0;
-      uint32_t control_done_pos = 0;
-      uint32_t control_done_cur = 0;
-      uint32_t control = 0;
-      uint32_t done = 0;
+  // Accumulated statistics of the Status::Dwt stamps across every
+  // control interrupt since the last reset.  All values are in CPU
+  // cycles measured from the start of the control cycle.
+  struct DwtStats {
+    // Each histogram bucket covers (1 << kBucketShift) cycles.  The
+    // final bucket holds everything beyond the end of the range.
+    static constexpr int kBucketShift = 8;
+    static constexpr int kNumBuckets = 20;
+
+    struct Stage {
+      uint32_t min = std::numeric_limits<uint32_t>::max();
+      uint32_t max = 0;
+      uint32_t count = 0;
+      uint64_t total = 0;
+      float mean = 0.0f;
+      std::array<uint32_t, kNumBuckets> histogram = {};
+
+      void Add(uint32_t cycles) MOTEUS_CCM_ATTRIBUTE {
+        // A zero stamp means the stage was not reached this cycle.
+        if (cycles == 0) { return; }
+
+        if (cycles < min) { min = cycles; }
+        if (cycles > max) { max = cycles; }
+        count++;
+        total += cycles;
+        histogram[std::min<uint32_t>(
+            kNumBuckets - 1, cycles >> kBucketShift)]++;
+      }
+
+      void UpdateMean() {
+        mean = (count == 0) ? 0.0f :
+            static_cast<float>(total) / static_cast<float>(count);
+      }
 
       template <typename Archive>
       void Serialize(Archive* a) {
-        a->Visit(MJ_NVP(adc_done));
-        a->Visit(MJ_NVP(start_pos_sample));
-        a->Visit(MJ_NVP(done_pos_sample));
-        a->Visit(MJ_NVP(done_temp_sample));
-        a->Visit(MJ_NVP(sense));
-        a->Visit(MJ_NVP(curstate));
-        a->Visit(MJ_NVP(control_sel_mode));
-        a->Visit(MJ_NVP(control_done_pos));
-        a->Visit(MJ_NVP(control_done_cur));
-        a->Visit(MJ_NVP(control));
-        a->Visit(MJ_NVP(done));
+        a->Visit(MJ_NVP(min));
+        a->Visit(MJ_NVP(max));
+        a->Visit(MJ_NVP(count));
+        a->Visit(MJ_NVP(total));
+        a->Visit(MJ_NVP(mean));
+        a->Visit(MJ_NVP(histogram));
       }
     };
 
-    Dwt dwt;
-#endif
-
-    template <typename Archive>
-    void Serialize(Archive* a) {
-      a->Visit(MJ_NVP(mode));
-      a->Visit(MJ_NVP(fault));
-
-      a->Visit(MJ_NVP(adc_cur1_raw));
-      a->Visit(MJ_NVP(adc_cur2_raw));
-      a->Visit(MJ_NVP(adc_cur3_raw));
-      a->Visit(MJ_NVP(adc_voltage_sense_raw));
-      a->Visit(MJ_NVP(adc_fet_temp_raw));
-      a->Visit(MJ_NVP(adc_motor_temp_raw));
-
-      a->Visit(MJ_NVP(position_raw));
-
-      a->Visit(MJ_NVP(adc_cur1_offset));
-      a->Visit(MJ_NVP(adc_cur2_offset));
-      a->Visit(MJ_NVP(adc_cur3_offset));
-
-      a->Visit(MJ_NVP(cur1_A));
-      a->Visit(MJ_NVP(cur2_A));
-      a->Visit(MJ_NVP(cur3_A));
-
-      a->Visit(MJ_NVP(bus_V));
-      a->Visit(MJ_NVP(filt_bus_V));
-      a->Visit(MJ_NVP(filt_1ms_bus_V));
-      a->Visit(MJ_NVP(position));
-      a->Visit(MJ_NVP(fet_temp_C));
-      a->Visit(MJ_NVP(filt_fet_temp_C));
-      a->Visit(MJ_NVP(electrical_theta));
-
-      a->Visit(MJ_NVP(d_A));
-      a->Visit(MJ_NVP(q_A));
-
-      a->Visit(MJ_NVP(unwrapped_position_raw));
-      a->Visit(MJ_NVP(unwrapped_position));
-      a->Visit(MJ_NVP(velocity));
-      a->Visit(MJ_NVP(torque_Nm));
-
-      a->Visit(MJ_NVP(pid_d));
-      a->Visit(MJ_NVP(pid_q));
-      a->Visit(MJ_NVP(pid_position));
-
-      a->Visit(MJ_NVP(control_position));
-      a->Visit(MJ_NVP(position_to_set));
-      a->Visit(MJ_NVP(timeout_s));
-      a->Visit(MJ_NVP(rezeroed));
-
-      a->Visit(MJ_NVP(sin));
-      a->Visit(MJ_NVP(cos));
-      a->Visit(MJ_NVP(cooldown_count));
-      a->Visit(MJ_NVP(final_timer));
-      a->Visit(MJ_NVP(total_timer));
-
-#ifdef MOTEUS_PERFORMANCE_MEASURE
-      a->Visit(MJ_NVP(dwt));
-#endif
-    }
-  };
-
-  // Intermediate control outputs.
-  struct Control {
-    Vec3 pwm;
-    Vec3 voltage;
-
-    float d_V = 0.0f;
-    float q_V = 0.0f;
-
-    float i_d_A = 0.0f;
-    float i_q_A = 0.0f;
-
-    float torque_Nm = 0.0f;
-
-    void Clear() {
-      // We implement this manually merely because it is faster than
-      // using the constructor which delegates to memset.  It is
-      // definitely more brittle.
-      pwm.a = 0.0f;
-      pwm.b = 0.0f;
-      pwm.c = 0.0f;
-
-      voltage.a = 0.0f;
-      voltage.b = 0.0f;
-      voltage.c = 0.0f;
-
-      d_V = 0.0f;
-      q_V = 0.0f;
-      i_d_A = 0.0f;
-      i_q_A = 0.0f;
-      torque_Nm = 0.0f;
+    uint32_t bucket_cycles = 1 << kBucketShift;
+
+    Stage adc_done;
+    Stage start_pos_sample;
+    Stage done_pos_sample;
+    Stage done_temp_sample;
+    Stage sense;
+    Stage curstate;
+    Stage control_sel_mode;
+    Stage control_done_pos;
+    Stage control_done_cur;
+    Stage control;
+    Stage done;
+
+    template <typename Functor>
+    void ForEachStage(Functor functor) {
+      functor(&adc_done);
+      functor(&start_pos_sample);
+      functor(&done_pos_sample);
+      functor(&done_temp_sample);
+      functor(&sense);
+      functor(&curstate);
+      functor(&control_sel_mode);
+      functor(&control_done_pos);
+      functor(&control_done_cur);
+      functor(&control);
+      functor(&done);
     }
 
     template <typename Archive>
     void Serialize(Archive* a) {
-      a->Visit(MJ_NVP(pwm));
-      a->Visit(MJ_NVP(voltage));
-      a->Visit(MJ_NVP(d_V));
-      a->Visit(MJ_NVP(q_V));
-      a->Visit(MJ_NVP(i_d_A));
-      a->Visit(MJ_NVP(i_q_A));
-      a->Visit(MJ_NVP(torque_Nm));
+      a->Visit(MJ_NVP(bucket_cycles));
+      a->Visit(MJ_NVP(adc_done));
+      a->Visit(MJ_NVP(start_pos_sample));
+      a->Visit(MJ_NVP(done_pos_sample));
+      a->Visit(MJ_NVP(done_temp_sample));
+      a->Visit(MJ_NVP(sense));
+      a->Visit(MJ_NVP(curstate));
+      a->Visit(MJ_NVP(control_sel_mode));
+      a->Visit(MJ_NVP(control_done_pos));
+      a->Visit(MJ_NVP(control_done_cur));
+      a->Visit(MJ_NVP(control));
+      a->Visit(MJ_NVP(done));
     }
   };
+#endif
 
-  struct CommandData {
-    Mode mode = kStopped;
-
-    // For kPwm mode.
-    Vec3 pwm;  // 0-1.0
-
-    // For kVoltage mode
-    Vec3 phase_v;
-
-    // For kVoltageFoc
-    float theta = 0.0f;
-    float voltage = 0.0f;
-
-    // For kVoltageDq
-    float d_V = 0.0f;
-    float q_V = 0.0f;
-
-    // For kFoc mode.
-    float i_d_A = 0.0f;
-    float i_q_A = 0.0f;
-
-    // For kPosition mode
-    float position = 0.0f;  // kNaN means start at the current position.
-    float velocity = 0.0f;
-
-    float max_torque_Nm = 100.0f;
-    float stop_position = std::numeric_limits<float>::quiet_NaN();
-    float feedforward_Nm = 0.0f;
-
-    float kp_scale = 1.0f;
-    float kd_scale = 1.0f;
-
-    float timeout_s = 0.0f;
-
-    // For kStayWithinBounds
-    float bounds_min = 0.0f;
-    float bounds_max = 0.0f;
-
-    // If set, then force the position to be the given value.
-    std::optional<float> set_position;
-
-    // If set, then rezero the position as if from boot.  Select a
-    // position closest to the given value.
-    std::optional<float> rezero_position;
-
-    template <typename Archive>
-    void Serialize(Archive* a) {
-      a->Visit(MJ_NVP(mode));
-
-      a->Visit(MJ_NVP(pwm));
-
-      a->Visit(MJ_NVP(phase_v));
-
-      a->Visit(MJ_NVP(theta));
-      a->Visit(MJ_NVP(voltage));
-
-      a->Visit(MJ_NVP(d_V));
-      a->Visit(MJ_NVP(q_V));
-
-      a->Visit(MJ_NVP(i_d_A));
-      a->Visit(MJ_NVP(i_q_A));
-
-      a->Visit(MJ_NVP(position));
-      a->Visit(MJ_NVP(velocity));
-      a->Visit(MJ_NVP(max_torque_Nm));
-      a->Visit(MJ_NVP(stop_position));
-      a->Visit(MJ_NVP(feedforward_Nm));
-      a->Visit(MJ_NVP(kp_scale));
-      a->Visit(MJ_NVP(kd_scale));
-      a->Visit(MJ_NVP(timeout_s));
-      a->Visit(MJ_NVP(bounds_min));
-      a->Visit(MJ_NVP(bounds_max));
-
-      a->Visit(MJ_NVP(set_position));
-      a->Visit(MJ_NVP(rezero_position));
-    }
+  using Control = BldcServoControl;
+  using CommandData = BldcServoCommandData;
+
+  // The signals which may be recorded with the Scope.
+  enum ScopeSignal : uint8_t {
+    kScopeCur1A,
+    kScopeCur2A,
+    kScopeCur3A,
+    kScopeBusV,
+    kScopeElectricalTheta,
+    kScopeDA,
+    kScopeQA,
+    kScopeVelocity,
+    kScopePosition,
+    kScopeTorqueNm,
+    kScopeControlDV,
+    kScopeControlQV,
+    kScopeControlIdA,
+    kScopeControlIqA,
+    kScopePwmA,
+    kScopePwmB,
+    kScopePwmC,
+    kScopeFetTempC,
+    kScopePositionRaw,
+    kNumScopeSignals,
   };
 
   void Start();
   void Command(const CommandData&);
 
+  /// The capture buffer, which is sampled once per control cycle.
+  Scope* scope();
+  /// The rate at which Scope::ISR_Sample is invoked.
+  float scope_rate_hz() const;
+
+  /// A free running count of the CPU cycles spent in the control
+  /// interrupt.
+  uint32_t isr_cycles() const;
+
   const Status& status() const;
   const Config& config() const;
   const Control& control() const;
   const Motor& motor() const;
 
+  /// Replace the encoder calibration, exactly as if motor.poles,
+  /// motor.invert and motor.offset had been set through the
+  /// configuration.  @p offset is called for each of the
+  /// motor.offset_size entries of the table.
+  void SetEncoderCalibration(
+      uint8_t poles, bool invert,
+      const mjlib::base::inplace_function<float (int)>& offset);
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+  /// Discard all accumulated DwtStats.  The statistics are cleared
+  /// at the start of the next control cycle.
+  void ResetDwtStats();
+#endif
+
  private:
   class Impl;
   mjlib::micro::PoolPtr<Impl> impl_;
@@ -578,26 +538,31 @@ namespace mjlib {
 namespace base {
 
 template <>
-struct IsEnum<moteus::BldcServo::Mode> {
+struct IsEnum<moteus::BldcServo::ScopeSignal> {
   static constexpr bool value = true;
 
-  using M = moteus::BldcServo::Mode;
-  static std::array<std::pair<M, const char*>, M::kNumModes> map() {
+  using S = moteus::BldcServo::ScopeSignal;
+  static std::array<std::pair<S, const char*>, S::kNumScopeSignals> map() {
     return { {
-        { M::kStopped, "stopped" },
-        { M::kFault, "fault" },
-        { M::kEnabling, "enabling" },
-        { M::kCalibrating, "calibrating" },
-        { M::kCalibrationComplete, "calib_complete" },
-        { M::kPwm, "pwm" },
-        { M::kVoltage, "voltage" },
-        { M::kVoltageFoc, "voltage_foc" },
-        { M::kVoltageDq, "voltage_dq" },
-        { M::kCurrent, "current" },
-        { M::kPosition, "position" },
-        { M::kPositionTimeout, "pos_timeout" },
-        { M::kZeroVelocity, "zero_vel" },
-        { M::kStayWithinBounds, "within" },
+        { S::kScopeCur1A, "cur1_A" },
+        { S::kScopeCur2A, "cur2_A" },
+        { S::kScopeCur3A, "cur3_A" },
+        { S::kScopeBusV, "bus_V" },
+        { S::kScopeElectricalTheta, "electrical_theta" },
+        { S::kScopeDA, "d_A" },
+        { S::kScopeQA, "q_A" },
+        { S::kScopeVelocity, "velocity" },
+        { S::kScopePosition, "position" },
+        { S::kScopeTorqueNm, "torque_Nm" },
+        { S::kScopeControlDV, "control_d_V" },
+        { S::kScopeControlQV, "control_q_V" },
+        { S::kScopeControlIdA, "control_i_d_A" },
+        { S::kScopeControlIqA, "control_i_q_A" },
+        { S::kScopePwmA, "pwm_a" },
+        { S::kScopePwmB, "pwm_b" },
+        { S::kScopePwmC, "pwm_c" },
+        { S::kScopeFetTempC, "fet_temp_C" },
+        { S::kScopePositionRaw, "position_raw" },
       }};
   }
 };
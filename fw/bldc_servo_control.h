@@ -0,0 +1,362 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "mjlib/base/limit.h"
+
+#include "fw/bldc_servo_structs.h"
+#include "fw/ccm.h"
+#include "fw/math.h"
+#include "fw/pid.h"
+
+namespace moteus {
+
+/// The position loop of BldcServo.
+///
+/// These depend only upon the servo status and configuration, so that
+/// ServoSim runs the same control law on the host as the ISR does on
+/// the controller.
+///
+/// status.control_position is measured in terms of 1 / 65536th of
+/// unwrapped_position_raw.  This is so that velocities do not become
+/// so small as to result in no change whatsoever at the control rate.
+/// Conversions to and from it go to some lengths to avoid converting
+/// a float directly to an int64, which calls out to a system library
+/// that is pretty slow.
+struct BldcServoPosition {
+  /// @param motor_scale16 unwrapped_position_raw counts per unit of
+  /// output position
+  static int64_t ToControl(float position, float motor_scale16)
+      MOTEUS_CCM_ATTRIBUTE {
+    return static_cast<int64_t>(65536) *
+        static_cast<int64_t>(static_cast<int32_t>(motor_scale16 * position));
+  }
+
+  static float Threshold(float value, float lower, float upper)
+      MOTEUS_CCM_ATTRIBUTE {
+    if (value > lower && value < upper) { return 0.0f; }
+    return value;
+  }
+
+  /// Prepare a newly received command for the ISR.
+  static void PrepareCommand(BldcServoCommandData* data,
+                             float unwrapped_position,
+                             float default_timeout_s) {
+    // If we have a case where the position is left unspecified, but
+    // we have a velocity and stop condition, then we pick the sign of
+    // the velocity so that we actually move.
+    if (std::isnan(data->position) &&
+        !std::isnan(data->stop_position) &&
+        !std::isnan(data->velocity) &&
+        data->velocity != 0.0f) {
+      data->velocity = std::abs(data->velocity) *
+          ((data->stop_position > unwrapped_position) ? 1.0f : -1.0f);
+    }
+
+    if (data->timeout_s == 0.0f) {
+      data->timeout_s = default_timeout_s;
+    }
+  }
+
+  /// Take up any position in @p data, which is consumed, either as
+  /// the control position or, when @p trajectory, as the target of
+  /// the trajectory.  With no control position yet, it starts from
+  /// the measured one.
+  static void Latch(BldcServoStatus* status, BldcServoCommandData* data,
+                    float motor_scale16, bool trajectory)
+      MOTEUS_CCM_ATTRIBUTE {
+    if (!std::isnan(data->position)) {
+      const int64_t position = ToControl(data->position, motor_scale16);
+      if (trajectory) {
+        status->trajectory_target = position;
+      } else {
+        status->control_position = position;
+      }
+      data->position = std::numeric_limits<float>::quiet_NaN();
+    }
+    if (!status->control_position) {
+      status->control_position =
+          static_cast<int64_t>(65536) *
+          static_cast<int64_t>(status->unwrapped_position_raw);
+      status->control_velocity = status->velocity;
+    }
+  }
+
+  /// Advance the control position by one position loop cycle at
+  /// @p velocity_command, subject to the position limits and the stop
+  /// position of @p data.
+  ///
+  /// @return the velocity command, which is 0 if a limit was hit
+  static float Advance(BldcServoStatus* status,
+                       const BldcServoCommandData& data,
+                       float velocity_command,
+                       float motor_scale16,
+                       int rate_hz,
+                       float position_min,
+                       float position_max) MOTEUS_CCM_ATTRIBUTE {
+    const auto old_position = *status->control_position;
+    // This limits our usable velocity to 20kHz modulo the position
+    // scale at a 40kHz switching frequency.  1.2 million RPM should
+    // be enough for anybody?
+    status->control_position =
+        *status->control_position +
+        static_cast<int32_t>(
+            (65536.0f * motor_scale16 * velocity_command) /
+            static_cast<float>(rate_hz));
+
+    bool limited = false;
+    const auto saturate = [&](auto value, auto compare) MOTEUS_CCM_ATTRIBUTE {
+      if (std::isnan(value)) { return; }
+      const auto limit_value = ToControl(value, motor_scale16);
+      if (compare(*status->control_position, limit_value)) {
+        status->control_position = limit_value;
+        limited = true;
+      }
+    };
+    saturate(position_min, [](auto l, auto r) { return l < r; });
+    saturate(position_max, [](auto l, auto r) { return l > r; });
+
+    if (!std::isnan(data.stop_position)) {
+      const int64_t stop_position_raw =
+          ToControl(data.stop_position, motor_scale16);
+
+      auto sign = [](auto value) MOTEUS_CCM_ATTRIBUTE -> float {
+        if (value < 0) { return -1.0f; }
+        if (value > 0) { return 1.0f; }
+        return 0.0f;
+      };
+      if (sign(*status->control_position -
+               stop_position_raw) * velocity_command > 0.0f) {
+        // We are moving away from the stop position.  Force it to be there.
+        status->control_position = stop_position_raw;
+        limited = true;
+      }
+    }
+    if (*status->control_position == old_position) {
+      // We have hit a limit.  Assume a velocity of 0.
+      velocity_command = 0.0f;
+    }
+    if (limited) {
+      status->control_velocity = 0.0f;
+    }
+    return velocity_command;
+  }
+
+  /// @return the output torque, limited to +-@p max_torque_Nm
+  static float Torque(const BldcServoStatus& status,
+                      PID* pid,
+                      const PID::ApplyOptions& pid_options,
+                      float velocity_command,
+                      float feedforward_Nm,
+                      float max_torque_Nm,
+                      float velocity_threshold,
+                      float unwrapped_position_scale,
+                      int rate_hz) MOTEUS_CCM_ATTRIBUTE {
+    const float measured_velocity = Threshold(
+        status.velocity, -velocity_threshold, velocity_threshold);
+
+    // We always control relative to the control position of 0, so
+    // that we get equal performance across the entire viable integral
+    // position range.
+    const int32_t scaled_control =
+        static_cast<int32_t>(*status.control_position / 65536);
+    const float unlimited_torque_Nm =
+        pid->Apply(
+            (status.unwrapped_position_raw - scaled_control) /
+            65536.0f * unwrapped_position_scale,
+            0.0,
+            measured_velocity, velocity_command,
+            rate_hz,
+            pid_options) +
+        feedforward_Nm;
+
+    return mjlib::base::Limit(unlimited_torque_Nm, -max_torque_Nm, max_torque_Nm);
+  }
+
+  /// @return the unwrapped_position_raw closest to @p position_to_set
+  /// which has the same position within a motor revolution as
+  /// @p zero_position.
+  static int32_t Rezero(float position_to_set, int16_t zero_position,
+                        float motor_scale16, float unwrapped_position_scale) {
+    const float error = position_to_set - zero_position / motor_scale16;
+    const float integral_offsets =
+        std::round(error / unwrapped_position_scale);
+    return static_cast<int32_t>(zero_position + integral_offsets * 65536.0f);
+  }
+
+  static bool PidActive(BldcServoMode mode) MOTEUS_CCM_ATTRIBUTE {
+    switch (mode) {
+      case kNumModes:
+      case kStopped:
+      case kFault:
+      case kEnabling:
+      case kCalibrating:
+      case kCalibrationComplete:
+      case kPwm:
+      case kVoltage:
+      case kVoltageFoc:
+      case kVoltageDq:
+      case kCurrent:
+      case kMeasureInductance:
+        return false;
+      case kPosition:
+      case kPositionTimeout:
+      case kZeroVelocity:
+      case kStayWithinBounds:
+        return true;
+    }
+    return false;
+  }
+
+  static void Clear(BldcServoStatus* status) MOTEUS_CCM_ATTRIBUTE {
+    status->pid_position.Clear();
+    status->control_position = {};
+    status->control_velocity = 0.0f;
+    status->trajectory_target = {};
+    status->field_weakening_d_A = 0.0f;
+  }
+};
+
+/// The current loop of BldcServo, in the same way as
+/// BldcServoPosition.
+struct BldcServoCurrent {
+  /// Derate a q axis current request in the direction that moves
+  /// further outside the position limits.
+  static float DeratePosition(float in, float unwrapped_position,
+                              float position_min, float position_max,
+                              float position_derate) MOTEUS_CCM_ATTRIBUTE {
+    if (!std::isnan(position_max) &&
+        unwrapped_position > position_max &&
+        in > 0.0f) {
+      // This is mostly useful when feedforward is applied, as
+      // otherwise, the position limits could easily be exceeded.
+      // Without feedforward, we shouldn't really be trying to push
+      // outside the limits anyhow.
+      return in *
+          std::max(0.0f,
+                   1.0f - (unwrapped_position - position_max) /
+                   position_derate);
+    }
+    if (!std::isnan(position_min) &&
+        unwrapped_position < position_min &&
+        in < 0.0f) {
+      return in *
+          std::max(0.0f,
+                   1.0f - (position_min - unwrapped_position) /
+                   position_derate);
+    }
+
+    return in;
+  }
+
+  /// @return the limit of the q axis current given @p i_d_A, with a
+  /// total limit of @p limit_A.
+  static float QLimit(float limit_A, float i_d_A, bool field_weakening)
+      MOTEUS_CCM_ATTRIBUTE {
+    // While field weakening current is injected, it takes priority,
+    // and the q axis gets whatever remains of the current limit, so
+    // that the total stays within it.
+    return field_weakening ?
+        std::sqrt(std::max(0.0f, limit_A * limit_A - i_d_A * i_d_A)) :
+        limit_A;
+  }
+
+  /// Converts from output velocity and current to the speed voltage.
+  static float DecouplingScale(float feedforward_scale, float inductance_H,
+                               int position_constant,
+                               float unwrapped_position_scale) {
+    return feedforward_scale * inductance_H * k2Pi *
+        static_cast<float>(position_constant) / unwrapped_position_scale;
+  }
+
+  /// Fill in the feedforward voltages of @p control for its dq
+  /// currents.
+  static void Feedforward(BldcServoControl* control,
+                          float velocity,
+                          float feedforward_scale,
+                          float decoupling_scale,
+                          float resistance_ohm,
+                          float v_per_hz,
+                          float unwrapped_position_scale)
+      MOTEUS_CCM_ATTRIBUTE {
+    // The speed voltages, w * L * i, couple each axis to the current
+    // in the other.  Feeding them forward leaves the PID loops only
+    // the resistive and transient error to correct.
+    const float decoupling_V_per_A = decoupling_scale * velocity;
+
+    control->d_ff_V =
+        feedforward_scale * control->i_d_A * resistance_ohm -
+        decoupling_V_per_A * control->i_q_A;
+    control->q_ff_V =
+        feedforward_scale * (
+            control->i_q_A * resistance_ohm +
+            velocity * v_per_hz / unwrapped_position_scale) +
+        decoupling_V_per_A * control->i_d_A;
+  }
+
+  /// The sensed currents are transformed with the electrical angle
+  /// at which they were sampled, but the voltages produced from them
+  /// only take effect some time later.
+  ///
+  /// @return the angle to modulate those voltages at, which is
+  /// @p electrical_theta extrapolated by @p advance_scale times
+  /// @p velocity
+  static float CommutationTheta(float electrical_theta,
+                                float advance_scale,
+                                float velocity) MOTEUS_CCM_ATTRIBUTE {
+    return WrapZeroToTwoPi(electrical_theta + advance_scale * velocity);
+  }
+
+  static bool PidActive(BldcServoMode mode) MOTEUS_CCM_ATTRIBUTE {
+    switch (mode) {
+      case kNumModes:
+      case kStopped:
+      case kFault:
+      case kEnabling:
+      case kCalibrating:
+      case kCalibrationComplete:
+      case kPwm:
+      case kVoltage:
+      case kVoltageFoc:
+      case kVoltageDq:
+      case kMeasureInductance:
+        return false;
+      case kCurrent:
+      case kPosition:
+      case kPositionTimeout:
+      case kZeroVelocity:
+      case kStayWithinBounds:
+        return true;
+    }
+    return false;
+  }
+
+  static void Clear(BldcServoStatus* status) MOTEUS_CCM_ATTRIBUTE {
+    status->pid_d.Clear();
+    status->pid_q.Clear();
+
+    // We always want to start from 0 current when initiating
+    // current control of some form.
+    status->pid_d.desired = 0.0f;
+    status->pid_q.desired = 0.0f;
+  }
+};
+
+}
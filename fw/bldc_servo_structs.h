@@ -0,0 +1,513 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <optional>
+
+#include "mjlib/base/visitor.h"
+
+#include "fw/error.h"
+#include "fw/flux_observer.h"
+#include "fw/pid.h"
+#include "fw/thermal_model.h"
+
+/// @file
+///
+/// The state and command types of BldcServo, which do not depend
+/// upon any hardware, so that the register mapping and ServoSim may
+/// use them on the host.
+
+namespace moteus {
+
+struct BldcServoVec3 {
+  float a = 0.0f;
+  float b = 0.0f;
+  float c = 0.0f;
+
+  template <typename Archive>
+  void Serialize(Archive* ar) {
+    ar->Visit(MJ_NVP(a));
+    ar->Visit(MJ_NVP(b));
+    ar->Visit(MJ_NVP(c));
+  }
+};
+
+enum BldcServoMode {
+  // In this mode, the entire motor driver will be disabled.
+  //
+  // When exiting this state, the current offset will be
+  // recalibrated.
+  kStopped = 0,
+
+  // This stage cannot be commanded directly, but will be entered
+  // upon any fault.  Here, the motor driver remains enabled, but
+  // the output stage power is removed.  The only valid transition
+  // from this state is to kStopped.
+  kFault = 1,
+
+  // This mode may not be commanded directly.  It is used when
+  // transitioning from kStopped to another mode.
+  kEnabling = 2,
+
+  // This mode may not be commanded directly, but is used when
+  // transitioning from kStopped to another mode.
+  kCalibrating = 3,
+
+  // This mode may not be commanded directly, but is used when
+  // transitioning from kStopped to another mode.
+  kCalibrationComplete = 4,
+
+  // Directly control the PWM of all 3 phases.
+  kPwm = 5,
+
+  // Control the voltage of all three phases
+  kVoltage = 6,
+
+  // Control the phase and voltage magnitude
+  kVoltageFoc = 7,
+
+  // Control d and q voltage
+  kVoltageDq = 8,
+
+  // Control d and q current
+  kCurrent = 9,
+
+  // Control absolute position
+  kPosition = 10,
+
+  // This state can be commanded directly, and will also be entered
+  // automatically upon a watchdog timeout from kPosition.  When in
+  // this state, the controller will apply a derivative only
+  // position control to slowly bring the servos to a resting
+  // position.
+  //
+  // The only way to exit this state is through a stop command.
+  kPositionTimeout = 11,
+
+  // This is just like kPositionTimeout, but is not latching.
+  kZeroVelocity = 12,
+
+  // This applies the PID controller only to stay within a
+  // particular position region, and applies 0 torque when within
+  // that region.
+  kStayWithinBounds = 13,
+
+  // This applies a square wave of d axis voltage, and accumulates
+  // the resulting change in current, in order to measure the
+  // inductance.
+  kMeasureInductance = 14,
+
+  kNumModes,
+};
+
+struct BldcServoStatus {
+  BldcServoMode mode = kStopped;
+  errc fault = errc::kSuccess;
+
+  uint16_t adc_cur1_raw = 0;
+  uint16_t adc_cur2_raw = 0;
+  uint16_t adc_cur3_raw = 0;
+  uint16_t adc_voltage_sense_raw = 0;
+  uint16_t adc_fet_temp_raw = 0;
+  uint16_t adc_motor_temp_raw = 0;
+
+  uint16_t position_raw = 0;
+
+  uint16_t adc_cur1_offset = 2048;
+  uint16_t adc_cur2_offset = 2048;
+  uint16_t adc_cur3_offset = 2048;
+  // True if the offsets above came from the stored configuration
+  // rather than being measured.
+  bool adc_offsets_stored = false;
+
+  // Microseconds from startup until the first calibration
+  // completed, 0 until then.
+  uint32_t boot_to_ready_us = 0;
+  // Microseconds the most recent calibration took, from leaving
+  // stopped until it completed.
+  uint32_t start_latency_us = 0;
+
+  float cur1_A = 0.0f;
+  float cur2_A = 0.0f;
+  float cur3_A = 0.0f;
+
+  float bus_V = 0.0f;
+  float filt_bus_V = std::numeric_limits<float>::quiet_NaN();
+  float filt_1ms_bus_V = std::numeric_limits<float>::quiet_NaN();
+  // The bus voltage used to convert voltages to PWM.
+  float pwm_bus_V = std::numeric_limits<float>::quiet_NaN();
+  uint16_t position = 0;
+  float fet_temp_C = 0.0f;
+  float filt_fet_temp_C = std::numeric_limits<float>::quiet_NaN();
+  ThermalModel::Status thermal;
+
+  float electrical_theta = 0.0f;
+  FluxObserver::Status flux_observer;
+
+  float d_A = 0.0f;
+  float q_A = 0.0f;
+
+  int32_t unwrapped_position_raw = 0;
+  float unwrapped_position = 0.0f;
+  float velocity = 0.0f;
+  float torque_Nm = 0.0f;
+
+  // The d axis current currently being injected for field
+  // weakening.  This is always zero or negative.
+  float field_weakening_d_A = 0.0f;
+
+  PID::State pid_d;
+  PID::State pid_q;
+  PID::State pid_position;
+
+  // This is scaled to be 65536 larger than unwrapped_position_raw.
+  std::optional<int64_t> control_position;
+  // When a trajectory is being followed, this is the velocity of
+  // control_position in rotations/s, and the position it is moving
+  // towards, in the same units as control_position.
+  float control_velocity = 0.0f;
+  std::optional<int64_t> trajectory_target;
+  float position_to_set = 0.0;
+  float timeout_s = 0.0;
+  bool rezeroed = false;
+
+  // For kMeasureInductance.  The integrator accumulates the rate of
+  // change of d axis current, in A/s, with the sign of the applied
+  // voltage, once per control cycle in meas_ind_count.  The mean
+  // is V / L.
+  int8_t meas_ind_phase = 0;
+  float meas_ind_integrator = 0.0f;
+  uint32_t meas_ind_count = 0;
+  float meas_ind_old_d_A = 0.0f;
+
+  // The sequence number of the command currently being executed.
+  uint32_t command_sequence = 0;
+  // The number of commands discarded because their host timestamp
+  // was not newer than the previous command.  This is only ever
+  // written from BldcServo::Command, not the ISR.
+  uint32_t stale_commands = 0;
+  // The number of commands whose apply time had already passed when
+  // they were received.  They are applied immediately.
+  uint32_t late_commands = 0;
+
+  float sin = 0.0f;
+  float cos = 0.0f;
+  uint16_t cooldown_count = 0;
+  uint32_t final_timer = 0;
+  uint32_t total_timer = 0;
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+  struct Dwt {
+    uint32_t adc_done = 0;
+    uint32_t start_pos_sample = 0;
+    uint32_t done_pos_sample = 0;
+    uint32_t done_temp_sample = 0;
+    uint32_t sense = 0;
+    uint32_t curstate = 0;
+    uint32_t control_sel_mode = 0;
+    uint32_t control_done_pos = 0;
+    uint32_t control_done_cur = 0;
+    uint32_t control = 0;
+    uint32_t done = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(adc_done));
+      a->Visit(MJ_NVP(start_pos_sample));
+      a->Visit(MJ_NVP(done_pos_sample));
+      a->Visit(MJ_NVP(done_temp_sample));
+      a->Visit(MJ_NVP(sense));
+      a->Visit(MJ_NVP(curstate));
+      a->Visit(MJ_NVP(control_sel_mode));
+      a->Visit(MJ_NVP(control_done_pos));
+      a->Visit(MJ_NVP(control_done_cur));
+      a->Visit(MJ_NVP(control));
+      a->Visit(MJ_NVP(done));
+    }
+  };
+
+  Dwt dwt;
+#endif
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(mode));
+    a->Visit(MJ_NVP(fault));
+
+    a->Visit(MJ_NVP(adc_cur1_raw));
+    a->Visit(MJ_NVP(adc_cur2_raw));
+    a->Visit(MJ_NVP(adc_cur3_raw));
+    a->Visit(MJ_NVP(adc_voltage_sense_raw));
+    a->Visit(MJ_NVP(adc_fet_temp_raw));
+    a->Visit(MJ_NVP(adc_motor_temp_raw));
+
+    a->Visit(MJ_NVP(position_raw));
+
+    a->Visit(MJ_NVP(adc_cur1_offset));
+    a->Visit(MJ_NVP(adc_cur2_offset));
+    a->Visit(MJ_NVP(adc_cur3_offset));
+    a->Visit(MJ_NVP(adc_offsets_stored));
+    a->Visit(MJ_NVP(boot_to_ready_us));
+    a->Visit(MJ_NVP(start_latency_us));
+
+    a->Visit(MJ_NVP(cur1_A));
+    a->Visit(MJ_NVP(cur2_A));
+    a->Visit(MJ_NVP(cur3_A));
+
+    a->Visit(MJ_NVP(bus_V));
+    a->Visit(MJ_NVP(filt_bus_V));
+    a->Visit(MJ_NVP(filt_1ms_bus_V));
+    a->Visit(MJ_NVP(pwm_bus_V));
+    a->Visit(MJ_NVP(position));
+    a->Visit(MJ_NVP(fet_temp_C));
+    a->Visit(MJ_NVP(filt_fet_temp_C));
+    a->Visit(MJ_NVP(thermal));
+    a->Visit(MJ_NVP(electrical_theta));
+    a->Visit(MJ_NVP(flux_observer));
+
+    a->Visit(MJ_NVP(d_A));
+    a->Visit(MJ_NVP(q_A));
+
+    a->Visit(MJ_NVP(unwrapped_position_raw));
+    a->Visit(MJ_NVP(unwrapped_position));
+    a->Visit(MJ_NVP(velocity));
+    a->Visit(MJ_NVP(torque_Nm));
+    a->Visit(MJ_NVP(field_weakening_d_A));
+
+    a->Visit(MJ_NVP(pid_d));
+    a->Visit(MJ_NVP(pid_q));
+    a->Visit(MJ_NVP(pid_position));
+
+    a->Visit(MJ_NVP(control_position));
+    a->Visit(MJ_NVP(control_velocity));
+    a->Visit(MJ_NVP(trajectory_target));
+    a->Visit(MJ_NVP(position_to_set));
+    a->Visit(MJ_NVP(timeout_s));
+    a->Visit(MJ_NVP(rezeroed));
+    a->Visit(MJ_NVP(meas_ind_phase));
+    a->Visit(MJ_NVP(meas_ind_integrator));
+    a->Visit(MJ_NVP(meas_ind_count));
+    a->Visit(MJ_NVP(meas_ind_old_d_A));
+    a->Visit(MJ_NVP(command_sequence));
+    a->Visit(MJ_NVP(stale_commands));
+    a->Visit(MJ_NVP(late_commands));
+
+    a->Visit(MJ_NVP(sin));
+    a->Visit(MJ_NVP(cos));
+    a->Visit(MJ_NVP(cooldown_count));
+    a->Visit(MJ_NVP(final_timer));
+    a->Visit(MJ_NVP(total_timer));
+
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+    a->Visit(MJ_NVP(dwt));
+#endif
+  }
+};
+
+// Intermediate control outputs.
+struct BldcServoControl {
+  BldcServoVec3 pwm;
+  BldcServoVec3 voltage;
+
+  float d_V = 0.0f;
+  float q_V = 0.0f;
+
+  float i_d_A = 0.0f;
+  float i_q_A = 0.0f;
+
+  // The portion of d_V and q_V which was feedforward, as opposed to
+  // the output of the current PID loops.
+  float d_ff_V = 0.0f;
+  float q_ff_V = 0.0f;
+
+  // The portion of i_q_A from motor.cogging_A.
+  float cogging_A = 0.0f;
+
+  float torque_Nm = 0.0f;
+
+  void Clear() {
+    // We implement this manually merely because it is faster than
+    // using the constructor which delegates to memset.  It is
+    // definitely more brittle.
+    pwm.a = 0.0f;
+    pwm.b = 0.0f;
+    pwm.c = 0.0f;
+
+    voltage.a = 0.0f;
+    voltage.b = 0.0f;
+    voltage.c = 0.0f;
+
+    d_V = 0.0f;
+    q_V = 0.0f;
+    i_d_A = 0.0f;
+    i_q_A = 0.0f;
+    d_ff_V = 0.0f;
+    q_ff_V = 0.0f;
+    cogging_A = 0.0f;
+    torque_Nm = 0.0f;
+  }
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(pwm));
+    a->Visit(MJ_NVP(voltage));
+    a->Visit(MJ_NVP(d_V));
+    a->Visit(MJ_NVP(q_V));
+    a->Visit(MJ_NVP(i_d_A));
+    a->Visit(MJ_NVP(i_q_A));
+    a->Visit(MJ_NVP(d_ff_V));
+    a->Visit(MJ_NVP(q_ff_V));
+    a->Visit(MJ_NVP(cogging_A));
+    a->Visit(MJ_NVP(torque_Nm));
+  }
+};
+
+struct BldcServoCommandData {
+  BldcServoMode mode = kStopped;
+
+  // For kPwm mode.
+  BldcServoVec3 pwm;  // 0-1.0
+
+  // For kVoltage mode
+  BldcServoVec3 phase_v;
+
+  // For kVoltageFoc
+  float theta = 0.0f;
+  float voltage = 0.0f;
+
+  // For kVoltageDq
+  float d_V = 0.0f;
+  float q_V = 0.0f;
+
+  // For kFoc mode.
+  float i_d_A = 0.0f;
+  float i_q_A = 0.0f;
+
+  // For kPosition mode
+  float position = 0.0f;  // kNaN means start at the current position.
+  float velocity = 0.0f;
+
+  float max_torque_Nm = 100.0f;
+  float stop_position = std::numeric_limits<float>::quiet_NaN();
+  float feedforward_Nm = 0.0f;
+
+  float kp_scale = 1.0f;
+  float kd_scale = 1.0f;
+
+  float timeout_s = 0.0f;
+
+  // For kStayWithinBounds
+  float bounds_min = 0.0f;
+  float bounds_max = 0.0f;
+
+  // For kMeasureInductance, d_V is the amplitude of the square
+  // wave, and this the number of control cycles in each half
+  // period.
+  int8_t meas_ind_period = 4;
+
+  // If set, then force the position to be the given value.
+  std::optional<float> set_position;
+
+  // If set, then rezero the position as if from boot.  Select a
+  // position closest to the given value.
+  std::optional<float> rezero_position;
+
+  // If set, an arbitrary increasing count from the host, left
+  // aligned in 32 bits so that it wraps identically regardless of
+  // the width it was sent with.  A command which is not newer than
+  // the last accepted one is discarded.
+  std::optional<uint32_t> host_timestamp;
+
+  // If set, the value of the microsecond timer at which this
+  // command should take effect, rather than as soon as possible.
+  std::optional<uint32_t> apply_us;
+
+  // This is assigned by BldcServo::Command.  The ISR treats each
+  // distinct value as a newly received command.
+  uint32_t sequence = 0;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(mode));
+
+    a->Visit(MJ_NVP(pwm));
+
+    a->Visit(MJ_NVP(phase_v));
+
+    a->Visit(MJ_NVP(theta));
+    a->Visit(MJ_NVP(voltage));
+
+    a->Visit(MJ_NVP(d_V));
+    a->Visit(MJ_NVP(q_V));
+
+    a->Visit(MJ_NVP(i_d_A));
+    a->Visit(MJ_NVP(i_q_A));
+
+    a->Visit(MJ_NVP(position));
+    a->Visit(MJ_NVP(velocity));
+    a->Visit(MJ_NVP(max_torque_Nm));
+    a->Visit(MJ_NVP(stop_position));
+    a->Visit(MJ_NVP(feedforward_Nm));
+    a->Visit(MJ_NVP(kp_scale));
+    a->Visit(MJ_NVP(kd_scale));
+    a->Visit(MJ_NVP(timeout_s));
+    a->Visit(MJ_NVP(bounds_min));
+    a->Visit(MJ_NVP(bounds_max));
+    a->Visit(MJ_NVP(meas_ind_period));
+
+    a->Visit(MJ_NVP(set_position));
+    a->Visit(MJ_NVP(rezero_position));
+    a->Visit(MJ_NVP(host_timestamp));
+    a->Visit(MJ_NVP(apply_us));
+    a->Visit(MJ_NVP(sequence));
+  }
+};
+
+}
+
+namespace mjlib {
+namespace base {
+
+template <>
+struct IsEnum<moteus::BldcServoMode> {
+  static constexpr bool value = true;
+
+  using M = moteus::BldcServoMode;
+  static std::array<std::pair<M, const char*>, M::kNumModes> map() {
+    return { {
+        { M::kStopped, "stopped" },
+        { M::kFault, "fault" },
+        { M::kEnabling, "enabling" },
+        { M::kCalibrating, "calibrating" },
+        { M::kCalibrationComplete, "calib_complete" },
+        { M::kPwm, "pwm" },
+        { M::kVoltage, "voltage" },
+        { M::kVoltageFoc, "voltage_foc" },
+        { M::kVoltageDq, "voltage_dq" },
+        { M::kCurrent, "current" },
+        { M::kPosition, "position" },
+        { M::kPositionTimeout, "pos_timeout" },
+        { M::kZeroVelocity, "zero_vel" },
+        { M::kStayWithinBounds, "within" },
+        { M::kMeasureInductance, "meas_ind" },
+      }};
+  }
+};
+
+}
+}
@@ -14,8 +14,11 @@
 
 #include "fw/board_debug.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
+#include <optional>
 
 #include "mbed.h"
 
@@ -27,7 +30,9 @@
 #include "fw/bldc_servo.h"
 #include "fw/bootloader.h"
 #include "fw/drv8323.h"
+#include "fw/encoder_calibrator.h"
 #include "fw/moteus_hw.h"
+#include "fw/stream_writer.h"
 
 namespace base = mjlib::base;
 namespace micro = mjlib::micro;
@@ -103,7 +108,9 @@ class BoardDebug::Impl {
   }
 
   void PollMillisecond() {
-    if (motor_cal_mode_ != kNoMotorCal) {
+    if (motor_cal_mode_ == kCalReport) {
+      DoCalibrationReport();
+    } else if (motor_cal_mode_ != kNoMotorCal) {
       DoCalibration();
     }
   }
@@ -140,7 +147,7 @@ class BoardDebug::Impl {
       motor_cal_mode_ = kNoMotorCal;
 
       BldcServo::CommandData command;
-      command.mode = BldcServo::kStopped;
+      command.mode = BldcServo::Mode::kStopped;
 
       bldc_->Command(command);
 
@@ -160,13 +167,22 @@ class BoardDebug::Impl {
           // Try to write out our final message.
           if (write_outstanding_) { return; }
 
+          if (cal_block_count_) {
+            EmitCalBlock();
+            return;
+          }
+
+          if (cal_onboard_) {
+            FinishOnboardCalibration();
+            return;
+          }
 
           WriteMessage(cal_response_, "CAL done\r\n");
           cal_response_ = {};
           motor_cal_mode_ = kNoMotorCal;
 
           BldcServo::CommandData command;
-          command.mode = BldcServo::kStopped;
+          command.mode = BldcServo::Mode::kStopped;
 
           bldc_->Command(command);
 
@@ -174,13 +190,42 @@ class BoardDebug::Impl {
         }
         break;
       }
-      case kNoMotorCal: {
+      case kNoMotorCal:
+      case kCalReport: {
         MJ_ASSERT(false);
         break;
       }
     }
 
-    if ((cal_count_ % 10) == 0 && !write_outstanding_) {
+    if (cal_onboard_) {
+      // Every sample is used, since nothing needs to be sent.
+      calibrator_.Sample(motor_cal_mode_ == kPhaseUp,
+                         old_phase, bldc_->status().position_raw);
+    } else if ((cal_count_ % 10) == 0 && cal_binary_) {
+      // One block fills while the other is written, so samples
+      // are only lost if the stream falls a whole block behind.
+      if (cal_block_count_ < kCalBlockSamples) {
+        const auto& status = bldc_->status();
+        char* const ptr =
+            &cal_blocks_[cal_block_index_][
+                kCalBlockHeaderSize + cal_block_count_ * kCalSampleSize];
+        const uint8_t direction = motor_cal_mode_;
+        const uint16_t encoder = status.position_raw;
+        const int16_t currents[] = {
+          SaturateMilliamps(status.cur1_A),
+          SaturateMilliamps(status.cur2_A),
+          SaturateMilliamps(status.cur3_A),
+        };
+        std::memcpy(&ptr[0], &direction, 1);
+        std::memcpy(&ptr[1], &old_phase, 2);
+        std::memcpy(&ptr[3], &encoder, 2);
+        std::memcpy(&ptr[5], currents, 6);
+        cal_block_count_++;
+      }
+      if (cal_block_count_ == kCalBlockSamples && !write_outstanding_) {
+        EmitCalBlock();
+      }
+    } else if ((cal_count_ % 10) == 0 && !write_outstanding_) {
       const auto& status = bldc_->status();
 
       ::snprintf(out_message_, sizeof(out_message_),
@@ -198,13 +243,102 @@ class BoardDebug::Impl {
     }
 
     BldcServo::CommandData command;
-    command.mode = BldcServo::kVoltageFoc;
+    command.mode = BldcServo::Mode::kVoltageFoc;
 
     command.theta = (cal_phase_ / 65536.0f) * 2.0f * kPi;
     command.voltage = cal_magnitude_;
     bldc_->Command(command);
   }
 
+  void FinishOnboardCalibration() {
+    BldcServo::CommandData command;
+    command.mode = BldcServo::Mode::kStopped;
+    bldc_->Command(command);
+
+    const auto& result = calibrator_.Calculate();
+    if (result.error == EncoderCalibrator::kNone) {
+      bldc_->SetEncoderCalibration(
+          result.poles, result.invert, [&](int index) {
+            return calibrator_.Offset(index, bldc_->motor().offset_size);
+          });
+    }
+
+    motor_cal_mode_ = kCalReport;
+    cal_report_index_ = -1;
+  }
+
+  // Report the outcome of an on board calibration, one line per
+  // millisecond: first the pole count and inversion, then each entry
+  // of the offset table in microradians.
+  void DoCalibrationReport() {
+    if (write_outstanding_) { return; }
+
+    const auto& result = calibrator_.result();
+    const auto& motor = bldc_->motor();
+    const int size = std::min<int>(
+        motor.offset_size, BldcServo::Motor::kMaxOffsetSize);
+
+    if (result.error != EncoderCalibrator::kNone) {
+      ::snprintf(out_message_, sizeof(out_message_), "CAL error %s\r\n",
+                 EncoderCalibrator::ErrorName(result.error));
+      WriteMessage(cal_response_, out_message_);
+      cal_response_ = {};
+      motor_cal_mode_ = kNoMotorCal;
+      return;
+    }
+
+    if (cal_report_index_ >= size) {
+      WriteMessage(cal_response_, "CAL done\r\n");
+      cal_response_ = {};
+      motor_cal_mode_ = kNoMotorCal;
+      return;
+    }
+
+    if (cal_report_index_ < 0) {
+      ::snprintf(out_message_, sizeof(out_message_),
+                 "CALR poles=%d invert=%d ratio=%d size=%d\r\n",
+                 result.poles, result.invert ? 1 : 0,
+                 static_cast<int>(result.ratio * 1000.0f), size);
+    } else {
+      ::snprintf(out_message_, sizeof(out_message_), "CALO %d %d\r\n",
+                 cal_report_index_,
+                 static_cast<int>(motor.offset[cal_report_index_] * 1e6f));
+    }
+    cal_report_index_++;
+
+    write_outstanding_ = true;
+    AsyncWrite(*cal_response_.stream, out_message_, [this](auto) {
+        write_outstanding_ = false;
+      });
+  }
+
+  static int16_t SaturateMilliamps(float value) {
+    return static_cast<int16_t>(
+        std::max(-32768.0f, std::min(32767.0f, value * 1000.0f)));
+  }
+
+  // Binary calibration data is sent as a line "CALB <count>\n",
+  // followed by count samples of kCalSampleSize bytes each.
+  void EmitCalBlock() {
+    // This is formatted by hand, as snprintf would overwrite the
+    // first sample with its terminating null.
+    char* const block = cal_blocks_[cal_block_index_];
+    std::memcpy(block, "CALB ", 5);
+    block[5] = '0' + cal_block_count_ / 10;
+    block[6] = '0' + cal_block_count_ % 10;
+    block[7] = '\n';
+    const size_t size =
+        kCalBlockHeaderSize + cal_block_count_ * kCalSampleSize;
+    cal_block_count_ = 0;
+    cal_block_index_ = !cal_block_index_;
+
+    write_outstanding_ = true;
+    AsyncWrite(*cal_response_.stream, std::string_view(block, size),
+               [this](auto) {
+                 write_outstanding_ = false;
+               });
+  }
+
   void HandleCommand(const std::string_view& message,
                      const micro::CommandManager::Response& response) {
     base::Tokenizer tokenizer(message, " ");
@@ -232,7 +366,7 @@ class BoardDebug::Impl {
 
     if (cmd_text == "stop") {
       BldcServo::CommandData command;
-      command.mode = BldcServo::kStopped;
+      command.mode = BldcServo::Mode::kStopped;
 
       bldc_->Command(command);
       WriteOk(response);
@@ -250,7 +384,7 @@ class BoardDebug::Impl {
       }
 
       BldcServo::CommandData command;
-      command.mode = BldcServo::kPwm;
+      command.mode = BldcServo::Mode::kPwm;
       command.pwm.a = std::strtof(pwm1_str.data(), nullptr);
       command.pwm.b = std::strtof(pwm2_str.data(), nullptr);
       command.pwm.c = std::strtof(pwm3_str.data(), nullptr);
@@ -273,7 +407,7 @@ class BoardDebug::Impl {
       const float magnitude = std::strtof(magnitude_str.data(), nullptr);
 
       BldcServo::CommandData command;
-      command.mode = BldcServo::kVoltageFoc;
+      command.mode = BldcServo::Mode::kVoltageFoc;
 
       command.theta = phase;
       command.voltage = magnitude;
@@ -292,6 +426,8 @@ class BoardDebug::Impl {
       }
 
       cal_speed_ = 1.0f;
+      cal_binary_ = false;
+      cal_onboard_ = false;
 
       while (tokenizer.remaining().size()) {
         const auto token = tokenizer.next();
@@ -307,6 +443,14 @@ class BoardDebug::Impl {
             cal_speed_ = value;
             break;
           }
+          case 'b': {
+            cal_binary_ = value != 0.0f;
+            break;
+          }
+          case 'o': {
+            cal_onboard_ = value != 0.0f;
+            break;
+          }
           default: {
             WriteMessage(response, "ERR unknown cal option\r\n");
             return;
@@ -320,6 +464,8 @@ class BoardDebug::Impl {
       cal_count_ = 0;
       cal_old_position_raw_ = bldc_->status().position_raw;
       cal_position_delta_ = 0;
+      cal_block_count_ = 0;
+      if (cal_onboard_) { calibrator_.Reset(); }
 
       cal_magnitude_ = std::strtof(magnitude_str.data(), nullptr);
 
@@ -331,6 +477,29 @@ class BoardDebug::Impl {
       return;
     }
 
+    if (cmd_text == "ind") {
+      const auto voltage_str = tokenizer.next();
+      const auto period_str = tokenizer.next();
+
+      if (voltage_str.empty()) {
+        WriteMessage(response, "ERR missing voltage\r\n");
+        return;
+      }
+
+      BldcServo::CommandData command;
+      command.mode = BldcServo::Mode::kMeasureInductance;
+      command.d_V = std::strtof(voltage_str.data(), nullptr);
+      if (!period_str.empty()) {
+        command.meas_ind_period = static_cast<int8_t>(
+            std::max<long>(1, std::min<long>(
+                               127, std::strtol(period_str.data(), nullptr, 0))));
+      }
+
+      bldc_->Command(command);
+      WriteOk(response);
+      return;
+    }
+
     if (cmd_text == "vdq") {
       const auto d_str = tokenizer.next();
       const auto q_str = tokenizer.next();
@@ -344,7 +513,7 @@ class BoardDebug::Impl {
       const float q_V = std::strtof(q_str.data(), nullptr);
 
       BldcServo::CommandData command;
-      command.mode = BldcServo::kVoltageDq;
+      command.mode = BldcServo::Mode::kVoltageDq;
 
       command.d_V = d_V;
       command.q_V = q_V;
@@ -367,7 +536,7 @@ class BoardDebug::Impl {
       const float q = std::strtof(q_str.data(), nullptr);
 
       BldcServo::CommandData command;
-      command.mode = BldcServo::kCurrent;
+      command.mode = BldcServo::Mode::kCurrent;
 
       command.i_d_A = d;
       command.i_q_A = q;
@@ -403,10 +572,10 @@ class BoardDebug::Impl {
       }
 
       command.mode =
-          (cmd_text == "pos") ? BldcServo::kPosition :
-          (cmd_text == "tmt") ? BldcServo::kPositionTimeout :
-          (cmd_text == "zero") ? BldcServo::kZeroVelocity :
-          BldcServo::kStopped;
+          (cmd_text == "pos") ? BldcServo::Mode::kPosition :
+          (cmd_text == "tmt") ? BldcServo::Mode::kPositionTimeout :
+          (cmd_text == "zero") ? BldcServo::Mode::kZeroVelocity :
+          BldcServo::Mode::kStopped;
 
       command.position = pos;
       command.velocity = vel;
@@ -441,7 +610,7 @@ class BoardDebug::Impl {
         return;
       }
 
-      command.mode = BldcServo::kStayWithinBounds;
+      command.mode = BldcServo::Mode::kStayWithinBounds;
 
       command.bounds_min = min_pos;
       command.bounds_max = max_pos;
@@ -463,7 +632,7 @@ class BoardDebug::Impl {
       const float index_value = std::strtof(pos_value.data(), nullptr);
 
       BldcServo::CommandData command;
-      command.mode = BldcServo::kStopped;
+      command.mode = BldcServo::Mode::kStopped;
 
       command.set_position = index_value;
 
@@ -474,7 +643,7 @@ class BoardDebug::Impl {
 
     if (cmd_text == "rezero") {
       BldcServo::CommandData command;
-      command.mode = BldcServo::kStopped;
+      command.mode = BldcServo::Mode::kStopped;
 
       const auto pos_value = tokenizer.next();
       command.rezero_position =
@@ -486,6 +655,21 @@ class BoardDebug::Impl {
       return;
     }
 
+    if (cmd_text == "dwtreset") {
+#ifdef MOTEUS_PERFORMANCE_MEASURE
+      bldc_->ResetDwtStats();
+      WriteOk(response);
+#else
+      WriteMessage(response, "ERR performance measurement disabled\r\n");
+#endif
+      return;
+    }
+
+    if (cmd_text == "scope") {
+      HandleScope(&tokenizer, response);
+      return;
+    }
+
     if (cmd_text == "die") {
       mbed_die();
     }
@@ -520,6 +704,239 @@ class BoardDebug::Impl {
     WriteMessage(response, "ERR unknown command\r\n");
   }
 
+  void HandleScope(base::Tokenizer* tokenizer,
+                   const micro::CommandManager::Response& response) {
+    Scope* const scope = bldc_->scope();
+    const auto scope_cmd = tokenizer->next();
+
+    if (scope_cmd == "arm") {
+      Scope::Options options;
+
+      const auto trigger = tokenizer->next();
+      if (trigger == "now") {
+        options.trigger = Scope::kNow;
+      } else if (trigger == "fault") {
+        options.trigger = Scope::kFault;
+      } else if (trigger == "mode") {
+        options.trigger = Scope::kModeChange;
+      } else if (trigger == "cmd") {
+        options.trigger = Scope::kCommand;
+      } else if (trigger == "rise") {
+        options.trigger = Scope::kRising;
+      } else if (trigger == "fall") {
+        options.trigger = Scope::kFalling;
+      } else {
+        WriteMessage(response, "ERR unknown trigger\r\n");
+        return;
+      }
+
+      base::Tokenizer signals(tokenizer->next(), ",");
+      options.channels = 0;
+      while (signals.remaining().size()) {
+        const auto name = signals.next();
+        if (options.channels >= Scope::kMaxChannels) {
+          WriteMessage(response, "ERR too many signals\r\n");
+          return;
+        }
+        const auto signal = FindScopeSignal(name);
+        if (signal < 0) {
+          WriteMessage(response, "ERR unknown signal\r\n");
+          return;
+        }
+        options.signals[options.channels++] = signal;
+      }
+      if (options.channels == 0) {
+        WriteMessage(response, "ERR missing signals\r\n");
+        return;
+      }
+
+      while (tokenizer->remaining().size()) {
+        const auto token = tokenizer->next();
+        if (token.size() < 1) { continue; }
+        const float value = std::strtof(&token[1], nullptr);
+        switch (token[0]) {
+          case 'l': {
+            options.level = value;
+            break;
+          }
+          case 'n': {
+            options.decimation = static_cast<uint16_t>(value);
+            break;
+          }
+          case 'p': {
+            options.post_trigger = static_cast<uint16_t>(value);
+            break;
+          }
+          default: {
+            WriteMessage(response, "ERR unknown option\r\n");
+            return;
+          }
+        }
+      }
+
+      scope->Arm(options);
+      WriteOk(response);
+      return;
+    }
+
+    if (scope_cmd == "stop") {
+      scope->Stop();
+      WriteOk(response);
+      return;
+    }
+
+    if (scope_cmd == "status") {
+      constexpr const char* kStates[] = {
+        "idle", "armed", "triggered", "complete",
+      };
+      ::snprintf(out_message_, sizeof(out_message_),
+                 "SCOPE %s %d\r\n",
+                 kStates[scope->state()], scope->frames());
+      WriteMessage(response, out_message_);
+      return;
+    }
+
+    if (scope_cmd == "dump") {
+      const auto state = scope->state();
+      if (state == Scope::kArmed || state == Scope::kTriggered) {
+        WriteMessage(response, "ERR capture in progress\r\n");
+        return;
+      }
+
+      // The header gives the sample rate and the signal names.  The
+      // samples follow in hex encoded little endian floats, ordered
+      // by channel within each sample.
+      char* const header = scope_lines_[0];
+      const auto& options = scope->options();
+      int pos = ::snprintf(
+          header, sizeof(scope_lines_[0]), "scope %d %d %d %d",
+          options.channels, scope->frames(),
+          (state == Scope::kComplete) ? scope->trigger_frame() : -1,
+          static_cast<int>(bldc_->scope_rate_hz() / options.decimation));
+      for (int i = 0; i < options.channels; i++) {
+        pos += ::snprintf(
+            &header[pos], sizeof(scope_lines_[0]) - pos, " %s",
+            ScopeSignalName(options.signals[i]));
+      }
+      pos += ::snprintf(&header[pos], sizeof(scope_lines_[0]) - pos, "\r\n");
+      pos = std::min<int>(pos, sizeof(scope_lines_[0]) - 1);
+
+      // The command manager always responds on the same stream, so
+      // the writer is only rebuilt if that were ever to change.
+      if (!scope_writer_ || scope_stream_ != response.stream) {
+        scope_writer_.emplace(response.stream);
+        scope_stream_ = response.stream;
+      }
+
+      scope_response_ = response;
+      scope_index_ = 0;
+      scope_failed_ = false;
+
+      // Hold the dump open until every line has been queued, in case
+      // the stream completes writes immediately.
+      scope_outstanding_ = 1;
+
+      // The header is copied, so its line is free to be formatted
+      // into straight away.
+      scope_outstanding_++;
+      if (scope_writer_->AsyncWrite(
+              std::string_view(header, pos), [this](auto) {
+                scope_outstanding_--;
+                MaybeFinishScope();
+              })) {
+        scope_outstanding_--;
+        scope_failed_ = true;
+      }
+      for (int i = 0; i < kScopeLines; i++) { QueueScopeLine(i); }
+
+      scope_outstanding_--;
+      MaybeFinishScope();
+      return;
+    }
+
+    WriteMessage(response, "ERR unknown scope command\r\n");
+  }
+
+  /// Format the next line of samples into @p line and queue it by
+  /// reference.  Once it has been written, the line is reused for
+  /// whatever samples remain, so that one line is formatted while
+  /// the other is on the wire.
+  void QueueScopeLine(int line) {
+    Scope* const scope = bldc_->scope();
+    const int channels = scope->options().channels;
+    const int total = scope->frames() * channels;
+
+    if (scope_failed_ || !scope_response_.stream ||
+        scope_index_ >= total) {
+      return;
+    }
+
+    char* const out = scope_lines_[line];
+    constexpr char kHex[] = "0123456789abcdef";
+    int pos = 0;
+    out[pos++] = 's';
+    out[pos++] = ' ';
+    for (int i = 0; i < kScopeValuesPerLine && scope_index_ < total;
+         i++, scope_index_++) {
+      const float value =
+          scope->value(scope_index_ / channels, scope_index_ % channels);
+      uint8_t bytes[sizeof(value)] = {};
+      std::memcpy(bytes, &value, sizeof(value));
+      for (auto byte : bytes) {
+        out[pos++] = kHex[byte >> 4];
+        out[pos++] = kHex[byte & 0x0f];
+      }
+    }
+    out[pos++] = '\r';
+    out[pos++] = '\n';
+
+    scope_outstanding_++;
+    const auto err = scope_writer_->AsyncWriteReference(
+        std::string_view(out, pos), [this, line](auto) {
+          scope_outstanding_--;
+          QueueScopeLine(line);
+          MaybeFinishScope();
+        });
+    if (err) {
+      // Both lines fit in a single batch, so this is not expected.
+      // Rather than send a dump with a gap, end it in error.
+      scope_outstanding_--;
+      scope_failed_ = true;
+    }
+  }
+
+  void MaybeFinishScope() {
+    if (!scope_response_.stream || scope_outstanding_ > 0) { return; }
+
+    Scope* const scope = bldc_->scope();
+    const int total = scope->frames() * scope->options().channels;
+    if (!scope_failed_ && scope_index_ < total) { return; }
+
+    auto response = scope_response_;
+    scope_response_ = {};
+    if (scope_failed_) {
+      WriteMessage(response, "ERR scope write failed\r\n");
+    } else {
+      WriteOk(response);
+    }
+  }
+
+  static int FindScopeSignal(const std::string_view& name) {
+    for (const auto& pair :
+             base::IsEnum<BldcServo::ScopeSignal>::map()) {
+      if (name == pair.second) { return pair.first; }
+    }
+    return -1;
+  }
+
+  static const char* ScopeSignalName(uint8_t signal) {
+    for (const auto& pair :
+             base::IsEnum<BldcServo::ScopeSignal>::map()) {
+      if (signal == pair.first) { return pair.second; }
+    }
+    return "unknown";
+  }
+
   void Recurse(int count) {
     recurse(count, [this](int value) { this->Recurse(value - 1); });
   }
@@ -555,11 +972,22 @@ class BoardDebug::Impl {
 
   char out_message_[64] = {};
 
+  static constexpr int kScopeValuesPerLine = 16;
+  static constexpr int kScopeLines = 2;
+  char scope_lines_[kScopeLines][4 + kScopeValuesPerLine * 8] = {};
+  micro::AsyncWriteStream* scope_stream_ = nullptr;
+  std::optional<StreamWriter<sizeof(scope_lines_[0]), 4, 4>> scope_writer_;
+  micro::CommandManager::Response scope_response_;
+  int scope_index_ = 0;
+  int scope_outstanding_ = 0;
+  bool scope_failed_ = false;
+
   micro::CommandManager::Response cal_response_;
   enum MotorCalMode {
     kNoMotorCal,
     kPhaseUp,
     kPhaseDown,
+    kCalReport,
   };
   MotorCalMode motor_cal_mode_ = kNoMotorCal;
   uint16_t cal_phase_ = 0;
@@ -569,6 +997,23 @@ class BoardDebug::Impl {
   float cal_magnitude_ = 0.0f;
   float cal_speed_ = 1.0f;
   bool write_outstanding_ = false;
+
+  // direction, phase, encoder, and 3 currents in mA
+  static constexpr int kCalSampleSize = 11;
+  static constexpr int kCalBlockSamples = 16;
+  // "CALB nn\n"
+  static constexpr int kCalBlockHeaderSize = 8;
+  bool cal_binary_ = false;
+  int cal_block_count_ = 0;
+  int cal_block_index_ = 0;
+  char cal_blocks_[2][
+      kCalBlockHeaderSize + kCalBlockSamples * kCalSampleSize] = {};
+
+  // When set, the offset table is computed here rather than by the
+  // host, and the samples are not reported.
+  bool cal_onboard_ = false;
+  EncoderCalibrator calibrator_;
+  int cal_report_index_ = 0;
 };
 
 BoardDebug::BoardDebug(micro::Pool* pool,
@@ -28,11 +28,13 @@
 #include "mjlib/multiplex/format.h"
 #include "mjlib/multiplex/stream.h"
 
+#include "fw/crc32.h"
 #include "fw/git_info.h"
 #include "fw/stm32g4xx_fdcan_typedefs.h"
 
 namespace {
 using mjlib::multiplex::Format;
+using moteus::Crc32;
 
 template <typename T>
 uint32_t u32(T value) {
@@ -189,6 +191,20 @@ class FlashWriter {
     return true;
   }
 
+  /// @param intaddr must be 8 byte aligned
+  bool ProgramDoubleWord(uint32_t intaddr, uint64_t value) {
+    if (shadow_bits_ && shadow_start_ != intaddr) {
+      if (!FlushWord()) {
+        return false;
+      }
+    }
+
+    shadow_start_ = intaddr;
+    shadow_ = value;
+    shadow_bits_ = 0xffffffffffffffffull;
+    return FlushWord();
+  }
+
  private:
   bool FlushWord() {
     if (!MaybeEraseSector(shadow_start_)) {
@@ -309,7 +325,7 @@ class BootloaderServer {
     fdcan_TxFIFOQSA_ = SramCanInstanceBase + SRAMCAN_TFQSA;
 
     auto writer = response_.writer();
-    writer.write("multiplex bootloader protocol 1 ");
+    writer.write("multiplex bootloader protocol 2 ");
 
     moteus::GitInfo git_info;
     for (auto v : git_info.hash) {
@@ -433,6 +449,21 @@ class BootloaderServer {
 
     const auto maybe_channel = read_stream.ReadVaruint();
     if (!maybe_channel) { return; }
+    if (*maybe_channel == kBinaryChannel && !poll_only) {
+      const auto maybe_bytes = read_stream.ReadVaruint();
+      if (!maybe_bytes) { return; }
+      if (*maybe_bytes > static_cast<size_t>(buffer_stream.remaining())) {
+        return;
+      }
+      HandleBinaryWrite(std::string_view(
+          reinterpret_cast<const char*>(
+              can_frame.data + buffer_stream.offset()),
+          *maybe_bytes));
+      if (query) {
+        WriteBinaryAck(source_id & 0x7f);
+      }
+      return;
+    }
     if (*maybe_channel != 1) { return; }
 
     const auto maybe_bytes = read_stream.ReadVaruint();
@@ -463,6 +494,99 @@ class BootloaderServer {
     }
   }
 
+  // Binary writes consist of a uint32 address followed by the data
+  // to program there.  Any number of them may be sent before one
+  // which requests a reply, so that programming overlaps with the
+  // reception of the next frame.
+  static constexpr uint32_t kBinaryChannel = 2;
+
+  // The erase granularity of the flash.
+  static constexpr uint32_t kPageSize = 2048;
+  // This many CRCs fit in the response buffer.
+  static constexpr uint32_t kMaxPageCrcs = 16;
+
+  enum BinaryStatus : uint8_t {
+    kBinaryOk = 0,
+    kBinaryLocked = 1,
+    kBinaryNotInFlash = 2,
+    kBinaryNotWritable = 3,
+    kBinaryProgramError = 4,
+    kBinaryMalformed = 5,
+  };
+
+  void HandleBinaryWrite(std::string_view payload) {
+    binary_writes_++;
+
+    const auto status = [&]() {
+      if (payload.size() < 4) { return kBinaryMalformed; }
+
+      uint32_t address = 0;
+      std::memcpy(&address, payload.data(), sizeof(address));
+      const auto data = payload.substr(4);
+
+      const auto result = WriteBinary(address, data);
+      if (result == kBinaryOk) {
+        binary_end_address_ = address + data.size();
+      }
+      return result;
+    }();
+
+    // Only the first error since the last acknowledgement is kept.
+    if (status != kBinaryOk && binary_status_ == kBinaryOk) {
+      binary_status_ = status;
+    }
+  }
+
+  BinaryStatus WriteBinary(uint32_t address, std::string_view data) {
+    if (flash_.locked()) { return kBinaryLocked; }
+
+    const uint32_t end = address + data.size();
+    if (address < 0x08000000 || end > 0x08080000 || end < address) {
+      return kBinaryNotInFlash;
+    }
+    if (address < 0x08010000 && end > 0x0800c000) {
+      return kBinaryNotWritable;
+    }
+
+    uint32_t i = 0;
+    while (i < data.size()) {
+      const uint32_t this_address = address + i;
+      if ((this_address & 0x7) == 0 && (i + 8) <= data.size()) {
+        uint64_t value = 0;
+        std::memcpy(&value, data.data() + i, sizeof(value));
+        if (!flash_.ProgramDoubleWord(this_address, value)) {
+          return kBinaryProgramError;
+        }
+        i += 8;
+      } else {
+        if (!flash_.ProgramByte(this_address, data[i])) {
+          return kBinaryProgramError;
+        }
+        i++;
+      }
+    }
+    return kBinaryOk;
+  }
+
+  /// The acknowledgement holds the uint32 end address of the most
+  /// recent successful write, the uint8 status of the first failure
+  /// since the previous acknowledgement, and the uint8 number of
+  /// writes received since then, including this one, so that the
+  /// host can tell if any were lost.
+  void WriteBinaryAck(uint8_t id) {
+    char frame[9] = {};
+    frame[0] = u32(Format::Subframe::kServerToClient);
+    frame[1] = kBinaryChannel;
+    frame[2] = 6;
+    std::memcpy(&frame[3], &binary_end_address_, 4);
+    frame[7] = binary_status_;
+    frame[8] = binary_writes_;
+    binary_status_ = kBinaryOk;
+    binary_writes_ = 0;
+
+    WriteCanFrame(((id_ << 8) | id), std::string_view(frame, sizeof(frame)));
+  }
+
   void WriteResponse(uint8_t id, int max_bytes) {
     // Formulate our out frame.
     out_frame_.pos = 0;
@@ -596,6 +720,22 @@ class BootloaderServer {
       } else {
         ReadFlash(address, size, writer);
       }
+    } else if (next == "crc") {
+      const auto address = tokenizer.next();
+      const auto size = tokenizer.next();
+      if (address.empty() || size.empty()) {
+        writer.write("malformed crc\r\n");
+      } else {
+        CrcFlash(address, size, writer);
+      }
+    } else if (next == "pcrc") {
+      const auto address = tokenizer.next();
+      const auto count = tokenizer.next();
+      if (address.empty() || count.empty()) {
+        writer.write("malformed pcrc\r\n");
+      } else {
+        PageCrcFlash(address, count, writer);
+      }
     } else if (next == "reset") {
       // Make sure flash is back in the locked state before resetting.
       if (!Lock()) {
@@ -649,6 +789,70 @@ class BootloaderServer {
     writer.write("\r\n");
   }
 
+  void CrcFlash(const std::string_view& address_str,
+                const std::string_view& size_str,
+                mjlib::base::WriteStream& writer) {
+    char buf[10] = {};
+
+    const uint32_t start_address = hex_to_i(address_str);
+    const uint32_t size = hex_to_i(size_str);
+    if (start_address < 0x08000000 ||
+        (start_address + size) > 0x08080000) {
+      writer.write("address not in flash\r\n");
+      return;
+    }
+
+    // Anything still held in the shadow would not be included.
+    if (!flash_.locked()) {
+      writer.write("flash is unlocked\r\n");
+      return;
+    }
+
+    writer.write("CRC ");
+    uint32_hex(Crc32(reinterpret_cast<const uint8_t*>(start_address), size),
+               buf);
+    writer.write(buf);
+    writer.write("\r\n");
+  }
+
+  /// Report the CRC of each of a run of whole flash pages, so that
+  /// only those which differ need to be programmed.
+  void PageCrcFlash(const std::string_view& address_str,
+                    const std::string_view& count_str,
+                    mjlib::base::WriteStream& writer) {
+    char buf[10] = {};
+
+    const uint32_t start_address = hex_to_i(address_str);
+    const uint32_t count = hex_to_i(count_str);
+    if (count > kMaxPageCrcs) {
+      writer.write("count too big\r\n");
+      return;
+    }
+    if ((start_address % kPageSize) != 0) {
+      writer.write("address not page aligned\r\n");
+      return;
+    }
+    if (start_address < 0x08000000 ||
+        (start_address + count * kPageSize) > 0x08080000) {
+      writer.write("address not in flash\r\n");
+      return;
+    }
+    if (!flash_.locked()) {
+      writer.write("flash is unlocked\r\n");
+      return;
+    }
+
+    writer.write("PCRC");
+    for (uint32_t i = 0; i < count; i++) {
+      writer.write(" ");
+      uint32_hex(Crc32(reinterpret_cast<const uint8_t*>(
+                           start_address + i * kPageSize), kPageSize),
+                 buf);
+      writer.write(buf);
+    }
+    writer.write("\r\n");
+  }
+
   void WriteFlash(const std::string_view& address_str,
                   const std::string_view& data_str,
                   mjlib::base::WriteStream& writer) {
@@ -715,6 +919,10 @@ class BootloaderServer {
   Buffer<char> out_frame_;
 
   FlashWriter flash_;
+
+  uint32_t binary_end_address_ = 0;
+  BinaryStatus binary_status_ = kBinaryOk;
+  uint8_t binary_writes_ = 0;
 };
 
 void BadInterrupt() {
@@ -0,0 +1,220 @@
+// Copyright 2019-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "mjlib/micro/async_types.h"
+
+#include "fw/error.h"
+
+namespace moteus {
+
+/// Holds CAN frames which find the hardware transmit FIFO full.
+///
+/// Frames are copied into a queue of QueueSize entries, and their
+/// writes complete immediately.  When the queue is full, a frame is
+/// instead copied into one of HeldSize held entries, and its callback
+/// is not invoked until a slot in the queue frees up and it is moved
+/// there.  Writers which wait for each write to complete, like the
+/// tunneled streams, are thus slowed to what the bus can take rather
+/// than losing data.  Only if the held entries are full as well is a
+/// frame discarded, and then its callback reports errc::kWouldBlock.
+///
+/// Control frames are sent, and leave the held entries, ahead of
+/// tunneled streams, and each class stays in order.
+template <int QueueSize, int HeldSize>
+class CanTxQueue {
+ public:
+  struct Stats {
+    uint32_t sent = 0;
+    // Frames which waited in the queue.
+    uint32_t queued = 0;
+    uint32_t queued_peak = 0;
+    // Frames whose write waited for room in the queue.
+    uint32_t held = 0;
+    // Frames discarded because the queue and held entries were full.
+    uint32_t dropped = 0;
+  };
+
+  /// Send @p data as @p id, or copy it to be sent later.
+  ///
+  /// @p send is invoked as bool(uint32_t id, std::string_view data),
+  /// with the data padded to a valid DLC, and returns false if the
+  /// hardware FIFO is full.
+  template <typename Send>
+  void Write(uint32_t id, std::string_view data, bool priority,
+             const mjlib::micro::SizeCallback& callback, Send send) {
+    Poll(send);
+
+    if (queue_count_ == 0) {
+      const auto size = Pad(data, buf_);
+      if (send(id, std::string_view(buf_, size))) {
+        stats_.sent++;
+        callback(mjlib::micro::error_code(), data.size());
+        return;
+      }
+    }
+
+    if (queue_count_ < QueueSize) {
+      Enqueue(id, data, priority);
+      callback(mjlib::micro::error_code(), data.size());
+      return;
+    }
+
+    if (held_count_ < HeldSize) {
+      auto& held = held_[held_count_++];
+      Copy(&held.frame, id, data, priority);
+      held.callback = callback;
+      held.size = data.size();
+      stats_.held++;
+      return;
+    }
+
+    stats_.dropped++;
+    callback(errc::kWouldBlock, 0);
+  }
+
+  /// Hand the hardware as many queued frames as it will take.
+  template <typename Send>
+  void Poll(Send send) {
+    while (queue_count_ > 0) {
+      const int next = Next(queue_, queue_count_,
+                            [](const Frame& frame) -> const Frame& {
+                              return frame;
+                            });
+      const auto& frame = queue_[next];
+      if (!send(frame.id, std::string_view(frame.data, frame.size))) {
+        return;
+      }
+      stats_.sent++;
+      Remove(queue_, &queue_count_, next);
+
+      if (held_count_ > 0) { Release(); }
+    }
+  }
+
+  int queue_count() const { return queue_count_; }
+  int held_count() const { return held_count_; }
+  const Stats& stats() const { return stats_; }
+
+  static size_t RoundUpDlc(size_t value) {
+    if (value == 0) { return 0; }
+    if (value == 1) { return 1; }
+    if (value == 2) { return 2; }
+    if (value == 3) { return 3; }
+    if (value == 4) { return 4; }
+    if (value == 5) { return 5; }
+    if (value == 6) { return 6; }
+    if (value == 7) { return 7; }
+    if (value == 8) { return 8; }
+    if (value <= 12) { return 12; }
+    if (value <= 16) { return 16; }
+    if (value <= 20) { return 20; }
+    if (value <= 24) { return 24; }
+    if (value <= 32) { return 32; }
+    if (value <= 48) { return 48; }
+    if (value <= 64) { return 64; }
+    return 0;
+  }
+
+ private:
+  struct Frame {
+    uint32_t id = 0;
+    uint8_t size = 0;
+    bool priority = false;
+    char data[64] = {};
+  };
+
+  struct Held {
+    Frame frame;
+    mjlib::micro::SizeCallback callback;
+    size_t size = 0;
+  };
+
+  /// Copy @p data into @p buf, padded to a valid DLC with NOPs.
+  static size_t Pad(std::string_view data, char* buf) {
+    const auto actual_dlc = RoundUpDlc(data.size());
+    std::memcpy(buf, data.data(), data.size());
+    for (size_t i = data.size(); i < actual_dlc; i++) {
+      buf[i] = 0x50;
+    }
+    return actual_dlc;
+  }
+
+  static void Copy(Frame* frame, uint32_t id, std::string_view data,
+                   bool priority) {
+    frame->id = id;
+    frame->size = Pad(data, frame->data);
+    frame->priority = priority;
+  }
+
+  void Enqueue(uint32_t id, std::string_view data, bool priority) {
+    Copy(&queue_[queue_count_++], id, data, priority);
+    stats_.queued++;
+    if (queue_count_ > static_cast<int>(stats_.queued_peak)) {
+      stats_.queued_peak = queue_count_;
+    }
+  }
+
+  /// Move the next held frame into the queue, and complete its write.
+  void Release() {
+    const int next = Next(held_, held_count_,
+                          [](const Held& held) -> const Frame& {
+                            return held.frame;
+                          });
+    auto& held = held_[next];
+    queue_[queue_count_++] = held.frame;
+    stats_.queued++;
+    auto callback = held.callback;
+    const auto size = held.size;
+    Remove(held_, &held_count_, next);
+
+    // This may start another write, so everything above must be
+    // consistent first.
+    callback(mjlib::micro::error_code(), size);
+  }
+
+  /// @return the first control frame, or the oldest if there are none
+  template <typename T, typename Function>
+  static int Next(const T* items, int count, Function frame_of) {
+    for (int i = 0; i < count; i++) {
+      if (frame_of(items[i]).priority) { return i; }
+    }
+    return 0;
+  }
+
+  template <typename T>
+  static void Remove(T* items, int* count, int index) {
+    for (int i = index + 1; i < *count; i++) {
+      items[i - 1] = items[i];
+    }
+    (*count)--;
+    items[*count] = {};
+  }
+
+  Frame queue_[QueueSize] = {};
+  int queue_count_ = 0;
+
+  Held held_[HeldSize] = {};
+  int held_count_ = 0;
+
+  Stats stats_;
+  char buf_[64] = {};
+};
+
+}
@@ -0,0 +1,25 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+// Functions marked with this attribute are placed in core coupled
+// memory, which can execute with zero wait states.  On the host it
+// has no effect, so that headers using it can be unit tested and
+// benchmarked.
+#if defined(TARGET_STM32G4)
+#define MOTEUS_CCM_ATTRIBUTE __attribute__ ((section (".ccmram")))
+#else
+#define MOTEUS_CCM_ATTRIBUTE
+#endif
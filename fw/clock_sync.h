@@ -0,0 +1,157 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace moteus {
+
+/// Tracks the host's microsecond time base from periodic sync frames.
+///
+/// Each sync frame carries the host time at which it was sent.  Every
+/// controller on a bus receives a broadcast frame at the same instant,
+/// so whatever latency the host adds to the frame is common to all of
+/// them, and their estimates agree with each other much more closely
+/// than any of them agree with the host.
+///
+/// The estimate is a phase and rate relative to the local timer, each
+/// corrected by a fixed fraction of the error observed at every sync.
+class ClockSync {
+ public:
+  struct Config {
+    // The fraction of each observed error applied to the phase.
+    float phase_gain = 0.5f;
+    // The fraction of each observed error, divided by the time since
+    // the previous sync, applied to the rate.
+    float rate_gain = 0.05f;
+    // An error larger than this restarts the estimate from the
+    // latest sync.
+    int32_t max_error_us = 2000;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(phase_gain));
+      a->Visit(MJ_NVP(rate_gain));
+      a->Visit(MJ_NVP(max_error_us));
+    }
+  };
+
+  struct Status {
+    bool valid = false;
+    // The host time minus its prediction, at the most recent sync.
+    int32_t error_us = 0;
+    // How much faster the host time base runs than ours.
+    float rate_ppm = 0.0f;
+    uint32_t updates = 0;
+    uint32_t resets = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(valid));
+      a->Visit(MJ_NVP(error_us));
+      a->Visit(MJ_NVP(rate_ppm));
+      a->Visit(MJ_NVP(updates));
+      a->Visit(MJ_NVP(resets));
+    }
+  };
+
+  ClockSync(const Config* config) : config_(config) {}
+
+  /// Incorporate a sync frame carrying @p host_us, which was received
+  /// at local time @p local_us.
+  void Update(uint32_t host_us, uint32_t local_us) {
+    status_.updates++;
+
+    if (!status_.valid) {
+      Reset(host_us, local_us);
+      return;
+    }
+
+    const int32_t dt = static_cast<int32_t>(local_us - local_base_);
+    // Everything is kept relative to the whole microseconds elapsed
+    // since the last sync, so that only small values are ever held
+    // in floating point.
+    const uint32_t whole_host = host_base_ + dt;
+    const float predicted = fraction_ + rate_ * static_cast<float>(dt);
+    const float error =
+        static_cast<float>(static_cast<int32_t>(host_us - whole_host)) -
+        predicted;
+    status_.error_us = static_cast<int32_t>(std::round(error));
+
+    const float max_error = static_cast<float>(config_->max_error_us);
+    if (error > max_error || error < -max_error) {
+      status_.resets++;
+      Reset(host_us, local_us);
+      return;
+    }
+
+    if (dt > 0) {
+      rate_ += config_->rate_gain * error / static_cast<float>(dt);
+    }
+
+    const float offset = predicted + config_->phase_gain * error;
+    const float whole_offset = std::floor(offset);
+    host_base_ = whole_host + static_cast<int32_t>(whole_offset);
+    fraction_ = offset - whole_offset;
+    local_base_ = local_us;
+
+    status_.rate_ppm = rate_ * 1e6f;
+  }
+
+  /// @return the host time corresponding to local time @p local_us
+  uint32_t ToHost(uint32_t local_us) const {
+    const int32_t dt = static_cast<int32_t>(local_us - local_base_);
+    return host_base_ + dt + static_cast<int32_t>(
+        std::round(fraction_ + rate_ * static_cast<float>(dt)));
+  }
+
+  /// @return the local time corresponding to host time @p host_us
+  uint32_t ToLocal(uint32_t host_us) const {
+    const int32_t dh = static_cast<int32_t>(host_us - host_base_);
+    // Only the small correction is computed in floating point, so
+    // that precision is not lost for times far from the last sync.
+    return local_base_ + dh - static_cast<int32_t>(
+        std::round((fraction_ + rate_ * static_cast<float>(dh)) /
+                   (1.0f + rate_)));
+  }
+
+  bool valid() const { return status_.valid; }
+  const Status& status() const { return status_; }
+
+ private:
+  void Reset(uint32_t host_us, uint32_t local_us) {
+    status_.valid = true;
+    status_.rate_ppm = 0.0f;
+    host_base_ = host_us;
+    local_base_ = local_us;
+    fraction_ = 0.0f;
+    rate_ = 0.0f;
+  }
+
+  const Config* const config_;
+  Status status_;
+
+  uint32_t host_base_ = 0;
+  uint32_t local_base_ = 0;
+  // The part of a microsecond by which the host time at local_base_
+  // exceeds host_base_, in [0, 1).
+  float fraction_ = 0.0f;
+  float rate_ = 0.0f;
+};
+
+}
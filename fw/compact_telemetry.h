@@ -0,0 +1,86 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace moteus {
+
+/// A small record of a few user selected signals, which can be
+/// emitted as its own telemetry channel at a much higher rate than
+/// the full status it is drawn from.
+///
+/// The record always has room for kMaxSignals values, so that its
+/// schema does not change with the configuration.  Unused values
+/// are 0.
+class CompactTelemetry {
+ public:
+  static constexpr int kMaxSignals = 6;
+
+  struct Config {
+    // The number of signals to record.
+    uint8_t count = 0;
+    // Opaque identifiers, passed back to the Update getter.
+    std::array<uint8_t, kMaxSignals> signals = {};
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(count));
+      a->Visit(MJ_NVP(signals));
+    }
+  };
+
+  struct Record {
+    // Incremented on every update, so that gaps in a log may be
+    // found.
+    uint32_t sample = 0;
+    std::array<float, kMaxSignals> value = {};
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(sample));
+      a->Visit(MJ_NVP(value));
+    }
+  };
+
+  CompactTelemetry(const Config* config) : config_(config) {}
+
+  /// Refresh the record.  @p get_signal is invoked with each
+  /// configured signal identifier, and must return its present
+  /// value.
+  template <typename Getter>
+  void Update(Getter get_signal) {
+    const int count = std::min<int>(kMaxSignals, config_->count);
+    for (int i = 0; i < count; i++) {
+      record_.value[i] = get_signal(config_->signals[i]);
+    }
+    for (int i = count; i < kMaxSignals; i++) {
+      record_.value[i] = 0.0f;
+    }
+    record_.sample++;
+  }
+
+  Record* record() { return &record_; }
+
+ private:
+  const Config* const config_;
+  Record record_;
+};
+
+}
@@ -0,0 +1,132 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+#include "mjlib/base/tokenizer.h"
+#include "mjlib/micro/async_stream.h"
+#include "mjlib/micro/command_manager.h"
+#include "mjlib/micro/flash.h"
+
+#include "fw/crc32.h"
+
+namespace moteus {
+
+/// Provides raw access to the flash region that PersistentConfig
+/// serializes into, so that a whole configuration can be copied
+/// between devices in a few commands.
+///
+///  confb info - "<size> <crc32>" of the region up to its last
+///               programmed double-word
+///  confb read <offset> <size> - hex encoded contents
+///  confb erase
+///  confb write <offset> <hexdata> - offset and size must be a
+///                                   multiple of 8
+///
+/// Values are hex.  Nothing is applied until `conf load`.
+class ConfigBlob {
+ public:
+  static constexpr size_t kMaxChunk = 64;
+
+  ConfigBlob(mjlib::micro::CommandManager& command_manager,
+             mjlib::micro::FlashInterface& flash)
+      : flash_(flash) {
+    command_manager.Register("confb", [this](auto&& command, auto&& response) {
+        this->Command(command, response);
+      });
+  }
+
+  void Command(const std::string_view& command,
+               const mjlib::micro::CommandManager::Response& response) {
+    mjlib::base::Tokenizer tokenizer(command, " ");
+    const auto cmd_text = tokenizer.next();
+    const auto info = flash_.GetInfo();
+    const size_t region_size = info.end - info.start;
+    const auto* const region = reinterpret_cast<const uint8_t*>(info.start);
+
+    if (cmd_text == "info") {
+      size_t size = region_size;
+      while (size > 0 && region[size - 1] == 0xff) { size--; }
+      size = (size + 7) & ~static_cast<size_t>(7);
+      snprintf(output_, sizeof(output_), "%u %08" PRIx32 "\r\n",
+               static_cast<unsigned>(size), Crc32(region, size));
+      WriteMessage(output_, response);
+    } else if (cmd_text == "read") {
+      const size_t offset = ParseHex(tokenizer.next());
+      const size_t size = ParseHex(tokenizer.next());
+      if (size > kMaxChunk || offset > region_size ||
+          size > (region_size - offset)) {
+        WriteMessage("ERR invalid range\r\n", response);
+        return;
+      }
+      for (size_t i = 0; i < size; i++) {
+        snprintf(&output_[i * 2], 3, "%02x", region[offset + i]);
+      }
+      snprintf(&output_[size * 2], 3, "\r\n");
+      WriteMessage(output_, response);
+    } else if (cmd_text == "erase") {
+      flash_.Unlock();
+      flash_.Erase();
+      flash_.Lock();
+      WriteMessage("OK\r\n", response);
+    } else if (cmd_text == "write") {
+      const size_t offset = ParseHex(tokenizer.next());
+      const auto data = tokenizer.next();
+      const size_t size = data.size() / 2;
+      // The flash is programmed a double-word at a time, and a
+      // partial one cannot be completed later.
+      if ((data.size() % 2) != 0 || (size % 8) != 0 || (offset % 8) != 0 ||
+          size > kMaxChunk || offset > region_size ||
+          size > (region_size - offset)) {
+        WriteMessage("ERR invalid write\r\n", response);
+        return;
+      }
+      flash_.Unlock();
+      for (size_t i = 0; i < size; i++) {
+        flash_.ProgramByte(info.start + offset + i,
+                           ParseHex(data.substr(i * 2, 2)));
+      }
+      flash_.Lock();
+      WriteMessage("OK\r\n", response);
+    } else {
+      WriteMessage("ERR unknown confb\r\n", response);
+    }
+  }
+
+ private:
+  static uint32_t ParseHex(const std::string_view& str) {
+    uint32_t result = 0;
+    for (char c : str) {
+      result <<= 4;
+      if (c >= '0' && c <= '9') { result |= c - '0'; }
+      else if (c >= 'a' && c <= 'f') { result |= c - 'a' + 0x0a; }
+      else if (c >= 'A' && c <= 'F') { result |= c - 'A' + 0x0a; }
+    }
+    return result;
+  }
+
+  void WriteMessage(const std::string_view& message,
+                    const mjlib::micro::CommandManager::Response& response) {
+    mjlib::micro::AsyncWrite(*response.stream, message, response.callback);
+  }
+
+  mjlib::micro::FlashInterface& flash_;
+  char output_[kMaxChunk * 2 + 3] = {};
+};
+
+}
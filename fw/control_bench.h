@@ -0,0 +1,167 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+
+#include "fw/foc.h"
+#include "fw/math.h"
+#include "fw/pid.h"
+#include "fw/torque_model.h"
+
+namespace moteus {
+
+/// Microbenchmarks for the kernels which are evaluated every control
+/// cycle.  The same suite is run on the host and on target, with
+/// only the clock and the method of reporting differing.
+///
+/// Each kernel is evaluated over a fixed table of inputs so that the
+/// data dependent branches are exercised, and the results are folded
+/// into a volatile sink so the compiler cannot discard them.
+class ControlBench {
+ public:
+  static constexpr int kNumInputs = 64;
+
+  struct Result {
+    const char* name = "";
+    // Total elapsed clock ticks across all iterations.
+    uint64_t ticks = 0;
+    // The number of kernel evaluations which were timed.
+    uint32_t count = 0;
+  };
+
+  ControlBench() {
+    for (int i = 0; i < kNumInputs; i++) {
+      // Spread the inputs across both signs and several revolutions,
+      // and the currents across both sides of the torque model
+      // rotation cutoff.
+      const float frac = static_cast<float>(i) / kNumInputs;
+      angle_[i] = (frac - 0.5f) * 4.0f * k2Pi;
+      current_[i] = (frac - 0.5f) * 80.0f;
+      log_input_[i] = 1.0f + frac * 30.0f;
+      pow_input_[i] = (frac - 0.5f) * 8.0f;
+      sin_cos_[i] = cordic_(RadiansToQ31(angle_[i]));
+    }
+
+    pid_config_.kp = 1.0f;
+    pid_config_.ki = 10.0f;
+    pid_config_.kd = 0.05f;
+    pid_config_.ilimit = 5.0f;
+    pid_config_.iratelimit = 100.0f;
+  }
+
+  /// Run every kernel @p iterations times over the input table.
+  ///
+  /// @p clock must return a monotonically increasing tick count.
+  /// @p report is invoked once per kernel with a `const Result&`.
+  template <typename Clock, typename Report>
+  void Run(int iterations, Clock clock, Report report) {
+    report(Time("RadiansToQ31", iterations, clock, [&](int i) {
+          return static_cast<float>(RadiansToQ31(angle_[i]));
+        }));
+    report(Time("WrapZeroToTwoPi", iterations, clock, [&](int i) {
+          return WrapZeroToTwoPi(angle_[i]);
+        }));
+    report(Time("log2f_approx", iterations, clock, [&](int i) {
+          return log2f_approx(log_input_[i]);
+        }));
+    report(Time("pow2f_approx", iterations, clock, [&](int i) {
+          return pow2f_approx(pow_input_[i]);
+        }));
+    report(Time("Cordic", iterations, clock, [&](int i) {
+          const SinCos sc = cordic_(RadiansToQ31(angle_[i]));
+          return sc.s + sc.c;
+        }));
+    report(Time("DqTransform", iterations, clock, [&](int i) {
+          const SinCos sc = cordic_(RadiansToQ31(angle_[i]));
+          const DqTransform dq(
+              sc, current_[i], current_[(i + 21) % kNumInputs],
+              current_[(i + 42) % kNumInputs]);
+          return dq.d + dq.q;
+        }));
+    report(Time("InverseDqTransform", iterations, clock, [&](int i) {
+          const SinCos sc = cordic_(RadiansToQ31(angle_[i]));
+          const InverseDqTransform idq(
+              sc, current_[i], current_[(i + 21) % kNumInputs]);
+          return idq.a + idq.b + idq.c;
+        }));
+    // The transforms alone, without the sin/cos evaluation.
+    report(Time("DqTransform (no sincos)", iterations, clock, [&](int i) {
+          const DqTransform dq(
+              sin_cos_[i], current_[i], current_[(i + 21) % kNumInputs],
+              current_[(i + 42) % kNumInputs]);
+          return dq.d + dq.q;
+        }));
+    report(Time("InverseDqTransform (no sincos)", iterations, clock, [&](int i) {
+          const InverseDqTransform idq(
+              sin_cos_[i], current_[i], current_[(i + 21) % kNumInputs]);
+          return idq.a + idq.b + idq.c;
+        }));
+    report(Time("SpaceVectorModulation", iterations, clock, [&](int i) {
+          const SpaceVectorModulation svm(
+              current_[i], current_[(i + 21) % kNumInputs],
+              current_[(i + 42) % kNumInputs]);
+          return svm.a + svm.b + svm.c;
+        }));
+    report(Time("PID::Apply", iterations, clock, [&](int i) {
+          PID pid(&pid_config_, &pid_state_);
+          return pid.Apply(current_[i], 0.0f, angle_[i], 0.0f, kRateHz);
+        }));
+    report(Time("TorqueModel::current_to_torque", iterations, clock, [&](int i) {
+          return torque_model_.current_to_torque(current_[i]);
+        }));
+    report(Time("TorqueModel::torque_to_current", iterations, clock, [&](int i) {
+          return torque_model_.torque_to_current(current_[i]);
+        }));
+  }
+
+ private:
+  static constexpr int kRateHz = 40000;
+
+  template <typename Clock, typename Kernel>
+  Result Time(const char* name, int iterations, Clock clock, Kernel kernel) {
+    Result result;
+    result.name = name;
+
+    float sum = 0.0f;
+    const auto start = clock();
+    for (int j = 0; j < iterations; j++) {
+      for (int i = 0; i < kNumInputs; i++) {
+        sum += kernel(i);
+      }
+    }
+    const auto end = clock();
+    sink_ = sum;
+
+    result.ticks = static_cast<uint64_t>(end - start);
+    result.count = static_cast<uint32_t>(iterations) * kNumInputs;
+    return result;
+  }
+
+  float angle_[kNumInputs] = {};
+  float current_[kNumInputs] = {};
+  float log_input_[kNumInputs] = {};
+  float pow_input_[kNumInputs] = {};
+  SinCos sin_cos_[kNumInputs] = {};
+
+  Cordic cordic_;
+  PID::Config pid_config_;
+  PID::State pid_state_;
+  TorqueModel torque_model_{0.1f, 10.0f, 0.5f, 0.1f};
+
+  volatile float sink_ = 0.0f;
+};
+
+}
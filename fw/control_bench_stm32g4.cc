@@ -0,0 +1,89 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// An on-target image which runs the control kernel microbenchmarks
+/// and reports the DWT cycle count per evaluation.  The results are
+/// printed on the debug UART at 115200 baud, and are also left in
+/// g_control_bench_results for inspection from a debugger.
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "mbed.h"
+
+#include "fw/control_bench.h"
+#include "fw/moteus_hw.h"
+#include "fw/stm32_serial.h"
+
+using namespace moteus;
+
+namespace {
+constexpr int kIterations = 1000;
+constexpr int kMaxResults = 16;
+
+void Write(USART_TypeDef* uart, const char* str) {
+  for (; *str; str++) {
+    while ((uart->ISR & USART_ISR_TXE_TXFNF) == 0);
+    uart->TDR = *str;
+  }
+}
+}
+
+extern "C" {
+ControlBench::Result g_control_bench_results[kMaxResults];
+}
+
+int main(void) {
+  ITM->LAR = 0xC5ACCE55;
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+  Stm32Serial serial{[]() {
+      Stm32Serial::Options options;
+      options.tx = MOTEUS_UART_TX;
+      options.rx = MOTEUS_UART_RX;
+      options.baud_rate = 115200;
+      return options;
+    }()};
+
+  ControlBench bench;
+  char line[80] = {};
+
+  while (true) {
+    int index = 0;
+    Write(serial.uart(), "\r\ncontrol_bench (cycles per evaluation)\r\n");
+
+    bench.Run(
+        kIterations,
+        []() { return DWT->CYCCNT; },
+        [&](const ControlBench::Result& result) {
+          if (index < kMaxResults) {
+            g_control_bench_results[index++] = result;
+          }
+          const uint32_t centi_cycles =
+              static_cast<uint32_t>(result.ticks * 100 / result.count);
+          ::snprintf(line, sizeof(line), "%-32s %4" PRIu32 ".%02" PRIu32 "\r\n",
+                     result.name, centi_cycles / 100, centi_cycles % 100);
+          Write(serial.uart(), line);
+        });
+
+    // Wait roughly one second before repeating, so that a terminal
+    // attached after reset still sees a complete report.
+    const uint32_t start = DWT->CYCCNT;
+    while ((DWT->CYCCNT - start) < SystemCoreClock);
+  }
+}
@@ -67,12 +67,20 @@ class Drv8323::Impl {
     // manage it manually here.
     pin_mode(options.miso, PullUp);
 
+#if MOTEUS_HW_REV != 3
+    // Latch any assertion of the fault line, so that one which is
+    // shorter than a control cycle is still seen by the servo.
+    fault_.fall(callback(this, &Impl::HandleFaultLine));
+#endif
+
     config->Register("drv8323_conf", &config_,
                      std::bind(&Impl::HandleConfigUpdate, this));
     status_update_ = telemetry_manager->Register("drv8323", &status_);
   }
 
   void Enable(bool value) {
+    if (!value) { AbandonBackgroundRead(); }
+
     const bool old_enable = enable_cache_ != 0;
     enable_ = enable_cache_ = value ? 1 : 0;
 
@@ -84,6 +92,7 @@ class Drv8323::Impl {
       }
       WriteConfig();
       Calibrate();
+      fault_latched_ = false;
     } else {
       status_.fault_config = 0;
     }
@@ -94,18 +103,68 @@ class Drv8323::Impl {
   }
 
   uint16_t Read(int reg) {
+    FinishBackgroundRead();
     const uint16_t result = spi_.write(0x8000 | (reg << 11)) & 0x7ff;
     timer_->wait_us(1);
     return result;
   }
 
   void Write(int reg, uint16_t value) {
+    FinishBackgroundRead();
     spi_.write((reg << 11) | (value & 0x7ff));
     timer_->wait_us(1);
   }
 
+  void HandleFaultLine() {
+    if (enable_cache_ != 0) {
+      fault_latched_ = true;
+    }
+  }
+
+  // The status registers are read without ever waiting on the SPI
+  // bus.  Each millisecond either starts a single word transfer, or
+  // collects the result of the one started in the previous
+  // millisecond, which also guarantees the minimum time between
+  // words with CS released.
+  void FinishBackgroundRead() {
+    if (!read_pending_) { return; }
+    status_regs_[read_reg_] = spi_.finish_write() & 0x7ff;
+    read_pending_ = false;
+    read_reg_++;
+  }
+
+  // Complete any word in flight, so that CS is released before the
+  // chip is disabled, and discard the round, since a word read as the
+  // chip is disabled can not be trusted.
+  void AbandonBackgroundRead() {
+    if (read_pending_) {
+      spi_.finish_write();
+      read_pending_ = false;
+    }
+    read_reg_ = 2;
+  }
+
   void PollMillisecond() {
     loop_count_++;
+
+    if (read_pending_) {
+      FinishBackgroundRead();
+      if (read_reg_ == 2) { PublishStatus(); }
+      return;
+    }
+
+    if (read_reg_ < 2) {
+      if (enable_cache_ == 0) {
+        // If we are not enabled, then we can not communicate over
+        // SPI.  Abandon this round and try again later.
+        read_reg_ = 2;
+        return;
+      }
+      spi_.start_write(0x8000 | (read_reg_ << 11));
+      read_pending_ = true;
+      return;
+    }
+
     if (loop_count_ < kPollRate) { return; }
 
     loop_count_ = 0;
@@ -113,6 +172,7 @@ class Drv8323::Impl {
     auto& s = status_;
 
     s.fault_line = fault_.read() == 0;
+    s.fault_latched = fault_latched_;
     s.power = (hiz_.read() != 0);
     s.enabled = (enable_cache_ != 0);
 
@@ -121,10 +181,13 @@ class Drv8323::Impl {
       return;
     }
 
-    const uint16_t status[2] = {
-      Read(0),
-      Read(1),
-    };
+    // Begin a new round of status reads.
+    read_reg_ = 0;
+  }
+
+  void PublishStatus() {
+    auto& s = status_;
+    const uint16_t* const status = status_regs_;
 
     const auto bit = [&](int reg, int b) {
       return (status[reg] & (1 << b)) != 0;
@@ -174,12 +237,12 @@ class Drv8323::Impl {
     // None of the cal bits should be set already.
     MJ_ASSERT((old_reg6 & 0x1c) == 0);
 
-    spi_.write((6 << 11) | (old_reg6 | 0x1c));
+    Write(6, old_reg6 | 0x1c);
 
     timer_->wait_us(200);
 
     // Now unset the cal bits.
-    spi_.write((6 << 11) | old_reg6);
+    Write(6, old_reg6);
   }
 
   void WriteConfig() {
@@ -295,10 +358,20 @@ class Drv8323::Impl {
   DigitalOut enable_;
   int32_t enable_cache_ = false;
   DigitalOut hiz_;
+#if MOTEUS_HW_REV != 3
+  InterruptIn fault_;
+#else
   DigitalIn fault_;
+#endif
+  volatile bool fault_latched_ = false;
 
   uint16_t loop_count_ = 0;
 
+  uint16_t status_regs_[2] = {};
+  // The status register being read, or 2 when idle.
+  int read_reg_ = 2;
+  bool read_pending_ = false;
+
   mjlib::base::inplace_function<void()> status_update_;
 };
 
@@ -325,7 +398,7 @@ bool Drv8323::fault() {
        // properly.  Thus we get a laggier version over SPI.
        (impl_->status_.fault == 1)
 #else
-       (impl_->fault_.read() == 0)
+       (impl_->fault_latched_ || impl_->fault_.read() == 0)
 #endif
        );
 }
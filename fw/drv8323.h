@@ -87,6 +87,9 @@ class Drv8323 : public MotorDriver {
 
     // Whether a fault was signaled over the hard-line.
     bool fault_line = false;
+    // Whether the hard-line has signaled a fault at any time since
+    // the driver was last enabled.
+    bool fault_latched = false;
 
     // Whether the motors are powered.
     bool power = false;
@@ -127,6 +130,7 @@ class Drv8323 : public MotorDriver {
       a->Visit(MJ_NVP(vgs_lc));
 
       a->Visit(MJ_NVP(fault_line));
+      a->Visit(MJ_NVP(fault_latched));
       a->Visit(MJ_NVP(power));
       a->Visit(MJ_NVP(enabled));
 
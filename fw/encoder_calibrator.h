@@ -0,0 +1,210 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#include "fw/math.h"
+
+namespace moteus {
+
+/// Computes the encoder to electrical phase mapping from a slow sweep
+/// of the phase, first up, then down, while the rotor follows.
+///
+/// This reaches the same result as calibrate_encoder.py, but keeps
+/// only a fixed size summary of the samples, so that it can run on
+/// the controller.  Each sample adds the unit vector of its phase to
+/// a bin selected by the encoder, which averages the lag of the sweep
+/// up against that of the sweep down.
+class EncoderCalibrator {
+ public:
+  static constexpr int kBins = 128;
+  // Samples at the start of the sweep up, while the rotor is still
+  // settling, do not count towards the pole estimate.
+  static constexpr int kDiscardSamples = 40;
+
+  enum Error : uint8_t {
+    kNone,
+    kTooFewSamples,
+    kEncoderDistance,
+    kNonIntegralPoles,
+    kEmptyBin,
+  };
+
+  static const char* ErrorName(Error error) {
+    switch (error) {
+      case kNone: { return "none"; }
+      case kTooFewSamples: { return "too_few_samples"; }
+      case kEncoderDistance: { return "encoder_distance"; }
+      case kNonIntegralPoles: { return "non_integral_poles"; }
+      case kEmptyBin: { return "empty_bin"; }
+    }
+    return "unknown";
+  }
+
+  struct Result {
+    Error error = kNone;
+    uint8_t poles = 0;
+    bool invert = false;
+    // The ratio of phase to encoder distance, which should be very
+    // nearly the number of pole pairs.
+    float ratio = 0.0f;
+  };
+
+  void Reset() {
+    for (auto& bin : bins_) { bin = {}; }
+    up_samples_ = 0;
+    total_phase_ = 0;
+    total_encoder_ = 0;
+    have_last_ = false;
+    result_ = {};
+  }
+
+  void Sample(bool phase_up, uint16_t phase, uint16_t encoder) {
+    if (phase_up) {
+      up_samples_++;
+      if (up_samples_ > kDiscardSamples) {
+        if (have_last_) {
+          total_phase_ += static_cast<int16_t>(phase - last_phase_);
+          total_encoder_ += static_cast<int16_t>(encoder - last_encoder_);
+        }
+        last_phase_ = phase;
+        last_encoder_ = encoder;
+        have_last_ = true;
+      }
+    }
+
+    const float theta = static_cast<float>(phase) * kPhaseToRadians;
+    Bin& bin = bins_[(static_cast<uint32_t>(encoder) * kBins) >> 16];
+    bin.s += std::sin(theta);
+    bin.c += std::cos(theta);
+  }
+
+  /// Determine the pole count, inversion, and the offset at every
+  /// bin.  This consumes the accumulated samples.
+  const Result& Calculate() {
+    result_ = {};
+
+    if (up_samples_ < 2 * kDiscardSamples) {
+      result_.error = kTooFewSamples;
+      return result_;
+    }
+    if (std::abs(std::abs(total_encoder_) - 65536) > 5000) {
+      result_.error = kEncoderDistance;
+      return result_;
+    }
+
+    result_.invert = total_encoder_ < 0;
+    result_.ratio =
+        static_cast<float>(total_phase_) /
+        static_cast<float>(std::abs(total_encoder_));
+    const float pole_pairs = std::round(result_.ratio);
+    if (std::abs(pole_pairs - result_.ratio) > 0.1f ||
+        pole_pairs < 1.0f || pole_pairs > 127.0f) {
+      result_.error = kNonIntegralPoles;
+      return result_;
+    }
+    result_.poles = static_cast<uint8_t>(2.0f * pole_pairs);
+
+    std::array<float, kBins> error = {};
+    for (int i = 0; i < kBins; i++) {
+      const Bin& bin = bins_[i];
+      if (bin.s == 0.0f && bin.c == 0.0f) {
+        result_.error = kEmptyBin;
+        return result_;
+      }
+      const float center_raw =
+          (static_cast<float>(i) + 0.5f) * (65536.0f / kBins);
+      const float position =
+          result_.invert ? (65536.0f - center_raw) : center_raw;
+      const float expected = pole_pairs * position * kPhaseToRadians;
+      error[i] = WrapNegPiToPi(std::atan2(bin.s, bin.c) - expected);
+    }
+
+    // As in calibrate_encoder.py, the error is averaged over 1/poles
+    // of a revolution, to suppress the cogging which the rotor
+    // experiences during the sweep.
+    const int window = std::max(1, kBins / result_.poles);
+    for (int i = 0; i < kBins; i++) {
+      const int start = i - window / 2;
+      const float base = error[Wrap(start)];
+      float sum = 0.0f;
+      int count = 0;
+      for (int j = start; j < start + window; j++) {
+        sum += WrapNegPiToPi(error[Wrap(j)] - base);
+        count++;
+      }
+      // The vector sums are no longer needed, so the smoothed offset
+      // takes their place.
+      bins_[i].s = WrapNegPiToPi(base + sum / static_cast<float>(count));
+    }
+
+    return result_;
+  }
+
+  /// @return the offset for entry @p index of a table with @p size
+  /// entries over one revolution of the (possibly inverted) position,
+  /// after a successful Calculate().
+  float Offset(int index, int size) const {
+    const float position = 65536.0f * static_cast<float>(index) /
+        static_cast<float>(size);
+    const float raw = result_.invert ? (65536.0f - position) : position;
+    const float x = raw * (kBins / 65536.0f) - 0.5f;
+    const float floor_x = std::floor(x);
+    const int i0 = Wrap(static_cast<int>(floor_x));
+    const int i1 = Wrap(i0 + 1);
+    const float fraction = x - floor_x;
+    const float y0 = bins_[i0].s;
+    const float y1 = bins_[i1].s;
+    return WrapNegPiToPi(y0 + fraction * WrapNegPiToPi(y1 - y0));
+  }
+
+  const Result& result() const { return result_; }
+
+ private:
+  static constexpr float kPhaseToRadians = k2Pi / 65536.0f;
+
+  static int Wrap(int index) {
+    return ((index % kBins) + kBins) % kBins;
+  }
+
+  static float WrapNegPiToPi(float value) {
+    return WrapZeroToTwoPi(value + kPi) - kPi;
+  }
+
+  struct Bin {
+    float s = 0.0f;
+    float c = 0.0f;
+  };
+
+  // The phase vector sums while sampling, or after Calculate(), the
+  // smoothed offset of each bin in s.
+  std::array<Bin, kBins> bins_ = {};
+
+  int32_t up_samples_ = 0;
+  int32_t total_phase_ = 0;
+  int32_t total_encoder_ = 0;
+  uint16_t last_phase_ = 0;
+  uint16_t last_encoder_ = 0;
+  bool have_last_ = false;
+
+  Result result_;
+};
+
+}
@@ -29,6 +29,7 @@ struct MoteusErrorCategory : mjlib::micro::error_category {
       case errc::kUartNoiseError: return "uart noise error";
       case errc::kUartBufferOverrunError: return "uart buffer overrun";
       case errc::kUartParityError: return "uart parity error";
+      case errc::kWouldBlock: return "would block";
       case errc::kCalibrationFault: return "calibration fault";
       case errc::kMotorDriverFault: return "motor driver fault";
       case errc::kOverVoltage: return "over voltage";
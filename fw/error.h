@@ -31,6 +31,7 @@ enum class errc {
   kUartNoiseError = 5,
   kUartBufferOverrunError = 6,
   kUartParityError = 7,
+  kWouldBlock = 8,
 
   kCalibrationFault = 32,
   kMotorDriverFault = 33,
@@ -14,6 +14,9 @@
 
 #include "fw/fdcan.h"
 
+#include <algorithm>
+#include <cstring>
+
 #include "PeripheralPins.h"
 
 extern const PinMap PinMap_CAN_TD[];
@@ -73,6 +76,13 @@ FDCan::Rate MakeTime(int bitrate, int max_time_seg1, int max_time_seg2) {
   return result;
 }
 
+IRQn_Type GetRxIrq(FDCAN_GlobalTypeDef* can) {
+  if (can == FDCAN1) { return FDCAN1_IT0_IRQn; }
+  if (can == FDCAN2) { return FDCAN2_IT0_IRQn; }
+  if (can == FDCAN3) { return FDCAN3_IT0_IRQn; }
+  mbed_die();
+}
+
 FDCan::Rate ApplyRateOverride(FDCan::Rate base, FDCan::Rate overlay) {
   if (overlay.prescaler >= 0) {
     base.prescaler = overlay.prescaler;
@@ -148,29 +158,108 @@ FDCan::FDCan(const Options& options)
   can.Init.DataTimeSeg1 = fast.time_seg1;
   can.Init.DataTimeSeg2 = fast.time_seg2;
 
-  can.Init.StdFiltersNbr =
+  can.Init.StdFiltersNbr = 0;
+  can.Init.ExtFiltersNbr = 0;
+  can.Init.TxFifoQueueMode = FDCAN_TX_FIFO_OPERATION;
+  if (HAL_FDCAN_Init(&can) != HAL_OK) {
+    mbed_die();
+  }
+
+  ApplyFilters(options.filter_begin, options.filter_end,
+               options.global_std_action,
+               options.global_ext_action,
+               options.global_remote_std_action,
+               options.global_remote_ext_action);
+
+  if (HAL_FDCAN_Start(&can) != HAL_OK) {
+    mbed_die();
+  }
+
+  if (HAL_FDCAN_ActivateNotification(
+          &can,
+          FDCAN_IT_RX_FIFO0_NEW_MESSAGE | FDCAN_IT_RX_FIFO0_MESSAGE_LOST,
+          0) != HAL_OK) {
+    mbed_die();
+  }
+
+  rx_callback_ = mjlib::micro::CallbackTable::MakeFunction([this]() {
+      this->ISR_Receive();
+    });
+
+  const auto rx_irq = GetRxIrq(can_);
+  NVIC_SetVector(rx_irq, reinterpret_cast<uint32_t>(rx_callback_.raw_function));
+  // This must not preempt the control interrupt.
+  HAL_NVIC_SetPriority(rx_irq, 1, 0);
+  HAL_NVIC_EnableIRQ(rx_irq);
+}
+
+void FDCan::ConfigureFilters(const Filter* begin, const Filter* end,
+                             FilterAction global_std_action,
+                             FilterAction global_ext_action) {
+  const auto rx_irq = GetRxIrq(can_);
+  NVIC_DisableIRQ(rx_irq);
+
+  // The filters may only be changed in the initialization state, and
+  // entering it resets the FIFOs.  Take what we can from the receive
+  // FIFO first, and count the frames that are left in either.
+  ISR_Receive();
+  stats_.reconfigure_lost +=
+      ((can_->RXF0S & FDCAN_RXF0S_F0FL) >> FDCAN_RXF0S_F0FL_Pos) +
+      __builtin_popcount(can_->TXBRP);
+
+  if (HAL_FDCAN_Stop(&hfdcan1_) != HAL_OK) {
+    mbed_die();
+  }
+
+  ApplyFilters(begin, end, global_std_action, global_ext_action,
+               options_.global_remote_std_action,
+               options_.global_remote_ext_action);
+
+  if (HAL_FDCAN_Start(&hfdcan1_) != HAL_OK) {
+    mbed_die();
+  }
+
+  NVIC_EnableIRQ(rx_irq);
+}
+
+void FDCan::ApplyFilters(const Filter* begin, const Filter* end,
+                         FilterAction global_std_action,
+                         FilterAction global_ext_action,
+                         FilterAction global_remote_std_action,
+                         FilterAction global_remote_ext_action) {
+  auto& can = hfdcan1_;
+
+  const uint32_t standard_count =
       std::count_if(
-          options.filter_begin, options.filter_end,
+          begin, end,
           [](const auto& filter) {
             return (filter.action != FilterAction::kDisable &&
                     filter.type == FilterType::kStandard);
           });
-  can.Init.ExtFiltersNbr =
+  const uint32_t extended_count =
       std::count_if(
-          options.filter_begin, options.filter_end,
+          begin, end,
           [](const auto& filter) {
             return (filter.action != FilterAction::kDisable &&
                     filter.type == FilterType::kExtended);
           });
-  can.Init.TxFifoQueueMode = FDCAN_TX_FIFO_OPERATION;
-  if (HAL_FDCAN_Init(&can) != HAL_OK) {
+  if (standard_count > kMaxStandardFilters ||
+      extended_count > kMaxExtendedFilters) {
     mbed_die();
   }
 
+  // HAL_FDCAN_Init only sets the list sizes when first configuring
+  // the message RAM, so they are written directly here.
+  can.Init.StdFiltersNbr = standard_count;
+  can.Init.ExtFiltersNbr = extended_count;
+  MODIFY_REG(can_->RXGFC, FDCAN_RXGFC_LSS | FDCAN_RXGFC_LSE,
+             (standard_count << FDCAN_RXGFC_LSS_Pos) |
+             (extended_count << FDCAN_RXGFC_LSE_Pos));
+
   int standard_index = 0;
   int extended_index = 0;
   std::for_each(
-      options.filter_begin, options.filter_end,
+      begin, end,
       [&](const auto& filter) {
         if (filter.action == FilterAction::kDisable) {
           return;
@@ -253,20 +342,34 @@ FDCan::FDCan(const Options& options)
      Reject non matching frames with STD ID and EXT ID */
   if (HAL_FDCAN_ConfigGlobalFilter(
           &can,
-          map_filter_action(options.global_std_action),
-          map_filter_action(options.global_ext_action),
-          map_remote_action(options.global_remote_std_action),
-          map_remote_action(options.global_remote_ext_action)) != HAL_OK) {
+          map_filter_action(global_std_action),
+          map_filter_action(global_ext_action),
+          map_remote_action(global_remote_std_action),
+          map_remote_action(global_remote_ext_action)) != HAL_OK) {
     mbed_die();
   }
+}
 
-  if (HAL_FDCAN_Start(&can) != HAL_OK) {
-    mbed_die();
+void FDCan::ISR_Receive() {
+  const uint32_t flags = can_->IR & (FDCAN_IR_RF0N | FDCAN_IR_RF0L);
+  // Acknowledge before draining, so that a frame arriving while we
+  // drain raises the interrupt again.
+  can_->IR = flags;
+  if (flags & FDCAN_IR_RF0L) {
+    stats_.rx_fifo_lost++;
   }
 
-  if (HAL_FDCAN_ActivateNotification(
-          &can, FDCAN_IT_RX_FIFO0_NEW_MESSAGE, 0) != HAL_OK) {
-    mbed_die();
+  while ((can_->RXF0S & FDCAN_RXF0S_F0FL) != 0) {
+    const uint8_t next = (rx_head_ + 1) % kRxQueueSize;
+    if (next == rx_tail_) {
+      // Poll will re-raise the interrupt once there is room.
+      stats_.rx_queue_full++;
+      return;
+    }
+    auto& frame = rx_queue_[rx_head_];
+    HAL_FDCAN_GetRxMessage(&hfdcan1_, FDCAN_RX_FIFO0,
+                           &frame.header, frame.data);
+    rx_head_ = next;
   }
 }
 
@@ -282,14 +385,10 @@ bool ApplyOverride(bool value, FDCan::Override o) {
 }
 }
 
-void FDCan::Send(uint32_t dest_id,
+bool FDCan::Send(uint32_t dest_id,
                  std::string_view data,
                  const SendOptions& send_options) {
-
-  // Abort anything we have started that hasn't finished.
-  if (last_tx_request_) {
-    HAL_FDCAN_AbortTxRequest(&hfdcan1_, last_tx_request_);
-  }
+  if (tx_free() == 0) { return false; }
 
   FDCAN_TxHeaderTypeDef tx_header;
   tx_header.Identifier = dest_id;
@@ -317,17 +416,34 @@ void FDCan::Send(uint32_t dest_id,
           &hfdcan1_, &tx_header,
           const_cast<uint8_t*>(
               reinterpret_cast<const uint8_t*>(data.data()))) != HAL_OK) {
-    mbed_die();
+    return false;
   }
-  last_tx_request_ = HAL_FDCAN_GetLatestTxFifoQRequestBuffer(&hfdcan1_);
+  return true;
+}
+
+int FDCan::tx_free() const {
+  return (can_->TXFQS & FDCAN_TXFQS_TFFL) >> FDCAN_TXFQS_TFFL_Pos;
+}
+
+bool FDCan::tx_idle() const {
+  return can_->TXBRP == 0;
 }
 
 bool FDCan::Poll(FDCAN_RxHeaderTypeDef* header,
                  mjlib::base::string_span data) {
-  if (HAL_FDCAN_GetRxMessage(
-          &hfdcan1_, FDCAN_RX_FIFO0, header,
-          reinterpret_cast<uint8_t*>(data.data())) != HAL_OK) {
-    return false;
+  const uint8_t tail = rx_tail_;
+  if (tail == rx_head_) { return false; }
+
+  const auto& frame = rx_queue_[tail];
+  *header = frame.header;
+  std::memcpy(data.data(), frame.data,
+              std::min<size_t>(data.size(), ParseDlc(frame.header.DataLength)));
+  rx_tail_ = (tail + 1) % kRxQueueSize;
+
+  // If the queue had filled, frames may still be waiting in the
+  // hardware FIFO.
+  if ((can_->RXF0S & FDCAN_RXF0S_F0FL) != 0) {
+    NVIC_SetPendingIRQ(GetRxIrq(can_));
   }
 
   return true;
@@ -339,6 +455,16 @@ FDCAN_ProtocolStatusTypeDef FDCan::status() {
   return result;
 }
 
+FDCAN_ErrorCountersTypeDef FDCan::error_counters() {
+  FDCAN_ErrorCountersTypeDef result = {};
+  HAL_FDCAN_GetErrorCounters(&hfdcan1_, &result);
+  return result;
+}
+
+void FDCan::RecoverBusOff() {
+  CLEAR_BIT(can_->CCCR, FDCAN_CCCR_INIT);
+}
+
 FDCan::Config FDCan::config() const {
   return config_;
 }
@@ -19,6 +19,7 @@
 #include "mbed.h"
 
 #include "mjlib/base/string_span.h"
+#include "mjlib/micro/callback_table.h"
 
 namespace moteus {
 
@@ -103,14 +104,63 @@ class FDCan {
     SendOptions() {}
   };
 
-  void Send(uint32_t dest_id,
+  /// @return false if the transmit FIFO had no room, in which case
+  /// nothing was sent.
+  bool Send(uint32_t dest_id,
             std::string_view data,
             const SendOptions& = SendOptions());
 
+  /// @return the number of frames which may be passed to Send before
+  /// it would fail.
+  int tx_free() const;
+
+  /// @return true if no frame is waiting in the hardware to be
+  /// transmitted.
+  bool tx_idle() const;
+
+  /// The capacity of the filter lists in the message RAM.
+  static constexpr uint32_t kMaxStandardFilters = 28;
+  static constexpr uint32_t kMaxExtendedFilters = 8;
+
+  /// Replace the acceptance filters and the global actions for
+  /// frames which match none of them.
+  ///
+  /// The filters may only be changed with the peripheral stopped,
+  /// which resets its FIFOs.  Received frames are first moved into
+  /// the receive queue, but any which do not fit, and any frames not
+  /// yet transmitted, are lost, and counted in
+  /// Stats::reconfigure_lost.  Callers should wait for tx_idle() where
+  /// they can.
+  void ConfigureFilters(const Filter* begin, const Filter* end,
+                        FilterAction global_std_action,
+                        FilterAction global_ext_action);
+
+  /// Received frames are moved from the hardware FIFO into a queue of
+  /// this many entries by the receive interrupt.
+  static constexpr int kRxQueueSize = 8;
+
   /// @return true if a packet was available.
   bool Poll(FDCAN_RxHeaderTypeDef* header, mjlib::base::string_span);
 
+  struct Stats {
+    // Frames left in the hardware FIFO because the queue was full.
+    uint32_t rx_queue_full = 0;
+    // Frames discarded by the hardware because its FIFO was full.
+    uint32_t rx_fifo_lost = 0;
+    // Frames, received or waiting to transmit, discarded when the
+    // filters were changed.
+    uint32_t reconfigure_lost = 0;
+  };
+
+  const Stats& stats() const { return stats_; }
+
   FDCAN_ProtocolStatusTypeDef status();
+  FDCAN_ErrorCountersTypeDef error_counters();
+
+  /// Leave the bus off state once the hardware has entered it.  The
+  /// peripheral then waits for 129 occurrences of bus idle before
+  /// participating again.
+  void RecoverBusOff();
 
   struct Config {
     int clock = 0;
@@ -123,12 +173,32 @@ class FDCan {
   static int ParseDlc(uint32_t dlc_code);
 
  private:
+  void ApplyFilters(const Filter* begin, const Filter* end,
+                    FilterAction global_std_action,
+                    FilterAction global_ext_action,
+                    FilterAction global_remote_std_action,
+                    FilterAction global_remote_ext_action);
+  void ISR_Receive();
+
   const Options options_;
   Config config_;
 
   FDCAN_GlobalTypeDef* can_ = nullptr;
   FDCAN_HandleTypeDef hfdcan1_;
-  uint32_t last_tx_request_ = 0;
+
+  struct RxFrame {
+    FDCAN_RxHeaderTypeDef header = {};
+    uint8_t data[64] = {};
+  };
+
+  // Written only by ISR_Receive, which ConfigureFilters also calls
+  // with the interrupt disabled, and read only by Poll.
+  RxFrame rx_queue_[kRxQueueSize] = {};
+  volatile uint8_t rx_head_ = 0;
+  volatile uint8_t rx_tail_ = 0;
+
+  Stats stats_;
+  mjlib::micro::CallbackTable::Callback rx_callback_;
 };
 
 }
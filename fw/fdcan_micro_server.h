@@ -14,16 +14,81 @@
 
 #pragma once
 
+#include "mjlib/base/visitor.h"
 #include "mjlib/multiplex/micro_datagram_server.h"
 
+#include "fw/can_tx_queue.h"
 #include "fw/fdcan.h"
 
 namespace moteus {
 
 class FDCanMicroServer : public mjlib::multiplex::MicroDatagramServer {
  public:
+  /// Gets the first look at each received frame.
+  class Filter {
+   public:
+    virtual ~Filter() {}
+
+    /// Return true if the frame was consumed, in which case it is not
+    /// passed on to the reader.
+    virtual bool HandleFrame(const Header&, std::string_view data) = 0;
+  };
+
+  struct Stats {
+    uint32_t tx_sent = 0;
+    // Frames which waited in the queue because the hardware FIFO was
+    // full.
+    uint32_t tx_queued = 0;
+    uint32_t tx_queued_peak = 0;
+    // Frames whose write did not complete until there was room in
+    // the queue.
+    uint32_t tx_held = 0;
+    // Frames discarded because the queue and the held writes were
+    // full.
+    uint32_t tx_dropped = 0;
+
+    uint32_t rx_queue_full = 0;
+    uint32_t rx_fifo_lost = 0;
+    // Frames discarded while the receive filters were changed.
+    uint32_t reconfigure_lost = 0;
+
+    // The number of entries into each state.
+    uint32_t bus_off = 0;
+    uint32_t error_passive = 0;
+
+    uint8_t tx_error_count = 0;
+    uint8_t rx_error_count = 0;
+    uint8_t last_error_code = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(tx_sent));
+      a->Visit(MJ_NVP(tx_queued));
+      a->Visit(MJ_NVP(tx_queued_peak));
+      a->Visit(MJ_NVP(tx_held));
+      a->Visit(MJ_NVP(tx_dropped));
+      a->Visit(MJ_NVP(rx_queue_full));
+      a->Visit(MJ_NVP(rx_fifo_lost));
+      a->Visit(MJ_NVP(reconfigure_lost));
+      a->Visit(MJ_NVP(bus_off));
+      a->Visit(MJ_NVP(error_passive));
+      a->Visit(MJ_NVP(tx_error_count));
+      a->Visit(MJ_NVP(rx_error_count));
+      a->Visit(MJ_NVP(last_error_code));
+    }
+  };
+
+  /// Frames which cannot immediately be placed in the hardware FIFO
+  /// wait in a queue of this many entries.
+  static constexpr int kTxQueueSize = 8;
+  /// Beyond that, this many more writes may wait for room in the
+  /// queue before any are discarded.
+  static constexpr int kTxHeldSize = 4;
+
   FDCanMicroServer(FDCan* can) : fdcan_(can) {}
 
+  void set_filter(Filter* filter) { filter_ = filter; }
+
   void AsyncRead(Header* header,
                  const mjlib::base::string_span& data,
                  const mjlib::micro::SizeCallback& callback) override {
@@ -33,24 +98,17 @@ class FDCanMicroServer : public mjlib::multiplex::MicroDatagramServer {
     current_read_header_ = header;
   }
 
+  /// The data is always copied before returning.  If the hardware
+  /// FIFO is full the frame is queued, with control traffic sent
+  /// ahead of tunneled streams.  If the queue is full too, the
+  /// callback is only invoked once the frame has found room in it.
+  /// See CanTxQueue.
   void AsyncWrite(const Header& header,
                   const std::string_view& data,
                   const mjlib::micro::SizeCallback& callback) override {
-    const auto actual_dlc = RoundUpDlc(data.size());
     const uint32_t id =
         ((header.source & 0xff) << 8) | (header.destination & 0xff);
-
-    if (actual_dlc == data.size()) {
-      fdcan_->Send(id, data, {});
-    } else {
-      std::memcpy(buf_, data.data(), data.size());
-      for (size_t i = data.size(); i < actual_dlc; i++) {
-        buf_[i] = 0x50;
-      }
-      fdcan_->Send(id, std::string_view(buf_, actual_dlc), {});
-    }
-
-    callback(mjlib::micro::error_code(), data.size());
+    tx_queue_.Write(id, data, !IsTunnel(data), callback, sender());
   }
 
   Properties properties() const override {
@@ -59,16 +117,80 @@ class FDCanMicroServer : public mjlib::multiplex::MicroDatagramServer {
     return properties;
   }
 
+  /// Deliver as many queued frames as the reader will accept, up to
+  /// one queue's worth per call so that a busy bus cannot starve the
+  /// rest of the main loop.
   void Poll() {
-    if (!current_read_header_) { return; }
+    tx_queue_.Poll(sender());
+    for (int i = 0; i < FDCan::kRxQueueSize; i++) {
+      if (!PollOne()) { return; }
+    }
+  }
+
+  void PollMillisecond() {
+    const auto status = fdcan_->status();
+    if (status.BusOff) {
+      if (!bus_off_) { stats_.bus_off++; }
+      fdcan_->RecoverBusOff();
+    }
+    bus_off_ = status.BusOff;
+    if (status.ErrorPassive && !error_passive_) { stats_.error_passive++; }
+    error_passive_ = status.ErrorPassive;
+    // A code of 7 means there has been no change since the last read.
+    if (status.LastErrorCode != 7) {
+      stats_.last_error_code = status.LastErrorCode;
+    }
+
+    const auto counters = fdcan_->error_counters();
+    stats_.tx_error_count = counters.TxErrorCnt;
+    stats_.rx_error_count = counters.RxErrorCnt;
+
+    const auto& tx_stats = tx_queue_.stats();
+    stats_.tx_sent = tx_stats.sent;
+    stats_.tx_queued = tx_stats.queued;
+    stats_.tx_queued_peak = tx_stats.queued_peak;
+    stats_.tx_held = tx_stats.held;
+    stats_.tx_dropped = tx_stats.dropped;
+
+    stats_.rx_queue_full = fdcan_->stats().rx_queue_full;
+    stats_.rx_fifo_lost = fdcan_->stats().rx_fifo_lost;
+    stats_.reconfigure_lost = fdcan_->stats().reconfigure_lost;
+  }
+
+  Stats* stats() { return &stats_; }
+
+  FDCan* fdcan() { return fdcan_; }
+
+ private:
+  auto sender() {
+    return [this](uint32_t id, std::string_view data) {
+      return fdcan_->Send(id, data, {});
+    };
+  }
+
+  static bool IsTunnel(std::string_view data) {
+    return !data.empty() && (static_cast<uint8_t>(data[0]) & 0xf0) == 0x40;
+  }
+
+  bool PollOne() {
+    if (!current_read_header_) { return false; }
 
     const bool got_data = fdcan_->Poll(&fdcan_header_, current_read_data_);
-    if (!got_data) { return; }
+    if (!got_data) { return false; }
 
     current_read_header_->destination = fdcan_header_.Identifier & 0xff;
     current_read_header_->source = (fdcan_header_.Identifier >> 8) & 0xff;
     current_read_header_->size = FDCan::ParseDlc(fdcan_header_.DataLength);
 
+    if (filter_ &&
+        filter_->HandleFrame(
+            *current_read_header_,
+            std::string_view(current_read_data_.data(),
+                             current_read_header_->size))) {
+      // Leave the read outstanding for the next frame.
+      return true;
+    }
+
     auto copy = current_read_callback_;
     auto bytes = current_read_header_->size;
 
@@ -77,37 +199,23 @@ class FDCanMicroServer : public mjlib::multiplex::MicroDatagramServer {
     current_read_data_ = {};
 
     copy(mjlib::micro::error_code(), bytes);
+    return true;
   }
 
-  static size_t RoundUpDlc(size_t value) {
-    if (value == 0) { return 0; }
-    if (value == 1) { return 1; }
-    if (value == 2) { return 2; }
-    if (value == 3) { return 3; }
-    if (value == 4) { return 4; }
-    if (value == 5) { return 5; }
-    if (value == 6) { return 6; }
-    if (value == 7) { return 7; }
-    if (value == 8) { return 8; }
-    if (value <= 12) { return 12; }
-    if (value <= 16) { return 16; }
-    if (value <= 20) { return 20; }
-    if (value <= 24) { return 24; }
-    if (value <= 32) { return 32; }
-    if (value <= 48) { return 48; }
-    if (value <= 64) { return 64; }
-    return 0;
-  }
-
- private:
   FDCan* const fdcan_;
+  Filter* filter_ = nullptr;
+
+  CanTxQueue<kTxQueueSize, kTxHeldSize> tx_queue_;
+
+  Stats stats_;
+  bool bus_off_ = false;
+  bool error_passive_ = false;
 
   mjlib::micro::SizeCallback current_read_callback_;
   Header* current_read_header_ = nullptr;
   mjlib::base::string_span current_read_data_;
 
   FDCAN_RxHeaderTypeDef fdcan_header_ = {};
-  char buf_[64] = {};
 };
 
 }
@@ -0,0 +1,171 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "mjlib/base/visitor.h"
+
+#include "fw/ccm.h"
+#include "fw/foc.h"
+#include "fw/math.h"
+
+namespace moteus {
+
+/// Estimates the electrical angle from the phase voltages and
+/// currents, and blends it with the encoder angle as speed increases.
+///
+/// This is the nonlinear observer of Ortega et al, "Sensorless
+/// control of surface mount permanent magnet synchronous motors: a
+/// nonlinear observer".  It integrates the stator voltage, less the
+/// resistive drop, in the stationary frame, and corrects the estimate
+/// towards the circle of radius equal to the magnet flux linkage.
+/// The rotor flux, and thus the angle, is then that estimate less the
+/// flux of the winding inductance.
+///
+/// Unlike the encoder, it has no sensing latency and no dependence
+/// upon the offset table, but it is only accurate once the speed
+/// voltage is large compared to the errors in the resistive drop.
+class FluxObserver {
+ public:
+  struct Config {
+    bool enable = false;
+
+    // The rate at which the flux estimate is pulled towards its
+    // expected magnitude.
+    float bandwidth_hz = 400.0f;
+
+    // The encoder angle alone is used below blend_start_hz
+    // electrical, and the observer alone above blend_end_hz, with a
+    // linear blend in between.
+    float blend_start_hz = 300.0f;
+    float blend_end_hz = 600.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(enable));
+      a->Visit(MJ_NVP(bandwidth_hz));
+      a->Visit(MJ_NVP(blend_start_hz));
+      a->Visit(MJ_NVP(blend_end_hz));
+    }
+  };
+
+  struct Status {
+    float theta = 0.0f;
+    // The fraction of the observer angle in the result.
+    float blend = 0.0f;
+    // The observer angle less the encoder angle, wrapped to +-pi.
+    float error = 0.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(theta));
+      a->Visit(MJ_NVP(blend));
+      a->Visit(MJ_NVP(error));
+    }
+  };
+
+  FluxObserver(const Config* config) : config_(config) {}
+
+  /// Configure the motor model.  @p flux_linkage_Wb is the peak
+  /// phase flux linkage of the magnets.
+  void SetMotor(float resistance_ohm, float inductance_H,
+                float flux_linkage_Wb, float period_s) {
+    resistance_ = resistance_ohm;
+    inductance_ = inductance_H;
+    flux_ = flux_linkage_Wb;
+    period_s_ = period_s;
+
+    // Linearized about the true flux, the magnitude error decays at
+    // gamma * flux^2.
+    gamma_ = (flux_ > 0.0f) ?
+        (k2Pi * config_->bandwidth_hz / (flux_ * flux_)) : 0.0f;
+    blend_scale_ =
+        1.0f / std::max(1.0f, config_->blend_end_hz - config_->blend_start_hz);
+    reset_ = true;
+  }
+
+  /// The next Update will seed the estimate from the encoder angle.
+  void Reset() { reset_ = true; }
+
+  bool configured() const { return gamma_ > 0.0f; }
+
+  /// Advance the observer by one control period.
+  ///
+  /// @param voltage the phase voltages applied over the period which
+  /// just ended
+  /// @param current the phase currents measured at its end
+  /// @param encoder_theta the encoder electrical angle
+  /// @param electrical_hz the electrical speed
+  ///
+  /// @return the electrical angle to commutate with
+  float Update(const ClarkTransform& voltage, const ClarkTransform& current,
+               float encoder_theta, float electrical_hz) MOTEUS_CCM_ATTRIBUTE {
+    if (reset_) {
+      x_ = inductance_ * current.x + flux_ * std::cos(encoder_theta);
+      y_ = inductance_ * current.y + flux_ * std::sin(encoder_theta);
+      reset_ = false;
+    }
+
+    const float eta_x = x_ - inductance_ * current.x;
+    const float eta_y = y_ - inductance_ * current.y;
+    const float error =
+        flux_ * flux_ - (eta_x * eta_x + eta_y * eta_y);
+    const float correction = 0.5f * gamma_ * error;
+
+    x_ += period_s_ *
+        (voltage.x - resistance_ * current.x + correction * eta_x);
+    y_ += period_s_ *
+        (voltage.y - resistance_ * current.y + correction * eta_y);
+
+    const float observed = WrapZeroToTwoPi(
+        std::atan2(y_ - inductance_ * current.y,
+                   x_ - inductance_ * current.x));
+
+    status_.error = WrapToPi(observed - encoder_theta);
+    status_.blend = std::max(
+        0.0f, std::min(1.0f, (std::abs(electrical_hz) -
+                              config_->blend_start_hz) * blend_scale_));
+    status_.theta = (status_.blend == 0.0f) ? encoder_theta :
+        WrapZeroToTwoPi(encoder_theta + status_.blend * status_.error);
+    return status_.theta;
+  }
+
+  const Status& status() const { return status_; }
+
+ private:
+  static float WrapToPi(float value) {
+    return WrapZeroToTwoPi(value + kPi) - kPi;
+  }
+
+  const Config* const config_;
+
+  float resistance_ = 0.0f;
+  float inductance_ = 0.0f;
+  float flux_ = 0.0f;
+  float period_s_ = 0.0f;
+  float gamma_ = 0.0f;
+  float blend_scale_ = 0.0f;
+
+  // The stator flux estimate in the stationary frame.
+  float x_ = 0.0f;
+  float y_ = 0.0f;
+  bool reset_ = true;
+
+  Status status_;
+};
+
+}
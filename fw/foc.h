@@ -75,30 +75,40 @@ class Cordic {
 };
 
 
+/// Map phase quantities into the rotating frame.  This is the Clarke
+/// transform followed by the Park transform, with the two fused so
+/// that the stationary frame terms are only evaluated once.
 struct DqTransform {
   DqTransform(const SinCos& sc, float a, float b, float c)
-      : d((2.0f / 3.0f) *
-          (a * sc.c +
-           (kSqrt3_4 * sc.s - 0.5f * sc.c) * b +
-           (-kSqrt3_4 * sc.s - 0.5f * sc.c) * c)),
-        q((2.0f / 3.0f) *
-          (-sc.s * a -
-           (-kSqrt3_4 * sc.c - 0.5f * sc.s) * b -
-           (kSqrt3_4 * sc.c - 0.5f * sc.s) * c)) {}
+      : DqTransform(sc,
+                    (2.0f * a - b - c) * (1.0f / 3.0f),
+                    (b - c) * (1.0f / kSqrt3)) {}
 
   const float d;
   const float q;
+
+ private:
+  DqTransform(const SinCos& sc, float x, float y)
+      : d(sc.c * x + sc.s * y),
+        q(sc.c * y - sc.s * x) {}
 };
 
+/// The inverse of DqTransform, again fused so that the stationary
+/// frame terms are shared between the three phases.
 struct InverseDqTransform {
   InverseDqTransform(const SinCos& sc, float d, float q)
-      : a(sc.c * d - sc.s * q),
-        b((kSqrt3_4 * sc.s - 0.5f * sc.c) * d - (-kSqrt3_4 * sc.c - 0.5f * sc.s) * q),
-        c((-kSqrt3_4 * sc.s - 0.5f * sc.c) * d - (kSqrt3_4 * sc.c - 0.5f * sc.s) * q) {}
+      : InverseDqTransform(sc.c * d - sc.s * q,
+                           kSqrt3_4 * (sc.c * q + sc.s * d)) {}
 
   const float a;
   const float b;
   const float c;
+
+ private:
+  InverseDqTransform(float x, float sqrt3_2_y)
+      : a(x),
+        b(-0.5f * x + sqrt3_2_y),
+        c(-0.5f * x - sqrt3_2_y) {}
 };
 
 struct ClarkTransform {
@@ -139,4 +149,23 @@ struct InverseParkTransform {
   const float y;
 };
 
+/// Min-max zero sequence injection.  Adding the same offset to all
+/// three phases leaves the line to line voltages unchanged, but
+/// centering the extrema allows a sinusoidal command of up to
+/// 2/sqrt(3) times the amplitude before any single phase saturates.
+/// This is equivalent to center aligned space vector PWM.
+struct SpaceVectorModulation {
+  SpaceVectorModulation(float a_in, float b_in, float c_in)
+      : offset(-0.5f * (std::max(a_in, std::max(b_in, c_in)) +
+                        std::min(a_in, std::min(b_in, c_in)))),
+        a(a_in + offset),
+        b(b_in + offset),
+        c(c_in + offset) {}
+
+  const float offset;
+  const float a;
+  const float b;
+  const float c;
+};
+
 }
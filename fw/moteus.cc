@@ -27,12 +27,16 @@
 #include "mjlib/multiplex/micro_stream_datagram.h"
 
 #include "fw/board_debug.h"
+#include "fw/config_blob.h"
 #include "fw/firmware_info.h"
 #include "fw/git_info.h"
 #include "fw/millisecond_timer.h"
 #include "fw/moteus_controller.h"
 #include "fw/moteus_hw.h"
+#include "fw/pool_arena.h"
+#include "fw/scheduler.h"
 #include "fw/system_info.h"
+#include "fw/transport_selector.h"
 
 #if defined(TARGET_STM32G4)
 #include "fw/fdcan.h"
@@ -103,6 +107,41 @@ void SetupClock() {
 }
 
 namespace {
+constexpr uint32_t kMainLoopBudgetUs = 100;
+
+// The number of bytes of the shared pool allocated by each
+// subsystem, as reported on the "pool" telemetry channel.
+struct PoolUsage {
+  uint32_t size = 0;
+  uint32_t available = 0;
+
+  uint32_t uart = 0;
+  uint32_t multiplex = 0;
+  uint32_t command_manager = 0;
+  uint32_t telemetry = 0;
+  uint32_t config = 0;
+  uint32_t system_info = 0;
+  uint32_t firmware_info = 0;
+  // This includes the servo and gate driver.
+  uint32_t controller = 0;
+  uint32_t board_debug = 0;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(size));
+    a->Visit(MJ_NVP(available));
+    a->Visit(MJ_NVP(uart));
+    a->Visit(MJ_NVP(multiplex));
+    a->Visit(MJ_NVP(command_manager));
+    a->Visit(MJ_NVP(telemetry));
+    a->Visit(MJ_NVP(config));
+    a->Visit(MJ_NVP(system_info));
+    a->Visit(MJ_NVP(firmware_info));
+    a->Visit(MJ_NVP(controller));
+    a->Visit(MJ_NVP(board_debug));
+  }
+};
+
 class ClockManager {
  public:
   ClockManager(MillisecondTimer* timer,
@@ -173,6 +212,8 @@ int main(void) {
   std::memcpy(&_sccmram, &_siccmram, &_eccmram - &_sccmram);
 #endif
 
+  SystemInfo::PaintStack();
+
   FLASH->ACR |= FLASH_ACR_PRFTEN | FLASH_ACR_ICEN | FLASH_ACR_DCEN;
 
   SetupClock();
@@ -184,15 +225,14 @@ int main(void) {
   DigitalIn hwrev1(HWREV_PIN1, PullUp);
   DigitalIn hwrev2(HWREV_PIN2, PullUp);
 
-  // To enable cycle counting.
-#ifdef MOTEUS_PERFORMANCE_MEASURE
+  // To enable cycle counting.  This is always on, as SystemInfo
+  // uses it to measure the interrupt load.
   {
     ITM->LAR = 0xC5ACCE55;
     CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
     DWT->CYCCNT = 0;
     DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
   }
-#endif
 
   const uint8_t this_hw_pins =
       0x07 & (~(hwrev0.read() |
@@ -225,14 +265,30 @@ int main(void) {
   // for millisecond turnover.
   MillisecondTimer timer;
 
-  micro::SizedPool<14000> pool;
-
-  HardwareUart rs485(&pool, &timer, []() {
+  micro::SizedPool<15200> pool;
+
+  // Each subsystem allocates through its own arena so that the usage
+  // of the pool can be attributed.  Registrations with the telemetry
+  // manager and persistent configuration are charged to those.
+  PoolUsage pool_usage;
+  PoolArena uart_pool(&pool, &pool_usage.uart);
+  PoolArena multiplex_pool(&pool, &pool_usage.multiplex);
+  PoolArena command_manager_pool(&pool, &pool_usage.command_manager);
+  PoolArena telemetry_pool(&pool, &pool_usage.telemetry);
+  PoolArena config_pool(&pool, &pool_usage.config);
+  PoolArena system_info_pool(&pool, &pool_usage.system_info);
+  PoolArena firmware_info_pool(&pool, &pool_usage.firmware_info);
+  PoolArena controller_pool(&pool, &pool_usage.controller);
+  PoolArena board_debug_pool(&pool, &pool_usage.board_debug);
+
+  HardwareUart rs485(&uart_pool, &timer, []() {
       HardwareUart::Options options;
       options.tx = MOTEUS_UART_TX;
       options.rx = MOTEUS_UART_RX;
       options.dir = MOTEUS_UART_DIR;
       options.baud_rate = 3000000;
+      // Two character times.
+      options.rx_frame_timeout_bits = 20;
       return options;
     }());
 
@@ -253,7 +309,9 @@ int main(void) {
       return options;
     }());
   FDCanMicroServer fdcan_micro_server(&fdcan);
-  multiplex::MicroServer multiplex_protocol(&pool, &fdcan_micro_server, {});
+  multiplex::MicroStreamDatagram rs485_datagram(&multiplex_pool, &rs485, {});
+  TransportSelector transport(&fdcan_micro_server, &rs485_datagram);
+  multiplex::MicroServer multiplex_protocol(&multiplex_pool, &transport, {});
 #else
 #error "Unknown target"
 #endif
@@ -261,28 +319,40 @@ int main(void) {
   micro::AsyncStream* serial = multiplex_protocol.MakeTunnel(1);
 
   micro::AsyncExclusive<micro::AsyncWriteStream> write_stream(serial);
-  micro::CommandManager command_manager(&pool, serial, &write_stream);
+  micro::CommandManager command_manager(&command_manager_pool, serial, &write_stream);
   micro::TelemetryManager telemetry_manager(
-      &pool, &command_manager, &write_stream);
+      &telemetry_pool, &command_manager, &write_stream);
   Stm32Flash flash_interface;
-  micro::PersistentConfig persistent_config(pool, command_manager, flash_interface);
+  micro::PersistentConfig persistent_config(config_pool, command_manager, flash_interface);
+  ConfigBlob config_blob(command_manager, flash_interface);
 
-  SystemInfo system_info(pool, telemetry_manager);
-  FirmwareInfo firmware_info(pool, telemetry_manager,
+  SystemInfo system_info(system_info_pool, telemetry_manager, &timer);
+  FirmwareInfo firmware_info(firmware_info_pool, telemetry_manager,
                              kMoteusFirmwareVersion, MOTEUS_MODEL_NUMBER);
   ClockManager clock(&timer, persistent_config, command_manager);
 
   MoteusController moteus_controller(
-      &pool, &persistent_config, &telemetry_manager, &timer, &firmware_info);
+      &controller_pool, &persistent_config, &telemetry_manager, &timer,
+      &firmware_info,
+      &multiplex_protocol, &fdcan_micro_server);
 
   BoardDebug board_debug(
-      &pool, &command_manager, &telemetry_manager, &multiplex_protocol,
-      moteus_controller.bldc_servo());
+      &board_debug_pool, &command_manager, &telemetry_manager,
+      &multiplex_protocol, moteus_controller.bldc_servo());
 
   persistent_config.Register("id", multiplex_protocol.config(), [](){});
+#if defined(TARGET_STM32G4)
+  persistent_config.Register("transport", transport.config(), [](){});
+#endif
 
   GitInfo git_info;
   telemetry_manager.Register("git", &git_info);
+  pool_usage.size = pool.size();
+  auto pool_usage_updater =
+      telemetry_manager.Register("pool", &pool_usage);
+#if defined(TARGET_STM32G4)
+  telemetry_manager.Register("can", fdcan_micro_server.stats());
+#endif
 
   persistent_config.Load();
 
@@ -290,25 +360,35 @@ int main(void) {
   command_manager.AsyncStart();
   multiplex_protocol.Start(moteus_controller.multiplex_server());
 
-  auto old_time = timer.read_ms();
-
-  for (;;) {
-    rs485.Poll();
+  // Time critical work is polled on every pass.  The millisecond
+  // pollers are ordered by priority, and spread across several
+  // passes if they cannot all complete within the budget.
+  SystemInfo::MainLoop scheduler(kMainLoopBudgetUs);
+  scheduler.AddPoller([&]() { rs485.Poll(); });
 #if defined(TARGET_STM32G4)
-    fdcan_micro_server.Poll();
+  scheduler.AddPoller([&]() { fdcan_micro_server.Poll(); });
 #endif
-    moteus_controller.Poll();
-
-    const auto new_time = timer.read_ms();
-
-    if (new_time != old_time) {
-      telemetry_manager.PollMillisecond();
-      system_info.PollMillisecond();
-      moteus_controller.PollMillisecond();
-      board_debug.PollMillisecond();
+  scheduler.AddPoller([&]() { moteus_controller.Poll(); });
+  scheduler.AddPeriodic(1000, [&]() { moteus_controller.PollMillisecond(); });
+#if defined(TARGET_STM32G4)
+  scheduler.AddPeriodic(1000, [&]() { fdcan_micro_server.PollMillisecond(); });
+#endif
+  scheduler.AddPeriodic(1000, [&]() { telemetry_manager.PollMillisecond(); });
+  scheduler.AddPeriodic(1000, [&]() { system_info.PollMillisecond(); });
+  scheduler.AddPeriodic(1000, [&]() { board_debug.PollMillisecond(); });
+  telemetry_manager.Register("scheduler", scheduler.stats());
+  system_info.SetMainLoop(scheduler.stats());
+  system_info.SetIsrCycles([&]() {
+      return moteus_controller.bldc_servo()->isr_cycles();
+    });
+
+  // Nearly all allocation is complete by this point, so what remains
+  // is the margin available to new telemetry channels.
+  pool_usage.available = pool.available();
+  pool_usage_updater();
 
-      old_time = new_time;
-    }
+  for (;;) {
+    scheduler.Run([&]() { return timer.read_us(); });
 
     SystemInfo::idle_count++;
   }
@@ -14,10 +14,15 @@
 
 #include "fw/moteus_controller.h"
 
+#include <cstring>
+
 #include "mjlib/base/limit.h"
 
+#include "fw/clock_sync.h"
 #include "fw/math.h"
 #include "fw/moteus_hw.h"
+#include "fw/reply_template.h"
+#include "fw/servo_registers.h"
 
 namespace micro = mjlib::micro;
 namespace multiplex = mjlib::multiplex;
@@ -27,225 +32,122 @@ namespace moteus {
 
 using Value = multiplex::MicroServer::Value;
 
-namespace {
-template <typename T>
-Value IntMapping(T value, size_t type) {
-  switch (type) {
-    case 0: return static_cast<int8_t>(value);
-    case 1: return static_cast<int16_t>(value);
-    case 2: return static_cast<int32_t>(value);
-    case 3: return static_cast<float>(value);
-  }
-  MJ_ASSERT(false);
-  return static_cast<int8_t>(0);
-}
-
-template <typename T>
-Value ScaleSaturate(float value, float scale) {
-  if (!std::isfinite(value)) {
-    return std::numeric_limits<T>::min();
-  }
-
-  const float scaled = value / scale;
-  const auto max = std::numeric_limits<T>::max();
-  // We purposefully limit to +- max, rather than to min.  The minimum
-  // value for our two's complement types is reserved for NaN.
-  return Limit<T>(static_cast<T>(scaled), -max, max);
-}
-
-Value ScaleMapping(float value,
-                   float int8_scale, float int16_scale, float int32_scale,
-                   size_t type) {
-  switch (type) {
-    case 0: return ScaleSaturate<int8_t>(value, int8_scale);
-    case 1: return ScaleSaturate<int16_t>(value, int16_scale);
-    case 2: return ScaleSaturate<int32_t>(value, int32_scale);
-    case 3: return Value(value);
-  }
-  MJ_ASSERT(false);
-  return Value(static_cast<int8_t>(0));
-}
-
-Value ScalePosition(float value, size_t type) {
-  return ScaleMapping(value, 0.01f, 0.0001f, 0.00001f, type);
-}
-
-Value ScaleVelocity(float value, size_t type) {
-  return ScaleMapping(value, 0.1f, 0.00025f, 0.00001f, type);
-}
-
-Value ScaleTemperature(float value, size_t type) {
-  return ScaleMapping(value, 1.0f, 0.1f, 0.001f, type);
-}
-
-Value ScalePwm(float value, size_t type) {
-  return ScaleMapping(value, 1.0f / 127.0f, 1.0f / 32767.0f,
-                      1.0f / 2147483647.0f,
-                      type);
-}
-
-Value ScaleCurrent(float value, size_t type) {
-  // For now, current and temperature have identical scaling.
-  return ScaleTemperature(value, type);
-}
-
-Value ScaleVoltage(float value, size_t type) {
-  return ScaleMapping(value, 0.5f, 0.1f, 0.001f, type);
-}
-
-Value ScaleTorque(float value, size_t type) {
-  return ScaleMapping(value, 0.5f, 0.01f, 0.001f, type);
-}
-
-Value ScaleTime(float value, size_t type) {
-  return ScaleMapping(value, 0.01f, 0.001f, 0.000001f, type);
-}
+static_assert(std::is_same_v<Value, ServoRegisters::Value>);
+static_assert(std::is_same_v<multiplex::MicroServer::ReadResult,
+                             ServoRegisters::ReadResult>);
 
-int8_t ReadIntMapping(Value value) {
-  return std::visit([](auto a) {
-      return static_cast<int8_t>(a);
-    }, value);
-}
-
-struct ValueScaler {
-  float int8_scale;
-  float int16_scale;
-  float int32_scale;
-
-  float operator()(int8_t value) const {
-    if (value == std::numeric_limits<int8_t>::min()) {
-      return std::numeric_limits<float>::quiet_NaN();
-    }
-    return value * int8_scale;
+namespace {
+/// A frame which is emitted periodically without any request.  It is
+/// laid out as a sequence of ordinary reply subframes, so that it can
+/// be decoded with the same parser used for query results.
+struct BroadcastConfig {
+  // 0 disables the broadcast.
+  float rate_hz = 0.0f;
+
+  // When non-zero, the broadcast period is divided into this many
+  // slots, and each controller transmits in the slot given by its
+  // multiplex id modulo phase_slots.
+  int32_t phase_slots = 0;
+
+  // The destination id placed in the CAN identifier.
+  int32_t destination = 0;
+
+  ReplyTemplate::Layout blocks = ReplyTemplate::DefaultLayout();
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(rate_hz));
+    a->Visit(MJ_NVP(phase_slots));
+    a->Visit(MJ_NVP(destination));
+    a->Visit(MJ_NVP(blocks));
   }
+};
 
-  float operator()(int16_t value) const {
-    if (value == std::numeric_limits<int16_t>::min()) {
-      return std::numeric_limits<float>::quiet_NaN();
-    }
-    return value * int16_scale;
-  }
+/// The reply sent for a template query frame.
+struct QueryTemplateConfig {
+  ReplyTemplate::Layout blocks = ReplyTemplate::DefaultLayout();
 
-  float operator()(int32_t value) const {
-    if (value == std::numeric_limits<int32_t>::min()) {
-      return std::numeric_limits<float>::quiet_NaN();
-    }
-    return value * int32_scale;
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(blocks));
   }
+};
 
-  float operator()(float value) const {
-    return value;
+// A frame consisting of only this byte, optionally followed by NOP
+// padding, and sent with the reply required flag, is answered with
+// the query template.
+constexpr uint8_t kTemplateQuery = 0x60;
+
+/// Selects this controller's portion of a group command frame.
+struct GroupConfig {
+  // Group frames are accepted when sent to this destination.
+  int32_t destination = 0x7f;
+
+  // The index of this controller's slot, or -1 to ignore group
+  // frames.
+  int32_t slot = -1;
+
+  // The registers written from each slot, in order.  Every
+  // controller addressed by a frame must use the same layout.
+  ReplyTemplate::Layout blocks = {{
+      // mode
+      { 0x000, 1, 0 },
+      // position, velocity, feedforward torque
+      { 0x020, 3, 1 },
+      {}, {},
+    }};
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(destination));
+    a->Visit(MJ_NVP(slot));
+    a->Visit(MJ_NVP(blocks));
   }
 };
 
-float ReadScaleMapping(Value value,
-                       float int8_scale,
-                       float int16_scale,
-                       float int32_scale) {
-  return std::visit(ValueScaler{int8_scale, int16_scale, int32_scale}, value);
-}
-
-float ReadPwm(Value value) {
-  return ReadScaleMapping(value, 1.0f / 127.0f, 1.0f / 32767.0f,
-                          1.0f / 2147483647.0f);
-}
-
-float ReadVoltage(Value value) {
-  return ReadScaleMapping(value, 0.5f, 0.1f, 0.001f);
-}
+// A group command frame consists of this byte, a 16 bit little
+// endian mask of the slots which should reply with their query
+// template, and then each slot in turn.
+constexpr uint8_t kGroupCommand = 0x61;
+constexpr size_t kGroupHeaderSize = 3;
 
-float ReadPosition(Value value) {
-  return ReadScaleMapping(value, 0.01f, 0.0001f, 0.00001f);
-}
+/// Configures how this controller follows the host's time base.
+struct ClockSyncConfig {
+  // Sync frames are accepted when sent to this destination, in
+  // addition to our own id.  -1 accepts them only at our own id.
+  int32_t destination = -1;
 
-float ReadVelocity(Value value) {
-  return ReadScaleMapping(value, 0.1f, 0.00025f, 0.00001f);
-}
-
-float ReadCurrent(Value value) {
-  return ReadScaleMapping(value, 1.0f, 0.1f, 0.001f);
-}
+  ClockSync::Config filter;
 
-float ReadTorque(Value value) {
-  return ReadScaleMapping(value, 0.5f, 0.01f, 0.001f);
-}
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(destination));
+    a->Visit(MJ_NVP(filter));
+  }
+};
 
-float ReadTime(Value value) {
-  return ReadScaleMapping(value, 0.01f, 0.001f, 0.000001f);
-}
+// A clock sync frame consists of this byte followed by the 32 bit
+// little endian host time in microseconds, optionally followed by
+// NOP padding.
+constexpr uint8_t kClockSync = 0x62;
+constexpr size_t kClockSyncSize = 5;
 
-enum class Register {
-  kMode = 0x000,
-  kPosition = 0x001,
-  kVelocity = 0x002,
-  kTorque = 0x003,
-  kQCurrent = 0x004,
-  kDCurrent = 0x005,
-
-  kRezeroState = 0x00c,
-  kVoltage = 0x00d,
-  kTemperature = 0x00e,
-  kFault = 0x00f,
-
-  kPwmPhaseA = 0x010,
-  kPwmPhaseB = 0x011,
-  kPwmPhaseC = 0x012,
-
-  kVoltagePhaseA = 0x014,
-  kVoltagePhaseB = 0x015,
-  kVoltagePhaseC = 0x016,
-
-  kVFocTheta = 0x018,
-  kVFocVoltage = 0x019,
-  kVoltageDqD = 0x01a,
-  kVoltageDqQ = 0x01b,
-
-  kCommandQCurrent = 0x01c,
-  kCommandDCurrent = 0x01d,
-
-  kCommandPosition = 0x020,
-  kCommandVelocity = 0x021,
-  kCommandFeedforwardTorque = 0x022,
-  kCommandKpScale = 0x023,
-  kCommandKdScale = 0x024,
-  kCommandPositionMaxTorque = 0x025,
-  kCommandStopPosition = 0x026,
-  kCommandTimeout = 0x027,
-
-  kPositionKp = 0x030,
-  kPositionKi = 0x031,
-  kPositionKd = 0x032,
-  kPositionFeedforward = 0x033,
-  kPositionCommandTorque = 0x034,
-
-  kStayWithinLower = 0x040,
-  kStayWithinUpper = 0x041,
-  kStayWithinFeedforward = 0x042,
-  kStayWithinKpScale = 0x043,
-  kStayWithinKdScale = 0x044,
-  kStayWithinMaxTorque = 0x045,
-  kStayWithinTimeout = 0x046,
-
-  kModelNumber = 0x100,
-  kFirmwareVersion = 0x101,
-  kRegisterMapVersion = 0x102,
-  kMultiplexId = 0x110,
-
-  kSerialNumber1 = 0x120,
-  kSerialNumber2 = 0x121,
-  kSerialNumber3 = 0x122,
-
-  kRezero = 0x130,
-};
+// Every periodic broadcast begins with this byte, ahead of its reply
+// subframes, so that hosts can tell it apart from the reply to a
+// query of the same controller.
+constexpr uint8_t kBroadcastFrame = 0x63;
 }
 
-class MoteusController::Impl : public multiplex::MicroServer::Server {
+class MoteusController::Impl : public multiplex::MicroServer::Server,
+                               public FDCanMicroServer::Filter {
  public:
   Impl(micro::Pool* pool,
        micro::PersistentConfig* persistent_config,
        micro::TelemetryManager* telemetry_manager,
        MillisecondTimer* timer,
-       FirmwareInfo* firmware)
+       FirmwareInfo* firmware,
+       multiplex::MicroServer* multiplex_protocol,
+       FDCanMicroServer* fdcan_micro_server)
       : as5047_([]() {
           AS5047::Options options;
           options.mosi = MOTEUS_AS5047_MOSI;
@@ -291,7 +193,28 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
 
             return options;
           }()),
-        firmware_(firmware) {}
+        timer_(timer),
+        firmware_(firmware),
+        multiplex_protocol_(multiplex_protocol),
+        fdcan_micro_server_(fdcan_micro_server) {
+    persistent_config->Register("can_broadcast", &broadcast_config_,
+                                [this]() { this->UpdateBroadcastConfig(); });
+    persistent_config->Register(
+        "query_template", &query_template_config_,
+        [this]() { this->UpdateQueryTemplateConfig(); });
+    persistent_config->Register("group", &group_config_,
+                                [this]() { this->UpdateGroupConfig(); });
+    persistent_config->Register("clock_sync", &clock_sync_config_, [](){});
+    persistent_config->Register(
+        "register_scale", &register_scale_config_,
+        [this]() { this->UpdateRegisterScaleConfig(); });
+    telemetry_manager->Register("clock_sync", &clock_sync_status_);
+    UpdateBroadcastConfig();
+    UpdateQueryTemplateConfig();
+    UpdateGroupConfig();
+    UpdateRegisterScaleConfig();
+    fdcan_micro_server_->set_filter(this);
+  }
 
   void Start() {
     bldc_.Start();
@@ -299,148 +222,34 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
 
   void Poll() {
     // Check to see if we have a command to send out.
-    if (command_valid_) {
-      command_valid_ = false;
-      bldc_.Command(command_);
+    if (registers_.command_valid()) {
+      registers_.clear_command_valid();
+      bldc_.Command(registers_.command());
     }
+
+    PollBroadcast();
   }
 
   void PollMillisecond() {
     drv8323_.PollMillisecond();
     bldc_.PollMillisecond();
+    UpdateCanFilters();
   }
 
   uint32_t Write(multiplex::MicroServer::Register reg,
                  const multiplex::MicroServer::Value& value) override
       __attribute__ ((optimize("O3"))){
     switch (static_cast<Register>(reg)) {
-      case Register::kMode: {
-        const auto new_mode_int = ReadIntMapping(value);
-        if (new_mode_int > static_cast<int8_t>(BldcServo::Mode::kNumModes)) {
-          return 3;
+      case Register::kCommandApplyTime: {
+        // Only an absolute time is meaningful.
+        if (value.index() != 2) { return 3; }
+        // Without a time base, the command is applied as it arrives.
+        if (clock_sync_.valid()) {
+          registers_.mutable_command()->apply_us = clock_sync_.ToLocal(
+              static_cast<uint32_t>(std::get<int32_t>(value)));
         }
-        command_valid_ = true;
-        const auto new_mode = static_cast<BldcServo::Mode>(new_mode_int);
-        command_ = {};
-        command_.mode = new_mode;
-        return 0;
-      }
-
-      case Register::kPwmPhaseA: {
-        command_.pwm.a = ReadPwm(value);
-        return 0;
-      }
-      case Register::kPwmPhaseB: {
-        command_.pwm.b = ReadPwm(value);
-        return 0;
-      }
-      case Register::kPwmPhaseC: {
-        command_.pwm.c = ReadPwm(value);
-        return 0;
-      }
-      case Register::kVoltagePhaseA: {
-        command_.phase_v.a = ReadVoltage(value);
-        return 0;
-      }
-      case Register::kVoltagePhaseB: {
-        command_.phase_v.b = ReadVoltage(value);
-        return 0;
-      }
-      case Register::kVoltagePhaseC: {
-        command_.phase_v.c = ReadVoltage(value);
-        return 0;
-      }
-      case Register::kVFocTheta: {
-        command_.theta = ReadPwm(value) * kPi;
-        return 0;
-      }
-      case Register::kVFocVoltage: {
-        command_.voltage = ReadVoltage(value);
-        return 0;
-      }
-      case Register::kVoltageDqD: {
-        command_.d_V = ReadVoltage(value);
-        return 0;
-      }
-      case Register::kVoltageDqQ: {
-        command_.q_V = ReadVoltage(value);
-        return 0;
-      }
-      case Register::kCommandQCurrent: {
-        command_.i_q_A = ReadCurrent(value);
-        return 0;
-      }
-      case Register::kCommandDCurrent: {
-        command_.i_d_A = ReadCurrent(value);
         return 0;
       }
-      case Register::kCommandPosition: {
-        command_.position = ReadPosition(value);
-        return 0;
-      }
-      case Register::kCommandVelocity: {
-        command_.velocity = ReadVelocity(value);
-        return 0;
-      }
-      case Register::kCommandPositionMaxTorque:
-      case Register::kStayWithinMaxTorque: {
-        command_.max_torque_Nm = ReadTorque(value);
-        return 0;
-      }
-      case Register::kCommandStopPosition: {
-        command_.stop_position = ReadPosition(value);
-        return 0;
-      }
-      case Register::kCommandTimeout:
-      case Register::kStayWithinTimeout: {
-        command_.timeout_s = ReadTime(value);
-        return 0;
-      }
-      case Register::kCommandFeedforwardTorque:
-      case Register::kStayWithinFeedforward: {
-        command_.feedforward_Nm = ReadTorque(value);
-        return 0;
-      }
-      case Register::kCommandKpScale:
-      case Register::kStayWithinKpScale: {
-        command_.kp_scale = ReadPwm(value);
-        return 0;
-      }
-      case Register::kCommandKdScale:
-      case Register::kStayWithinKdScale: {
-        command_.kd_scale = ReadPwm(value);
-        return 0;
-      }
-      case Register::kStayWithinLower: {
-        command_.bounds_min = ReadPosition(value);
-        return 0;
-      }
-      case Register::kStayWithinUpper: {
-        command_.bounds_max = ReadPosition(value);
-        return 0;
-      }
-
-      case Register::kRezero: {
-        command_.rezero_position = ReadPosition(value);
-        command_.mode = BldcServo::kStopped;
-        command_valid_ = true;
-        return 0;
-      }
-
-      case Register::kPosition:
-      case Register::kVelocity:
-      case Register::kTemperature:
-      case Register::kQCurrent:
-      case Register::kDCurrent:
-      case Register::kRezeroState:
-      case Register::kVoltage:
-      case Register::kTorque:
-      case Register::kFault:
-      case Register::kPositionKp:
-      case Register::kPositionKi:
-      case Register::kPositionKd:
-      case Register::kPositionFeedforward:
-      case Register::kPositionCommandTorque:
       case Register::kModelNumber:
       case Register::kSerialNumber1:
       case Register::kSerialNumber2:
@@ -451,10 +260,12 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
         // Not writeable
         return 2;
       }
+      default: {
+        break;
+      }
     }
 
-    // If we got here, then we had an unknown register.
-    return 1;
+    return registers_.Write(reg, value);
   }
 
   multiplex::MicroServer::ReadResult Read(
@@ -464,126 +275,14 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
     auto vi32 = [](auto v) { return Value(static_cast<int32_t>(v)); };
 
     switch (static_cast<Register>(reg)) {
-      case Register::kMode: {
-        return IntMapping(static_cast<int8_t>(bldc_.status().mode), type);
+      case Register::kCommandApplyTime: {
+        // This reports our estimate of the current host time, so that
+        // the synchronization may be checked.
+        if (!clock_sync_.valid()) { break; }
+        return ServoRegisters::IntMapping(
+            static_cast<int32_t>(clock_sync_.ToHost(timer_->read_us())),
+            type);
       }
-      case Register::kPosition: {
-        return ScalePosition(bldc_.status().unwrapped_position, type);
-      }
-      case Register::kVelocity: {
-        return ScaleVelocity(bldc_.status().velocity, type);
-      }
-      case Register::kTemperature: {
-        return ScaleTemperature(bldc_.status().fet_temp_C, type);
-      }
-      case Register::kQCurrent: {
-        return ScaleCurrent(bldc_.status().q_A, type);
-      }
-      case Register::kDCurrent: {
-        return ScaleCurrent(bldc_.status().d_A, type);
-      }
-      case Register::kRezeroState: {
-        return IntMapping(bldc_.status().rezeroed ? 1 : 0, type);
-      }
-      case Register::kVoltage: {
-        return ScaleVoltage(bldc_.status().bus_V, type);
-      }
-      case Register::kTorque: {
-        return ScaleTorque(bldc_.status().torque_Nm, type);
-      }
-      case Register::kFault: {
-        return IntMapping(bldc_.status().fault, type);
-      }
-
-      case Register::kPwmPhaseA: {
-        return ScalePwm(command_.pwm.a, type);
-      }
-      case Register::kPwmPhaseB: {
-        return ScalePwm(command_.pwm.b, type);
-      }
-      case Register::kPwmPhaseC: {
-        return ScalePwm(command_.pwm.c, type);
-      }
-      case Register::kVoltagePhaseA: {
-        return ScaleVoltage(command_.phase_v.a, type);
-      }
-      case Register::kVoltagePhaseB: {
-        return ScaleVoltage(command_.phase_v.b, type);
-      }
-      case Register::kVoltagePhaseC: {
-        return ScaleVoltage(command_.phase_v.c, type);
-      }
-      case Register::kVFocTheta: {
-        return ScalePwm(command_.theta / kPi, type);
-      }
-      case Register::kVFocVoltage: {
-        return ScaleVoltage(command_.voltage, type);
-      }
-      case Register::kVoltageDqD: {
-        return ScaleVoltage(command_.d_V, type);
-      }
-      case Register::kVoltageDqQ: {
-        return ScaleVoltage(command_.q_V, type);
-      }
-      case Register::kCommandQCurrent: {
-        return ScaleCurrent(command_.i_q_A, type);
-      }
-      case Register::kCommandDCurrent: {
-        return ScaleCurrent(command_.i_d_A, type);
-      }
-      case Register::kCommandPosition: {
-        return ScalePosition(command_.position, type);
-      }
-      case Register::kCommandVelocity: {
-        return ScaleVelocity(command_.velocity, type);
-      }
-      case Register::kCommandPositionMaxTorque:
-      case Register::kStayWithinMaxTorque: {
-        return ScaleTorque(command_.max_torque_Nm, type);
-      }
-      case Register::kCommandStopPosition: {
-        return ScalePosition(command_.stop_position, type);
-      }
-      case Register::kCommandTimeout:
-      case Register::kStayWithinTimeout: {
-        return ScaleTime(command_.timeout_s, type);
-      }
-      case Register::kCommandFeedforwardTorque:
-      case Register::kStayWithinFeedforward: {
-        return ScaleTorque(command_.feedforward_Nm, type);
-      }
-      case Register::kCommandKpScale:
-      case Register::kStayWithinKpScale: {
-        return ScalePwm(command_.kp_scale, type);
-      }
-      case Register::kCommandKdScale:
-      case Register::kStayWithinKdScale: {
-        return ScalePwm(command_.kd_scale, type);
-      }
-
-      case Register::kPositionKp: {
-        return ScaleTorque(bldc_.status().pid_position.p, type);
-      }
-      case Register::kPositionKi: {
-        return ScaleTorque(bldc_.status().pid_position.integral, type);
-      }
-      case Register::kPositionKd: {
-        return ScaleTorque(bldc_.status().pid_position.d, type);
-      }
-      case Register::kPositionFeedforward: {
-        return ScaleTorque(command_.feedforward_Nm, type);
-      }
-      case Register::kPositionCommandTorque: {
-        return ScaleTorque(bldc_.control().torque_Nm, type);
-      }
-
-      case Register::kStayWithinLower: {
-        return ScalePosition(command_.bounds_min, type);
-      }
-      case Register::kStayWithinUpper: {
-        return ScalePosition(command_.bounds_max, type);
-      }
-
       case Register::kModelNumber: {
         if (type != 2) { break; }
 
@@ -613,8 +312,8 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
       case Register::kMultiplexId: {
         break;
       }
-      case Register::kRezero: {
-        break;
+      default: {
+        return registers_.Read(reg, type);
       }
     }
 
@@ -622,22 +321,318 @@ class MoteusController::Impl : public multiplex::MicroServer::Server {
     return static_cast<uint32_t>(1);
   }
 
+  bool HandleFrame(const multiplex::MicroDatagramServer::Header& header,
+                   std::string_view data) override {
+    if (data.empty()) { return false; }
+
+    switch (static_cast<uint8_t>(data[0])) {
+      case kTemplateQuery: {
+        return HandleTemplateQuery(header, data);
+      }
+      case kGroupCommand: {
+        return HandleGroupCommand(header, data);
+      }
+      case kClockSync: {
+        return HandleClockSync(header, data);
+      }
+    }
+    return false;
+  }
+
+  bool HandleClockSync(
+      const multiplex::MicroDatagramServer::Header& header,
+      std::string_view data) {
+    // This is sampled as early as we can, as every controller should
+    // see the same delay from the end of the frame.
+    const uint32_t now = timer_->read_us();
+
+    const int32_t destination = header.destination & 0x7f;
+    if (destination != multiplex_protocol_->config()->id &&
+        destination != clock_sync_config_.destination) {
+      return false;
+    }
+    if (data.size() < kClockSyncSize) { return false; }
+    for (size_t i = kClockSyncSize; i < data.size(); i++) {
+      if (static_cast<uint8_t>(data[i]) != 0x50) { return false; }
+    }
+
+    uint32_t host_us = 0;
+    std::memcpy(&host_us, &data[1], sizeof(host_us));
+    clock_sync_.Update(host_us, now);
+    clock_sync_status_ = clock_sync_.status();
+    return true;
+  }
+
+  bool HandleTemplateQuery(
+      const multiplex::MicroDatagramServer::Header& header,
+      std::string_view data) {
+    // Anything beyond the query byte may only be padding.
+    for (size_t i = 1; i < data.size(); i++) {
+      if (static_cast<uint8_t>(data[i]) != 0x50) { return false; }
+    }
+    const auto id = multiplex_protocol_->config()->id;
+    if ((header.destination & 0x7f) != id) { return false; }
+
+    if (header.source & 0x80) {
+      SendTemplate(&query_template_, header.source & 0x7f);
+    }
+    return true;
+  }
+
+  bool HandleGroupCommand(
+      const multiplex::MicroDatagramServer::Header& header,
+      std::string_view data) {
+    if ((header.destination & 0x7f) != group_config_.destination) {
+      return false;
+    }
+    // Group frames are never meaningful to the multiplex server, so
+    // they are consumed even if we have no slot in them.
+    if (group_config_.slot < 0 ||
+        group_config_.slot >= static_cast<int32_t>(data.size()) ||
+        group_slot_size_ == 0) {
+      return true;
+    }
+
+    const size_t offset =
+        kGroupHeaderSize + group_config_.slot * group_slot_size_;
+    if (offset + group_slot_size_ > data.size()) { return true; }
+
+    const char* slot = &data[offset];
+    for (const auto& block : group_config_.blocks) {
+      if (block.count <= 0 || block.start < 0) { continue; }
+      const int resolution = Limit<int32_t>(block.resolution, 0, 3);
+      for (int32_t i = 0; i < block.count; i++) {
+        Write(block.start + i, ReadValue(slot, resolution));
+        slot += ReplyTemplate::ValueSize(resolution);
+      }
+    }
+
+    uint16_t reply_mask = 0;
+    std::memcpy(&reply_mask, &data[1], sizeof(reply_mask));
+    if (group_config_.slot < 16 &&
+        (reply_mask & (1 << group_config_.slot)) != 0) {
+      SendTemplate(&query_template_, header.source & 0x7f);
+    }
+    return true;
+  }
+
+  static Value ReadValue(const char* data, int resolution) {
+    switch (resolution) {
+      case 0: { return static_cast<int8_t>(data[0]); }
+      case 1: {
+        int16_t value = 0;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+      }
+      case 2: {
+        int32_t value = 0;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+      }
+    }
+    float value = 0.0f;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+  }
+
+  void UpdateRegisterScaleConfig() {
+    registers_.SetScale(register_scale_config_);
+
+    // The templates captured the previous scales when compiled.
+    UpdateQueryTemplateConfig();
+    UpdateBroadcastConfig();
+  }
+
+  void UpdateGroupConfig() {
+    group_slot_size_ = 0;
+    for (const auto& block : group_config_.blocks) {
+      if (block.count <= 0 || block.start < 0) { continue; }
+      group_slot_size_ +=
+          block.count * ReplyTemplate::ValueSize(
+              Limit<int32_t>(block.resolution, 0, 3));
+    }
+  }
+
+  /// Configure the hardware filters to accept only frames addressed
+  /// to our id, our group, or our clock sync destination, so that
+  /// other traffic on a shared bus never reaches the CPU.  This is
+  /// re-evaluated periodically, as the id may be changed at any time.
+  ///
+  /// Changing the filters discards whatever the hardware has yet to
+  /// transmit, so a change waits for the transmit FIFO to drain, for
+  /// up to kMaxFilterDelayMs.  Only if the bus stays busy that long
+  /// is it applied anyway.
+  void UpdateCanFilters() {
+    const int32_t id = multiplex_protocol_->config()->id;
+    const int32_t group =
+        (group_config_.slot >= 0) ? (group_config_.destination & 0x7f) : -1;
+    const int32_t sync =
+        (clock_sync_config_.destination >= 0) ?
+        (clock_sync_config_.destination & 0x7f) : -1;
+    if (id == filter_id_ && group == filter_group_ &&
+        sync == filter_sync_) {
+      filter_delay_ms_ = 0;
+      return;
+    }
+
+    auto* const fdcan = fdcan_micro_server_->fdcan();
+    if (!fdcan->tx_idle() && filter_delay_ms_ < kMaxFilterDelayMs) {
+      filter_delay_ms_++;
+      return;
+    }
+    filter_delay_ms_ = 0;
+
+    filter_id_ = id;
+    filter_group_ = group;
+    filter_sync_ = sync;
+
+    auto* const end = MakeCanFilters(&can_filters_[0], id);
+    auto* const group_end =
+        (group >= 0 && group != id) ? MakeCanFilters(end, group) : end;
+    auto* const sync_end =
+        (sync >= 0 && sync != id && sync != group) ?
+        MakeCanFilters(group_end, sync) : group_end;
+
+    fdcan->ConfigureFilters(
+        &can_filters_[0], sync_end,
+        FDCan::FilterAction::kReject, FDCan::FilterAction::kReject);
+  }
+
+  static FDCan::Filter* MakeCanFilters(FDCan::Filter* filter,
+                                       int32_t destination) {
+    // The destination is the low byte of the identifier, in both
+    // standard and extended frames.
+    for (auto type : { FDCan::FilterType::kStandard,
+                       FDCan::FilterType::kExtended }) {
+      filter->id1 = destination;
+      filter->id2 = 0xff;
+      filter->mode = FDCan::FilterMode::kMask;
+      filter->action = FDCan::FilterAction::kAccept;
+      filter->type = type;
+      filter++;
+    }
+    return filter;
+  }
+
+  void UpdateQueryTemplateConfig() {
+    CompileTemplate(query_template_config_.blocks, &query_template_);
+  }
+
+  void UpdateBroadcastConfig() {
+    const char prefix[] = { static_cast<char>(kBroadcastFrame) };
+    CompileTemplate(broadcast_config_.blocks, &broadcast_template_,
+                    std::string_view(prefix, sizeof(prefix)));
+    broadcast_period_us_ =
+        (broadcast_config_.rate_hz > 0.0f) ?
+        std::max<uint32_t>(
+            kMinBroadcastPeriodUs,
+            static_cast<uint32_t>(1e6f / broadcast_config_.rate_hz)) :
+        0;
+    next_broadcast_us_ = timer_->read_us();
+  }
+
+  void PollBroadcast() {
+    if (broadcast_period_us_ == 0) { return; }
+
+    const uint32_t now = timer_->read_us();
+    if (static_cast<int32_t>(now - next_broadcast_us_) < 0) { return; }
+
+    // The next deadline is placed on a grid aligned to the
+    // microsecond timer, so that controllers which were powered up
+    // together stay in their respective slots, and so that a late
+    // poll does not accumulate into the phase.
+    const uint32_t period = broadcast_period_us_;
+    const uint32_t offset =
+        (broadcast_config_.phase_slots > 0) ?
+        (period / broadcast_config_.phase_slots) *
+        (multiplex_protocol_->config()->id %
+         broadcast_config_.phase_slots) :
+        0;
+    next_broadcast_us_ =
+        ((now - offset) / period + 1) * period + offset;
+
+    SendTemplate(&broadcast_template_, broadcast_config_.destination);
+  }
+
+  void CompileTemplate(const ReplyTemplate::Layout& layout,
+                       ReplyTemplate* reply_template,
+                       std::string_view prefix = {}) {
+    reply_template->Compile(layout, [&](int32_t reg) {
+        return registers_.ResolveSource(reg);
+      }, prefix);
+  }
+
+  void SendTemplate(ReplyTemplate* reply_template, int32_t destination) {
+    if (reply_template->size() == 0) { return; }
+
+    const auto data = reply_template->Render(
+        [&](int32_t reg, int resolution, char* dest) {
+          const auto result = Read(reg, resolution);
+          const Value* const value = std::get_if<Value>(&result);
+          if (value) {
+            std::visit([&](auto v) {
+                std::memcpy(dest, &v, sizeof(v));
+              }, *value);
+          } else {
+            // Unknown registers keep their place in the frame.
+            std::memset(dest, 0, ReplyTemplate::ValueSize(resolution));
+          }
+        });
+
+    multiplex::MicroDatagramServer::Header header;
+    header.source = multiplex_protocol_->config()->id;
+    header.destination = destination;
+    header.size = data.size();
+
+    fdcan_micro_server_->AsyncWrite(
+        header, data, [](micro::error_code, size_t) {});
+  }
+
+  static constexpr uint32_t kMinBroadcastPeriodUs = 100;
+  static constexpr int kMaxFilterDelayMs = 20;
+
   AS5047 as5047_;
   Drv8323 drv8323_;
   BldcServo bldc_;
+  ServoRegisters registers_{&bldc_.status(), &bldc_.control()};
+  MillisecondTimer* const timer_;
   FirmwareInfo* const firmware_;
+  multiplex::MicroServer* const multiplex_protocol_;
+  FDCanMicroServer* const fdcan_micro_server_;
+
+  BroadcastConfig broadcast_config_;
+  ReplyTemplate broadcast_template_;
+  uint32_t broadcast_period_us_ = 0;
+  uint32_t next_broadcast_us_ = 0;
+
+  QueryTemplateConfig query_template_config_;
+  ReplyTemplate query_template_;
+
+  GroupConfig group_config_;
+  size_t group_slot_size_ = 0;
+
+  std::array<FDCan::Filter, 6> can_filters_ = {};
+  int32_t filter_id_ = -1;
+  int32_t filter_group_ = -1;
+  int32_t filter_sync_ = -1;
+  int filter_delay_ms_ = 0;
+
+  ClockSyncConfig clock_sync_config_;
+  ClockSync clock_sync_{&clock_sync_config_.filter};
+  ClockSync::Status clock_sync_status_;
 
-  bool command_valid_ = false;
-  BldcServo::CommandData command_;
+  RegisterScaleConfig register_scale_config_;
 };
 
 MoteusController::MoteusController(micro::Pool* pool,
                                    micro::PersistentConfig* persistent_config,
                                    micro::TelemetryManager* telemetry_manager,
                                    MillisecondTimer* timer,
-                                   FirmwareInfo* firmware)
+                                   FirmwareInfo* firmware,
+                                   multiplex::MicroServer* multiplex_protocol,
+                                   FDCanMicroServer* fdcan_micro_server)
     : impl_(pool, pool, persistent_config, telemetry_manager,
-            timer, firmware) {}
+            timer, firmware, multiplex_protocol, fdcan_micro_server) {}
 
 MoteusController::~MoteusController() {}
 
@@ -20,6 +20,7 @@
 #include "fw/as5047.h"
 #include "fw/bldc_servo.h"
 #include "fw/drv8323.h"
+#include "fw/fdcan_micro_server.h"
 #include "fw/firmware_info.h"
 #include "fw/millisecond_timer.h"
 
@@ -33,7 +34,9 @@ class MoteusController {
                    mjlib::micro::PersistentConfig* config,
                    mjlib::micro::TelemetryManager* telemetry_manager,
                    MillisecondTimer*,
-                   FirmwareInfo*);
+                   FirmwareInfo*,
+                   mjlib::multiplex::MicroServer* multiplex_protocol,
+                   FDCanMicroServer* fdcan_micro_server);
   ~MoteusController();
 
   void Start();
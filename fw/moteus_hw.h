@@ -14,6 +14,8 @@
 
 #pragma once
 
+#include "fw/ccm.h"
+
 namespace moteus {
 
 // The measured version of MOTEUS_HW_REV
@@ -206,9 +208,7 @@ constexpr int kCompatibleHwRev[] = {
 
 #define MOTEUS_DEBUG_DAC PA_4
 
-#if defined(TARGET_STM32G4)
-#define MOTEUS_CCM_ATTRIBUTE __attribute__ ((section (".ccmram")))
-#else
+#if !defined(TARGET_STM32G4)
 #error "Unknown target"
 #endif
 
@@ -0,0 +1,183 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cmath>
+
+#include "mjlib/base/visitor.h"
+
+#include "fw/foc.h"
+#include "fw/math.h"
+
+namespace moteus {
+
+/// The electrical and mechanical dynamics of a surface mount
+/// permanent magnet motor driving a rigid load.
+///
+/// The electrical state is integrated in the rotor frame with the
+/// implicit Euler method, so that it remains stable for time steps
+/// much longer than the L/R time constant.  This is intended for host
+/// simulation only.
+class MotorPlant {
+ public:
+  struct Config {
+    int poles = 14;
+    float resistance_ohm = 0.05f;
+    float inductance_H = 20e-6f;
+    // The electrical torque per Amp of q axis current.
+    float torque_constant_Nm_per_A = 0.1f;
+
+    // Of the rotor and load together.
+    float inertia_kgm2 = 1e-4f;
+    float viscous_Nm_per_rad_s = 1e-4f;
+    float coulomb_Nm = 0.005f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(poles));
+      a->Visit(MJ_NVP(resistance_ohm));
+      a->Visit(MJ_NVP(inductance_H));
+      a->Visit(MJ_NVP(torque_constant_Nm_per_A));
+      a->Visit(MJ_NVP(inertia_kgm2));
+      a->Visit(MJ_NVP(viscous_Nm_per_rad_s));
+      a->Visit(MJ_NVP(coulomb_Nm));
+    }
+  };
+
+  struct State {
+    // The rotor angle, unwrapped, in radians.
+    double angle_rad = 0.0;
+    float velocity_rad_s = 0.0f;
+
+    float d_A = 0.0f;
+    float q_A = 0.0f;
+
+    float torque_Nm = 0.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(angle_rad));
+      a->Visit(MJ_NVP(velocity_rad_s));
+      a->Visit(MJ_NVP(d_A));
+      a->Visit(MJ_NVP(q_A));
+      a->Visit(MJ_NVP(torque_Nm));
+    }
+  };
+
+  struct PhaseCurrents {
+    float a = 0.0f;
+    float b = 0.0f;
+    float c = 0.0f;
+  };
+
+  MotorPlant(const Config& config) : config_(config) {}
+
+  /// Advance by @p dt_s with the given phase to neutral voltages
+  /// applied, and an external @p load_Nm opposing positive rotation.
+  void Step(float va, float vb, float vc, float load_Nm, float dt_s) {
+    const float pole_pairs = 0.5f * static_cast<float>(config_.poles);
+    const SinCos sc = electrical_sin_cos();
+    const DqTransform v(sc, va, vb, vc);
+
+    const float omega_e = pole_pairs * state_.velocity_rad_s;
+    const float L = config_.inductance_H;
+    const float R = config_.resistance_ohm;
+    const float flux_Wb =
+        config_.torque_constant_Nm_per_A / (1.5f * pole_pairs);
+
+    // L di/dt = v - R i - (speed voltages)
+    const float denominator = 1.0f + dt_s * R / L;
+    state_.d_A =
+        (state_.d_A + dt_s / L * (v.d + omega_e * L * state_.q_A)) /
+        denominator;
+    state_.q_A =
+        (state_.q_A + dt_s / L *
+         (v.q - omega_e * L * state_.d_A - omega_e * flux_Wb)) /
+        denominator;
+
+    state_.torque_Nm = config_.torque_constant_Nm_per_A * state_.q_A;
+
+    StepMechanics(load_Nm, dt_s);
+  }
+
+  /// Advance by @p dt_s with the phases disconnected, so that no
+  /// current flows.
+  void StepOpen(float load_Nm, float dt_s) {
+    state_.d_A = 0.0f;
+    state_.q_A = 0.0f;
+    state_.torque_Nm = 0.0f;
+
+    StepMechanics(load_Nm, dt_s);
+  }
+
+  PhaseCurrents phase_currents() const {
+    const InverseDqTransform idt(
+        electrical_sin_cos(), state_.d_A, state_.q_A);
+    PhaseCurrents result;
+    result.a = idt.a;
+    result.b = idt.b;
+    result.c = idt.c;
+    return result;
+  }
+
+  SinCos electrical_sin_cos() const {
+    const double electrical =
+        state_.angle_rad * 0.5 * static_cast<double>(config_.poles);
+    const float wrapped = static_cast<float>(
+        electrical - 2.0 * M_PI * std::floor(electrical / (2.0 * M_PI)));
+    SinCos result;
+    result.s = std::sin(wrapped);
+    result.c = std::cos(wrapped);
+    return result;
+  }
+
+  const Config& config() const { return config_; }
+  const State& state() const { return state_; }
+  State* mutable_state() { return &state_; }
+
+ private:
+  void StepMechanics(float load_Nm, float dt_s) {
+    // Coulomb friction can only hold the rotor in place, never drive
+    // it backwards.
+    const float drive_Nm =
+        state_.torque_Nm - load_Nm -
+        config_.viscous_Nm_per_rad_s * state_.velocity_rad_s;
+    const float velocity = state_.velocity_rad_s;
+    float accel = 0.0f;
+    if (velocity != 0.0f) {
+      accel = (drive_Nm - std::copysign(config_.coulomb_Nm, velocity)) /
+          config_.inertia_kgm2;
+    } else if (std::abs(drive_Nm) > config_.coulomb_Nm) {
+      accel = (drive_Nm - std::copysign(config_.coulomb_Nm, drive_Nm)) /
+          config_.inertia_kgm2;
+    }
+
+    float new_velocity = velocity + accel * dt_s;
+    if (velocity != 0.0f && (new_velocity * velocity) < 0.0f &&
+        std::abs(drive_Nm) <= config_.coulomb_Nm) {
+      // Friction brought us to a stop within this step.
+      new_velocity = 0.0f;
+    }
+    state_.angle_rad +=
+        0.5 * static_cast<double>(velocity + new_velocity) *
+        static_cast<double>(dt_s);
+    state_.velocity_rad_s = new_velocity;
+  }
+
+  const Config config_;
+  State state_;
+};
+
+}
@@ -12,12 +12,22 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <cstring>
+
 #include <boost/asio/io_context.hpp>
 
 #include "mjlib/multiplex/multiplex_tool.h"
 
+#include "utils/bus_bench.h"
+
 extern "C" {
 int main(int argc, char** argv) {
+  // "multiplex_tool bench ..." loads the bus with a traffic mix and
+  // reports how it coped, everything else is the stock tool.
+  if (argc > 1 && std::strcmp(argv[1], "bench") == 0) {
+    return moteus::client::BusBenchMain(argc - 1, argv + 1);
+  }
+
   boost::asio::io_context context;
   return mjlib::multiplex::multiplex_main(context, argc, argv);
 }
@@ -20,7 +20,7 @@
 #include "mjlib/base/limit.h"
 #include "mjlib/base/visitor.h"
 
-#include "fw/moteus_hw.h"
+#include "fw/ccm.h"
 
 namespace moteus {
 
@@ -0,0 +1,52 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mjlib/micro/pool_ptr.h"
+
+namespace moteus {
+
+/// A view of a parent pool which counts how much of it has been
+/// allocated through this view.
+///
+/// Handing each subsystem its own arena lets the usage of a single
+/// shared pool be broken down by subsystem.  The count includes any
+/// padding the parent inserted for alignment.
+class PoolArena : public mjlib::micro::Pool {
+ public:
+  /// @param used is incremented by the size of every allocation, and
+  /// must outlive this arena.
+  PoolArena(mjlib::micro::Pool* parent, uint32_t* used)
+      : parent_(parent), used_(used) {}
+
+  void* Allocate(size_t size, size_t alignment) override {
+    const size_t before = parent_->available();
+    void* const result = parent_->Allocate(size, alignment);
+    *used_ += before - parent_->available();
+    return result;
+  }
+
+  size_t size() const override { return parent_->size(); }
+  size_t available() const override { return parent_->available(); }
+
+ private:
+  mjlib::micro::Pool* const parent_;
+  uint32_t* const used_;
+};
+
+}
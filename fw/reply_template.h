@@ -0,0 +1,216 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string_view>
+
+#include "mjlib/base/limit.h"
+#include "mjlib/base/visitor.h"
+
+namespace moteus {
+
+/// A multiplex reply frame whose layout is fixed ahead of time.
+///
+/// Compile() resolves each register of the layout once, writing all
+/// subframe headers and recording where each value lives.  Render()
+/// then only needs to fill in values, and registers which are backed
+/// directly by a float need neither a dispatch on the register number
+/// nor on the resolution.
+class ReplyTemplate {
+ public:
+  static constexpr int kMaxBlocks = 4;
+  static constexpr size_t kMaxSize = 64;
+  static constexpr int kMaxFields = 32;
+
+  /// A contiguous range of registers, encoded as one reply subframe.
+  struct Block {
+    int32_t start = 0;
+    // 0 disables this block.
+    int32_t count = 0;
+    // 0=int8, 1=int16, 2=int32, 3=float
+    int32_t resolution = 1;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(start));
+      a->Visit(MJ_NVP(count));
+      a->Visit(MJ_NVP(resolution));
+    }
+  };
+
+  using Layout = std::array<Block, kMaxBlocks>;
+
+  /// The mode, position, velocity and torque as int16, followed by
+  /// the voltage, temperature and fault as int8.
+  static Layout DefaultLayout() {
+    return {{
+        { 0x000, 4, 1 },
+        { 0x00d, 3, 0 },
+        {}, {},
+      }};
+  }
+
+  /// Describes how the value of a register may be obtained without
+  /// going through the generic register read.
+  struct Source {
+    // If nullptr, the register is read through the fallback passed
+    // to Render().
+    const float* value = nullptr;
+    // The size of one count for the int8, int16, and int32
+    // resolutions.
+    std::array<float, 3> scale = {};
+  };
+
+  /// @p resolve is invoked once per register as `Source(int32_t
+  /// reg)`.  The first block which would exceed kMaxSize, or
+  /// kMaxFields in total, is dropped along with all that follow it.
+  ///
+  /// @p prefix, if non-empty, is placed verbatim ahead of the
+  /// subframes.
+  template <typename Resolver>
+  void Compile(const Layout& layout, Resolver resolve,
+               std::string_view prefix = {}) {
+    size_ = 0;
+    field_count_ = 0;
+
+    if (prefix.size() < kMaxSize) {
+      std::memcpy(&frame_[0], prefix.data(), prefix.size());
+      size_ = prefix.size();
+    }
+
+    for (const auto& block : layout) {
+      if (block.count <= 0 || block.start < 0) { continue; }
+      const int resolution = mjlib::base::Limit<int32_t>(
+          block.resolution, 0, 3);
+      const size_t value_size = ValueSize(resolution);
+
+      char header[12] = {};
+      size_t header_size = 0;
+      if (block.count <= 3) {
+        header[header_size++] = 0x20 | (resolution << 2) | block.count;
+      } else {
+        header[header_size++] = 0x20 | (resolution << 2);
+        header_size += WriteVaruint(block.count, &header[header_size]);
+      }
+      header_size += WriteVaruint(block.start, &header[header_size]);
+
+      if (size_ + header_size + block.count * value_size > kMaxSize ||
+          field_count_ + block.count > kMaxFields) {
+        break;
+      }
+
+      std::memcpy(&frame_[size_], header, header_size);
+      size_ += header_size;
+
+      for (int32_t i = 0; i < block.count; i++) {
+        auto& field = fields_[field_count_++];
+        const int32_t reg = block.start + i;
+        const Source source = resolve(reg);
+
+        field.reg = reg;
+        field.offset = size_;
+        field.resolution = resolution;
+        field.value = source.value;
+        field.scale = (resolution < 3) ? source.scale[resolution] : 1.0f;
+
+        size_ += value_size;
+      }
+    }
+
+    // A prefix alone is not worth sending.
+    if (field_count_ == 0) { size_ = 0; }
+  }
+
+  /// Fill in the current value of every field and return the frame.
+  ///
+  /// @p fallback is invoked as `void(int32_t reg, int resolution,
+  /// char* dest)` for registers without a direct source, and must
+  /// write exactly the number of bytes for that resolution.
+  template <typename Fallback>
+  std::string_view Render(Fallback fallback) {
+    for (int i = 0; i < field_count_; i++) {
+      const auto& field = fields_[i];
+      char* const dest = &frame_[field.offset];
+      if (!field.value) {
+        fallback(field.reg, field.resolution, dest);
+        continue;
+      }
+
+      const float value = *field.value;
+      switch (field.resolution) {
+        case 0: { Saturate<int8_t>(value, field.scale, dest); break; }
+        case 1: { Saturate<int16_t>(value, field.scale, dest); break; }
+        case 2: { Saturate<int32_t>(value, field.scale, dest); break; }
+        case 3: { std::memcpy(dest, &value, sizeof(value)); break; }
+      }
+    }
+    return std::string_view(frame_, size_);
+  }
+
+  size_t size() const { return size_; }
+  int field_count() const { return field_count_; }
+
+  static size_t ValueSize(int resolution) {
+    return (resolution == 0) ? 1 : (resolution == 1) ? 2 : 4;
+  }
+
+ private:
+  struct Field {
+    const float* value = nullptr;
+    float scale = 1.0f;
+    int32_t reg = 0;
+    uint8_t offset = 0;
+    uint8_t resolution = 0;
+  };
+
+  template <typename T>
+  static void Saturate(float value, float scale, char* dest) {
+    // This matches the encoding of the generic register read: the
+    // minimum value is reserved for NaN, and everything else is
+    // limited to +- max.  The comparisons are made in float, as the
+    // int32 maximum is not representable there.
+    constexpr T max = std::numeric_limits<T>::max();
+    constexpr float float_max = static_cast<float>(max);
+    const float scaled = value / scale;
+    const T result =
+        !std::isfinite(value) ? std::numeric_limits<T>::min() :
+        (scaled >= float_max) ? max :
+        (scaled <= -float_max) ? static_cast<T>(-max) :
+        static_cast<T>(scaled);
+    std::memcpy(dest, &result, sizeof(result));
+  }
+
+  static size_t WriteVaruint(uint32_t value, char* data) {
+    size_t size = 0;
+    do {
+      data[size] = (value & 0x7f) | ((value > 0x7f) ? 0x80 : 0x00);
+      value >>= 7;
+      size++;
+    } while (value);
+    return size;
+  }
+
+  char frame_[kMaxSize] = {};
+  size_t size_ = 0;
+  std::array<Field, kMaxFields> fields_ = {};
+  int field_count_ = 0;
+};
+
+}
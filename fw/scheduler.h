@@ -0,0 +1,170 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "mjlib/base/assert.h"
+#include "mjlib/base/inplace_function.h"
+#include "mjlib/base/visitor.h"
+
+namespace moteus {
+
+/// A cooperative scheduler for the main loop.
+///
+/// Pollers run on every pass, in the order they were added, and are
+/// intended for latency sensitive work like servicing the CAN bus.
+/// Periodic tasks become pending once their period has elapsed, and
+/// are then run in the order they were added for as long as the pass
+/// remains within its budget.  Any which do not fit stay pending for
+/// the next pass, so that a slow task delays the others rather than
+/// the pollers.  At least one pending task is run on every pass, so
+/// that none can be starved.
+template <int MaxTasks>
+class Scheduler {
+ public:
+  using Function = mjlib::base::inplace_function<void()>;
+
+  struct TaskStats {
+    uint32_t runs = 0;
+    uint32_t last_us = 0;
+    uint32_t max_us = 0;
+    // The free running sum of last_us.
+    uint32_t total_us = 0;
+    // The number of passes in which this task was pending but did not
+    // fit in the budget.
+    uint32_t deferred = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(runs));
+      a->Visit(MJ_NVP(last_us));
+      a->Visit(MJ_NVP(max_us));
+      a->Visit(MJ_NVP(total_us));
+      a->Visit(MJ_NVP(deferred));
+    }
+  };
+
+  struct Stats {
+    uint32_t passes = 0;
+    uint32_t pass_max_us = 0;
+    std::array<TaskStats, MaxTasks> tasks = {};
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(passes));
+      a->Visit(MJ_NVP(pass_max_us));
+      a->Visit(MJ_NVP(tasks));
+    }
+  };
+
+  /// @param budget_us once a pass has run for this long, no further
+  /// periodic tasks are started in it.
+  Scheduler(uint32_t budget_us) : budget_us_(budget_us) {}
+
+  /// @return the index of the task in Stats::tasks
+  int AddPoller(Function function) {
+    return Add(0, function);
+  }
+
+  int AddPeriodic(uint32_t period_us, Function function) {
+    return Add(period_us, function);
+  }
+
+  /// Run one pass.  @p clock is invoked as `uint32_t()` and must
+  /// return a free running microsecond count.
+  template <typename Clock>
+  void Run(Clock clock) {
+    const uint32_t start = clock();
+    uint32_t now = start;
+
+    for (int i = 0; i < task_count_; i++) {
+      auto& task = tasks_[i];
+      if (task.period_us != 0) { continue; }
+      now = RunTask(i, now, clock);
+    }
+
+    bool ran_periodic = false;
+    bool out_of_budget = false;
+    for (int i = 0; i < task_count_; i++) {
+      auto& task = tasks_[i];
+      if (task.period_us == 0) { continue; }
+      if (!task.pending) {
+        if (static_cast<int32_t>(start - task.next_us) < 0) { continue; }
+        task.pending = true;
+        task.next_us += task.period_us;
+        // If we have fallen more than a period behind, do not try to
+        // catch up.
+        if (static_cast<int32_t>(start - task.next_us) >= 0) {
+          task.next_us = start + task.period_us;
+        }
+      }
+
+      if (ran_periodic && (now - start) >= budget_us_) {
+        out_of_budget = true;
+      }
+      if (out_of_budget) {
+        stats_.tasks[i].deferred++;
+        continue;
+      }
+
+      task.pending = false;
+      ran_periodic = true;
+      now = RunTask(i, now, clock);
+    }
+
+    stats_.passes++;
+    const uint32_t pass_us = now - start;
+    if (pass_us > stats_.pass_max_us) { stats_.pass_max_us = pass_us; }
+  }
+
+  Stats* stats() { return &stats_; }
+
+ private:
+  struct Task {
+    Function function;
+    uint32_t period_us = 0;
+    uint32_t next_us = 0;
+    bool pending = false;
+  };
+
+  int Add(uint32_t period_us, Function function) {
+    MJ_ASSERT(task_count_ < MaxTasks);
+    auto& task = tasks_[task_count_];
+    task.function = function;
+    task.period_us = period_us;
+    return task_count_++;
+  }
+
+  template <typename Clock>
+  uint32_t RunTask(int index, uint32_t start, Clock& clock) {
+    tasks_[index].function();
+    const uint32_t end = clock();
+    auto& stats = stats_.tasks[index];
+    stats.runs++;
+    stats.last_us = end - start;
+    if (stats.last_us > stats.max_us) { stats.max_us = stats.last_us; }
+    stats.total_us += stats.last_us;
+    return end;
+  }
+
+  const uint32_t budget_us_;
+  std::array<Task, MaxTasks> tasks_ = {};
+  int task_count_ = 0;
+  Stats stats_;
+};
+
+}
@@ -0,0 +1,217 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace moteus {
+
+/// A triggered capture of up to kMaxChannels signals, sampled from
+/// the control ISR into a caller provided ring buffer.
+///
+/// Recording starts as soon as the scope is armed, so that samples
+/// from before the trigger are available.  Once the trigger
+/// condition is met, post_trigger further samples are recorded and
+/// the capture is then frozen until it is re-armed.
+///
+/// Arm and Stop are called from the main loop, ISR_Sample from the
+/// ISR.  The capture may only be read once state() is kComplete or
+/// kIdle.
+class Scope {
+ public:
+  static constexpr int kMaxChannels = 4;
+
+  enum Trigger : uint8_t {
+    kNow,
+    kFault,
+    kModeChange,
+    kCommand,
+    kRising,
+    kFalling,
+  };
+
+  enum State : uint8_t {
+    kIdle,
+    kArmed,
+    kTriggered,
+    kComplete,
+  };
+
+  enum Event : uint8_t {
+    kEventFault = 1,
+    kEventModeChange = 2,
+    kEventCommand = 4,
+  };
+
+  struct Options {
+    uint8_t channels = 1;
+    // Opaque identifiers, passed back to the ISR_Sample getter.
+    std::array<uint8_t, kMaxChannels> signals = {};
+
+    Trigger trigger = kNow;
+    // For kRising and kFalling, the level the first channel must
+    // cross.
+    float level = 0.0f;
+
+    // Record one sample every this many calls to ISR_Sample.
+    uint16_t decimation = 1;
+
+    // The number of samples to record after the trigger, including
+    // the triggering sample.  This is limited to the capacity of the
+    // buffer.
+    uint16_t post_trigger = 0;
+  };
+
+  Scope(float* buffer, int size) : buffer_(buffer), size_(size) {}
+
+  void Arm(const Options& options) {
+    state_ = kIdle;
+    // The ISR must observe the idle state before anything else is
+    // changed, and everything else before the armed state.
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+
+    options_ = options;
+    options_.channels = std::max<uint8_t>(
+        1, std::min<uint8_t>(kMaxChannels, options_.channels));
+    options_.decimation = std::max<uint16_t>(1, options_.decimation);
+    frames_ = size_ / options_.channels;
+    options_.post_trigger = std::max<uint16_t>(
+        1, std::min<int>(frames_, options_.post_trigger));
+
+    write_frame_ = 0;
+    valid_frames_ = 0;
+    remaining_ = 0;
+    decimate_count_ = 0;
+    pending_events_ = 0;
+    have_last_ = false;
+
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    state_ = kArmed;
+  }
+
+  void Stop() {
+    state_ = kIdle;
+  }
+
+  /// Record the current value of each channel if a sample is due.
+  /// @p get_signal is invoked with a signal identifier, and must
+  /// return its present value.
+  template <typename Getter>
+  void ISR_Sample(uint8_t events, Getter get_signal) {
+    if (state_ != kArmed && state_ != kTriggered) { return; }
+
+    // Events are latched until the next recorded sample so that they
+    // are not lost to decimation.
+    pending_events_ |= events;
+
+    decimate_count_++;
+    if (decimate_count_ < options_.decimation) { return; }
+    decimate_count_ = 0;
+
+    float* const frame = &buffer_[write_frame_ * options_.channels];
+    for (int i = 0; i < options_.channels; i++) {
+      frame[i] = get_signal(options_.signals[i]);
+    }
+    write_frame_++;
+    if (write_frame_ >= frames_) { write_frame_ = 0; }
+    if (valid_frames_ < frames_) { valid_frames_++; }
+
+    const float value = frame[0];
+    const uint8_t this_events = pending_events_;
+    pending_events_ = 0;
+
+    if (state_ == kArmed) {
+      if (IsTriggered(value, this_events)) {
+        state_ = kTriggered;
+        remaining_ = options_.post_trigger;
+      }
+      last_value_ = value;
+      have_last_ = true;
+    }
+
+    if (state_ == kTriggered) {
+      remaining_--;
+      if (remaining_ == 0) {
+        state_ = kComplete;
+      }
+    }
+  }
+
+  State state() const { return state_; }
+  const Options& options() const { return options_; }
+
+  /// The number of recorded samples per channel.
+  int frames() const { return valid_frames_; }
+
+  /// The index of the triggering sample, as passed to value(), once
+  /// the capture is complete.
+  int trigger_frame() const {
+    return valid_frames_ - options_.post_trigger;
+  }
+
+  /// Return the given recorded sample, where 0 is the oldest.
+  float value(int frame, int channel) const {
+    int index = write_frame_ - valid_frames_ + frame;
+    if (index < 0) { index += frames_; }
+    return buffer_[index * options_.channels + channel];
+  }
+
+ private:
+  bool IsTriggered(float value, uint8_t events) const {
+    switch (options_.trigger) {
+      case kNow: {
+        return true;
+      }
+      case kFault: {
+        return (events & kEventFault) != 0;
+      }
+      case kModeChange: {
+        return (events & kEventModeChange) != 0;
+      }
+      case kCommand: {
+        return (events & kEventCommand) != 0;
+      }
+      case kRising: {
+        return have_last_ && last_value_ < options_.level &&
+            value >= options_.level;
+      }
+      case kFalling: {
+        return have_last_ && last_value_ > options_.level &&
+            value <= options_.level;
+      }
+    }
+    return false;
+  }
+
+  float* const buffer_;
+  const int size_;
+
+  volatile State state_ = kIdle;
+  Options options_;
+
+  int frames_ = 0;
+  int write_frame_ = 0;
+  int valid_frames_ = 0;
+  int remaining_ = 0;
+  uint16_t decimate_count_ = 0;
+  uint8_t pending_events_ = 0;
+  bool have_last_ = false;
+  float last_value_ = 0.0f;
+};
+
+}
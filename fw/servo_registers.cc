@@ -0,0 +1,553 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/servo_registers.h"
+
+#include <cmath>
+#include <limits>
+#include <optional>
+
+#include "mjlib/base/assert.h"
+#include "mjlib/base/limit.h"
+
+#include "fw/math.h"
+
+using mjlib::base::Limit;
+
+namespace moteus {
+
+using Value = ServoRegisters::Value;
+
+namespace {
+template <typename T>
+Value ScaleSaturate(float value, float scale) {
+  if (!std::isfinite(value)) {
+    return std::numeric_limits<T>::min();
+  }
+
+  const float scaled = value / scale;
+  const auto max = std::numeric_limits<T>::max();
+  // We purposefully limit to +- max, rather than to min.  The minimum
+  // value for our two's complement types is reserved for NaN.
+  return Limit<T>(static_cast<T>(scaled), -max, max);
+}
+
+constexpr ServoRegisters::Scaling kPositionScale = { 0.01f, 0.0001f, 0.00001f };
+constexpr ServoRegisters::Scaling kVelocityScale = { 0.1f, 0.00025f, 0.00001f };
+constexpr ServoRegisters::Scaling kTorqueScale = { 0.5f, 0.01f, 0.001f };
+constexpr ServoRegisters::Scaling kCurrentScale = { 1.0f, 0.1f, 0.001f };
+constexpr ServoRegisters::Scaling kVoltageScale = { 0.5f, 0.1f, 0.001f };
+constexpr ServoRegisters::Scaling kTemperatureScale = { 1.0f, 0.1f, 0.001f };
+constexpr ServoRegisters::Scaling kTimeScale = { 0.01f, 0.001f, 0.000001f };
+constexpr ServoRegisters::Scaling kPwmScale = {
+  1.0f / 127.0f, 1.0f / 32767.0f, 1.0f / 2147483647.0f };
+
+Value ScaleMapping(float value, const ServoRegisters::Scaling& scaling, size_t type) {
+  switch (type) {
+    case 0: return ScaleSaturate<int8_t>(value, scaling.int8);
+    case 1: return ScaleSaturate<int16_t>(value, scaling.int16);
+    case 2: return ScaleSaturate<int32_t>(value, scaling.int32);
+    case 3: return Value(value);
+  }
+  MJ_ASSERT(false);
+  return Value(static_cast<int8_t>(0));
+}
+
+int8_t ReadIntMapping(Value value) {
+  return std::visit([](auto a) {
+      return static_cast<int8_t>(a);
+    }, value);
+}
+
+// Return an integer value shifted so that its most significant bit
+// is bit 31, or an empty optional for floats.
+std::optional<uint32_t> ReadLeftAlignedInt(Value value) {
+  switch (value.index()) {
+    case 0: return static_cast<uint32_t>(std::get<int8_t>(value)) << 24;
+    case 1: return static_cast<uint32_t>(std::get<int16_t>(value)) << 16;
+    case 2: return static_cast<uint32_t>(std::get<int32_t>(value));
+  }
+  return {};
+}
+
+struct ValueScaler {
+  const ServoRegisters::Scaling& scaling;
+
+  float operator()(int8_t value) const {
+    if (value == std::numeric_limits<int8_t>::min()) {
+      return std::numeric_limits<float>::quiet_NaN();
+    }
+    return value * scaling.int8;
+  }
+
+  float operator()(int16_t value) const {
+    if (value == std::numeric_limits<int16_t>::min()) {
+      return std::numeric_limits<float>::quiet_NaN();
+    }
+    return value * scaling.int16;
+  }
+
+  float operator()(int32_t value) const {
+    if (value == std::numeric_limits<int32_t>::min()) {
+      return std::numeric_limits<float>::quiet_NaN();
+    }
+    return value * scaling.int32;
+  }
+
+  float operator()(float value) const {
+    return value;
+  }
+};
+
+float ReadScaleMapping(Value value, const ServoRegisters::Scaling& scaling) {
+  return std::visit(ValueScaler{scaling}, value);
+}
+}
+
+void ServoRegisters::SetScale(const RegisterScaleConfig& c) {
+  const auto scale = [](const Scaling& base, float multiplier) {
+    // Anything unusable leaves the default in place.
+    const float m =
+        (std::isfinite(multiplier) && multiplier > 0.0f) ? multiplier : 1.0f;
+    return Scaling{base.int8 * m, base.int16 * m, base.int32 * m};
+  };
+  position_scale_ = scale(kPositionScale, c.position);
+  velocity_scale_ = scale(kVelocityScale, c.velocity);
+  torque_scale_ = scale(kTorqueScale, c.torque);
+  current_scale_ = scale(kCurrentScale, c.current);
+  voltage_scale_ = scale(kVoltageScale, c.voltage);
+  temperature_scale_ = scale(kTemperatureScale, c.temperature);
+  time_scale_ = scale(kTimeScale, c.time);
+}
+
+Value ServoRegisters::IntMapping(int32_t value, size_t type) {
+  switch (type) {
+    case 0: return static_cast<int8_t>(value);
+    case 1: return static_cast<int16_t>(value);
+    case 2: return static_cast<int32_t>(value);
+    case 3: return static_cast<float>(value);
+  }
+  MJ_ASSERT(false);
+  return static_cast<int8_t>(0);
+}
+
+__attribute__ ((optimize("O3")))
+uint32_t ServoRegisters::Write(uint32_t reg, const Value& value) {
+  switch (static_cast<Register>(reg)) {
+    case Register::kMode: {
+      const auto new_mode_int = ReadIntMapping(value);
+      if (new_mode_int > static_cast<int8_t>(kNumModes)) {
+        return 3;
+      }
+      command_valid_ = true;
+      const auto new_mode = static_cast<BldcServoMode>(new_mode_int);
+      command_ = {};
+      command_.mode = new_mode;
+      return 0;
+    }
+
+    case Register::kPwmPhaseA: {
+      command_.pwm.a = ReadPwm(value);
+      return 0;
+    }
+    case Register::kPwmPhaseB: {
+      command_.pwm.b = ReadPwm(value);
+      return 0;
+    }
+    case Register::kPwmPhaseC: {
+      command_.pwm.c = ReadPwm(value);
+      return 0;
+    }
+    case Register::kVoltagePhaseA: {
+      command_.phase_v.a = ReadVoltage(value);
+      return 0;
+    }
+    case Register::kVoltagePhaseB: {
+      command_.phase_v.b = ReadVoltage(value);
+      return 0;
+    }
+    case Register::kVoltagePhaseC: {
+      command_.phase_v.c = ReadVoltage(value);
+      return 0;
+    }
+    case Register::kVFocTheta: {
+      command_.theta = ReadPwm(value) * kPi;
+      return 0;
+    }
+    case Register::kVFocVoltage: {
+      command_.voltage = ReadVoltage(value);
+      return 0;
+    }
+    case Register::kVoltageDqD: {
+      command_.d_V = ReadVoltage(value);
+      return 0;
+    }
+    case Register::kVoltageDqQ: {
+      command_.q_V = ReadVoltage(value);
+      return 0;
+    }
+    case Register::kCommandQCurrent: {
+      command_.i_q_A = ReadCurrent(value);
+      return 0;
+    }
+    case Register::kCommandDCurrent: {
+      command_.i_d_A = ReadCurrent(value);
+      return 0;
+    }
+    case Register::kCommandPosition: {
+      command_.position = ReadPosition(value);
+      return 0;
+    }
+    case Register::kCommandVelocity: {
+      command_.velocity = ReadVelocity(value);
+      return 0;
+    }
+    case Register::kCommandPositionMaxTorque:
+    case Register::kStayWithinMaxTorque: {
+      command_.max_torque_Nm = ReadTorque(value);
+      return 0;
+    }
+    case Register::kCommandStopPosition: {
+      command_.stop_position = ReadPosition(value);
+      return 0;
+    }
+    case Register::kCommandTimeout:
+    case Register::kStayWithinTimeout: {
+      command_.timeout_s = ReadTime(value);
+      return 0;
+    }
+    case Register::kCommandTimestamp: {
+      const auto timestamp = ReadLeftAlignedInt(value);
+      if (!timestamp) { return 3; }
+      command_.host_timestamp = timestamp;
+      return 0;
+    }
+    case Register::kCommandFeedforwardTorque:
+    case Register::kStayWithinFeedforward: {
+      command_.feedforward_Nm = ReadTorque(value);
+      return 0;
+    }
+    case Register::kCommandKpScale:
+    case Register::kStayWithinKpScale: {
+      command_.kp_scale = ReadPwm(value);
+      return 0;
+    }
+    case Register::kCommandKdScale:
+    case Register::kStayWithinKdScale: {
+      command_.kd_scale = ReadPwm(value);
+      return 0;
+    }
+    case Register::kStayWithinLower: {
+      command_.bounds_min = ReadPosition(value);
+      return 0;
+    }
+    case Register::kStayWithinUpper: {
+      command_.bounds_max = ReadPosition(value);
+      return 0;
+    }
+
+    case Register::kRezero: {
+      // As for a mode change, this starts a new command, so nothing
+      // from a previous one, like its host timestamp, carries over.
+      command_ = {};
+      command_.rezero_position = ReadPosition(value);
+      command_.mode = kStopped;
+      command_valid_ = true;
+      return 0;
+    }
+
+    case Register::kPosition:
+    case Register::kVelocity:
+    case Register::kTemperature:
+    case Register::kQCurrent:
+    case Register::kDCurrent:
+    case Register::kRezeroState:
+    case Register::kVoltage:
+    case Register::kTorque:
+    case Register::kFault:
+    case Register::kPositionKp:
+    case Register::kPositionKi:
+    case Register::kPositionKd:
+    case Register::kPositionFeedforward:
+    case Register::kPositionCommandTorque: {
+      // Not writeable
+      return 2;
+    }
+
+    case Register::kCommandApplyTime:
+    case Register::kModelNumber:
+    case Register::kFirmwareVersion:
+    case Register::kRegisterMapVersion:
+    case Register::kMultiplexId:
+    case Register::kSerialNumber1:
+    case Register::kSerialNumber2:
+    case Register::kSerialNumber3: {
+      // These belong to the controller as a whole.
+      break;
+    }
+  }
+
+  // If we got here, then we had an unknown register.
+  return 1;
+}
+
+__attribute__ ((optimize("O3")))
+ServoRegisters::ReadResult ServoRegisters::Read(
+    uint32_t reg, size_t type) const {
+  switch (static_cast<Register>(reg)) {
+    case Register::kMode: {
+      return IntMapping(status_->mode, type);
+    }
+    case Register::kPosition: {
+      return ScalePosition(status_->unwrapped_position, type);
+    }
+    case Register::kVelocity: {
+      return ScaleVelocity(status_->velocity, type);
+    }
+    case Register::kTemperature: {
+      return ScaleTemperature(status_->fet_temp_C, type);
+    }
+    case Register::kQCurrent: {
+      return ScaleCurrent(status_->q_A, type);
+    }
+    case Register::kDCurrent: {
+      return ScaleCurrent(status_->d_A, type);
+    }
+    case Register::kRezeroState: {
+      return IntMapping(status_->rezeroed ? 1 : 0, type);
+    }
+    case Register::kVoltage: {
+      return ScaleVoltage(status_->bus_V, type);
+    }
+    case Register::kTorque: {
+      return ScaleTorque(status_->torque_Nm, type);
+    }
+    case Register::kFault: {
+      return IntMapping(static_cast<int32_t>(status_->fault), type);
+    }
+
+    case Register::kPwmPhaseA: {
+      return ScalePwm(command_.pwm.a, type);
+    }
+    case Register::kPwmPhaseB: {
+      return ScalePwm(command_.pwm.b, type);
+    }
+    case Register::kPwmPhaseC: {
+      return ScalePwm(command_.pwm.c, type);
+    }
+    case Register::kVoltagePhaseA: {
+      return ScaleVoltage(command_.phase_v.a, type);
+    }
+    case Register::kVoltagePhaseB: {
+      return ScaleVoltage(command_.phase_v.b, type);
+    }
+    case Register::kVoltagePhaseC: {
+      return ScaleVoltage(command_.phase_v.c, type);
+    }
+    case Register::kVFocTheta: {
+      return ScalePwm(command_.theta / kPi, type);
+    }
+    case Register::kVFocVoltage: {
+      return ScaleVoltage(command_.voltage, type);
+    }
+    case Register::kVoltageDqD: {
+      return ScaleVoltage(command_.d_V, type);
+    }
+    case Register::kVoltageDqQ: {
+      return ScaleVoltage(command_.q_V, type);
+    }
+    case Register::kCommandQCurrent: {
+      return ScaleCurrent(command_.i_q_A, type);
+    }
+    case Register::kCommandDCurrent: {
+      return ScaleCurrent(command_.i_d_A, type);
+    }
+    case Register::kCommandPosition: {
+      return ScalePosition(command_.position, type);
+    }
+    case Register::kCommandVelocity: {
+      return ScaleVelocity(command_.velocity, type);
+    }
+    case Register::kCommandPositionMaxTorque:
+    case Register::kStayWithinMaxTorque: {
+      return ScaleTorque(command_.max_torque_Nm, type);
+    }
+    case Register::kCommandStopPosition: {
+      return ScalePosition(command_.stop_position, type);
+    }
+    case Register::kCommandTimeout:
+    case Register::kStayWithinTimeout: {
+      return ScaleTime(command_.timeout_s, type);
+    }
+    case Register::kCommandTimestamp: {
+      const uint32_t timestamp = command_.host_timestamp.value_or(0);
+      switch (type) {
+        case 0: return IntMapping(static_cast<int32_t>(timestamp) >> 24, type);
+        case 1: return IntMapping(static_cast<int32_t>(timestamp) >> 16, type);
+      }
+      return IntMapping(static_cast<int32_t>(timestamp), type);
+    }
+    case Register::kCommandFeedforwardTorque:
+    case Register::kStayWithinFeedforward: {
+      return ScaleTorque(command_.feedforward_Nm, type);
+    }
+    case Register::kCommandKpScale:
+    case Register::kStayWithinKpScale: {
+      return ScalePwm(command_.kp_scale, type);
+    }
+    case Register::kCommandKdScale:
+    case Register::kStayWithinKdScale: {
+      return ScalePwm(command_.kd_scale, type);
+    }
+
+    case Register::kPositionKp: {
+      return ScaleTorque(status_->pid_position.p, type);
+    }
+    case Register::kPositionKi: {
+      return ScaleTorque(status_->pid_position.integral, type);
+    }
+    case Register::kPositionKd: {
+      return ScaleTorque(status_->pid_position.d, type);
+    }
+    case Register::kPositionFeedforward: {
+      return ScaleTorque(command_.feedforward_Nm, type);
+    }
+    case Register::kPositionCommandTorque: {
+      return ScaleTorque(control_->torque_Nm, type);
+    }
+
+    case Register::kStayWithinLower: {
+      return ScalePosition(command_.bounds_min, type);
+    }
+    case Register::kStayWithinUpper: {
+      return ScalePosition(command_.bounds_max, type);
+    }
+
+    case Register::kCommandApplyTime:
+    case Register::kModelNumber:
+    case Register::kFirmwareVersion:
+    case Register::kRegisterMapVersion:
+    case Register::kMultiplexId:
+    case Register::kSerialNumber1:
+    case Register::kSerialNumber2:
+    case Register::kSerialNumber3:
+    case Register::kRezero: {
+      // These belong to the controller as a whole, or cannot be
+      // read.
+      break;
+    }
+  }
+
+  // If we made it here, then we had an unknown register.
+  return static_cast<uint32_t>(1);
+}
+
+ReplyTemplate::Source ServoRegisters::ResolveSource(int32_t reg) const {
+  auto make = [](const float* value, const Scaling& scale) {
+    ReplyTemplate::Source result;
+    result.value = value;
+    result.scale = {{scale.int8, scale.int16, scale.int32}};
+    return result;
+  };
+
+  switch (static_cast<Register>(reg)) {
+    case Register::kPosition: {
+      return make(&status_->unwrapped_position, position_scale_);
+    }
+    case Register::kVelocity: {
+      return make(&status_->velocity, velocity_scale_);
+    }
+    case Register::kTemperature: {
+      return make(&status_->fet_temp_C, temperature_scale_);
+    }
+    case Register::kQCurrent: {
+      return make(&status_->q_A, current_scale_);
+    }
+    case Register::kDCurrent: {
+      return make(&status_->d_A, current_scale_);
+    }
+    case Register::kVoltage: {
+      return make(&status_->bus_V, voltage_scale_);
+    }
+    case Register::kTorque: {
+      return make(&status_->torque_Nm, torque_scale_);
+    }
+    default: {
+      break;
+    }
+  }
+  return {};
+}
+
+Value ServoRegisters::ScalePosition(float value, size_t type) const {
+  return ScaleMapping(value, position_scale_, type);
+}
+
+Value ServoRegisters::ScaleVelocity(float value, size_t type) const {
+  return ScaleMapping(value, velocity_scale_, type);
+}
+
+Value ServoRegisters::ScaleTemperature(float value, size_t type) const {
+  return ScaleMapping(value, temperature_scale_, type);
+}
+
+Value ServoRegisters::ScalePwm(float value, size_t type) const {
+  return ScaleMapping(value, kPwmScale, type);
+}
+
+Value ServoRegisters::ScaleCurrent(float value, size_t type) const {
+  return ScaleMapping(value, current_scale_, type);
+}
+
+Value ServoRegisters::ScaleVoltage(float value, size_t type) const {
+  return ScaleMapping(value, voltage_scale_, type);
+}
+
+Value ServoRegisters::ScaleTorque(float value, size_t type) const {
+  return ScaleMapping(value, torque_scale_, type);
+}
+
+Value ServoRegisters::ScaleTime(float value, size_t type) const {
+  return ScaleMapping(value, time_scale_, type);
+}
+
+float ServoRegisters::ReadPwm(const Value& value) const {
+  return ReadScaleMapping(value, kPwmScale);
+}
+
+float ServoRegisters::ReadVoltage(const Value& value) const {
+  return ReadScaleMapping(value, voltage_scale_);
+}
+
+float ServoRegisters::ReadPosition(const Value& value) const {
+  return ReadScaleMapping(value, position_scale_);
+}
+
+float ServoRegisters::ReadVelocity(const Value& value) const {
+  return ReadScaleMapping(value, velocity_scale_);
+}
+
+float ServoRegisters::ReadCurrent(const Value& value) const {
+  return ReadScaleMapping(value, current_scale_);
+}
+
+float ServoRegisters::ReadTorque(const Value& value) const {
+  return ReadScaleMapping(value, torque_scale_);
+}
+
+float ServoRegisters::ReadTime(const Value& value) const {
+  return ReadScaleMapping(value, time_scale_);
+}
+
+}
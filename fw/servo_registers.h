@@ -0,0 +1,205 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <variant>
+
+#include "mjlib/base/visitor.h"
+
+#include "fw/bldc_servo_structs.h"
+#include "fw/reply_template.h"
+
+namespace moteus {
+
+enum class Register {
+  kMode = 0x000,
+  kPosition = 0x001,
+  kVelocity = 0x002,
+  kTorque = 0x003,
+  kQCurrent = 0x004,
+  kDCurrent = 0x005,
+
+  kRezeroState = 0x00c,
+  kVoltage = 0x00d,
+  kTemperature = 0x00e,
+  kFault = 0x00f,
+
+  kPwmPhaseA = 0x010,
+  kPwmPhaseB = 0x011,
+  kPwmPhaseC = 0x012,
+
+  kVoltagePhaseA = 0x014,
+  kVoltagePhaseB = 0x015,
+  kVoltagePhaseC = 0x016,
+
+  kVFocTheta = 0x018,
+  kVFocVoltage = 0x019,
+  kVoltageDqD = 0x01a,
+  kVoltageDqQ = 0x01b,
+
+  kCommandQCurrent = 0x01c,
+  kCommandDCurrent = 0x01d,
+
+  kCommandPosition = 0x020,
+  kCommandVelocity = 0x021,
+  kCommandFeedforwardTorque = 0x022,
+  kCommandKpScale = 0x023,
+  kCommandKdScale = 0x024,
+  kCommandPositionMaxTorque = 0x025,
+  kCommandStopPosition = 0x026,
+  kCommandTimeout = 0x027,
+  kCommandTimestamp = 0x028,
+  kCommandApplyTime = 0x029,
+
+  kPositionKp = 0x030,
+  kPositionKi = 0x031,
+  kPositionKd = 0x032,
+  kPositionFeedforward = 0x033,
+  kPositionCommandTorque = 0x034,
+
+  kStayWithinLower = 0x040,
+  kStayWithinUpper = 0x041,
+  kStayWithinFeedforward = 0x042,
+  kStayWithinKpScale = 0x043,
+  kStayWithinKdScale = 0x044,
+  kStayWithinMaxTorque = 0x045,
+  kStayWithinTimeout = 0x046,
+
+  kModelNumber = 0x100,
+  kFirmwareVersion = 0x101,
+  kRegisterMapVersion = 0x102,
+  kMultiplexId = 0x110,
+
+  kSerialNumber1 = 0x120,
+  kSerialNumber2 = 0x121,
+  kSerialNumber3 = 0x122,
+
+  kRezero = 0x130,
+};
+
+/// Multiplies the value of one integer LSB for each kind of
+/// register, trading resolution for range.  For instance, a position
+/// of 10 makes an int16 position cover +-32.767 revolutions in steps
+/// of 0.001, so that it need not be sent as an int32 or float.
+/// Clients must be configured with the same values.  Float registers
+/// are unaffected.
+struct RegisterScaleConfig {
+  float position = 1.0f;
+  float velocity = 1.0f;
+  float torque = 1.0f;
+  float current = 1.0f;
+  float voltage = 1.0f;
+  float temperature = 1.0f;
+  float time = 1.0f;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(position));
+    a->Visit(MJ_NVP(velocity));
+    a->Visit(MJ_NVP(torque));
+    a->Visit(MJ_NVP(current));
+    a->Visit(MJ_NVP(voltage));
+    a->Visit(MJ_NVP(temperature));
+    a->Visit(MJ_NVP(time));
+  }
+};
+
+/// Maps the servo registers onto a BldcServo's status and control
+/// outputs, and assembles written registers into a command.
+///
+/// This is the part of the register map which depends only upon the
+/// servo, so that ServoSim may answer exactly as MoteusController
+/// does.  Registers which need the rest of the controller, like the
+/// firmware version or the clock synchronization, are left to the
+/// caller, and are reported here as unknown.
+class ServoRegisters {
+ public:
+  // These are the same as those of mjlib::multiplex::MicroServer.
+  using Value = std::variant<int8_t, int16_t, int32_t, float>;
+  using ReadResult = std::variant<Value, uint32_t>;
+
+  /// The value of one LSB at each integer resolution.
+  struct Scaling {
+    float int8;
+    float int16;
+    float int32;
+  };
+
+  ServoRegisters(const BldcServoStatus* status,
+                 const BldcServoControl* control)
+      : status_(status), control_(control) {
+    SetScale({});
+  }
+
+  void SetScale(const RegisterScaleConfig&);
+
+  /// @return 0 on success, or a multiplex error number
+  uint32_t Write(uint32_t reg, const Value& value);
+
+  ReadResult Read(uint32_t reg, size_t type) const;
+
+  /// Return the backing value of registers which are a plain scaled
+  /// float, so that templates can skip the generic Read().
+  ReplyTemplate::Source ResolveSource(int32_t reg) const;
+
+  /// The command assembled from the registers written so far.
+  const BldcServoCommandData& command() const { return command_; }
+  BldcServoCommandData* mutable_command() { return &command_; }
+
+  /// True once a mode or rezero write has started a new command,
+  /// until cleared.
+  bool command_valid() const { return command_valid_; }
+  void clear_command_valid() { command_valid_ = false; }
+
+  /// Map an integer onto the given resolution, 0=int8, 1=int16,
+  /// 2=int32, 3=float.
+  static Value IntMapping(int32_t value, size_t type);
+
+ private:
+  Value ScalePosition(float, size_t type) const;
+  Value ScaleVelocity(float, size_t type) const;
+  Value ScaleTemperature(float, size_t type) const;
+  Value ScalePwm(float, size_t type) const;
+  Value ScaleCurrent(float, size_t type) const;
+  Value ScaleVoltage(float, size_t type) const;
+  Value ScaleTorque(float, size_t type) const;
+  Value ScaleTime(float, size_t type) const;
+
+  float ReadPwm(const Value&) const;
+  float ReadVoltage(const Value&) const;
+  float ReadPosition(const Value&) const;
+  float ReadVelocity(const Value&) const;
+  float ReadCurrent(const Value&) const;
+  float ReadTorque(const Value&) const;
+  float ReadTime(const Value&) const;
+
+  const BldcServoStatus* const status_;
+  const BldcServoControl* const control_;
+
+  BldcServoCommandData command_;
+  bool command_valid_ = false;
+
+  Scaling position_scale_;
+  Scaling velocity_scale_;
+  Scaling torque_scale_;
+  Scaling current_scale_;
+  Scaling voltage_scale_;
+  Scaling temperature_scale_;
+  Scaling time_scale_;
+};
+
+}
@@ -0,0 +1,588 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/servo_sim.h"
+
+#include <cmath>
+#include <cstring>
+
+#include "mjlib/base/limit.h"
+
+#include "fw/bldc_servo_control.h"
+#include "fw/math.h"
+
+namespace moteus {
+
+namespace {
+float TorqueConstant(float v_per_hz) {
+  if (v_per_hz == 0.0f) { return 0.1f; }
+  // This is the same empirical relation BldcServo uses.
+  const float kv = 0.5f * 60.0f / v_per_hz;
+  return 0.78f * 60.0f / (k2Pi * kv);
+}
+
+size_t TypeSize(size_t type) {
+  return type == 0 ? 1 : type == 1 ? 2 : 4;
+}
+
+/// A minimal cursor over the bytes of a multiplex frame.
+class FrameReader {
+ public:
+  FrameReader(const uint8_t* data, size_t size)
+      : data_(data), size_(size) {}
+
+  bool empty() const { return pos_ >= size_; }
+
+  bool ReadByte(uint8_t* value) {
+    if (pos_ >= size_) { return false; }
+    *value = data_[pos_++];
+    return true;
+  }
+
+  bool ReadVaruint(uint32_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      uint8_t byte = 0;
+      if (!ReadByte(&byte)) { return false; }
+      *value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) { return true; }
+    }
+    return false;
+  }
+
+  bool ReadValue(size_t type, ServoSim::Value* value) {
+    const size_t size = TypeSize(type);
+    if (pos_ + size > size_) { return false; }
+    uint32_t raw = 0;
+    for (size_t i = 0; i < size; i++) {
+      raw |= static_cast<uint32_t>(data_[pos_ + i]) << (8 * i);
+    }
+    pos_ += size;
+    switch (type) {
+      case 0: { *value = static_cast<int8_t>(raw); break; }
+      case 1: { *value = static_cast<int16_t>(raw); break; }
+      case 2: { *value = static_cast<int32_t>(raw); break; }
+      case 3: {
+        float f = 0.0f;
+        std::memcpy(&f, &raw, sizeof(f));
+        *value = f;
+        break;
+      }
+    }
+    return true;
+  }
+
+ private:
+  const uint8_t* const data_;
+  const size_t size_;
+  size_t pos_ = 0;
+};
+
+class FrameWriter {
+ public:
+  FrameWriter(uint8_t* data, size_t capacity)
+      : data_(data), capacity_(capacity) {}
+
+  size_t size() const { return pos_; }
+
+  void WriteByte(uint8_t value) {
+    if (pos_ < capacity_) { data_[pos_] = value; }
+    pos_++;
+  }
+
+  void WriteVaruint(uint32_t value) {
+    do {
+      const uint8_t byte = value & 0x7f;
+      value >>= 7;
+      WriteByte(byte | (value ? 0x80 : 0x00));
+    } while (value);
+  }
+
+  void WriteValue(const ServoSim::Value& value) {
+    uint32_t raw = 0;
+    size_t size = 4;
+    switch (value.index()) {
+      case 0: {
+        raw = static_cast<uint8_t>(std::get<int8_t>(value));
+        size = 1;
+        break;
+      }
+      case 1: {
+        raw = static_cast<uint16_t>(std::get<int16_t>(value));
+        size = 2;
+        break;
+      }
+      case 2: {
+        raw = static_cast<uint32_t>(std::get<int32_t>(value));
+        break;
+      }
+      case 3: {
+        const float f = std::get<float>(value);
+        std::memcpy(&raw, &f, sizeof(raw));
+        break;
+      }
+    }
+    for (size_t i = 0; i < size; i++) {
+      WriteByte((raw >> (8 * i)) & 0xff);
+    }
+  }
+
+  bool overflowed() const { return pos_ > capacity_; }
+
+ private:
+  uint8_t* const data_;
+  const size_t capacity_;
+  size_t pos_ = 0;
+};
+}
+
+MotorPlant::Config ServoSim::Config::MakePlant() const {
+  MotorPlant::Config result;
+  result.poles = poles;
+  result.resistance_ohm = resistance_ohm;
+  result.inductance_H = inductance_H;
+  result.torque_constant_Nm_per_A = TorqueConstant(v_per_hz);
+  return result;
+}
+
+ServoSim::ServoSim() : ServoSim(Config()) {}
+
+ServoSim::ServoSim(const Config& config)
+    : ServoSim(config, config.MakePlant()) {}
+
+ServoSim::ServoSim(const Config& config, const MotorPlant::Config& plant)
+    : config_(config),
+      torque_model_(TorqueConstant(config.v_per_hz),
+                    config.rotation_current_cutoff_A,
+                    config.rotation_current_scale,
+                    config.rotation_torque_scale),
+      motor_scale16_(65536.0f / config.unwrapped_position_scale),
+      decoupling_scale_(BldcServoCurrent::DecouplingScale(
+                            config.feedforward_scale, config.inductance_H,
+                            config.poles / 2,
+                            config.unwrapped_position_scale)),
+      // As for BldcServo without the velocity PLL, this applies to
+      // the sum of the encoder deltas in the velocity filter.
+      commutation_advance_scale_(
+          config.commutation_advance_cycles *
+          static_cast<float>(config.poles / 2) * (k2Pi / 65536.0f) /
+          static_cast<float>(kVelocityFilter)),
+      plant_(plant) {
+  status_.bus_V = config_.bus_V;
+  status_.fet_temp_C = 25.0f;
+  status_.filt_fet_temp_C = status_.fet_temp_C;
+  BldcServoCurrent::Clear(&status_);
+  BldcServoPosition::Clear(&status_);
+}
+
+void ServoSim::Step(float load_Nm) {
+  // This is what MoteusController::Poll does between frames.
+  if (registers_.command_valid()) {
+    registers_.clear_command_valid();
+    Command(registers_.command());
+  }
+
+  Sense();
+  DoControl();
+
+  const float dt = 1.0f / static_cast<float>(config_.rate_hz);
+  const float motor_load_Nm = load_Nm * config_.unwrapped_position_scale;
+  if (status_.mode == kStopped || status_.mode == kFault) {
+    plant_.StepOpen(motor_load_Nm, dt);
+  } else {
+    plant_.Step(phase_V_[0], phase_V_[1], phase_V_[2], motor_load_Nm, dt);
+  }
+
+  cycles_++;
+}
+
+void ServoSim::Run(double seconds, float load_Nm) {
+  const uint64_t count =
+      static_cast<uint64_t>(std::round(seconds * config_.rate_hz));
+  for (uint64_t i = 0; i < count; i++) {
+    Step(load_Nm);
+  }
+}
+
+void ServoSim::Command(const BldcServoCommandData& data) {
+  switch (data.mode) {
+    case kStopped:
+    case kCurrent:
+    case kPosition:
+    case kZeroVelocity: {
+      break;
+    }
+    default: {
+      return;
+    }
+  }
+
+  // The same sequencing as BldcServo::Command, without an apply time,
+  // as the simulation has no clock to synchronize.
+  if (data.mode == kStopped || status_.mode == kPositionTimeout) {
+    last_host_timestamp_ = {};
+  }
+  if (data.host_timestamp) {
+    if (last_host_timestamp_ &&
+        static_cast<int32_t>(
+            *data.host_timestamp - *last_host_timestamp_) <= 0) {
+      status_.stale_commands++;
+      return;
+    }
+    last_host_timestamp_ = data.host_timestamp;
+  }
+
+  data_ = data;
+  data_.sequence = ++command_sequence_;
+  BldcServoPosition::PrepareCommand(
+      &data_, status_.unwrapped_position, config_.default_timeout_s);
+}
+
+void ServoSim::Sense() {
+  if (data_.rezero_position) {
+    status_.position_to_set = *data_.rezero_position;
+    status_.rezeroed = true;
+    data_.rezero_position = {};
+  }
+  if (data_.sequence != status_.command_sequence) {
+    status_.command_sequence = data_.sequence;
+    status_.timeout_s = data_.timeout_s;
+  }
+
+  const double revolutions = plant_.state().angle_rad / (2.0 * M_PI);
+  const uint16_t raw = static_cast<uint16_t>(
+      static_cast<int64_t>(std::floor(revolutions * 65536.0)) & 0xffff);
+
+  const int16_t delta_position =
+      have_position_ ? static_cast<int16_t>(raw - status_.position) : 0;
+  have_position_ = true;
+  status_.position_raw = raw;
+  status_.position = raw;
+
+  // Like the firmware, the position starts out as the one closest to
+  // position_to_set, which is 0 at boot.
+  if (!std::isnan(status_.position_to_set)) {
+    status_.unwrapped_position_raw = BldcServoPosition::Rezero(
+        status_.position_to_set, static_cast<int16_t>(raw),
+        motor_scale16_, config_.unwrapped_position_scale);
+    status_.position_to_set = std::numeric_limits<float>::quiet_NaN();
+  } else {
+    status_.unwrapped_position_raw += delta_position;
+  }
+
+  velocity_sum_ += delta_position - velocity_deltas_[velocity_index_];
+  velocity_deltas_[velocity_index_] = delta_position;
+  velocity_index_ = (velocity_index_ + 1) % kVelocityFilter;
+
+  status_.velocity =
+      ((static_cast<float>(velocity_sum_) / motor_scale16_) *
+       static_cast<float>(config_.rate_hz)) /
+      static_cast<float>(kVelocityFilter);
+  status_.unwrapped_position =
+      status_.unwrapped_position_raw / motor_scale16_;
+
+  // The electrical angle is derived from the encoder, just as on the
+  // controller, so that its quantization is modeled as well.
+  const float electrical =
+      k2Pi * (static_cast<float>(raw) / 65536.0f) *
+      static_cast<float>(config_.poles / 2);
+  status_.electrical_theta = WrapZeroToTwoPi(electrical);
+  sin_cos_ = cordic_(RadiansToQ31(status_.electrical_theta));
+  status_.sin = sin_cos_.s;
+  status_.cos = sin_cos_.c;
+  output_sin_cos_ =
+      (commutation_advance_scale_ == 0.0f) ? sin_cos_ :
+      cordic_(RadiansToQ31(
+                  BldcServoCurrent::CommutationTheta(
+                      status_.electrical_theta, commutation_advance_scale_,
+                      static_cast<float>(velocity_sum_))));
+
+  const auto currents = plant_.phase_currents();
+  status_.cur1_A = currents.a;
+  status_.cur2_A = currents.b;
+  status_.cur3_A = currents.c;
+  const DqTransform dq(sin_cos_, currents.a, currents.b, currents.c);
+  status_.d_A = dq.d;
+  status_.q_A = dq.q;
+  status_.torque_Nm =
+      torque_model_.current_to_torque(status_.q_A) /
+      config_.unwrapped_position_scale;
+  status_.bus_V = config_.bus_V;
+  status_.filt_bus_V = config_.bus_V;
+  status_.filt_1ms_bus_V = config_.bus_V;
+}
+
+void ServoSim::DoControl() {
+  const float period_s = 1.0f / static_cast<float>(config_.rate_hz);
+
+  control_.Clear();
+
+  if (!std::isnan(status_.timeout_s) && status_.timeout_s > 0.0f) {
+    status_.timeout_s = std::max(0.0f, status_.timeout_s - period_s);
+  }
+
+  if (data_.mode != status_.mode) {
+    MaybeChangeMode();
+  }
+
+  if (status_.mode == kPosition &&
+      !std::isnan(status_.timeout_s) &&
+      status_.timeout_s <= 0.0f) {
+    status_.mode = kPositionTimeout;
+  }
+
+  ClearPid(false);
+
+  if (status_.mode != kFault) {
+    status_.fault = errc::kSuccess;
+  }
+
+  switch (status_.mode) {
+    case kCurrent: {
+      DoCurrent(data_.i_d_A, data_.i_q_A);
+      break;
+    }
+    case kPosition: {
+      PID::ApplyOptions options;
+      options.kp_scale = data_.kp_scale;
+      options.kd_scale = data_.kd_scale;
+      DoPosition(options, data_.max_torque_Nm, data_.feedforward_Nm,
+                 data_.velocity);
+      break;
+    }
+    case kPositionTimeout:
+    case kZeroVelocity: {
+      PID::ApplyOptions options;
+      options.kp_scale = 0.0f;
+      options.kd_scale = 1.0f;
+      DoPosition(options, config_.timeout_max_torque_Nm, 0.0f, 0.0f);
+      break;
+    }
+    default: {
+      // Everything else drives nothing.
+      phase_V_ = {};
+      break;
+    }
+  }
+}
+
+void ServoSim::MaybeChangeMode() {
+  // This is BldcServo's ISR_MaybeChangeMode for the modeled modes,
+  // where the calibration which precedes any active mode completes
+  // immediately.
+  if (data_.mode == kStopped) {
+    status_.mode = kStopped;
+    return;
+  }
+  if (status_.mode == kFault || status_.mode == kPositionTimeout) {
+    // These can only be left through a stop.
+    return;
+  }
+
+  const bool outside_limits =
+      (!std::isnan(config_.position_min) &&
+       status_.unwrapped_position < config_.position_min) ||
+      (!std::isnan(config_.position_max) &&
+       status_.unwrapped_position > config_.position_max);
+  if (data_.mode == kPosition && outside_limits) {
+    status_.mode = kFault;
+    status_.fault = errc::kStartOutsideLimit;
+    return;
+  }
+
+  status_.mode = data_.mode;
+  ClearPid(true);
+}
+
+void ServoSim::ClearPid(bool always) {
+  if (always || !BldcServoCurrent::PidActive(status_.mode)) {
+    BldcServoCurrent::Clear(&status_);
+  }
+  if (always || !BldcServoPosition::PidActive(status_.mode)) {
+    BldcServoPosition::Clear(&status_);
+  }
+}
+
+void ServoSim::DoPosition(const PID::ApplyOptions& options,
+                          float max_torque_Nm, float feedforward_Nm,
+                          float velocity) {
+  BldcServoPosition::Latch(&status_, &data_, motor_scale16_, false);
+
+  const float velocity_command = BldcServoPosition::Advance(
+      &status_, data_, velocity, motor_scale16_, config_.rate_hz,
+      config_.position_min, config_.position_max);
+
+  const float limited_torque_Nm = BldcServoPosition::Torque(
+      status_, &pid_position_, options, velocity_command,
+      feedforward_Nm, max_torque_Nm, config_.velocity_threshold,
+      config_.unwrapped_position_scale, config_.rate_hz);
+
+  control_.torque_Nm = limited_torque_Nm;
+
+  DoCurrent(0.0f, torque_model_.torque_to_current(
+                limited_torque_Nm * config_.unwrapped_position_scale));
+}
+
+void ServoSim::DoCurrent(float i_d_A_in, float i_q_A_in) {
+  const float limit_A = config_.max_current_A;
+  const float i_d_A = mjlib::base::Limit(i_d_A_in, -limit_A, limit_A);
+  const float q_limit_A = BldcServoCurrent::QLimit(limit_A, i_d_A, false);
+  const float i_q_A = mjlib::base::Limit(
+      BldcServoCurrent::DeratePosition(
+          i_q_A_in, status_.unwrapped_position,
+          config_.position_min, config_.position_max,
+          config_.position_derate),
+      -q_limit_A, q_limit_A);
+
+  control_.i_d_A = i_d_A;
+  control_.i_q_A = i_q_A;
+
+  BldcServoCurrent::Feedforward(
+      &control_, status_.velocity, config_.feedforward_scale,
+      decoupling_scale_, config_.resistance_ohm, config_.v_per_hz,
+      config_.unwrapped_position_scale);
+
+  const float d_V =
+      control_.d_ff_V +
+      pid_d_.Apply(status_.d_A, i_d_A, 1.0f, 0.0f, config_.rate_hz);
+  const float q_V =
+      control_.q_ff_V +
+      pid_q_.Apply(status_.q_A, i_q_A, 0.0f, 0.0f, config_.rate_hz);
+
+  DoVoltageDq(d_V, q_V);
+}
+
+void ServoSim::DoVoltageDq(float d_V, float q_V) {
+  control_.d_V = d_V;
+  control_.q_V = q_V;
+
+  const float max_voltage =
+      (2.0f / kSqrt3) * (0.5f - config_.min_pwm) * config_.bus_V;
+  const auto limit_v = [&](float in) {
+    return mjlib::base::Limit(in, -max_voltage, max_voltage);
+  };
+  const InverseDqTransform idt(
+      output_sin_cos_, limit_v(d_V), limit_v(q_V));
+  const SpaceVectorModulation svm(idt.a, idt.b, idt.c);
+
+  // Each phase is switched between ground and the bus, and the motor
+  // neutral floats to the average of the three.
+  const auto duty = [&](float v) {
+    return mjlib::base::Limit(
+        0.5f + v / config_.bus_V, config_.min_pwm, 1.0f - config_.min_pwm);
+  };
+  control_.pwm.a = duty(svm.a);
+  control_.pwm.b = duty(svm.b);
+  control_.pwm.c = duty(svm.c);
+  const float a = control_.pwm.a * config_.bus_V;
+  const float b = control_.pwm.b * config_.bus_V;
+  const float c = control_.pwm.c * config_.bus_V;
+  const float neutral = (a + b + c) / 3.0f;
+  phase_V_ = { a - neutral, b - neutral, c - neutral };
+  control_.voltage.a = phase_V_[0];
+  control_.voltage.b = phase_V_[1];
+  control_.voltage.c = phase_V_[2];
+}
+
+uint32_t ServoSim::Write(uint32_t reg, const Value& value) {
+  return registers_.Write(reg, value);
+}
+
+ServoRegisters::ReadResult ServoSim::Read(uint32_t reg, size_t type) const {
+  return registers_.Read(reg, type);
+}
+
+size_t ServoSim::HandleFrame(const uint8_t* data, size_t size,
+                             uint8_t* reply, size_t reply_capacity) {
+  FrameReader reader(data, size);
+  FrameWriter writer(reply, reply_capacity);
+
+  while (!reader.empty()) {
+    uint8_t cmd = 0;
+    reader.ReadByte(&cmd);
+
+    if (cmd == 0x50) {
+      // NOP
+      continue;
+    }
+
+    const uint8_t kind = cmd & 0xf0;
+    if (kind != 0x00 && kind != 0x10) {
+      // Anything else ends the frame.
+      break;
+    }
+
+    const size_t type = (cmd >> 2) & 0x03;
+    uint32_t count = cmd & 0x03;
+    if (count == 0 && !reader.ReadVaruint(&count)) { break; }
+    uint32_t start_reg = 0;
+    if (!reader.ReadVaruint(&start_reg)) { break; }
+
+    if (kind == 0x00) {
+      bool complete = true;
+      for (uint32_t i = 0; i < count; i++) {
+        Value value;
+        if (!reader.ReadValue(type, &value)) {
+          complete = false;
+          break;
+        }
+        const uint32_t err = Write(start_reg + i, value);
+        if (err) {
+          writer.WriteByte(0x30);
+          writer.WriteVaruint(start_reg + i);
+          writer.WriteVaruint(err);
+        }
+      }
+      if (!complete) { break; }
+      continue;
+    }
+
+    // A read.  Registers which cannot be read are reported as zero,
+    // followed by an error subframe for each.
+    if (count <= 3) {
+      writer.WriteByte(0x20 | (type << 2) | count);
+    } else {
+      writer.WriteByte(0x20 | (type << 2));
+      writer.WriteVaruint(count);
+    }
+    writer.WriteVaruint(start_reg);
+
+    uint32_t errors[16] = {};
+    uint32_t error_regs[16] = {};
+    size_t error_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      const auto result = Read(start_reg + i, type);
+      if (std::holds_alternative<Value>(result)) {
+        writer.WriteValue(std::get<Value>(result));
+        continue;
+      }
+      writer.WriteValue(ServoRegisters::IntMapping(0, type));
+      if (error_count < 16) {
+        errors[error_count] = std::get<uint32_t>(result);
+        error_regs[error_count] = start_reg + i;
+        error_count++;
+      }
+    }
+    for (size_t i = 0; i < error_count; i++) {
+      writer.WriteByte(0x31);
+      writer.WriteVaruint(error_regs[i]);
+      writer.WriteVaruint(errors[i]);
+    }
+  }
+
+  if (writer.overflowed()) { return 0; }
+  return writer.size();
+}
+
+}
@@ -0,0 +1,196 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+
+#include "fw/bldc_servo_structs.h"
+#include "fw/foc.h"
+#include "fw/motor_plant.h"
+#include "fw/pid.h"
+#include "fw/servo_registers.h"
+#include "fw/torque_model.h"
+
+namespace moteus {
+
+/// A host model of a single moteus controller and its motor.
+///
+/// The control cycle follows BldcServo's ISR: phase currents are
+/// sensed and transformed with the encoder angle, the position loop
+/// produces a torque which the torque model turns into a q current,
+/// and the current loop produces dq voltages which are modulated onto
+/// the phases within the limits of the bus.  The position and current
+/// loops are those of BldcServoPosition and BldcServoCurrent, run
+/// against a MotorPlant rather than hardware.
+///
+/// Commands and queries go through ServoRegisters, exactly as they do
+/// for MoteusController, either one register at a time, or as
+/// complete multiplex frames.  Only the kStopped, kCurrent,
+/// kPosition and kZeroVelocity modes are modeled, and commands for
+/// any other are ignored.  Time only advances when Step() is called,
+/// so a simulation may run as fast as the host allows.
+class ServoSim {
+ public:
+  using Value = ServoRegisters::Value;
+  using Status = BldcServoStatus;
+  using Control = BldcServoControl;
+
+  struct Config {
+    int rate_hz = 40000;
+    float bus_V = 24.0f;
+    // The fraction of each PWM period which cannot be used.
+    float min_pwm = 0.01f;
+
+    // These mirror the motor.* and servo.* configuration.
+    int poles = 14;
+    float resistance_ohm = 0.05f;
+    float inductance_H = 20e-6f;
+    float v_per_hz = 0.15f;
+    float unwrapped_position_scale = 1.0f;
+    float rotation_current_cutoff_A = 10000.0f;
+    float rotation_current_scale = 0.05f;
+    float rotation_torque_scale = 14.7f;
+
+    float feedforward_scale = 0.5f;
+    float max_current_A = 100.0f;
+    float default_timeout_s = 0.1f;
+    float timeout_max_torque_Nm = 5.0f;
+    float velocity_threshold = 0.0f;
+    float position_derate = 0.02f;
+    float position_min = std::numeric_limits<float>::quiet_NaN();
+    float position_max = std::numeric_limits<float>::quiet_NaN();
+    float commutation_advance_cycles = 0.0f;
+
+    PID::Config pid_dq;
+    PID::Config pid_position;
+
+    Config() {
+      pid_dq.kp = 0.005f;
+      pid_dq.ki = 30.0f;
+      pid_dq.ilimit = 20.0f;
+      pid_dq.sign = -1;
+      pid_dq.max_desired_rate = 30000.0f;
+
+      pid_position.kp = 4.0f;
+      pid_position.ki = 1.0f;
+      pid_position.ilimit = 0.0f;
+      pid_position.kd = 0.05f;
+      pid_position.sign = -1;
+    }
+
+    /// The plant parameters implied by the motor configuration.
+    MotorPlant::Config MakePlant() const;
+  };
+
+  ServoSim();
+  ServoSim(const Config&);
+  ServoSim(const Config&, const MotorPlant::Config&);
+
+  // The registers refer to our own status.
+  ServoSim(const ServoSim&) = delete;
+  ServoSim& operator=(const ServoSim&) = delete;
+
+  /// Run one control cycle, and advance the plant by one period with
+  /// an external @p load_Nm at the output.
+  void Step(float load_Nm = 0.0f);
+
+  /// Run control cycles until @p seconds have elapsed.
+  void Run(double seconds, float load_Nm = 0.0f);
+
+  /// Write a single register, as if from a multiplex frame.
+  ///
+  /// @return 0 on success, or a multiplex error number
+  uint32_t Write(uint32_t reg, const Value& value);
+
+  /// Read a single register as the given resolution, 0=int8, 1=int16,
+  /// 2=int32, 3=float.
+  ///
+  /// @return the value, or a multiplex error number
+  ServoRegisters::ReadResult Read(uint32_t reg, size_t type) const;
+
+  /// Configure the integer register scales, as servo.register_scale
+  /// does for the controller.
+  void SetRegisterScale(const RegisterScaleConfig& config) {
+    registers_.SetScale(config);
+  }
+
+  /// Process the register subframes of a multiplex frame, which is
+  /// what a controller would receive in the data of a CAN frame.
+  ///
+  /// @return the number of bytes written to @p reply, which is empty
+  /// if nothing was read
+  size_t HandleFrame(const uint8_t* data, size_t size,
+                     uint8_t* reply, size_t reply_capacity);
+
+  const Config& config() const { return config_; }
+  const Status& status() const { return status_; }
+  const Control& control() const { return control_; }
+  const MotorPlant& plant() const { return plant_; }
+  MotorPlant* mutable_plant() { return &plant_; }
+  double time_s() const {
+    return static_cast<double>(cycles_) / config_.rate_hz;
+  }
+
+ private:
+  void Command(const BldcServoCommandData&);
+  void Sense();
+  void DoControl();
+  void MaybeChangeMode();
+  void ClearPid(bool always);
+  void DoPosition(const PID::ApplyOptions&, float max_torque_Nm,
+                  float feedforward_Nm, float velocity);
+  void DoCurrent(float i_d_A, float i_q_A);
+  void DoVoltageDq(float d_V, float q_V);
+
+  const Config config_;
+  const TorqueModel torque_model_;
+  const float motor_scale16_;
+  const float decoupling_scale_;
+  const float commutation_advance_scale_;
+  Cordic cordic_;
+  MotorPlant plant_;
+
+  Status status_;
+  Control control_;
+  BldcServoCommandData data_;
+  ServoRegisters registers_{&status_, &control_};
+  uint32_t command_sequence_ = 0;
+  std::optional<uint32_t> last_host_timestamp_;
+
+  PID pid_d_{&config_.pid_dq, &status_.pid_d};
+  PID pid_q_{&config_.pid_dq, &status_.pid_q};
+  PID pid_position_{&config_.pid_position, &status_.pid_position};
+
+  bool have_position_ = false;
+
+  static constexpr int kVelocityFilter = 16;
+  std::array<int16_t, kVelocityFilter> velocity_deltas_ = {};
+  int velocity_index_ = 0;
+  int32_t velocity_sum_ = 0;
+
+  // The sampled angle, used to transform the currents, and the one
+  // extrapolated by servo.commutation_advance_cycles, used to
+  // modulate the voltages.
+  SinCos sin_cos_ = {0.0f, 1.0f};
+  SinCos output_sin_cos_ = {0.0f, 1.0f};
+  std::array<float, 3> phase_V_ = {};
+  uint64_t cycles_ = 0;
+};
+
+}
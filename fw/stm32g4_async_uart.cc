@@ -217,6 +217,14 @@ class Stm32G4AsyncUart::Impl {
       uart->CR3 |= USART_CR3_DMAR;
 
       dma_rx_flags_.te = DMA_ISR_TEIF1 << channel_index;
+
+      if (options.rx_frame_timeout_bits != 0) {
+        // RTOEN may only be changed while the USART is disabled.
+        uart->CR1 &= ~USART_CR1_UE;
+        uart->RTOR = options.rx_frame_timeout_bits;
+        uart->CR2 |= USART_CR2_RTOEN;
+        uart->CR1 |= USART_CR1_UE | USART_CR1_RTOIE;
+      }
     }
 
     hdma_usart_tx_.Instance = options.tx_dma;
@@ -241,11 +249,12 @@ class Stm32G4AsyncUart::Impl {
       });
 
     uart_callback_ = micro::CallbackTable::MakeFunction([this]() {
-        HAL_UART_IRQHandler(&uart_);
+        this->ISR_HandleUart();
       });
 
     const auto tx_irq = GetDmaIrq(options.tx_dma);
     const auto usart_irq = GetUsartIrq(uart);
+    usart_irq_ = usart_irq;
 
     NVIC_SetVector(
         tx_irq,
@@ -268,21 +277,61 @@ class Stm32G4AsyncUart::Impl {
     current_read_callback_ = callback;
   }
 
+  // CALLED IN INTERRUPT CONTEXT.
+  void ISR_HandleUart() {
+    auto* const uart = uart_.Instance;
+    // The HAL would treat a receiver timeout as an error, so it is
+    // handled here before the HAL sees it.
+    if (uart->ISR & USART_ISR_RTOF) {
+      uart->ICR = USART_ICR_RTOCF;
+      rx_frame_ready_ = true;
+    }
+
+    HAL_UART_IRQHandler(&uart_);
+
+    // The HAL marks the transmitter ready from the transmission
+    // complete interrupt, once the final byte has left the shift
+    // register.
+    if (tx_outstanding_ && uart_.gState == HAL_UART_STATE_READY) {
+      tx_outstanding_ = false;
+      tx_complete_ = true;
+    }
+  }
+
   void AsyncWriteSome(const string_view& data,
                       const micro::SizeCallback& callback) {
     MJ_ASSERT(!current_write_callback_);
     current_write_callback_ = callback;
     current_write_bytes_ = data.size();
 
+    // The USART interrupt is masked until the transfer has started and
+    // is marked outstanding.  Otherwise, it could observe the idle
+    // transmitter before the start, or miss a completion which raced
+    // with setting the flag.
+    NVIC_DisableIRQ(usart_irq_);
     if (HAL_UART_Transmit_DMA(
             &uart_,
             const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(data.data())),
             data.size()) != HAL_OK) {
       mbed_die();
     }
+    tx_outstanding_ = true;
+    NVIC_EnableIRQ(usart_irq_);
+  }
+
+  bool RxReady() const {
+    if (options_.rx_frame_timeout_bits == 0) { return true; }
+    if (rx_frame_ready_ || pending_rx_error_) { return true; }
+
+    const uint16_t half_pos = (
+        rx_buffer_pos_ + options_.rx_buffer_size / 2) %
+        options_.rx_buffer_size;
+    return rx_buffer_[half_pos] != 0xffff;
   }
 
   void ProcessRead() {
+    rx_frame_ready_ = false;
+
     if (rx_buffer_[rx_buffer_pos_] == 0xffff && !pending_rx_error_) {
       return;
     }
@@ -305,6 +354,12 @@ class Stm32G4AsyncUart::Impl {
       rx_buffer_[rx_buffer_pos_] = 0xffff;
     }
 
+    // If the caller's buffer was filled, the rest of the frame should
+    // be delivered on the next read without waiting for another.
+    if (rx_buffer_[rx_buffer_pos_] != 0xffff) {
+      rx_frame_ready_ = true;
+    }
+
     {
       auto copy = current_read_callback_;
       auto rx_error = pending_rx_error_;
@@ -338,17 +393,16 @@ class Stm32G4AsyncUart::Impl {
     }
 
     // Handle writes if they are done.
-    if (current_write_callback_) {
-      if (uart_.gState == HAL_UART_STATE_READY) {
-        decltype(current_write_callback_) copy;
-        using std::swap;
-        swap(copy, current_write_callback_);
-        copy(micro::error_code(), current_write_bytes_);
-      }
+    if (tx_complete_) {
+      tx_complete_ = false;
+      decltype(current_write_callback_) copy;
+      using std::swap;
+      swap(copy, current_write_callback_);
+      copy(micro::error_code(), current_write_bytes_);
     }
 
     // Handle any read data.
-    if (current_read_callback_) {
+    if (current_read_callback_ && RxReady()) {
       ProcessRead();
     }
   }
@@ -359,9 +413,12 @@ class Stm32G4AsyncUart::Impl {
   DMA_Channel_TypeDef* dma_rx_ = nullptr;
   DMAMUX_Channel_TypeDef* dmamux_rx_ = nullptr;
   DMA_HandleTypeDef hdma_usart_tx_;
+  IRQn_Type usart_irq_ = {};
 
   micro::SizeCallback current_write_callback_;
   ssize_t current_write_bytes_ = 0;
+  volatile bool tx_outstanding_ = false;
+  volatile bool tx_complete_ = false;
 
   micro::SizeCallback current_read_callback_;
   base::string_span current_read_data_ = {};
@@ -380,6 +437,8 @@ class Stm32G4AsyncUart::Impl {
   // at high data rates.
   volatile uint16_t* rx_buffer_ = nullptr;
   uint16_t rx_buffer_pos_ = 0;
+  // Set from the receiver timeout interrupt at the end of each frame.
+  volatile bool rx_frame_ready_ = false;
 };
 
 Stm32G4AsyncUart::Stm32G4AsyncUart(micro::Pool* pool,
@@ -47,6 +47,14 @@ class Stm32G4AsyncUart : public mjlib::micro::AsyncStream {
 
     size_t rx_buffer_size = 128u;
 
+    // If non-zero, the receiver timeout interrupt marks the end of a
+    // frame once the line has been idle for this many bit times.
+    // Received data is then only delivered at the end of a frame, or
+    // once half the buffer is filled, so that Poll() is inexpensive
+    // while a frame is still arriving.  If zero, data is delivered as
+    // soon as Poll() observes it.
+    uint8_t rx_frame_timeout_bits = 0;
+
     DMA_Channel_TypeDef* rx_dma = DMA1_Channel2;
     DMA_Channel_TypeDef* tx_dma = DMA1_Channel1;
   };
@@ -61,7 +69,10 @@ class Stm32G4AsyncUart : public mjlib::micro::AsyncStream {
   void AsyncWriteSome(const std::string_view&,
                       const mjlib::micro::SizeCallback&) override;
 
-  // Call frequently.
+  /// Invoke any completed callbacks.  Reception is performed by DMA
+  /// into a circular buffer and transmit completion is flagged from
+  /// the interrupt, so this only needs to be called often enough that
+  /// the receive buffer does not overflow.
   void Poll();
 
  private:
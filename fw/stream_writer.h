@@ -15,91 +15,160 @@
 #pragma once
 
 #include <array>
+#include <cstring>
+#include <string_view>
 
-#include "mjlib/base/assert.h"
 #include "mjlib/micro/async_stream.h"
 #include "mjlib/micro/async_types.h"
+#include "mjlib/micro/error_code.h"
+
+#include "fw/error.h"
 
 namespace moteus {
 
-/// Supports writing to a stream where the buffer passed to AsyncWrite
-/// does not need to live past the call.  It does this through an
-/// internal double buffer.
-template <size_t Size, size_t NumCallbacks = 14>
+/// Merges many small writes into a stream so that callers need not
+/// wait for each other.
+///
+/// Writes are gathered into a batch while the previous batch is being
+/// written.  A batch is a list of segments, each of which either
+/// references memory owned by the caller, or a region of an internal
+/// buffer that copied writes are appended to.  Once every segment of
+/// a batch has been written, the callbacks of all its writes are
+/// invoked.
+///
+/// If a write cannot be accepted, errc::kWouldBlock is returned and
+/// its callback will never be invoked.  The caller may retry once any
+/// outstanding callback has completed.
+template <size_t Size, size_t NumCallbacks = 14, size_t NumSegments = 8>
 class StreamWriter {
  public:
   StreamWriter(mjlib::micro::AsyncWriteStream* stream)
       : stream_(stream) {}
 
-  void AsyncWrite(const std::string_view& buffer,
-                  const mjlib::micro::ErrorCallback& callback) {
-    // Verify we have sufficient room.
-    MJ_ASSERT((current_offset_ + buffer.size()) <= Size);
+  /// Queue a copy of @p buffer, which need not live past the call.
+  mjlib::micro::error_code AsyncWrite(
+      const std::string_view& buffer,
+      const mjlib::micro::ErrorCallback& callback) {
+    auto* const batch = in_progress_;
+    if (batch->callback_count >= NumCallbacks ||
+        (current_offset_ + buffer.size()) > Size) {
+      return errc::kWouldBlock;
+    }
 
-    std::memcpy(&data_in_progress_->buffer[current_offset_],
-                buffer.data(), buffer.size());
+    char* const dest = &batch->buffer[current_offset_];
+    // Copies which follow one another in the buffer are written as a
+    // single segment.
+    Segment* const last = batch->segment_count ?
+        &batch->segments[batch->segment_count - 1] : nullptr;
+    if (last && (last->data + last->size) == dest) {
+      last->size += buffer.size();
+    } else if (batch->segment_count < NumSegments) {
+      batch->segments[batch->segment_count++] = { dest, buffer.size() };
+    } else {
+      return errc::kWouldBlock;
+    }
+
+    std::memcpy(dest, buffer.data(), buffer.size());
     current_offset_ += buffer.size();
+    batch->callbacks[batch->callback_count++] = callback;
+
+    MaybeStartWrite();
+    return {};
+  }
+
+  /// Queue @p buffer without copying it.  It must remain valid and
+  /// unchanged until @p callback is invoked.  If no segment is free,
+  /// it is copied instead when there is room to do so.
+  mjlib::micro::error_code AsyncWriteReference(
+      const std::string_view& buffer,
+      const mjlib::micro::ErrorCallback& callback) {
+    auto* const batch = in_progress_;
+    if (batch->segment_count >= NumSegments) {
+      return AsyncWrite(buffer, callback);
+    }
+    if (batch->callback_count >= NumCallbacks) {
+      return errc::kWouldBlock;
+    }
 
-    const bool installed_callback = [&]() {
-      for (auto& cbk_holder : data_in_progress_->callbacks) {
-        if (!cbk_holder) {
-          cbk_holder = callback;
-          return true;
-        }
-      }
-      return false;
-    }();
-    MJ_ASSERT(installed_callback);
+    batch->segments[batch->segment_count++] = {
+      buffer.data(), buffer.size() };
+    batch->callbacks[batch->callback_count++] = callback;
 
     MaybeStartWrite();
+    return {};
   }
 
  private:
   void MaybeStartWrite() {
     if (write_outstanding_) { return; }
-    if (current_offset_ == 0) { return; }
+    if (in_progress_->segment_count == 0) { return; }
 
-    // Swap our buffers and get ready to write.
-    const size_t size_to_write = current_offset_;
-    std::swap(data_in_progress_, data_writing_);
+    // Swap our batches and get ready to write.
+    std::swap(in_progress_, writing_);
     current_offset_ = 0;
 
     write_outstanding_ = true;
+    write_segment_ = 0;
+    WriteSegment();
+  }
+
+  void WriteSegment() {
+    const auto& segment = writing_->segments[write_segment_];
     mjlib::micro::AsyncWrite(
         *stream_,
-        std::string_view(data_writing_->buffer, size_to_write),
-        std::bind(&StreamWriter::HandleWrite, this, std::placeholders::_1));
+        std::string_view(segment.data, segment.size),
+        [this](const mjlib::micro::error_code& ec) {
+          this->HandleWrite(ec);
+        });
   }
 
   void HandleWrite(const mjlib::micro::error_code& ec) {
-    write_outstanding_ = false;
-    for (auto& cbk : data_writing_->callbacks) {
-      if (!cbk) {
-        continue;
-      }
+    write_segment_++;
+    if (!ec && write_segment_ < writing_->segment_count) {
+      WriteSegment();
+      return;
+    }
+
+    // Writes made from these callbacks go into the other batch, and
+    // are not started until all of these have been invoked.
+    for (size_t i = 0; i < writing_->callback_count; i++) {
+      auto& cbk = writing_->callbacks[i];
+      if (!cbk) { continue; }
       auto copy = cbk;
       cbk = {};
       copy(ec);
     }
+    writing_->callback_count = 0;
+    writing_->segment_count = 0;
+    write_outstanding_ = false;
 
     MaybeStartWrite();
   }
 
   mjlib::micro::AsyncWriteStream* const stream_;
 
-  struct Data {
+  struct Segment {
+    const char* data = nullptr;
+    size_t size = 0;
+  };
+
+  struct Batch {
     char buffer[Size] = {};
+    std::array<Segment, NumSegments> segments = {};
+    size_t segment_count = 0;
     std::array<mjlib::micro::ErrorCallback, NumCallbacks> callbacks;
+    size_t callback_count = 0;
   };
 
-  Data data1_;
-  Data data2_;
+  Batch batch1_;
+  Batch batch2_;
   size_t current_offset_ = 0;
 
-  Data* data_in_progress_ = &data1_;
-  Data* data_writing_ = &data2_;
+  Batch* in_progress_ = &batch1_;
+  Batch* writing_ = &batch2_;
 
   bool write_outstanding_ = false;
+  size_t write_segment_ = 0;
 };
 
 }
@@ -14,6 +14,9 @@
 
 #include "fw/system_info.h"
 
+#include <algorithm>
+#include <array>
+
 #include "mbed.h"
 
 #include "mjlib/base/inplace_function.h"
@@ -21,36 +24,81 @@
 
 #include "mjlib/micro/telemetry_manager.h"
 
+// These are provided by the linker script.
+extern "C" {
+extern uint32_t __StackLimit;
+extern uint32_t __StackTop;
+}
+
 namespace moteus {
 
 volatile uint32_t SystemInfo::idle_count = 0;
 
 namespace {
+constexpr uint32_t kStackPaint = 0xa5a5a5a5;
+
+// PaintStack leaves this many words immediately below the stack
+// pointer untouched, as its own frame may extend there.
+constexpr int kStackPaintMargin = 16;
+
+constexpr int kUpdateMs = 10;
+
 struct SystemInfoData {
   uint32_t pool_size = 0;
   uint32_t pool_available = 0;
+  // The least pool_available has been when sampled.
+  uint32_t pool_available_min = 0;
 
   uint32_t idle_rate = 0;
 
+  // The fraction of CPU time spent in interrupt context since the
+  // last update.
+  float isr_fraction = 0.0f;
+
+  // The longest main loop pass ever seen.
+  uint32_t main_loop_max_us = 0;
+
+  // The time spent in each main loop task since the last update, and
+  // the longest single invocation ever seen.
+  std::array<uint32_t, SystemInfo::kMaxMainLoopTasks> task_us = {};
+  std::array<uint32_t, SystemInfo::kMaxMainLoopTasks> task_max_us = {};
+
+  uint32_t stack_size = 0;
+  // The deepest the stack has ever been.
+  uint32_t stack_used = 0;
+
   template <typename Archive>
   void Serialize(Archive* a) {
     a->Visit(MJ_NVP(pool_size));
     a->Visit(MJ_NVP(pool_available));
+    a->Visit(MJ_NVP(pool_available_min));
     a->Visit(MJ_NVP(idle_rate));
+    a->Visit(MJ_NVP(isr_fraction));
+    a->Visit(MJ_NVP(main_loop_max_us));
+    a->Visit(MJ_NVP(task_us));
+    a->Visit(MJ_NVP(task_max_us));
+    a->Visit(MJ_NVP(stack_size));
+    a->Visit(MJ_NVP(stack_used));
   }
 };
 }
 
 class SystemInfo::Impl {
  public:
-  Impl(mjlib::micro::Pool& pool, mjlib::micro::TelemetryManager& telemetry)
-      : pool_(pool) {
+  Impl(mjlib::micro::Pool& pool, mjlib::micro::TelemetryManager& telemetry,
+       MillisecondTimer* timer)
+      : pool_(pool),
+        timer_(timer) {
     data_updater_ = telemetry.Register("system_info", &data_);
+    data_.pool_available_min = pool_.available();
+    data_.stack_size =
+        (&__StackTop - &__StackLimit) * sizeof(uint32_t);
+    last_us_ = timer_->read_us();
   }
 
   void PollMillsecond() {
     ms_count_++;
-    if (ms_count_ >= 10) {
+    if (ms_count_ >= kUpdateMs) {
       ms_count_ = 0;
     } else {
       return;
@@ -58,30 +106,94 @@ class SystemInfo::Impl {
 
     data_.pool_size = pool_.size();
     data_.pool_available = pool_.available();
+    data_.pool_available_min =
+        std::min<uint32_t>(data_.pool_available_min, data_.pool_available);
 
     const auto this_idle_count = idle_count;
     data_.idle_rate = this_idle_count - last_idle_count_;
     last_idle_count_ = this_idle_count;
 
+    const uint32_t now_us = timer_->read_us();
+    const uint32_t elapsed_us = now_us - last_us_;
+    last_us_ = now_us;
+
+    if (isr_cycles_) {
+      const uint32_t this_isr_cycles = isr_cycles_();
+      const uint32_t delta_cycles = this_isr_cycles - last_isr_cycles_;
+      last_isr_cycles_ = this_isr_cycles;
+      const float elapsed_cycles =
+          static_cast<float>(elapsed_us) *
+          static_cast<float>(SystemCoreClock / 1000000);
+      data_.isr_fraction = (elapsed_cycles == 0.0f) ? 0.0f :
+          static_cast<float>(delta_cycles) / elapsed_cycles;
+    }
+
+    if (main_loop_) {
+      data_.main_loop_max_us = main_loop_->pass_max_us;
+      for (int i = 0; i < kMaxMainLoopTasks; i++) {
+        const auto& task = main_loop_->tasks[i];
+        data_.task_us[i] = task.total_us - last_task_total_us_[i];
+        last_task_total_us_[i] = task.total_us;
+        data_.task_max_us[i] = task.max_us;
+      }
+    }
+
+    // The high-water mark only ever moves down, so the search can stop
+    // at the deepest point seen so far.
+    const uint32_t* ptr = &__StackLimit;
+    while (ptr < stack_low_ && *ptr == kStackPaint) { ptr++; }
+    stack_low_ = ptr;
+    data_.stack_used = (&__StackTop - stack_low_) * sizeof(uint32_t);
+
     data_updater_();
   }
 
   mjlib::micro::Pool& pool_;
+  MillisecondTimer* const timer_;
+
+  const MainLoop::Stats* main_loop_ = nullptr;
+  mjlib::base::inplace_function<uint32_t()> isr_cycles_;
 
   uint8_t ms_count_ = 0;
   uint32_t last_idle_count_ = 0;
+  uint32_t last_us_ = 0;
+  uint32_t last_isr_cycles_ = 0;
+  std::array<uint32_t, kMaxMainLoopTasks> last_task_total_us_ = {};
+  const uint32_t* stack_low_ = &__StackTop;
+
   SystemInfoData data_;
   mjlib::base::inplace_function<void ()> data_updater_;
 };
 
 SystemInfo::SystemInfo(mjlib::micro::Pool& pool,
-                       mjlib::micro::TelemetryManager& telemetry)
-    : impl_(&pool, pool, telemetry) {}
+                       mjlib::micro::TelemetryManager& telemetry,
+                       MillisecondTimer* timer)
+    : impl_(&pool, pool, telemetry, timer) {}
 
 SystemInfo::~SystemInfo() {}
 
+void SystemInfo::SetMainLoop(const MainLoop::Stats* main_loop) {
+  impl_->main_loop_ = main_loop;
+}
+
+void SystemInfo::SetIsrCycles(
+    mjlib::base::inplace_function<uint32_t()> isr_cycles) {
+  impl_->isr_cycles_ = isr_cycles;
+  impl_->last_isr_cycles_ = isr_cycles();
+}
+
 void SystemInfo::PollMillisecond() {
   impl_->PollMillsecond();
 }
 
+void SystemInfo::PaintStack() {
+  // Everything below the stack pointer is unused.  An interrupt
+  // taken during this loop only uses memory below that as well, and
+  // has returned before the loop continues.
+  uint32_t* const sp = reinterpret_cast<uint32_t*>(__get_MSP());
+  for (uint32_t* ptr = &__StackLimit; ptr < sp - kStackPaintMargin; ptr++) {
+    *ptr = kStackPaint;
+  }
+}
+
 }
@@ -14,9 +14,14 @@
 
 #pragma once
 
+#include "mjlib/base/inplace_function.h"
+
 #include "mjlib/micro/pool_ptr.h"
 #include "mjlib/micro/telemetry_manager.h"
 
+#include "fw/millisecond_timer.h"
+#include "fw/scheduler.h"
+
 namespace moteus {
 
 /// This class keeps track of things like how many main loops we
@@ -24,11 +29,28 @@ namespace moteus {
 /// memory usage.
 class SystemInfo {
  public:
-  SystemInfo(mjlib::micro::Pool&, mjlib::micro::TelemetryManager&);
+  static constexpr int kMaxMainLoopTasks = 8;
+  using MainLoop = Scheduler<kMaxMainLoopTasks>;
+
+  SystemInfo(mjlib::micro::Pool&, mjlib::micro::TelemetryManager&,
+             MillisecondTimer*);
   ~SystemInfo();
 
+  /// Report the timing of the given main loop, which must outlive
+  /// this instance.
+  void SetMainLoop(const MainLoop::Stats*);
+
+  /// @p isr_cycles must return a free running count of the CPU
+  /// cycles spent in interrupt context.
+  void SetIsrCycles(mjlib::base::inplace_function<uint32_t()> isr_cycles);
+
   void PollMillisecond();
 
+  /// Fill the unused portion of the stack with a known pattern so
+  /// that its high-water mark can be reported.  This should be
+  /// called once, as early as possible in main().
+  static void PaintStack();
+
   // Increment this from an idle thread.
   static volatile uint32_t idle_count;
 
@@ -0,0 +1,177 @@
+// Copyright 2019-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/can_tx_queue.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+// The hardware FIFO, which accepts frames while it has room.
+struct Fifo {
+  int free = 0;
+  std::vector<std::pair<uint32_t, std::string>> sent;
+
+  auto sender() {
+    return [this](uint32_t id, std::string_view data) {
+      if (free == 0) { return false; }
+      free--;
+      sent.push_back(std::make_pair(id, std::string(data)));
+      return true;
+    };
+  }
+};
+
+struct Write {
+  int count = 0;
+  mjlib::micro::error_code ec;
+  std::ptrdiff_t size = -1;
+
+  mjlib::micro::SizeCallback callback() {
+    return [this](mjlib::micro::error_code ec_in, std::ptrdiff_t size_in) {
+      count++;
+      ec = ec_in;
+      size = size_in;
+    };
+  }
+};
+
+using Queue = CanTxQueue<4, 2>;
+}
+
+BOOST_AUTO_TEST_CASE(CanTxQueueSendsDirectly) {
+  Fifo fifo;
+  fifo.free = 3;
+  Queue dut;
+
+  Write write;
+  dut.Write(0x102, "abcdefghi", true, write.callback(), fifo.sender());
+  BOOST_TEST(write.count == 1);
+  BOOST_TEST(!write.ec);
+  BOOST_TEST(write.size == 9);
+
+  // The frame is padded to a valid DLC with NOPs.
+  BOOST_TEST_REQUIRE(fifo.sent.size() == 1u);
+  BOOST_TEST(fifo.sent[0].first == 0x102u);
+  BOOST_TEST(fifo.sent[0].second == "abcdefghi\x50\x50\x50");
+  BOOST_TEST(dut.queue_count() == 0);
+  BOOST_TEST(dut.stats().sent == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(CanTxQueueFull) {
+  Fifo fifo;
+  Queue dut;
+
+  // With the FIFO full, writes complete as long as the queue has room.
+  std::vector<Write> writes(7);
+  for (int i = 0; i < 4; i++) {
+    dut.Write(i, std::string(1, 'a' + i), false,
+              writes[i].callback(), fifo.sender());
+    BOOST_TEST(writes[i].count == 1);
+    BOOST_TEST(!writes[i].ec);
+  }
+  BOOST_TEST(dut.queue_count() == 4);
+
+  // After that, they are held, and do not complete.
+  for (int i = 4; i < 6; i++) {
+    dut.Write(i, std::string(1, 'a' + i), false,
+              writes[i].callback(), fifo.sender());
+    BOOST_TEST(writes[i].count == 0);
+  }
+  BOOST_TEST(dut.held_count() == 2);
+
+  // Once everything is full, the write fails.
+  dut.Write(6, "g", false, writes[6].callback(), fifo.sender());
+  BOOST_TEST(writes[6].count == 1);
+  BOOST_TEST((writes[6].ec == mjlib::micro::error_code(errc::kWouldBlock)));
+  BOOST_TEST(writes[6].size == 0);
+  BOOST_TEST(dut.stats().dropped == 1u);
+  BOOST_TEST(dut.stats().held == 2u);
+  BOOST_TEST(dut.stats().queued_peak == 4u);
+
+  // A held write completes as soon as one slot frees up.
+  fifo.free = 1;
+  dut.Poll(fifo.sender());
+  BOOST_TEST(writes[4].count == 1);
+  BOOST_TEST(!writes[4].ec);
+  BOOST_TEST(writes[4].size == 1);
+  BOOST_TEST(writes[5].count == 0);
+
+  fifo.free = 10;
+  dut.Poll(fifo.sender());
+  BOOST_TEST(writes[5].count == 1);
+  BOOST_TEST(dut.queue_count() == 0);
+  BOOST_TEST(dut.held_count() == 0);
+
+  // Every frame which was accepted was sent, in order.
+  BOOST_TEST_REQUIRE(fifo.sent.size() == 6u);
+  for (int i = 0; i < 6; i++) {
+    BOOST_TEST(fifo.sent[i].first == static_cast<uint32_t>(i));
+  }
+  BOOST_TEST(dut.stats().sent == 6u);
+}
+
+BOOST_AUTO_TEST_CASE(CanTxQueuePriority) {
+  Fifo fifo;
+  Queue dut;
+
+  Write write;
+  for (int i = 0; i < 5; i++) {
+    dut.Write(i, "t", false, write.callback(), fifo.sender());
+  }
+  dut.Write(10, "c", true, write.callback(), fifo.sender());
+  BOOST_TEST(dut.held_count() == 2);
+
+  // The held control frame is moved ahead of the held tunnel frame,
+  // and sent as soon as it is in the queue.
+  fifo.free = 2;
+  dut.Poll(fifo.sender());
+  BOOST_TEST_REQUIRE(fifo.sent.size() == 2u);
+  BOOST_TEST(fifo.sent[0].first == 0u);
+  BOOST_TEST(fifo.sent[1].first == 10u);
+}
+
+BOOST_AUTO_TEST_CASE(CanTxQueueWriteFromCallback) {
+  Fifo fifo;
+  Queue dut;
+
+  // A writer which issues its next write upon completion, like a
+  // tunneled stream, is paced by the bus and loses nothing.
+  int next = 0;
+  mjlib::micro::SizeCallback callback;
+  callback = [&](mjlib::micro::error_code ec, std::ptrdiff_t) {
+    BOOST_TEST(!ec);
+    if (next < 20) {
+      const int id = next++;
+      dut.Write(id, "s", false, callback, fifo.sender());
+    }
+  };
+  callback({}, 0);
+
+  BOOST_TEST(next == 5);
+  for (int i = 0; i < 20; i++) {
+    fifo.free = 1;
+    dut.Poll(fifo.sender());
+  }
+  BOOST_TEST(next == 20);
+  BOOST_TEST(dut.stats().dropped == 0u);
+  BOOST_TEST_REQUIRE(fifo.sent.size() == 20u);
+  for (int i = 0; i < 20; i++) {
+    BOOST_TEST(fifo.sent[i].first == static_cast<uint32_t>(i));
+  }
+}
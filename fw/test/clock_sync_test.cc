@@ -0,0 +1,84 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/clock_sync.h"
+
+#include <cstdlib>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+int32_t Delta(uint32_t a, uint32_t b) {
+  return static_cast<int32_t>(a - b);
+}
+}
+
+BOOST_AUTO_TEST_CASE(ClockSyncFirstUpdate) {
+  ClockSync::Config config;
+  ClockSync dut(&config);
+  BOOST_TEST(!dut.valid());
+
+  dut.Update(5000, 100);
+  BOOST_TEST(dut.valid());
+  BOOST_TEST(dut.ToHost(100) == 5000u);
+  BOOST_TEST(dut.ToHost(1100) == 6000u);
+  BOOST_TEST(dut.ToLocal(6000) == 1100u);
+}
+
+BOOST_AUTO_TEST_CASE(ClockSyncTracksRate) {
+  ClockSync::Config config;
+  ClockSync dut(&config);
+
+  // The host runs 200ppm fast, starts at an arbitrary offset, and
+  // both counters wrap during the test.
+  constexpr double kRate = 1.0 + 200e-6;
+  const uint32_t host_start = 0xfff00000u;
+  const uint32_t local_start = 0xffff0000u;
+
+  for (int i = 0; i < 200; i++) {
+    const uint32_t local_elapsed = i * 10000;
+    const uint32_t local = local_start + local_elapsed;
+    const uint32_t host =
+        host_start + static_cast<uint32_t>(local_elapsed * kRate);
+    dut.Update(host, local);
+  }
+
+  BOOST_TEST(dut.status().resets == 0u);
+  BOOST_TEST(std::abs(dut.status().rate_ppm - 200.0f) < 5.0f);
+
+  // Predict half a second beyond the last sync.
+  const uint32_t local_elapsed = 199 * 10000 + 500000;
+  const uint32_t local = local_start + local_elapsed;
+  const uint32_t host =
+      host_start + static_cast<uint32_t>(local_elapsed * kRate);
+  BOOST_TEST(std::abs(Delta(dut.ToHost(local), host)) <= 3);
+  BOOST_TEST(std::abs(Delta(dut.ToLocal(host), local)) <= 3);
+}
+
+BOOST_AUTO_TEST_CASE(ClockSyncResetsOnJump) {
+  ClockSync::Config config;
+  ClockSync dut(&config);
+
+  dut.Update(1000, 0);
+  dut.Update(11000, 10000);
+  BOOST_TEST(dut.status().error_us == 0);
+
+  // The host restarted its time base.
+  dut.Update(500, 20000);
+  BOOST_TEST(dut.status().resets == 1u);
+  BOOST_TEST(dut.ToHost(20000) == 500u);
+  BOOST_TEST(dut.valid());
+}
@@ -0,0 +1,62 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/compact_telemetry.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+float Signal(uint8_t signal) {
+  return 10.0f + static_cast<float>(signal);
+}
+}
+
+BOOST_AUTO_TEST_CASE(CompactTelemetryEmpty) {
+  CompactTelemetry::Config config;
+  CompactTelemetry dut{&config};
+
+  dut.Update(Signal);
+  BOOST_TEST(dut.record()->sample == 1);
+  for (const float value : dut.record()->value) {
+    BOOST_TEST(value == 0.0f);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(CompactTelemetrySelect) {
+  CompactTelemetry::Config config;
+  config.count = 3;
+  config.signals = {{ 4, 0, 7, 9 }};
+  CompactTelemetry dut{&config};
+
+  dut.Update(Signal);
+  BOOST_TEST(dut.record()->value[0] == 14.0f);
+  BOOST_TEST(dut.record()->value[1] == 10.0f);
+  BOOST_TEST(dut.record()->value[2] == 17.0f);
+  BOOST_TEST(dut.record()->value[3] == 0.0f);
+
+  // Reducing the count clears the values no longer selected.
+  config.count = 1;
+  dut.Update(Signal);
+  BOOST_TEST(dut.record()->sample == 2);
+  BOOST_TEST(dut.record()->value[0] == 14.0f);
+  BOOST_TEST(dut.record()->value[2] == 0.0f);
+
+  // Counts beyond the capacity are limited to it.
+  config.count = 200;
+  config.signals = {{ 1, 2, 3, 4, 5, 6 }};
+  dut.Update(Signal);
+  BOOST_TEST(dut.record()->value[5] == 16.0f);
+}
@@ -0,0 +1,44 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Run the control kernel microbenchmarks on the host and report the
+/// time per evaluation in nanoseconds.
+
+#include <chrono>
+#include <cstdlib>
+
+#include <fmt/format.h>
+
+#include "fw/control_bench.h"
+
+int main(int argc, char** argv) {
+  const int iterations = (argc > 1) ? std::atoi(argv[1]) : 20000;
+
+  moteus::ControlBench bench;
+  bench.Run(
+      iterations,
+      []() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+      },
+      [](const moteus::ControlBench::Result& result) {
+        fmt::print("{:32s} {:8.2f} ns\n",
+                   result.name,
+                   static_cast<double>(result.ticks) / result.count);
+      });
+
+  return 0;
+}
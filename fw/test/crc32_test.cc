@@ -0,0 +1,31 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/crc32.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+BOOST_AUTO_TEST_CASE(Crc32MatchesZlib) {
+  const uint8_t check[] = "123456789";
+  // The standard check value, and what zlib.crc32 gives in python.
+  BOOST_TEST(Crc32(check, sizeof(check) - 1) == 0xcbf43926u);
+  BOOST_TEST(Crc32(check, 0) == 0u);
+
+  const uint8_t erased[8] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  };
+  BOOST_TEST(Crc32(erased, sizeof(erased)) == 0x2144df1cu);
+}
@@ -0,0 +1,113 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/encoder_calibrator.h"
+
+#include <cmath>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+// The true offset of the simulated motor, as a function of position.
+float TrueOffset(float position) {
+  return 0.4f + 0.15f * std::sin(k2Pi * position / 65536.0f);
+}
+
+uint16_t ToPhase(double radians) {
+  const double wrapped = radians - 2.0 * M_PI * std::floor(radians / (2.0 * M_PI));
+  return static_cast<uint16_t>(
+      static_cast<int64_t>(wrapped * 65536.0 / (2.0 * M_PI)) & 0xffff);
+}
+
+// Simulate a calibration sweep of a motor with @p pole_pairs, where
+// the rotor lags the commanded phase by @p lag radians.
+void Sweep(EncoderCalibrator* dut, int pole_pairs, bool invert, float lag) {
+  // Each sample advances 1/1000 of an electrical cycle, as 'd cal'
+  // does at its default speed.
+  const double step = 65536.0 / pole_pairs / 1000.0;
+  auto sample = [&](bool up, double position) {
+    const double electrical =
+        pole_pairs * position * 2.0 * M_PI / 65536.0 +
+        TrueOffset(static_cast<float>(
+            position - 65536.0 * std::floor(position / 65536.0)));
+    const uint16_t phase = ToPhase(electrical + (up ? lag : -lag));
+    const uint16_t position_u16 = static_cast<uint16_t>(
+        static_cast<int64_t>(std::floor(position)) & 0xffff);
+    const uint16_t encoder = invert ?
+        static_cast<uint16_t>(65536 - position_u16) : position_u16;
+    dut->Sample(up, phase, encoder);
+  };
+
+  double position = 1000.0;
+  for (double moved = 0; moved < 70000.0; moved += step) {
+    sample(true, position);
+    position += step;
+  }
+  for (double moved = 0; moved < 70000.0; moved += step) {
+    sample(false, position);
+    position -= step;
+  }
+}
+
+float WrapAngle(float value) {
+  return std::remainder(value, k2Pi);
+}
+}
+
+BOOST_AUTO_TEST_CASE(EncoderCalibratorBasic) {
+  for (const bool invert : {false, true}) {
+    for (const int pole_pairs : {7, 11, 20}) {
+      BOOST_TEST_CONTEXT("invert " << invert << " pole_pairs " << pole_pairs) {
+        EncoderCalibrator dut;
+        dut.Reset();
+        Sweep(&dut, pole_pairs, invert, 0.3f);
+
+        const auto& result = dut.Calculate();
+        BOOST_TEST(result.error == EncoderCalibrator::kNone);
+        BOOST_TEST(result.poles == 2 * pole_pairs);
+        BOOST_TEST(result.invert == invert);
+
+        constexpr int kSize = 64;
+        for (int i = 0; i < kSize; i++) {
+          const float position = 65536.0f * i / kSize;
+          const float expected = TrueOffset(position);
+          BOOST_TEST_CONTEXT("index " << i) {
+            BOOST_TEST(std::abs(WrapAngle(dut.Offset(i, kSize) - expected))
+                       < 0.03f);
+          }
+        }
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(EncoderCalibratorErrors) {
+  {
+    EncoderCalibrator dut;
+    dut.Reset();
+    BOOST_TEST(dut.Calculate().error == EncoderCalibrator::kTooFewSamples);
+  }
+
+  {
+    // The encoder never moved, as if the magnet were missing.
+    EncoderCalibrator dut;
+    dut.Reset();
+    for (int i = 0; i < 10000; i++) {
+      dut.Sample(true, static_cast<uint16_t>(i * 50), 1234);
+    }
+    BOOST_TEST(dut.Calculate().error == EncoderCalibrator::kEncoderDistance);
+  }
+}
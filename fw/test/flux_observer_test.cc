@@ -0,0 +1,136 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/flux_observer.h"
+
+#include <cmath>
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include "fw/motor_plant.h"
+
+using namespace moteus;
+
+namespace {
+constexpr float kPeriod = 25e-6f;
+constexpr int kSubsteps = 20;
+
+float AngleError(float a, float b) {
+  return std::abs(WrapZeroToTwoPi(a - b + kPi) - kPi);
+}
+
+struct Fixture {
+  Fixture() {
+    plant_config.coulomb_Nm = 0.0f;
+    // The rotor holds its speed regardless of the torque applied.
+    plant_config.inertia_kgm2 = 1e6f;
+  }
+
+  float pole_pairs() const { return 0.5f * plant_config.poles; }
+
+  float flux_linkage() const {
+    return plant_config.torque_constant_Nm_per_A / (1.5f * pole_pairs());
+  }
+
+  float electrical_theta() const {
+    const SinCos sc = plant.electrical_sin_cos();
+    return WrapZeroToTwoPi(std::atan2(sc.s, sc.c));
+  }
+
+  // Run at @p velocity_rad_s, with the back EMF and resistive drop
+  // of @p q_A fed forward, reporting the encoder angle offset by
+  // @p encoder_error.  Returns the last observer output.
+  float Run(float velocity_rad_s, float q_A, float encoder_error, int cycles) {
+    plant.mutable_state()->velocity_rad_s = velocity_rad_s;
+    const float omega_e = pole_pairs() * velocity_rad_s;
+    const float electrical_hz = omega_e / k2Pi;
+
+    float result = 0.0f;
+    for (int i = 0; i < cycles; i++) {
+      const SinCos sc = plant.electrical_sin_cos();
+      const InverseDqTransform v(
+          sc, 0.0f,
+          omega_e * flux_linkage() + plant_config.resistance_ohm * q_A);
+      // The plant holds its voltage fixed in the rotor frame over a
+      // step, where the inverter holds it fixed in the stationary
+      // frame, so substep to make the difference negligible.
+      for (int j = 0; j < kSubsteps; j++) {
+        plant.Step(v.a, v.b, v.c, 0.0f, kPeriod / kSubsteps);
+      }
+
+      const auto current = plant.phase_currents();
+      result = dut.Update(ClarkTransform(v.a, v.b, v.c),
+                          ClarkTransform(current.a, current.b, current.c),
+                          WrapZeroToTwoPi(electrical_theta() + encoder_error),
+                          electrical_hz);
+    }
+    return result;
+  }
+
+  MotorPlant::Config plant_config;
+  MotorPlant plant{plant_config};
+  FluxObserver::Config config;
+  FluxObserver dut{&config};
+};
+}
+
+BOOST_AUTO_TEST_CASE(FluxObserverTracksAngle) {
+  Fixture f;
+  f.dut.SetMotor(f.plant_config.resistance_ohm, f.plant_config.inductance_H,
+                 f.flux_linkage(), kPeriod);
+  BOOST_TEST(f.dut.configured());
+
+  // 7 pole pairs at 100 rad/s is ~110Hz electrical, below the blend,
+  // so the encoder is used directly, but the observer still tracks.
+  const float result = f.Run(100.0f, 2.0f, 0.3f, 20000);
+  BOOST_TEST(f.dut.status().blend == 0.0f);
+  BOOST_TEST(AngleError(result, f.electrical_theta() + 0.3f) < 1e-5f);
+  BOOST_TEST(std::abs(f.dut.status().error + 0.3f) < 0.03f);
+}
+
+BOOST_AUTO_TEST_CASE(FluxObserverReplacesEncoderAtSpeed) {
+  Fixture f;
+  f.dut.SetMotor(f.plant_config.resistance_ohm, f.plant_config.inductance_H,
+                 f.flux_linkage(), kPeriod);
+
+  // ~780Hz electrical, above the blend, with an encoder which is
+  // badly off.
+  const float result = f.Run(700.0f, 5.0f, 0.3f, 20000);
+  BOOST_TEST(f.dut.status().blend == 1.0f);
+  BOOST_TEST(AngleError(result, f.electrical_theta()) < 0.03f);
+}
+
+BOOST_AUTO_TEST_CASE(FluxObserverBlends) {
+  Fixture f;
+  f.dut.SetMotor(f.plant_config.resistance_ohm, f.plant_config.inductance_H,
+                 f.flux_linkage(), kPeriod);
+
+  // 450Hz electrical is half way through the default blend.
+  const float velocity = 450.0f * k2Pi / f.pole_pairs();
+  const float result = f.Run(velocity, 0.0f, 0.2f, 20000);
+  BOOST_TEST(std::abs(f.dut.status().blend - 0.5f) < 0.01f);
+  BOOST_TEST(AngleError(result, f.electrical_theta() + 0.1f) < 0.02f);
+}
+
+BOOST_AUTO_TEST_CASE(FluxObserverRecoversFromBadSeed) {
+  Fixture f;
+  f.dut.SetMotor(f.plant_config.resistance_ohm, f.plant_config.inductance_H,
+                 f.flux_linkage(), kPeriod);
+
+  // Seed from an encoder which is a quarter turn off, then let it
+  // converge with the encoder fixed.
+  f.Run(700.0f, 0.0f, 1.5f, 1);
+  f.Run(700.0f, 0.0f, 0.0f, 20000);
+  BOOST_TEST(std::abs(f.dut.status().error) < 0.03f);
+}
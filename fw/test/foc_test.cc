@@ -81,3 +81,66 @@ BOOST_AUTO_TEST_CASE(FocTest2) {
   BOOST_TEST(idq.b == ict.b);
   BOOST_TEST(idq.c == ict.c);
 }
+
+BOOST_AUTO_TEST_CASE(SpaceVectorModulationTest) {
+  Cordic cordic;
+
+  for (int i = 0; i < 64; i++) {
+    const float theta = k2Pi * i / 64;
+    SinCos sin_cos = cordic.radians(theta);
+    InverseDqTransform idq(sin_cos, 0.0f, 1.0f);
+    SpaceVectorModulation svm(idq.a, idq.b, idq.c);
+
+    // The line to line voltages are unchanged.
+    BOOST_TEST(std::abs((svm.a - svm.b) - (idq.a - idq.b)) <= 1e-5f);
+    BOOST_TEST(std::abs((svm.b - svm.c) - (idq.b - idq.c)) <= 1e-5f);
+
+    // And no phase exceeds sqrt(3) / 2 of the commanded amplitude.
+    const float max_phase =
+        std::max(std::abs(svm.a), std::max(std::abs(svm.b), std::abs(svm.c)));
+    BOOST_TEST(max_phase <= 0.5f * kSqrt3 + 1e-5f);
+  }
+
+  SpaceVectorModulation svm(1.0f, -0.5f, -0.5f);
+  BOOST_TEST(svm.offset == -0.25f);
+  BOOST_TEST(svm.a == 0.75f);
+  BOOST_TEST(svm.b == -0.75f);
+  BOOST_TEST(svm.c == -0.75f);
+}
+
+BOOST_AUTO_TEST_CASE(FocFusedTransformTest) {
+  Cordic cordic;
+
+  for (int i = 0; i < 64; i++) {
+    const float theta = k2Pi * i / 64;
+    SinCos sc = cordic.radians(theta);
+
+    const float a = 2.0f * std::cos(0.3f * i);
+    const float b = -1.0f + 0.1f * i;
+    const float c = 0.5f;
+
+    // Compare against the textbook form of the transform.
+    DqTransform dq(sc, a, b, c);
+    const float cos_m = std::cos(theta - k2Pi / 3.0f);
+    const float cos_p = std::cos(theta + k2Pi / 3.0f);
+    const float sin_m = std::sin(theta - k2Pi / 3.0f);
+    const float sin_p = std::sin(theta + k2Pi / 3.0f);
+    BOOST_TEST(std::abs(
+                   dq.d - (2.0f / 3.0f) * (a * sc.c + b * cos_m + c * cos_p))
+               <= 1e-4f);
+    BOOST_TEST(std::abs(
+                   dq.q + (2.0f / 3.0f) * (a * sc.s + b * sin_m + c * sin_p))
+               <= 1e-4f);
+
+    InverseDqTransform idq(sc, dq.d, dq.q);
+    BOOST_TEST(std::abs(idq.a - (sc.c * dq.d - sc.s * dq.q)) <= 1e-4f);
+    BOOST_TEST(std::abs(idq.b - (cos_m * dq.d - sin_m * dq.q)) <= 1e-4f);
+    BOOST_TEST(std::abs(idq.c - (cos_p * dq.d - sin_p * dq.q)) <= 1e-4f);
+
+    // The inverse recovers the balanced part of the input.
+    const float common = (a + b + c) / 3.0f;
+    BOOST_TEST(std::abs(idq.a - (a - common)) <= 1e-4f);
+    BOOST_TEST(std::abs(idq.b - (b - common)) <= 1e-4f);
+    BOOST_TEST(std::abs(idq.c - (c - common)) <= 1e-4f);
+  }
+}
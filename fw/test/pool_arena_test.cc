@@ -0,0 +1,59 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/pool_arena.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+// A bump allocator which aligns each allocation.
+class TestPool : public mjlib::micro::Pool {
+ public:
+  void* Allocate(size_t size, size_t alignment) override {
+    const size_t start = (used_ + alignment - 1) / alignment * alignment;
+    used_ = start + size;
+    return &data_[start];
+  }
+
+  size_t size() const override { return sizeof(data_); }
+  size_t available() const override { return sizeof(data_) - used_; }
+
+ private:
+  alignas(8) char data_[256] = {};
+  size_t used_ = 0;
+};
+}
+
+BOOST_AUTO_TEST_CASE(PoolArenaAccounting) {
+  TestPool pool;
+  uint32_t used_a = 0;
+  uint32_t used_b = 0;
+  PoolArena a(&pool, &used_a);
+  PoolArena b(&pool, &used_b);
+
+  a.Allocate(3, 1);
+  BOOST_TEST(used_a == 3);
+
+  // The alignment padding is charged to the arena which needed it.
+  b.Allocate(8, 4);
+  BOOST_TEST(used_b == 9);
+  a.Allocate(4, 4);
+  BOOST_TEST(used_a == 7);
+
+  BOOST_TEST(a.size() == 256);
+  BOOST_TEST(b.available() == 256 - 16);
+  BOOST_TEST(used_a + used_b == pool.size() - pool.available());
+}
@@ -0,0 +1,159 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/reply_template.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+std::string_view ToView(const uint8_t* data, size_t size) {
+  return std::string_view(reinterpret_cast<const char*>(data), size);
+}
+}
+
+BOOST_AUTO_TEST_CASE(ReplyTemplateLayout) {
+  float position = 0.5f;
+  float velocity = -2.0f;
+
+  ReplyTemplate dut;
+  ReplyTemplate::Layout layout = {};
+  layout[0] = { 0x000, 3, 1 };
+  layout[1] = { 0x00f, 1, 0 };
+  dut.Compile(layout, [&](int32_t reg) {
+      ReplyTemplate::Source result;
+      if (reg == 0x001) {
+        result.value = &position;
+        result.scale = {{0.01f, 1.0f / 1024.0f, 0.00001f}};
+      } else if (reg == 0x002) {
+        result.value = &velocity;
+        result.scale = {{0.1f, 0.25f, 0.00001f}};
+      }
+      return result;
+    });
+
+  BOOST_TEST(dut.field_count() == 4);
+
+  int fallback_count = 0;
+  auto fallback = [&](int32_t reg, int resolution, char* dest) {
+    fallback_count++;
+    if (resolution == 1) {
+      const int16_t value = reg + 10;
+      std::memcpy(dest, &value, sizeof(value));
+    } else {
+      *dest = static_cast<char>(reg + 20);
+    }
+  };
+
+  {
+    const uint8_t expected[] = {
+      0x27, 0x00,
+      0x0a, 0x00,  // mode fallback
+      0x00, 0x02,  // 512
+      0xf8, 0xff,  // -8
+      0x21, 0x0f,
+      0x23,  // fault fallback
+    };
+    BOOST_TEST(dut.Render(fallback) == ToView(expected, sizeof(expected)));
+    BOOST_TEST(fallback_count == 2);
+  }
+
+  // Only the values change from one render to the next.
+  position = std::numeric_limits<float>::quiet_NaN();
+  velocity = 1e6f;
+  {
+    const uint8_t expected[] = {
+      0x27, 0x00,
+      0x0a, 0x00,
+      0x00, 0x80,  // NaN
+      0xff, 0x7f,  // saturated
+      0x21, 0x0f,
+      0x23,
+    };
+    BOOST_TEST(dut.Render(fallback) == ToView(expected, sizeof(expected)));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ReplyTemplateFloatAndLongCount) {
+  float values[5] = { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f };
+
+  ReplyTemplate dut;
+  ReplyTemplate::Layout layout = {};
+  layout[0] = { 0x120, 5, 3 };
+  dut.Compile(layout, [&](int32_t reg) {
+      ReplyTemplate::Source result;
+      result.value = &values[reg - 0x120];
+      return result;
+    });
+
+  const auto data = dut.Render([](int32_t, int, char*) {
+      BOOST_TEST(false);
+    });
+  BOOST_TEST(data.size() == 4 + 5 * 4);
+  // The count does not fit in the type byte, and the register
+  // requires a two byte varuint.
+  BOOST_TEST(static_cast<uint8_t>(data[0]) == 0x2c);
+  BOOST_TEST(static_cast<uint8_t>(data[1]) == 5);
+  BOOST_TEST(static_cast<uint8_t>(data[2]) == 0xa0);
+  BOOST_TEST(static_cast<uint8_t>(data[3]) == 0x02);
+
+  float last = 0.0f;
+  std::memcpy(&last, &data[4 + 4 * 4], sizeof(last));
+  BOOST_TEST(last == 5.0f);
+}
+
+BOOST_AUTO_TEST_CASE(ReplyTemplateOverflow) {
+  float value = 0.0f;
+
+  ReplyTemplate dut;
+  ReplyTemplate::Layout layout = {};
+  layout[0] = { 0x000, 10, 2 };
+  // This would bring the total past 64 bytes, so is dropped.
+  layout[1] = { 0x020, 10, 2 };
+  dut.Compile(layout, [&](int32_t) {
+      ReplyTemplate::Source result;
+      result.value = &value;
+      result.scale = {{1.0f, 1.0f, 1.0f}};
+      return result;
+    });
+
+  BOOST_TEST(dut.field_count() == 10);
+  BOOST_TEST(dut.size() == 3 + 10 * 4);
+}
+
+BOOST_AUTO_TEST_CASE(ReplyTemplatePrefix) {
+  float value = 1.0f;
+
+  ReplyTemplate dut;
+  ReplyTemplate::Layout layout = {};
+  layout[0] = { 0x001, 1, 0 };
+  const auto resolve = [&](int32_t) {
+    ReplyTemplate::Source result;
+    result.value = &value;
+    result.scale = {{0.5f, 1.0f, 1.0f}};
+    return result;
+  };
+  dut.Compile(layout, resolve, "\x63");
+
+  {
+    const uint8_t expected[] = { 0x63, 0x21, 0x01, 0x02 };
+    BOOST_TEST(dut.Render([](int32_t, int, char*) {}) ==
+               ToView(expected, sizeof(expected)));
+  }
+
+  // With nothing to report, the prefix is not sent either.
+  dut.Compile(ReplyTemplate::Layout{}, resolve, "\x63");
+  BOOST_TEST(dut.size() == 0);
+}
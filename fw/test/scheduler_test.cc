@@ -0,0 +1,109 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/scheduler.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+// Each task advances the simulated clock by its cost when run.
+struct Context {
+  uint32_t now = 1000;
+  Scheduler<4> dut{100};
+  std::array<int, 4> runs = {};
+
+  void Add(int index, uint32_t period_us, uint32_t cost_us) {
+    auto function = [this, index, cost_us]() {
+      runs[index]++;
+      now += cost_us;
+    };
+    if (period_us == 0) {
+      dut.AddPoller(function);
+    } else {
+      dut.AddPeriodic(period_us, function);
+    }
+  }
+
+  void Run() {
+    dut.Run([this]() { return now; });
+  }
+};
+}
+
+BOOST_AUTO_TEST_CASE(SchedulerPollersEveryPass) {
+  Context ctx;
+  ctx.Add(0, 0, 5);
+  ctx.Add(1, 1000, 5);
+
+  for (int i = 0; i < 10; i++) { ctx.Run(); }
+  BOOST_TEST(ctx.runs[0] == 10);
+  // The periodic task is due on the first pass, and not again until
+  // a full period has elapsed.
+  BOOST_TEST(ctx.runs[1] == 1);
+
+  ctx.now += 1000;
+  ctx.Run();
+  BOOST_TEST(ctx.runs[1] == 2);
+
+  const auto& stats = *ctx.dut.stats();
+  BOOST_TEST(stats.passes == 11);
+  BOOST_TEST(stats.tasks[0].runs == 11);
+  BOOST_TEST(stats.tasks[0].last_us == 5);
+  BOOST_TEST(stats.tasks[0].total_us == 55);
+  BOOST_TEST(stats.tasks[1].max_us == 5);
+  BOOST_TEST(stats.pass_max_us == 10);
+}
+
+BOOST_AUTO_TEST_CASE(SchedulerBudgetSpreadsTasks) {
+  Context ctx;
+  ctx.Add(0, 0, 10);
+  ctx.Add(1, 1000, 95);
+  ctx.Add(2, 1000, 95);
+  ctx.Add(3, 1000, 95);
+
+  // Only the first periodic task fits in the first pass.
+  ctx.Run();
+  BOOST_TEST(ctx.runs[0] == 1);
+  BOOST_TEST(ctx.runs[1] == 1);
+  BOOST_TEST(ctx.runs[2] == 0);
+  BOOST_TEST(ctx.runs[3] == 0);
+
+  ctx.Run();
+  BOOST_TEST(ctx.runs[2] == 1);
+  BOOST_TEST(ctx.runs[3] == 0);
+
+  ctx.Run();
+  BOOST_TEST(ctx.runs[3] == 1);
+
+  // The poller still ran every time.
+  BOOST_TEST(ctx.runs[0] == 3);
+  BOOST_TEST(ctx.dut.stats()->tasks[3].deferred == 2);
+}
+
+BOOST_AUTO_TEST_CASE(SchedulerNoCatchUp) {
+  Context ctx;
+  ctx.Add(0, 1000, 1);
+
+  ctx.Run();
+  ctx.now += 5500;
+  ctx.Run();
+  ctx.Run();
+  BOOST_TEST(ctx.runs[0] == 2);
+
+  ctx.now += 1000;
+  ctx.Run();
+  BOOST_TEST(ctx.runs[0] == 3);
+}
@@ -0,0 +1,105 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/scope.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+// Each signal is just its identifier plus the sample count, so that
+// the recorded values can be predicted.
+struct Context {
+  float buffer[64] = {};
+  Scope dut{buffer, 64};
+  int count = 0;
+
+  void Sample(uint8_t events = 0) {
+    dut.ISR_Sample(events, [&](uint8_t signal) {
+        return static_cast<float>(count + 1000 * signal);
+      });
+    count++;
+  }
+};
+}
+
+BOOST_AUTO_TEST_CASE(ScopeIdle) {
+  Context ctx;
+  ctx.Sample();
+  BOOST_TEST(ctx.dut.state() == Scope::kIdle);
+  BOOST_TEST(ctx.dut.frames() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(ScopeRisingPreTrigger) {
+  Context ctx;
+
+  Scope::Options options;
+  options.channels = 2;
+  options.signals = {{0, 1}};
+  options.trigger = Scope::kRising;
+  options.level = 50.0f;
+  options.post_trigger = 8;
+  ctx.dut.Arm(options);
+
+  for (int i = 0; i < 100; i++) {
+    ctx.Sample();
+    if (i < 57) {
+      BOOST_TEST(ctx.dut.state() != Scope::kComplete);
+    }
+  }
+
+  // The trigger happened on sample 50, and 8 samples including it
+  // were recorded afterwards.
+  BOOST_TEST(ctx.dut.state() == Scope::kComplete);
+  BOOST_TEST(ctx.dut.frames() == 32);
+  BOOST_TEST(ctx.dut.trigger_frame() == 24);
+  BOOST_TEST(ctx.dut.value(ctx.dut.trigger_frame(), 0) == 50.0f);
+  BOOST_TEST(ctx.dut.value(ctx.dut.trigger_frame(), 1) == 1050.0f);
+  BOOST_TEST(ctx.dut.value(0, 0) == 26.0f);
+  BOOST_TEST(ctx.dut.value(31, 0) == 57.0f);
+}
+
+BOOST_AUTO_TEST_CASE(ScopeEventDecimation) {
+  Context ctx;
+
+  Scope::Options options;
+  options.channels = 1;
+  options.signals = {{2}};
+  options.trigger = Scope::kFault;
+  options.decimation = 4;
+  options.post_trigger = 2;
+  ctx.dut.Arm(options);
+
+  for (int i = 0; i < 10; i++) { ctx.Sample(); }
+  BOOST_TEST(ctx.dut.state() == Scope::kArmed);
+  BOOST_TEST(ctx.dut.frames() == 2);
+
+  // An event between recorded samples is latched until the next
+  // one.
+  ctx.Sample(Scope::kEventFault);
+  BOOST_TEST(ctx.dut.state() == Scope::kArmed);
+  ctx.Sample();
+  BOOST_TEST(ctx.dut.state() == Scope::kTriggered);
+  for (int i = 0; i < 8; i++) { ctx.Sample(); }
+
+  BOOST_TEST(ctx.dut.state() == Scope::kComplete);
+  BOOST_TEST(ctx.dut.frames() == 4);
+  BOOST_TEST(ctx.dut.value(ctx.dut.trigger_frame(), 0) == 2011.0f);
+  BOOST_TEST(ctx.dut.value(3, 0) == 2015.0f);
+
+  // Nothing more is recorded once complete.
+  for (int i = 0; i < 8; i++) { ctx.Sample(); }
+  BOOST_TEST(ctx.dut.frames() == 4);
+}
@@ -0,0 +1,85 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/servo_registers.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+constexpr int32_t kPositionRegister =
+    static_cast<int32_t>(Register::kPosition);
+
+int16_t RenderPosition(ServoRegisters* dut, ReplyTemplate* reply_template) {
+  ReplyTemplate::Layout layout = {};
+  layout[0] = { kPositionRegister, 1, 1 };
+  reply_template->Compile(layout, [&](int32_t reg) {
+      return dut->ResolveSource(reg);
+    });
+  const auto frame = reply_template->Render(
+      [&](int32_t reg, int resolution, char* dest) {
+        const auto result = dut->Read(reg, resolution);
+        const auto value = std::get<int16_t>(
+            std::get<ServoRegisters::Value>(result));
+        std::memcpy(dest, &value, sizeof(value));
+      });
+  BOOST_TEST_REQUIRE(frame.size() == 4u);
+  int16_t result = 0;
+  std::memcpy(&result, &frame[2], sizeof(result));
+  return result;
+}
+}
+
+BOOST_AUTO_TEST_CASE(ServoRegistersTemplateScale) {
+  BldcServoStatus status;
+  BldcServoControl control;
+  status.unwrapped_position = 12.5f;
+
+  ServoRegisters dut(&status, &control);
+  ReplyTemplate reply_template;
+
+  // At the default scale, this is beyond the range of an int16.
+  BOOST_TEST(RenderPosition(&dut, &reply_template) == 32767);
+
+  RegisterScaleConfig config;
+  config.position = 10.0f;
+  dut.SetScale(config);
+
+  // A recompiled template uses the new scale, and agrees with the
+  // generic register read.
+  BOOST_TEST(RenderPosition(&dut, &reply_template) == 12500);
+  BOOST_TEST(std::get<int16_t>(
+                 std::get<ServoRegisters::Value>(dut.Read(kPositionRegister, 1))) ==
+             12500);
+}
+
+BOOST_AUTO_TEST_CASE(ServoRegistersCommandScale) {
+  BldcServoStatus status;
+  BldcServoControl control;
+  ServoRegisters dut(&status, &control);
+
+  RegisterScaleConfig config;
+  config.position = 10.0f;
+  dut.SetScale(config);
+
+  BOOST_TEST(dut.Write(0x000, int8_t(10)) == 0u);
+  BOOST_TEST(dut.Write(0x020, int16_t(5000)) == 0u);
+  BOOST_TEST(dut.command_valid());
+  BOOST_TEST(dut.command().mode == BldcServoMode::kPosition);
+  BOOST_TEST(std::abs(dut.command().position - 5.0f) < 1e-5f);
+}
@@ -0,0 +1,57 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Simulate a number of servos tracking a position step, and report
+/// how much faster than real time the simulation runs on this host.
+
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "fw/servo_sim.h"
+
+int main(int argc, char** argv) {
+  const int servos = (argc > 1) ? std::atoi(argv[1]) : 12;
+  const double seconds = (argc > 2) ? std::atof(argv[2]) : 1.0;
+
+  std::vector<moteus::ServoSim> sims(servos);
+  for (auto& sim : sims) {
+    sim.Write(0x000, int8_t(10));
+    sim.Write(0x020, 0.5f);
+    sim.Write(0x027, std::numeric_limits<float>::quiet_NaN());
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  for (auto& sim : sims) {
+    sim.Run(seconds);
+  }
+  const auto end = std::chrono::steady_clock::now();
+  const double elapsed =
+      std::chrono::duration<double>(end - start).count();
+
+  for (size_t i = 0; i < sims.size(); i++) {
+    const auto& status = sims[i].status();
+    fmt::print("servo {:2d} mode {:2d} position {:8.4f} velocity {:8.4f}\n",
+               i, static_cast<int>(status.mode),
+               status.unwrapped_position, status.velocity);
+  }
+  fmt::print("{} servos, {:.3f}s simulated in {:.3f}s, {:.1f}x real time\n",
+             servos, seconds, elapsed, seconds * servos / elapsed);
+
+  return 0;
+}
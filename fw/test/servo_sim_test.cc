@@ -0,0 +1,203 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/servo_sim.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+BOOST_AUTO_TEST_CASE(MotorPlantAcceleratesUnderLoad) {
+  MotorPlant::Config config;
+  config.coulomb_Nm = 0.0f;
+  config.viscous_Nm_per_rad_s = 0.0f;
+  MotorPlant dut(config);
+
+  for (int i = 0; i < 1000; i++) {
+    dut.StepOpen(-0.1f, 1e-4f);
+  }
+
+  // Against no friction, the rotor accelerates at 0.1 / 1e-4 rad/s^2
+  // for 0.1s.
+  BOOST_TEST(std::abs(dut.state().velocity_rad_s - 100.0f) < 0.5f);
+  BOOST_TEST(std::abs(dut.state().angle_rad - 5.0) < 0.1);
+  BOOST_TEST(dut.state().q_A == 0.0f);
+}
+
+BOOST_AUTO_TEST_CASE(MotorPlantBackEmf) {
+  MotorPlant::Config config;
+  MotorPlant dut(config);
+  dut.mutable_state()->velocity_rad_s = 100.0f;
+
+  // With the phases shorted, the speed voltage drives a current which
+  // brakes the rotor.
+  for (int i = 0; i < 10; i++) {
+    dut.Step(0.0f, 0.0f, 0.0f, 0.0f, 25e-6f);
+  }
+  BOOST_TEST(dut.state().q_A < -10.0f);
+  BOOST_TEST(dut.state().torque_Nm < 0.0f);
+  BOOST_TEST(dut.state().velocity_rad_s < 95.0f);
+}
+
+BOOST_AUTO_TEST_CASE(MotorPlantCoulombHolds) {
+  MotorPlant::Config config;
+  config.coulomb_Nm = 0.1f;
+  MotorPlant dut(config);
+
+  for (int i = 0; i < 1000; i++) {
+    dut.StepOpen(0.05f, 1e-4f);
+  }
+  BOOST_TEST(dut.state().velocity_rad_s == 0.0f);
+  BOOST_TEST(dut.state().angle_rad == 0.0);
+}
+
+BOOST_AUTO_TEST_CASE(ServoSimCurrentTracks) {
+  ServoSim dut;
+  // Hold the rotor, so that the current loop sees no back EMF.
+  BOOST_TEST(dut.Write(0x000, int8_t(9)) == 0u);
+  BOOST_TEST(dut.Write(0x01c, 2.0f) == 0u);
+
+  for (int i = 0; i < 4000; i++) {
+    dut.Step();
+    dut.mutable_plant()->mutable_state()->velocity_rad_s = 0.0f;
+  }
+
+  BOOST_TEST(dut.status().mode == kCurrent);
+  BOOST_TEST(std::abs(dut.status().q_A - 2.0f) < 0.05f);
+  BOOST_TEST(std::abs(dut.status().d_A) < 0.05f);
+}
+
+BOOST_AUTO_TEST_CASE(ServoSimCommutationAdvance) {
+  ServoSim::Config config;
+  // At the speed below, this is about 0.35 electrical radians.
+  config.commutation_advance_cycles = 20.0f;
+  ServoSim dut(config);
+  BOOST_TEST(dut.Write(0x000, int8_t(9)) == 0u);
+  BOOST_TEST(dut.Write(0x01c, 2.0f) == 0u);
+
+  for (int i = 0; i < 4000; i++) {
+    dut.Step();
+    dut.mutable_plant()->mutable_state()->velocity_rad_s = 100.0f;
+  }
+
+  // Only the modulation is advanced.  The currents are still
+  // transformed with the angle they were sampled at, so the current
+  // loop holds the actual d axis current at zero, rather than
+  // injecting some in proportion to the speed.
+  BOOST_TEST(dut.status().mode == kCurrent);
+  BOOST_TEST(std::abs(dut.status().q_A - 2.0f) < 0.05f);
+  BOOST_TEST(std::abs(dut.status().d_A) < 0.05f);
+  BOOST_TEST(std::abs(dut.plant().state().q_A - 2.0f) < 0.05f);
+  BOOST_TEST(std::abs(dut.plant().state().d_A) < 0.05f);
+}
+
+BOOST_AUTO_TEST_CASE(ServoSimPositionStep) {
+  ServoSim dut;
+  BOOST_TEST(dut.Write(0x000, int8_t(10)) == 0u);
+  BOOST_TEST(dut.Write(0x020, 0.5f) == 0u);
+  BOOST_TEST(dut.Write(0x027, std::numeric_limits<float>::quiet_NaN()) == 0u);
+
+  dut.Run(1.0);
+
+  BOOST_TEST(dut.status().mode == kPosition);
+  BOOST_TEST(std::abs(dut.status().unwrapped_position - 0.5f) < 0.002f);
+  BOOST_TEST(std::abs(dut.status().velocity) < 0.05f);
+  BOOST_TEST(dut.time_s() == 1.0);
+}
+
+BOOST_AUTO_TEST_CASE(ServoSimTimeout) {
+  ServoSim dut;
+  dut.Write(0x000, int8_t(10));
+  dut.Write(0x020, 0.0f);
+
+  dut.Run(0.05);
+  BOOST_TEST(dut.status().mode == kPosition);
+  dut.Run(0.1);
+  BOOST_TEST(dut.status().mode == kPositionTimeout);
+
+  // Only a stop command leaves the timeout mode.
+  dut.Write(0x000, int8_t(10));
+  dut.Step();
+  BOOST_TEST(dut.status().mode == kPositionTimeout);
+  dut.Write(0x000, int8_t(0));
+  dut.Step();
+  BOOST_TEST(dut.status().mode == kStopped);
+}
+
+BOOST_AUTO_TEST_CASE(ServoSimFrame) {
+  ServoSim dut;
+
+  const uint8_t command[] = {
+    // Write int8 mode = 10
+    0x01, 0x00, 0x0a,
+    // Write 2 int16, position and velocity, starting at 0x020
+    0x06, 0x20, 0x00, 0x00, 0x00, 0x04,
+    // Write float timeout = NaN
+    0x0d, 0x27, 0x00, 0x00, 0xc0, 0x7f,
+    // NOP padding
+    0x50,
+  };
+  uint8_t reply[64] = {};
+  BOOST_TEST(dut.HandleFrame(command, sizeof(command),
+                             reply, sizeof(reply)) == 0u);
+
+  dut.Run(0.5);
+
+  const uint8_t query[] = {
+    // Read int8 mode and 3 int16 registers starting at position.
+    0x11, 0x00,
+    0x17, 0x01,
+    // Read an unknown register.
+    0x11, 0x7e,
+  };
+  const size_t size =
+      dut.HandleFrame(query, sizeof(query), reply, sizeof(reply));
+  BOOST_TEST_REQUIRE(size == 17u);
+
+  BOOST_TEST(reply[0] == 0x21);
+  BOOST_TEST(reply[1] == 0x00);
+  BOOST_TEST(reply[2] == 10);
+
+  BOOST_TEST(reply[3] == 0x27);
+  BOOST_TEST(reply[4] == 0x01);
+  int16_t position = 0;
+  std::memcpy(&position, &reply[5], 2);
+  // The command ran at 1024 * 0.00025 = 0.256 rev/s for 0.5s.
+  BOOST_TEST(std::abs(position * 0.0001f - 0.128f) < 0.01f);
+
+  BOOST_TEST(reply[11] == 0x21);
+  BOOST_TEST(reply[12] == 0x7e);
+  BOOST_TEST(reply[13] == 0x00);
+  BOOST_TEST(reply[14] == 0x31);
+  BOOST_TEST(reply[15] == 0x7e);
+  BOOST_TEST(reply[16] == 0x01);
+}
+
+BOOST_AUTO_TEST_CASE(ServoSimRezero) {
+  ServoSim dut;
+  dut.mutable_plant()->mutable_state()->angle_rad = 3.0;
+  dut.Step();
+  BOOST_TEST(std::abs(dut.status().unwrapped_position - 3.0f / k2Pi) < 0.001f);
+
+  // As on the controller, the new position is the one closest to that
+  // requested which keeps the encoder's position within a revolution.
+  BOOST_TEST(dut.Write(0x130, 1.25f) == 0u);
+  dut.Step();
+  BOOST_TEST(std::abs(dut.status().unwrapped_position -
+                      (1.0f + 3.0f / k2Pi)) < 0.001f);
+  BOOST_TEST(dut.status().rezeroed);
+}
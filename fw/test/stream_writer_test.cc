@@ -0,0 +1,168 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/stream_writer.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+// Records each write, and completes it only when asked to.
+class FakeStream : public mjlib::micro::AsyncWriteStream {
+ public:
+  void AsyncWriteSome(const std::string_view& data,
+                      const mjlib::micro::SizeCallback& callback) override {
+    BOOST_TEST_REQUIRE(!callback_);
+    pointers.push_back(data.data());
+    writes.push_back(std::string(data));
+    callback_ = callback;
+  }
+
+  bool pending() const { return !!callback_; }
+
+  void Complete() {
+    BOOST_TEST_REQUIRE(pending());
+    auto copy = callback_;
+    callback_ = {};
+    copy({}, writes.back().size());
+  }
+
+  std::vector<const char*> pointers;
+  std::vector<std::string> writes;
+
+ private:
+  mjlib::micro::SizeCallback callback_;
+};
+}
+
+BOOST_AUTO_TEST_CASE(StreamWriterCoalescesCopies) {
+  FakeStream stream;
+  StreamWriter<64, 4, 4> dut(&stream);
+
+  int done = 0;
+  auto count = [&](auto ec) { BOOST_TEST(!ec); done++; };
+
+  // The first write goes out right away, the rest wait for it.
+  BOOST_TEST(!dut.AsyncWrite("abc", count));
+  BOOST_TEST(!dut.AsyncWrite("def", count));
+  BOOST_TEST(!dut.AsyncWrite("ghi", count));
+  BOOST_TEST(stream.writes.size() == 1u);
+
+  stream.Complete();
+  BOOST_TEST(done == 1);
+
+  // The waiting copies were adjacent in the buffer, and go out as one.
+  BOOST_TEST_REQUIRE(stream.writes.size() == 2u);
+  BOOST_TEST(stream.writes[1] == "defghi");
+  stream.Complete();
+  BOOST_TEST(done == 3);
+  BOOST_TEST(!stream.pending());
+}
+
+BOOST_AUTO_TEST_CASE(StreamWriterReference) {
+  FakeStream stream;
+  StreamWriter<64, 4, 4> dut(&stream);
+
+  const char line1[] = "line1";
+  const char line2[] = "line2";
+  int done = 0;
+  auto count = [&](auto) { done++; };
+
+  BOOST_TEST(!dut.AsyncWrite("head", count));
+  BOOST_TEST(!dut.AsyncWriteReference(line1, count));
+  BOOST_TEST(!dut.AsyncWriteReference(line2, count));
+
+  stream.Complete();
+
+  // The references are written from the caller's memory, one segment
+  // at a time, and their callbacks wait for the whole batch.
+  BOOST_TEST_REQUIRE(stream.writes.size() == 2u);
+  BOOST_TEST(stream.pointers[1] == line1);
+  stream.Complete();
+  BOOST_TEST(done == 1);
+  BOOST_TEST_REQUIRE(stream.writes.size() == 3u);
+  BOOST_TEST(stream.pointers[2] == line2);
+  stream.Complete();
+  BOOST_TEST(done == 3);
+}
+
+BOOST_AUTO_TEST_CASE(StreamWriterWouldBlock) {
+  FakeStream stream;
+  StreamWriter<8, 2, 4> dut(&stream);
+
+  int done = 0;
+  auto count = [&](auto) { done++; };
+
+  BOOST_TEST(!dut.AsyncWrite("1", count));
+  BOOST_TEST(!dut.AsyncWrite("2", count));
+  BOOST_TEST(!dut.AsyncWrite("3", count));
+
+  // Out of callbacks.
+  int blocked = 0;
+  auto never = [&](auto) { blocked++; };
+  BOOST_TEST((dut.AsyncWrite("4", never) ==
+              mjlib::micro::error_code(errc::kWouldBlock)));
+  BOOST_TEST((dut.AsyncWriteReference("4", never) ==
+              mjlib::micro::error_code(errc::kWouldBlock)));
+
+  // Out of buffer.
+  stream.Complete();
+  BOOST_TEST(done == 1);
+  BOOST_TEST(!dut.AsyncWrite("12345678", count));
+  BOOST_TEST((dut.AsyncWrite("9", never) ==
+              mjlib::micro::error_code(errc::kWouldBlock)));
+
+  stream.Complete();
+  stream.Complete();
+  BOOST_TEST(done == 4);
+  BOOST_TEST(blocked == 0);
+
+  // Once the writes have completed, there is room again.
+  BOOST_TEST(!dut.AsyncWrite("abc", count));
+  stream.Complete();
+  BOOST_TEST(done == 5);
+  BOOST_TEST(stream.writes.back() == "abc");
+}
+
+BOOST_AUTO_TEST_CASE(StreamWriterWriteFromCallback) {
+  FakeStream stream;
+  StreamWriter<64, 4, 4> dut(&stream);
+
+  // A callback may queue a new write, which waits for the next batch.
+  char line[] = "first";
+  int done = 0;
+  std::function<void(mjlib::micro::error_code)> requeue = [&](auto) {
+    done++;
+    if (done < 3) {
+      line[0] = '0' + done;
+      BOOST_TEST(!dut.AsyncWriteReference(line, requeue));
+    }
+  };
+
+  BOOST_TEST(!dut.AsyncWriteReference(line, requeue));
+  stream.Complete();
+  stream.Complete();
+  stream.Complete();
+  BOOST_TEST(done == 3);
+  BOOST_TEST(!stream.pending());
+  BOOST_TEST_REQUIRE(stream.writes.size() == 3u);
+  BOOST_TEST(stream.writes[0] == "first");
+  BOOST_TEST(stream.writes[1] == "1irst");
+  BOOST_TEST(stream.writes[2] == "2irst");
+}
@@ -0,0 +1,117 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/thermal_model.h"
+
+#include <cmath>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus;
+
+namespace {
+constexpr float kResistance = 0.05f;
+constexpr float kBoard = 30.0f;
+constexpr float kMaxCurrent = 100.0f;
+constexpr float kDt = 0.001f;
+}
+
+BOOST_AUTO_TEST_CASE(ThermalModelColdStart) {
+  ThermalModel::Config config;
+  ThermalModel dut(&config);
+
+  dut.Update(0.0f, kResistance, kBoard, kDt, kMaxCurrent);
+
+  BOOST_TEST(dut.status().winding_C == kBoard);
+  BOOST_TEST(dut.status().fet_C == kBoard);
+  // 70C of winding headroom, at 2 C/W and 0.075 W/A^2.
+  BOOST_TEST(std::abs(dut.status().continuous_current_A -
+                      std::sqrt(70.0f / (2.0f * 0.075f))) < 0.01f);
+  // When cold, more than the continuous rating is available.
+  BOOST_TEST(dut.current_limit_A() > dut.status().continuous_current_A);
+}
+
+BOOST_AUTO_TEST_CASE(ThermalModelSteadyState) {
+  ThermalModel::Config config;
+  ThermalModel dut(&config);
+
+  // 10A for 10 winding time constants.
+  for (int i = 0; i < 600000; i++) {
+    dut.Update(100.0f, kResistance, kBoard, kDt, kMaxCurrent);
+  }
+
+  // 7.5W at 2 C/W
+  BOOST_TEST(std::abs(dut.status().winding_rise_C - 15.0f) < 0.01f);
+  // 0.6W at 10 C/W
+  BOOST_TEST(std::abs(dut.status().fet_rise_C - 6.0f) < 0.01f);
+}
+
+BOOST_AUTO_TEST_CASE(ThermalModelNeverExceedsLimit) {
+  ThermalModel::Config config;
+  ThermalModel dut(&config);
+
+  // Always command the maximum, but apply only what the model
+  // allows.
+  float limit = kMaxCurrent;
+  float max_winding = 0.0f;
+  float max_fet = 0.0f;
+  for (int i = 0; i < 300000; i++) {
+    dut.Update(limit * limit, kResistance, kBoard, kDt, kMaxCurrent);
+    limit = dut.current_limit_A();
+    max_winding = std::max(max_winding, dut.status().winding_C);
+    max_fet = std::max(max_fet, dut.status().fet_C);
+  }
+
+  BOOST_TEST(max_winding <= config.winding_max_C + 0.01f);
+  BOOST_TEST(max_fet <= config.fet_max_C + 0.01f);
+  // And the limit has converged upon the continuous rating.
+  BOOST_TEST(std::abs(limit - dut.status().continuous_current_A) < 0.5f);
+}
+
+BOOST_AUTO_TEST_CASE(ThermalModelBudget) {
+  ThermalModel::Config config;
+  ThermalModel dut(&config);
+
+  dut.Update(0.0f, kResistance, kBoard, kDt, kMaxCurrent);
+  const float budget = dut.status().peak_budget_s;
+  BOOST_TEST(budget > 0.0f);
+
+  // Applying the maximum for the predicted budget reaches a limit,
+  // to within what the FETs heat in one step.
+  const int steps = static_cast<int>(budget / kDt);
+  for (int i = 0; i < steps; i++) {
+    dut.Update(kMaxCurrent * kMaxCurrent, kResistance, kBoard, kDt,
+               kMaxCurrent);
+  }
+  const float fet_margin = config.fet_max_C - dut.status().fet_C;
+  const float winding_margin = config.winding_max_C - dut.status().winding_C;
+  BOOST_TEST(std::min(fet_margin, winding_margin) < 1.0f);
+  BOOST_TEST(std::min(fet_margin, winding_margin) > -1.0f);
+
+  // A current within the continuous rating can run forever.
+  dut.Update(0.0f, kResistance, kBoard, kDt, 10.0f);
+  BOOST_TEST(std::isinf(dut.status().peak_budget_s));
+}
+
+BOOST_AUTO_TEST_CASE(ThermalModelHotBoard) {
+  ThermalModel::Config config;
+  ThermalModel dut(&config);
+
+  // With the thermistor already past the FET limit, nothing may be
+  // applied.
+  dut.Update(0.0f, kResistance, 75.0f, kDt, kMaxCurrent);
+  BOOST_TEST(dut.current_limit_A() == 0.0f);
+  BOOST_TEST(dut.status().continuous_current_A == 0.0f);
+  BOOST_TEST(dut.status().peak_budget_s == 0.0f);
+}
@@ -0,0 +1,192 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "mjlib/base/visitor.h"
+
+namespace moteus {
+
+/// Estimates the temperature of the motor windings and the FETs from
+/// the current flowing through them, and from that, how much current
+/// may be applied without either exceeding its limit.
+///
+/// Each is a single thermal mass, heated by the I^2 R loss in it, and
+/// cooling through a thermal resistance to the board thermistor.  The
+/// thermistor supplies the baseline temperature, so the model only
+/// needs to predict the rise above it, which is what the thermistor
+/// is too slow, or too far away, to see.
+///
+/// The allowed current for each is the one which, applied
+/// continuously from now, would just reach the limit after
+/// peak_horizon_s.  When cool, that is well above the continuous
+/// rating, and it converges to the continuous rating as the limit is
+/// approached, so the limit is never exceeded.
+class ThermalModel {
+ public:
+  struct Config {
+    bool enable = false;
+
+    float winding_max_C = 100.0f;
+    // Of the windings relative to the board thermistor.
+    float winding_resistance_C_per_W = 2.0f;
+    float winding_time_constant_s = 60.0f;
+
+    float fet_max_C = 70.0f;
+    // The equivalent on resistance of all FET losses, per phase.
+    float fet_resistance_ohm = 0.004f;
+    float fet_resistance_C_per_W = 10.0f;
+    float fet_time_constant_s = 1.0f;
+
+    float peak_horizon_s = 2.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(enable));
+      a->Visit(MJ_NVP(winding_max_C));
+      a->Visit(MJ_NVP(winding_resistance_C_per_W));
+      a->Visit(MJ_NVP(winding_time_constant_s));
+      a->Visit(MJ_NVP(fet_max_C));
+      a->Visit(MJ_NVP(fet_resistance_ohm));
+      a->Visit(MJ_NVP(fet_resistance_C_per_W));
+      a->Visit(MJ_NVP(fet_time_constant_s));
+      a->Visit(MJ_NVP(peak_horizon_s));
+    }
+  };
+
+  struct Status {
+    float winding_C = std::numeric_limits<float>::quiet_NaN();
+    float fet_C = std::numeric_limits<float>::quiet_NaN();
+    float winding_rise_C = 0.0f;
+    float fet_rise_C = 0.0f;
+
+    // The current which, applied continuously from now, would just
+    // reach the nearer thermal limit after peak_horizon_s.
+    float peak_current_A = 0.0f;
+    // The current which may be applied indefinitely.
+    float continuous_current_A = 0.0f;
+    // How long the maximum current could be applied before a limit
+    // is reached.
+    float peak_budget_s = 0.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(winding_C));
+      a->Visit(MJ_NVP(fet_C));
+      a->Visit(MJ_NVP(winding_rise_C));
+      a->Visit(MJ_NVP(fet_rise_C));
+      a->Visit(MJ_NVP(peak_current_A));
+      a->Visit(MJ_NVP(continuous_current_A));
+      a->Visit(MJ_NVP(peak_budget_s));
+    }
+  };
+
+  ThermalModel(const Config* config) : config_(config) {}
+
+  /// Advance the model by @p dt_s.
+  ///
+  /// @param current_sq_A2 the mean of d_A^2 + q_A^2 over the interval
+  /// @param motor_resistance_ohm the phase resistance
+  /// @param board_C the thermistor reading
+  /// @param max_current_A the largest current which will ever be
+  /// applied
+  void Update(float current_sq_A2, float motor_resistance_ohm,
+              float board_C, float dt_s, float max_current_A) {
+    // For amplitude invariant dq currents, the loss in all three
+    // phases is 1.5 * R * (d^2 + q^2).
+    const float winding_loss = 1.5f * motor_resistance_ohm;
+    const float fet_loss = 1.5f * config_->fet_resistance_ohm;
+
+    const Node winding = {
+      winding_loss, config_->winding_resistance_C_per_W,
+      config_->winding_time_constant_s, config_->winding_max_C - board_C,
+    };
+    const Node fet = {
+      fet_loss, config_->fet_resistance_C_per_W,
+      config_->fet_time_constant_s, config_->fet_max_C - board_C,
+    };
+
+    status_.winding_rise_C = winding.Step(
+        status_.winding_rise_C, current_sq_A2, dt_s);
+    status_.fet_rise_C = fet.Step(status_.fet_rise_C, current_sq_A2, dt_s);
+    status_.winding_C = board_C + status_.winding_rise_C;
+    status_.fet_C = board_C + status_.fet_rise_C;
+
+    const float horizon = config_->peak_horizon_s;
+    status_.peak_current_A = std::min(
+        max_current_A,
+        std::min(winding.AllowedCurrent(status_.winding_rise_C, horizon),
+                 fet.AllowedCurrent(status_.fet_rise_C, horizon)));
+    status_.continuous_current_A = std::min(
+        max_current_A,
+        std::min(winding.ContinuousCurrent(), fet.ContinuousCurrent()));
+    status_.peak_budget_s = std::min(
+        winding.Budget(status_.winding_rise_C, max_current_A),
+        fet.Budget(status_.fet_rise_C, max_current_A));
+  }
+
+  /// The largest current which may be applied now.
+  float current_limit_A() const { return status_.peak_current_A; }
+
+  const Status& status() const { return status_; }
+
+ private:
+  static constexpr float kInf = std::numeric_limits<float>::infinity();
+
+  struct Node {
+    // W per A^2
+    float loss;
+    // C per W
+    float resistance;
+    float time_constant;
+    // How far above the thermistor the node may rise.
+    float headroom;
+
+    float Step(float rise, float current_sq, float dt) const {
+      const float decay = std::exp(-dt / time_constant);
+      return rise * decay + loss * current_sq * resistance * (1.0f - decay);
+    }
+
+    float AllowedCurrent(float rise, float horizon) const {
+      if (loss <= 0.0f) { return kInf; }
+      const float decay = std::exp(-horizon / time_constant);
+      const float power =
+          (headroom - rise * decay) / (resistance * (1.0f - decay));
+      return (power > 0.0f) ? std::sqrt(power / loss) : 0.0f;
+    }
+
+    float ContinuousCurrent() const {
+      if (loss <= 0.0f) { return kInf; }
+      return (headroom > 0.0f) ?
+          std::sqrt(headroom / (resistance * loss)) : 0.0f;
+    }
+
+    float Budget(float rise, float current) const {
+      if (rise >= headroom) { return 0.0f; }
+      const float final_rise = loss * current * current * resistance;
+      if (final_rise <= headroom) { return kInf; }
+      return -time_constant *
+          std::log((final_rise - headroom) / (final_rise - rise));
+    }
+  };
+
+  const Config* const config_;
+  Status status_;
+};
+
+}
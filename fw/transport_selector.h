@@ -0,0 +1,81 @@
+// Copyright 2018-2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+
+#include "mjlib/base/visitor.h"
+#include "mjlib/multiplex/micro_datagram_server.h"
+
+namespace moteus {
+
+/// Presents one of two datagram servers to the multiplex protocol.
+///
+/// The choice is made when the first read is started, so that it
+/// reflects the configuration loaded from persistent storage.  A
+/// change to the configuration takes effect after the next reset.
+class TransportSelector : public mjlib::multiplex::MicroDatagramServer {
+ public:
+  struct Config {
+    // 0=CAN, 1=RS485
+    int32_t transport = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(transport));
+    }
+  };
+
+  TransportSelector(MicroDatagramServer* can, MicroDatagramServer* rs485)
+      : can_(can), rs485_(rs485) {}
+
+  Config* config() { return &config_; }
+
+  void AsyncRead(Header* header,
+                 const mjlib::base::string_span& data,
+                 const mjlib::micro::SizeCallback& callback) override {
+    active()->AsyncRead(header, data, callback);
+  }
+
+  void AsyncWrite(const Header& header,
+                  const std::string_view& data,
+                  const mjlib::micro::SizeCallback& callback) override {
+    active()->AsyncWrite(header, data, callback);
+  }
+
+  /// This may be queried before the choice is made, so reports what
+  /// both transports can support.
+  Properties properties() const override {
+    Properties result;
+    result.max_size = std::min(can_->properties().max_size,
+                               rs485_->properties().max_size);
+    return result;
+  }
+
+ private:
+  MicroDatagramServer* active() {
+    if (!active_) {
+      active_ = (config_.transport == 1) ? rs485_ : can_;
+    }
+    return active_;
+  }
+
+  MicroDatagramServer* const can_;
+  MicroDatagramServer* const rs485_;
+  MicroDatagramServer* active_ = nullptr;
+  Config config_;
+};
+
+}
@@ -14,6 +14,13 @@
 
 import json
 import math
+import struct
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
 
 class Entry:
     direction = 0
@@ -50,6 +57,43 @@ def _parse_entry(line):
     return result
 
 
+# The layout of each sample when the firmware reports calibration
+# data in binary blocks: direction, phase, encoder, then i1, i2 and i3
+# in mA.
+BINARY_ENTRY = struct.Struct('<BHHhhh')
+
+
+def parse_binary(data):
+    '''Parse the samples from one or more binary calibration blocks,
+    returning a list of Entry.'''
+    result = []
+    for direction, phase, encoder, i1, i2, i3 in BINARY_ENTRY.iter_unpack(data):
+        entry = Entry()
+        entry.direction = direction
+        entry.phase = phase
+        entry.encoder = encoder
+        entry.i1 = i1 * 0.001
+        entry.i2 = i2 * 0.001
+        entry.i3 = i3 * 0.001
+        result.append(entry)
+    return result
+
+
+def format_entry(entry):
+    '''Return the text line parse_file accepts for the given entry.'''
+    return '{} {} {} i1={} i2={} i3={}'.format(
+        entry.direction, entry.phase, entry.encoder,
+        int(round(entry.i1 * 1000)), int(round(entry.i2 * 1000)),
+        int(round(entry.i3 * 1000)))
+
+
+def make_file(entries):
+    result = File()
+    result.phase_up = [x for x in entries if x.direction == 1]
+    result.phase_down = [x for x in entries if x.direction == 2]
+    return result
+
+
 def parse_file(fp):
     lines = [x.decode('latin1') for x in fp.readlines()]
     if not lines[0].startswith("CAL start"):
@@ -61,11 +105,7 @@ def parse_file(fp):
 
     entries = [_parse_entry(line) for line in lines]
 
-    result = File()
-    result.phase_up = [x for x in entries if x.direction == 1]
-    result.phase_down = [x for x in entries if x.direction == 2]
-
-    return result
+    return make_file(entries)
 
 
 def _wrap_int16(value):
@@ -157,6 +197,75 @@ def _window_average(values, window_size):
     return result
 
 
+# These produce the same results as the functions above, but operate
+# on whole arrays at once.
+
+def _wrap_neg_pi_to_pi_numpy(value):
+    value = numpy.asarray(value, dtype=float)
+    two_pi = 2.0 * math.pi
+    high = numpy.ceil((value - math.pi) / two_pi)
+    low = numpy.ceil((-math.pi - value) / two_pi)
+    return numpy.where(value > math.pi, value - two_pi * high,
+                       numpy.where(value < -math.pi, value + two_pi * low,
+                                   value))
+
+
+def _unwrap_numpy(value):
+    value = numpy.asarray(value, dtype=float)
+    if len(value) == 0:
+        return value
+    # Each step is wrapped independently, so the result is just the
+    # running sum of the wrapped steps.
+    steps = _wrap_neg_pi_to_pi_numpy(numpy.diff(value))
+    return numpy.concatenate([value[0:1], value[0] + numpy.cumsum(steps)])
+
+
+def _interpolate_numpy(sample_points, x, y):
+    assert len(x) > 1
+    assert len(x) == len(y)
+
+    sample_points = numpy.asarray(sample_points, dtype=float)
+    x = numpy.asarray(x, dtype=float)
+    y = numpy.asarray(y, dtype=float)
+
+    # Like _interpolate, use the last segment which starts at or
+    # before each point.
+    index = numpy.clip(numpy.searchsorted(x, sample_points, side='right') - 1,
+                       0, len(x) - 2)
+    x0 = x[index]
+    x1 = x[index + 1]
+    y0 = y[index]
+    y1 = y[index + 1]
+    length = x1 - x0
+    zero_length = length == 0.0
+    ratio = (sample_points - x0) / numpy.where(zero_length, 1.0, length)
+    value = numpy.where(zero_length, y1, (y1 - y0) * ratio + y0)
+
+    value = numpy.where(sample_points < x[0], y[0], value)
+    return numpy.where(sample_points > x[-1], y[-1], value)
+
+
+def _window_average_numpy(values, window_size):
+    values = numpy.asarray(values, dtype=float)
+    size = len(values)
+    half = window_size // 2
+    offsets = numpy.arange(-half, half)
+
+    result = numpy.empty(size)
+
+    # The full index matrix may be large, so it is formed a few rows
+    # at a time.
+    CHUNK = 256
+    for start in range(0, size, CHUNK):
+        rows = numpy.arange(start, min(size, start + CHUNK))
+        base = values[(rows - half) % size]
+        window = values[(rows[:, None] + offsets) % size]
+        errs = _wrap_neg_pi_to_pi_numpy(window - base[:, None])
+        result[rows] = base + errs.mean(axis=1)
+
+    return result
+
+
 class CalibrationResult:
     def __init__(self):
         self.invert = None
@@ -185,7 +294,23 @@ class CalibrationResult:
         }
 
 
-def calibrate(parsed):
+def calibrate(parsed, offset_size=64, use_numpy=None):
+    '''Compute the encoder calibration from parsed data.
+
+    When use_numpy is None, the vectorized implementation is used if
+    numpy is available.'''
+    if use_numpy is None:
+        use_numpy = numpy is not None
+
+    if use_numpy:
+        unwrap = lambda x: _unwrap_numpy(x).tolist()
+        interpolate = lambda *args: _interpolate_numpy(*args).tolist()
+        window_average = lambda *args: _window_average_numpy(*args).tolist()
+    else:
+        unwrap = _unwrap
+        interpolate = _interpolate
+        window_average = _window_average
+
     if (len(parsed.phase_up) < 2 or
         len(parsed.phase_down) < 2):
         raise RuntimeError("one or more phases were empty")
@@ -249,16 +374,16 @@ def calibrate(parsed):
 
     phase_up_encoder = [x.encoder for x in phase_up_by_encoder]
     phase_up_phase = [2.0 * math.pi / 65536.0 * x.phase for x in phase_up_by_encoder]
-    phase_up_phase = _unwrap(phase_up_phase)
+    phase_up_phase = unwrap(phase_up_phase)
 
     phase_down_encoder = [x.encoder for x in phase_down_by_encoder]
     phase_down_phase = [2.0 * math.pi / 65536.0 * x.phase for x in phase_down_by_encoder]
-    phase_down_phase = _unwrap(phase_down_phase)
+    phase_down_phase = unwrap(phase_down_phase)
 
     xpos = _linspace(0, 65535.0, 10000)
 
-    pu_interp = _interpolate(xpos, phase_up_encoder, phase_up_phase)
-    pd_interp = _interpolate(xpos, phase_down_encoder, phase_down_phase)
+    pu_interp = interpolate(xpos, phase_up_encoder, phase_up_phase)
+    pd_interp = interpolate(xpos, phase_down_encoder, phase_down_phase)
     avg_interp = [0.5 * (a + b) for a, b in zip(pu_interp, pd_interp)]
 
     expected = [(2.0 * math.pi / 65536.0) * (result.poles / 2) * x for x in xpos]
@@ -271,10 +396,10 @@ def calibrate(parsed):
         err = [x if x > 0 else x + 2 * math.pi for x in err]
 
     avg_window = int(len(err) / result.poles)
-    avg_err = _window_average(err, avg_window)
+    avg_err = window_average(err, avg_window)
 
-    offset_x = list(range(0, 65536, 1024))
-    offset = _interpolate(offset_x, xpos, avg_err)
+    offset_x = [i * 65536 / offset_size for i in range(offset_size)]
+    offset = interpolate(offset_x, xpos, avg_err)
 
     result.offset = offset
 
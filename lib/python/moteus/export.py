@@ -16,10 +16,12 @@
 controller."""
 
 ALL = [
-    'make_transport_args', 'get_singleton_transport',
+    'make_transport_args', 'get_singleton_transport', 'make_group_position',
+    'make_clock_sync', 'parse_broadcast',
     'Fdcanusb', 'Router', 'Controller', 'Register', 'Transport',
     'PythonCan',
-    'Mode', 'QueryResolution', 'PositionResolution', 'Command',
+    'Mode', 'QueryResolution', 'PositionResolution', 'RegisterScale',
+    'Command',
     'TRANSPORT_FACTORIES',
     'INT8', 'INT16', 'INT32', 'F32', 'IGNORE',
     'reader',
@@ -31,8 +33,9 @@ from moteus.transport import Transport
 from moteus.pythoncan import PythonCan
 from moteus.moteus import (
     Controller, Register, Mode, QueryResolution, PositionResolution,
-    make_transport_args, get_singleton_transport,
-    TRANSPORT_FACTORIES)
+    RegisterScale,
+    make_transport_args, get_singleton_transport, make_group_position,
+    make_clock_sync, parse_broadcast, TRANSPORT_FACTORIES)
 from moteus.multiplex import (INT8, INT16, INT32, F32, IGNORE)
 import moteus.reader as reader
 
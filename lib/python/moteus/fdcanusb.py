@@ -19,6 +19,9 @@ import sys
 
 from . import aioserial
 
+# The first byte of a periodic broadcast, moteus.BROADCAST.
+_BROADCAST = b'\x63'
+
 
 def _hexify(data):
     return ''.join(['{:02X}'.format(x) for x in data])
@@ -102,36 +105,61 @@ class Fdcanusb:
         their command specific parsers.
 
         Each command instance must model moteus.Command
+
+        A reply which does not arrive in time is returned as None.
         """
 
-        # Since the fdcanusb can't send multiple things at once, we
-        # just go through the commands one at a time and handle them
-        # individually.
+        # All the commands are written back to back, and replies
+        # matched to them as they arrive.
         #
-        # We do require that each command fully complete in between
+        # We do require that the cycle fully complete in between
         # cancellation points, so that the overall device stays
         # synchronized.
-        return [await asyncio.shield(self._do_command_shield(x)) for x in commands]
+        return await asyncio.shield(self._do_cycle_shield(commands))
 
-    async def _do_command_shield(self, command):
+    async def _do_cycle_shield(self, commands):
         # We only permit one outstanding cycle at a time.
         async with self._cycle_lock:
-            return await self._do_command(command)
-
-    async def _do_command(self, command):
-        await self.write(command)
-        reply_required = command.reply_required
+            return await self._do_cycle(commands)
 
-        # Get the OK response.
-        ok_response = await self._readline(self._serial)
-        if not ok_response.startswith(b"OK"):
-            raise RuntimeError("fdcanusb lost synchronization, got: " +
-                               ok_response.decode('latin1'))
+    async def _do_cycle(self, commands):
+        for command in commands:
+            self._write_frame(command)
+        await self._serial.drain()
 
-        if reply_required:
-            # Any device should definitely respond within this much
-            # time, otherwise it is having serious problems.
-            line = await asyncio.wait_for(self._readline(self._serial), 0.5)
+        result = [None] * len(commands)
+
+        # Any device should definitely respond within this much time
+        # of being sent its frame, otherwise it is having serious
+        # problems.
+        deadline = asyncio.get_event_loop().time() + 0.5
+
+        # The indices of the commands still awaiting a reply, by the
+        # id of the device which will send it.
+        outstanding = {}
+        for index, command in enumerate(commands):
+            if command.reply_required:
+                outstanding.setdefault(command.destination, []).append(index)
+
+        oks_remaining = len(commands)
+        while oks_remaining or outstanding:
+            remaining = deadline - asyncio.get_event_loop().time()
+            try:
+                if remaining <= 0:
+                    raise asyncio.TimeoutError()
+                line = await asyncio.wait_for(
+                    self._readline(self._serial), remaining)
+            except asyncio.TimeoutError:
+                # The fdcanusb itself always acknowledges every frame,
+                # but devices which do not reply are just left as
+                # None.
+                if oks_remaining:
+                    raise
+                break
+
+            if line.startswith(b"OK"):
+                oks_remaining -= 1
+                continue
 
             if not line.startswith(b"rcv"):
                 raise RuntimeError("unexpected fdcanusb response, got: " +
@@ -142,16 +170,35 @@ class Fdcanusb:
             message.data = _dehexify(fields[2])
             message.arbitration_id = int(fields[1], 16)
 
-            return command.parse(message)
+            if message.data[:1] == _BROADCAST:
+                # Periodic broadcasts are never the reply to a command.
+                continue
 
-    async def write(self, command):
-        # This merely sends a command and doesn't even wait for an OK
-        # to come back.  It can *not* be intermixed with calls to
-        # 'cycle'.
+            source = (message.arbitration_id >> 8) & 0x7f
+            indices = outstanding.get(source)
+            if not indices:
+                # Nothing was waiting for this, maybe it is the late
+                # reply to a cycle which timed out.
+                continue
+
+            index = indices.pop(0)
+            if not indices:
+                del outstanding[source]
+            result[index] = commands[index].parse(message)
+
+        return result
+
+    def _write_frame(self, command):
         bus_id = command.destination + (0x8000 if command.reply_required else 0)
         self._serial.write(
             "can send {:04x} {}\n".format(
                 bus_id, _hexify(command.data)).encode('latin1'))
+
+    async def write(self, command):
+        # This merely sends a command and doesn't even wait for an OK
+        # to come back.  It can *not* be intermixed with calls to
+        # 'cycle'.
+        self._write_frame(command)
         await self._serial.drain()
 
     async def read(self):
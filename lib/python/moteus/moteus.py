@@ -15,8 +15,11 @@
 import asyncio
 import argparse
 import enum
+import functools
 import importlib_metadata
 import io
+import math
+import operator
 import struct
 
 from . import multiplex as mp
@@ -168,6 +171,8 @@ class Register(enum.IntEnum):
     COMMAND_POSITION_MAX_TORQUE = 0x025
     COMMAND_STOP_POSITION = 0x026
     COMMAND_TIMEOUT = 0x027
+    COMMAND_TIMESTAMP = 0x028
+    COMMAND_APPLY_TIME = 0x029
 
     POSITION_KP = 0x030
     POSITION_KI = 0x031
@@ -198,6 +203,7 @@ class Mode(enum.IntEnum):
     TIMEOUT = 11
     ZERO_VELOCITY = 12
     STAY_WITHIN = 13
+    MEASURE_IND = 14
 
 
 class QueryResolution:
@@ -229,64 +235,117 @@ class CurrentResolution:
     q_A = mp.F32
 
 
+# The INT8, INT16 and INT32 scales of each kind of value, before
+# applying any RegisterScale.
+_POSITION_SCALES = (0.01, 0.0001, 0.00001)
+_VELOCITY_SCALES = (0.1, 0.00025, 0.00001)
+_TORQUE_SCALES = (0.5, 0.01, 0.001)
+_PWM_SCALES = (1.0 / 127.0, 1.0 / 32767.0, 1.0 / 2147483647.0)
+_VOLTAGE_SCALES = (0.5, 0.1, 0.001)
+_TEMPERATURE_SCALES = (1.0, 0.1, 0.001)
+_TIME_SCALES = (0.01, 0.001, 0.000001)
+_CURRENT_SCALES = (1.0, 0.1, 0.001)
+
+
+class RegisterScale:
+    """Multiplies the value of one integer LSB for each kind of
+    register.  These must match the controller's register_scale
+    configuration.  For instance, a position of 10 gives an INT16
+    position a range of +-32.767 revolutions in steps of 0.001."""
+    position = 1.0
+    velocity = 1.0
+    torque = 1.0
+    current = 1.0
+    voltage = 1.0
+    temperature = 1.0
+    time = 1.0
+
+
+def _scaled(scales, multiplier):
+    return tuple(x * multiplier for x in scales)
+
+
 class Parser(mp.RegisterParser):
+    def __init__(self, data, register_scale=None):
+        super(Parser, self).__init__(data)
+        self._register_scale = register_scale or RegisterScale()
+
+    def _read(self, resolution, scales, multiplier):
+        return self.read_mapped(resolution, *_scaled(scales, multiplier))
+
     def read_position(self, resolution):
-        return self.read_mapped(resolution, 0.01, 0.0001, 0.00001)
+        return self._read(resolution, _POSITION_SCALES,
+                          self._register_scale.position)
 
     def read_velocity(self, resolution):
-        return self.read_mapped(resolution, 0.1, 0.00025, 0.00001)
+        return self._read(resolution, _VELOCITY_SCALES,
+                          self._register_scale.velocity)
 
     def read_torque(self, resolution):
-        return self.read_mapped(resolution, 0.5, 0.01, 0.001)
+        return self._read(resolution, _TORQUE_SCALES,
+                          self._register_scale.torque)
 
     def read_pwm(self, resolution):
-        return self.read_mapped(
-            resolution, 1.0 / 127.0, 1.0 / 32767.0, 1.0 / 2147483647.0)
+        return self._read(resolution, _PWM_SCALES, 1.0)
 
     def read_voltage(self, resolution):
-        return self.read_mapped(resolution, 0.5, 0.1, 0.001)
+        return self._read(resolution, _VOLTAGE_SCALES,
+                          self._register_scale.voltage)
 
     def read_temperature(self, resolution):
-        return self.read_mapped(resolution, 1.0, 0.1, 0.001)
+        return self._read(resolution, _TEMPERATURE_SCALES,
+                          self._register_scale.temperature)
 
     def read_time(self, resolution):
-        return self.read_mapped(resolution, 0.01, 0.001, 0.000001)
+        return self._read(resolution, _TIME_SCALES,
+                          self._register_scale.time)
 
     def read_current(self, resolution):
-        return self.read_mapped(resolution, 1.0, 0.1, 0.001)
+        return self._read(resolution, _CURRENT_SCALES,
+                          self._register_scale.current)
 
     def ignore(self, resolution):
         self._offset += mp.resolution_size(resolution)
 
 
 class Writer(mp.WriteFrame):
+    def __init__(self, buf, register_scale=None):
+        super(Writer, self).__init__(buf)
+        self._register_scale = register_scale or RegisterScale()
+
+    def _write(self, value, scales, multiplier, resolution):
+        self.write_mapped(value, *_scaled(scales, multiplier), resolution)
+
     def write_position(self, value, resolution):
-        self.write_mapped(value, 0.01, 0.0001, 0.00001, resolution)
+        self._write(value, _POSITION_SCALES,
+                    self._register_scale.position, resolution)
 
     def write_velocity(self, value, resolution):
-        self.write_mapped(value, 0.1, 0.00025, 0.00001, resolution)
+        self._write(value, _VELOCITY_SCALES,
+                    self._register_scale.velocity, resolution)
 
     def write_torque(self, value, resolution):
-        self.write_mapped(value, 0.5, 0.01, 0.001, resolution)
+        self._write(value, _TORQUE_SCALES,
+                    self._register_scale.torque, resolution)
 
     def write_pwm(self, value, resolution):
-        self.write_mapped(value,
-                          1.0 / 127.0,
-                          1.0 / 32767.0,
-                          1.0 / 2147483647.0,
-                          resolution)
+        self._write(value, _PWM_SCALES, 1.0, resolution)
 
     def write_voltage(self, value, resolution):
-        self.write_mapped(value, 0.5, 0.1, 0.001, resolution)
+        self._write(value, _VOLTAGE_SCALES,
+                    self._register_scale.voltage, resolution)
 
     def write_temperature(self, value, resolution):
-        self.write_mapped(value, 1.0, 0.1, 0.001, resolution)
+        self._write(value, _TEMPERATURE_SCALES,
+                    self._register_scale.temperature, resolution)
 
     def write_time(self, value, resolution):
-        self.write_mapped(value, 0.01, 0.001, 0.000001, resolution)
+        self._write(value, _TIME_SCALES,
+                    self._register_scale.time, resolution)
 
     def write_current(self, value, resolution):
-        self.write_mapped(value, 1.0, 0.1, 0.001, resolution)
+        self._write(value, _CURRENT_SCALES,
+                    self._register_scale.current, resolution)
 
 
 def parse_register(parser, register, resolution):
@@ -312,8 +371,8 @@ def parse_register(parser, register, resolution):
         return parser.read_int(resolution)
 
 
-def parse_reply(data):
-    parser = Parser(data)
+def parse_reply(data, register_scale=None):
+    parser = Parser(data, register_scale)
     result = {}
     while True:
         item = parser.next()
@@ -325,6 +384,143 @@ def parse_reply(data):
     return result
 
 
+# The scales applied to each register at the INT8, INT16 and INT32
+# resolutions, and the RegisterScale attribute which multiplies them,
+# or None for those which hold integers, matching parse_register.
+_REGISTER_SCALES = {
+    Register.MODE: None,
+    Register.POSITION: (_POSITION_SCALES, 'position'),
+    Register.VELOCITY: (_VELOCITY_SCALES, 'velocity'),
+    Register.TORQUE: (_TORQUE_SCALES, 'torque'),
+    Register.Q_CURRENT: (_CURRENT_SCALES, 'current'),
+    Register.D_CURRENT: (_CURRENT_SCALES, 'current'),
+    Register.REZERO_STATE: None,
+    Register.VOLTAGE: (_VOLTAGE_SCALES, 'voltage'),
+    Register.TEMPERATURE: (_TEMPERATURE_SCALES, 'temperature'),
+    Register.FAULT: None,
+}
+
+_STRUCT_FORMATS = ['b', 'h', 'i', 'f']
+
+_NAN_VALUES = [-128, -32768, -2147483648]
+
+
+class CompiledReplyParser:
+    """Decodes replies to one fixed set of register reads with a single
+    struct unpack.
+
+    Replies which do not have exactly the expected layout, like those
+    reporting an error, are passed to parse_reply instead.
+    """
+
+    def __init__(self, query_data, register_scale=None):
+        """
+        Arguments:
+          query_data: the read subframes sent to the controller
+          register_scale: an instance of moteus.RegisterScale
+
+        Raises:
+          ValueError: if query_data holds anything other than reads of
+            registers known to parse_register
+        """
+        self._register_scale = register_scale
+        if register_scale is None:
+            register_scale = RegisterScale()
+
+        fmt = '<'
+        headers = []
+        header_indices = []
+        value_indices = []
+        self._registers = []
+        self._scales = []
+        self._nan_values = []
+
+        offset = 0
+        while offset < len(query_data):
+            cmd = query_data[offset]
+            if cmd < mp.READ_BASE or cmd >= mp.READ_BASE + 0x10:
+                raise ValueError(f'unsupported subframe 0x{cmd:02x}')
+            resolution = (cmd >> 2) & 0x03
+            count = cmd & 0x03
+            header_end = offset + 1
+            if count == 0:
+                count = query_data[header_end]
+                header_end += 1
+            register, header_end = mp.read_varuint(header_end, query_data)
+            if register is None:
+                raise ValueError('truncated register')
+
+            # The reply header is the same as that of the request, but
+            # with the reply command.
+            header = bytes([cmd - mp.READ_BASE + mp.REPLY_BASE]) + \
+                query_data[offset + 1:header_end]
+            for byte in header:
+                header_indices.append(len(headers) + len(value_indices))
+                headers.append(byte)
+                fmt += 'B'
+
+            for i in range(count):
+                this_register = register + i
+                if this_register not in _REGISTER_SCALES:
+                    raise ValueError(f'unknown register 0x{this_register:03x}')
+                scales = _REGISTER_SCALES[this_register]
+                value_indices.append(len(headers) + len(value_indices))
+                fmt += _STRUCT_FORMATS[resolution]
+                self._registers.append(this_register)
+                if scales is None or resolution == mp.F32:
+                    self._scales.append(1)
+                    self._nan_values.append(None)
+                else:
+                    base, name = scales
+                    self._scales.append(
+                        base[resolution] * getattr(register_scale, name))
+                    self._nan_values.append(_NAN_VALUES[resolution])
+
+            offset = header_end
+
+        if not value_indices:
+            raise ValueError('no registers')
+
+        self._struct = struct.Struct(fmt)
+        self._headers = tuple(headers)
+        # Every header has at least a command and register byte, so
+        # this always returns a tuple.
+        self._get_headers = operator.itemgetter(*header_indices)
+        self._get_values = operator.itemgetter(*value_indices)
+        self._single = len(value_indices) == 1
+
+    def __call__(self, data):
+        size = self._struct.size
+        if len(data) < size or data[size:].strip(bytes([mp.NOP])):
+            return parse_reply(data, self._register_scale)
+
+        raw = self._struct.unpack_from(data)
+        if self._get_headers(raw) != self._headers:
+            return parse_reply(data, self._register_scale)
+
+        values = self._get_values(raw)
+        if self._single:
+            values = (values,)
+
+        nan = math.nan
+        return {
+            register: (nan if value == nan_value else value * scale)
+            for register, scale, nan_value, value in
+            zip(self._registers, self._scales, self._nan_values, values)
+        }
+
+
+def compile_reply_parser(query_data, register_scale=None):
+    """Return a function which decodes replies to query_data like
+    parse_reply, but faster where possible."""
+    try:
+        return CompiledReplyParser(query_data, register_scale)
+    except ValueError:
+        if register_scale is None:
+            return parse_reply
+        return functools.partial(parse_reply, register_scale=register_scale)
+
+
 class Result:
     id = None
     values = []
@@ -335,11 +531,11 @@ class Result:
         return f'{self.id}/{{{value_str}}}'
 
 
-def make_parser(id):
+def make_parser(id, reply_parser=parse_reply):
     def parse(message):
         result = Result()
         result.id = id
-        result.values = parse_reply(message.data)
+        result.values = reply_parser(message.data)
         return result
     return parse
 
@@ -380,6 +576,178 @@ def make_diagnostic_parser(id):
     return parse
 
 
+# The bootloader accepts raw flash data on this stream channel.
+FLASH_CHANNEL = 2
+
+# Each binary flash write holds a 4 byte address and up to this many
+# bytes of data, which fills a 64 byte frame with a whole number of
+# flash double-words.
+MAX_FLASH_WRITE_SIZE = 56
+
+
+class FlashAck:
+    """The bootloader's acknowledgement of binary flash writes.
+
+    Attributes:
+      end_address: the address just past the most recent successful
+        write
+      status: 0 if every write since the previous acknowledgement
+        succeeded, otherwise the first failure
+      writes: the number of writes received since the previous
+        acknowledgement, including the one which requested this, or
+        None for bootloaders which do not report it
+    """
+    id = None
+    end_address = None
+    status = None
+    writes = None
+
+    def __repr__(self):
+        return f'{self.id}/{self.end_address:08x}/{self.status}'
+
+
+def make_flash_ack_parser(id):
+    def parse(message):
+        data = message.data
+        if (len(data) < 8 or
+            data[0] != mp.STREAM_SERVER_DATA or
+            data[1] != FLASH_CHANNEL or
+            data[2] not in (5, 6) or
+            len(data) < 3 + data[2]):
+            return None
+        result = FlashAck()
+        result.id = id
+        result.end_address, result.status = struct.unpack('<IB', data[3:8])
+        if data[2] >= 6:
+            result.writes = data[8]
+        return result
+    return parse
+
+
+# A frame consisting of only this byte requests the reply layout
+# configured in the controller's query_template.
+TEMPLATE_QUERY = 0x60
+
+GROUP_COMMAND = 0x61
+
+
+def make_group_position(setpoints, *,
+                        destination=0x7f,
+                        reply_slots=(),
+                        source=0,
+                        register_scale=None):
+    """Return a moteus.Command which sends a position mode setpoint to
+    several controllers in one frame.
+
+    This requires each controller to be configured with a unique
+    group.slot and the default group.blocks layout.
+
+    Arguments:
+      setpoints: a list, indexed by slot, of
+        (position, velocity, feedforward_torque) tuples.
+      destination: the group.destination of the controllers
+      reply_slots: slots which should reply with their query template.
+        These replies arrive from the id of each controller, and may
+        be decoded with moteus.make_parser(id).
+      register_scale: an instance of moteus.RegisterScale shared by
+        every controller in the group
+    """
+
+    reply_mask = 0
+    for slot in reply_slots:
+        reply_mask |= 1 << slot
+
+    data_buf = io.BytesIO()
+    writer = Writer(data_buf, register_scale)
+    writer.write_int8(GROUP_COMMAND)
+    data_buf.write(struct.pack('<H', reply_mask))
+    for position, velocity, feedforward_torque in setpoints:
+        writer.write_int8(int(Mode.POSITION))
+        writer.write_position(position, mp.INT16)
+        writer.write_velocity(velocity, mp.INT16)
+        writer.write_torque(feedforward_torque, mp.INT16)
+
+    if len(data_buf.getvalue()) > 64:
+        raise RuntimeError('too many setpoints for one frame')
+
+    result = cmd.Command()
+    result.destination = destination
+    result.source = source
+    result.reply_required = False
+    result.data = data_buf.getvalue()
+    return result
+
+
+CLOCK_SYNC = 0x62
+
+
+# Periodic broadcasts begin with this byte, followed by ordinary reply
+# subframes.
+BROADCAST = 0x63
+
+
+def parse_broadcast(data, register_scale=None):
+    """Decode a periodic broadcast like parse_reply, or return None if
+    @p data is not a broadcast."""
+    if data[:1] != bytes([BROADCAST]):
+        return None
+    return parse_reply(data[1:], register_scale)
+
+
+def _wrap_int32(value):
+    value = int(value) & 0xffffffff
+    return value - 0x100000000 if value >= 0x80000000 else value
+
+
+def make_clock_sync(host_us, *, destination=0x7f, source=0):
+    """Return a moteus.Command which tells every controller whose
+    clock_sync.destination matches @p destination that the host time
+    is now @p host_us microseconds.
+
+    The host time may start anywhere and wraps at 32 bits.  Sent a few
+    times a second, this lets the controllers schedule commands given
+    an apply_time in that same time base.
+    """
+    result = cmd.Command()
+    result.destination = destination
+    result.source = source
+    result.reply_required = False
+    result.data = struct.pack('<BI', CLOCK_SYNC, int(host_us) & 0xffffffff)
+    return result
+
+
+class CommandTemplate:
+    """A command whose register layout is fixed when it is created, so
+    that each use need only encode its values into known offsets.
+
+    Construct with Controller.make_position_template or
+    make_current_template.
+    """
+
+    def __init__(self, command, data, fields):
+        self._command = command
+        self._data = data
+        self._fields = fields
+
+        self.names = [name for name, _, _, _, _ in fields]
+
+    def make(self, **values):
+        """Return a moteus.Command with the given values, which must
+        include every value the template was created with."""
+        data = bytearray(self._data)
+        for name, offset, packer, resolution, scale in self._fields:
+            packer.pack_into(
+                data, offset, mp.saturate(values[name], resolution, scale))
+
+        result = cmd.Command()
+        result.destination = self._command.destination
+        result.source = self._command.source
+        result.reply_required = self._command.reply_required
+        result.parse = self._command.parse
+        result.data = bytes(data)
+        return result
+
+
 class Controller:
     """Operates a single moteus controller across some communication
     medium.
@@ -388,6 +756,8 @@ class Controller:
       id: bus ID of the controller
       query_resolution: an instance of moteus.QueryResolution
       position_resolution: an instance of moteus.PositionResolution
+      register_scale: an instance of moteus.RegisterScale, matching the
+        controller's register_scale configuration
       transport: something modeling moteus.Transport to send commands through
     """
 
@@ -395,17 +765,20 @@ class Controller:
                  query_resolution=QueryResolution(),
                  position_resolution=PositionResolution(),
                  current_resolution=CurrentResolution(),
-                 transport=None):
+                 transport=None,
+                 register_scale=RegisterScale()):
         self.id = id
         self.query_resolution = query_resolution
         self.position_resolution = position_resolution
         self.current_resolution = current_resolution
+        self.register_scale = register_scale
         self.transport = transport
-        self._parser = make_parser(id)
         self._diagnostic_parser = make_diagnostic_parser(id)
 
-        # Pre-compute our query string.
+        # Pre-compute our query string, and how to decode its reply.
         self._query_data = self._make_query_data()
+        self._parser = make_parser(
+            id, compile_reply_parser(self._query_data, register_scale))
 
     def _get_transport(self):
         if self.transport:
@@ -466,6 +839,17 @@ class Controller:
         return self._extract(await self._get_transport().cycle(
             [self.make_query(**kwargs)]))
 
+    def make_template_query(self):
+        """Request the reply layout configured in the controller's
+        query_template.blocks, rather than an explicit register list."""
+        result = self._make_command(query=True)
+        result.data = bytes([TEMPLATE_QUERY])
+        return result
+
+    async def template_query(self, **kwargs):
+        return self._extract(await self._get_transport().cycle(
+            [self.make_template_query(**kwargs)]))
+
     def make_stop(self, *, query=False):
         """Return a moteus.Command structure with data necessary to send a
         stop mode command."""
@@ -523,9 +907,14 @@ class Controller:
                       maximum_torque=None,
                       stop_position=None,
                       watchdog_timeout=None,
+                      apply_time=None,
                       query=False):
         """Return a moteus.Command structure with data necessary to send a
-        position mode command with the given values."""
+        position mode command with the given values.
+
+        If apply_time is given, it is the host time in microseconds,
+        as sent with moteus.make_clock_sync, at which the controller
+        should act on the command."""
 
         result = self._make_command(query=query)
 
@@ -543,7 +932,7 @@ class Controller:
 
         data_buf = io.BytesIO()
 
-        writer = Writer(data_buf)
+        writer = Writer(data_buf, self.register_scale)
         writer.write_int8(mp.WRITE_INT8 | 0x01)
         writer.write_int8(int(Register.MODE))
         writer.write_int8(int(Mode.POSITION))
@@ -568,6 +957,11 @@ class Controller:
         if combiner.maybe_write():
             writer.write_time(watchdog_timeout, pr.watchdog_timeout)
 
+        if apply_time is not None:
+            writer.write_int8(mp.WRITE_INT32 | 0x01)
+            writer.write_varuint(int(Register.COMMAND_APPLY_TIME))
+            writer.write_int32(_wrap_int32(apply_time))
+
         if query:
             data_buf.write(self._query_data)
 
@@ -597,7 +991,7 @@ class Controller:
 
         data_buf = io.BytesIO()
 
-        writer = Writer(data_buf)
+        writer = Writer(data_buf, self.register_scale)
         writer.write_int8(mp.WRITE_INT8 | 0x01)
         writer.write_int8(int(Register.MODE))
         writer.write_int8(int(Mode.CURRENT))
@@ -620,6 +1014,86 @@ class Controller:
 
         return result
 
+    def _make_template(self, mode, start_register, fields, query):
+        """fields is a list of (name, resolution, scales, multiplier),
+        where a resolution of IGNORE leaves that register out."""
+        command = self._make_command(query=query)
+
+        data_buf = io.BytesIO()
+        writer = Writer(data_buf)
+        writer.write_int8(mp.WRITE_INT8 | 0x01)
+        writer.write_int8(int(Register.MODE))
+        writer.write_int8(int(mode))
+
+        combiner = mp.WriteCombiner(
+            writer, 0x00, int(start_register),
+            [resolution for _, resolution, _, _ in fields])
+
+        template_fields = []
+        for name, resolution, scales, multiplier in fields:
+            if not combiner.maybe_write():
+                continue
+            packer = mp.TYPES[resolution]
+            template_fields.append(
+                (name, data_buf.tell(), packer, resolution,
+                 (_scaled(scales, multiplier) + (1.0,))[resolution]))
+            data_buf.write(bytes(packer.size))
+
+        if query:
+            data_buf.write(self._query_data)
+
+        return CommandTemplate(command, data_buf.getvalue(), template_fields)
+
+    def make_position_template(self,
+                               *,
+                               position=False,
+                               velocity=False,
+                               feedforward_torque=False,
+                               kp_scale=False,
+                               kd_scale=False,
+                               maximum_torque=False,
+                               stop_position=False,
+                               watchdog_timeout=False,
+                               query=False):
+        """Return a CommandTemplate which makes the same commands as
+        make_position would, given each of the values set to True."""
+
+        pr = self.position_resolution
+        rs = self.register_scale
+
+        def maybe(enabled, resolution):
+            return resolution if enabled else mp.IGNORE
+
+        return self._make_template(Mode.POSITION, Register.COMMAND_POSITION, [
+            ('position', maybe(position, pr.position),
+             _POSITION_SCALES, rs.position),
+            ('velocity', maybe(velocity, pr.velocity),
+             _VELOCITY_SCALES, rs.velocity),
+            ('feedforward_torque',
+             maybe(feedforward_torque, pr.feedforward_torque),
+             _TORQUE_SCALES, rs.torque),
+            ('kp_scale', maybe(kp_scale, pr.kp_scale), _PWM_SCALES, 1.0),
+            ('kd_scale', maybe(kd_scale, pr.kd_scale), _PWM_SCALES, 1.0),
+            ('maximum_torque',
+             maybe(maximum_torque, pr.maximum_torque),
+             _TORQUE_SCALES, rs.torque),
+            ('stop_position',
+             maybe(stop_position, pr.stop_position),
+             _POSITION_SCALES, rs.position),
+            ('watchdog_timeout',
+             maybe(watchdog_timeout, pr.watchdog_timeout),
+             _TIME_SCALES, rs.time),
+        ], query)
+
+    def make_current_template(self, *, query=False):
+        """Return a CommandTemplate which makes the same commands as
+        make_current would, with values d_A and q_A."""
+        cr = self.current_resolution
+        return self._make_template(Mode.CURRENT, Register.COMMAND_Q_CURRENT, [
+            ('q_A', cr.q_A, _CURRENT_SCALES, self.register_scale.current),
+            ('d_A', cr.d_A, _CURRENT_SCALES, self.register_scale.current),
+        ], query)
+
     async def set_current(self, *args, **kwargs):
         return self._extract(await self._get_transport().cycle(
             [self.make_current(**kwargs)]))
@@ -661,6 +1135,29 @@ class Controller:
         return await self._get_transport().cycle(
             [self.make_diagnostic_read(**kwargs)])
 
+    def make_flash_write(self, address, data, *, query=False):
+        """Return a moteus.Command which programs data at the given
+        flash address while the bootloader is active.
+
+        Writes need not wait for one another.  When query is True,
+        the reply is a FlashAck covering every write since the
+        previous one which requested a reply."""
+        assert len(data) <= MAX_FLASH_WRITE_SIZE
+
+        result = self._make_command(query=query)
+
+        data_buf = io.BytesIO()
+        writer = Writer(data_buf)
+        writer.write_int8(mp.STREAM_CLIENT_DATA)
+        writer.write_int8(FLASH_CHANNEL)
+        writer.write_int8(4 + len(data))
+        data_buf.write(struct.pack('<I', address))
+        data_buf.write(data)
+
+        result.parse = make_flash_ack_parser(self.id)
+        result.data = data_buf.getvalue()
+        return result
+
 
 class CommandError(RuntimeError):
     def __init__(self, message):
@@ -668,17 +1165,29 @@ class CommandError(RuntimeError):
         self.message = message
 
 
+# The most data a single diagnostic read may return.
+_MAX_DIAGNOSTIC_READ = 61
+
+
 class Stream:
     """Presents a python file-like interface to the diagnostic stream of a
-    moteus controller."""
+    moteus controller.
+
+    Reads keep up to max_window polls in flight in each transport
+    cycle.  The window doubles each time every poll in it is answered
+    with a full frame, and drops back to a single poll as soon as the
+    controller has nothing more to send, so that an idle console costs
+    no more bus time than before."""
 
-    def __init__(self, controller, verbose=False):
+    def __init__(self, controller, verbose=False, max_window=8):
         self.controller = controller
         self.verbose = verbose
+        self.max_window = max_window
 
         self.lock = asyncio.Lock()
         self._read_data = b''
         self._write_data = b''
+        self._window = 1
 
         self._readers = {}
 
@@ -692,15 +1201,33 @@ class Stream:
             async with self.lock:
                 await self.controller.send_diagnostic_write(data=to_write)
 
+    async def _poll(self, size):
+        """Request up to @p size bytes, and return what was received."""
+        count = max(1, min(self._window,
+                           -(-size // _MAX_DIAGNOSTIC_READ)))
+        lengths = [_MAX_DIAGNOSTIC_READ] * (count - 1)
+        lengths.append(min(_MAX_DIAGNOSTIC_READ,
+                           size - _MAX_DIAGNOSTIC_READ * (count - 1)))
+
+        async with self.lock:
+            these_results = await self.controller._get_transport().cycle(
+                [self.controller.make_diagnostic_read(x) for x in lengths])
+
+        chunks = [x.data if x is not None and x.data else b''
+                  for x in these_results]
+
+        if all(len(chunk) == length
+               for chunk, length in zip(chunks, lengths)):
+            self._window = min(max(1, self.max_window), self._window * 2)
+        else:
+            self._window = 1
+
+        return b''.join(chunks)
+
     async def read(self, size, block=True):
         while ((block == True and len(self._read_data) < size)
                or len(self._read_data) == 0):
-            bytes_to_request = min(61, size - len(self._read_data))
-
-            async with self.lock:
-                these_results = await self.controller.diagnostic_read(bytes_to_request)
-
-            this_data = b''.join(x.data for x in these_results if x.data)
+            this_data = await self._poll(size - len(self._read_data))
 
             self._read_data += this_data
 
@@ -725,10 +1252,7 @@ class Stream:
 
     async def _read_maybe_empty_line(self):
         while b'\n' not in self._read_data and b'\r' not in self._read_data:
-            async with self.lock:
-                these_results = await self.controller.diagnostic_read(61)
-
-            this_data = b''.join(x.data for x in these_results if x.data)
+            this_data = await self._poll(_MAX_DIAGNOSTIC_READ * self._window)
 
             self._read_data += this_data
 
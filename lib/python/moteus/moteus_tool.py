@@ -28,6 +28,8 @@ import os
 import struct
 import sys
 import tempfile
+import time
+import zlib
 
 from . import moteus
 from . import aiostream
@@ -36,6 +38,30 @@ from . import calibrate_encoder as ce
 
 MAX_FLASH_BLOCK_SIZE = 32
 
+# The erase granularity of the flash.
+FLASH_PAGE_SIZE = 2048
+
+# The most page CRCs the bootloader reports per command.
+MAX_PAGE_CRCS = 16
+
+# The size of the firmware's motor.offset table.
+MAX_OFFSET_SIZE = 256
+
+# The size of the firmware's motor.cogging_A table.
+MAX_COGGING_SIZE = 64
+
+# The most binary flash writes which may be sent before waiting for
+# an acknowledgement.  A page erase stalls the bootloader for long
+# enough that more would overflow its receive FIFO.
+MAX_FLASH_WINDOW = 3
+
+# Leads a file written by --dump-config-blob.
+CONFIG_BLOB_MAGIC = b'MOTEUSCB'
+
+# How much of a configuration blob is transferred per command.  This
+# must be a multiple of the 8 byte flash double-word.
+CONFIG_BLOB_CHUNK = 32
+
 
 class FirmwareUpgrade:
     '''This encodes "magic" rules about upgrading firmware, largely about
@@ -89,6 +115,33 @@ class FirmwareUpgrade:
         return b'\n'.join(lines)
 
 
+def _config_schema_hash(enumerated):
+    """Return a hash of the names in the output of "conf enumerate".
+
+    A configuration blob is only meaningful to a device with the same
+    set of configurable values."""
+    names = [line.strip().split(b' ')[0]
+             for line in enumerated.split(b'\n') if b' ' in line]
+    return zlib.crc32(b'\n'.join(names))
+
+
+def _encode_config_blob(schema_hash, blob):
+    return CONFIG_BLOB_MAGIC + struct.pack('<II', schema_hash, len(blob)) + blob
+
+
+def _decode_config_blob(data):
+    """Return (schema_hash, blob)."""
+    header_size = len(CONFIG_BLOB_MAGIC) + 8
+    if data[:len(CONFIG_BLOB_MAGIC)] != CONFIG_BLOB_MAGIC:
+        raise RuntimeError("not a configuration blob")
+    schema_hash, size = struct.unpack(
+        '<II', data[len(CONFIG_BLOB_MAGIC):header_size])
+    blob = data[header_size:]
+    if len(blob) != size:
+        raise RuntimeError(f"configuration blob truncated, {len(blob)} != {size}")
+    return schema_hash, blob
+
+
 def _get_log_directory():
     moteus_cal_dir = os.environ.get("MOTEUS_CAL_DIR", None)
     if moteus_cal_dir:
@@ -103,6 +156,17 @@ def _get_log_directory():
     return "."
 
 
+def _bounded_int(low, high):
+    """An argparse type for integers between low and high inclusive."""
+    def parse(text):
+        value = int(text)
+        if value < low or value > high:
+            raise argparse.ArgumentTypeError(
+                f"{value} is not between {low} and {high}")
+        return value
+    return parse
+
+
 def _expand_targets(targets):
     result = set()
 
@@ -238,6 +302,56 @@ def _calculate_winding_resistance(voltages, currents):
     return 1.0 / _calculate_slope(voltages, currents)
 
 
+def _calculate_deadtime_voltage(voltages, currents):
+    """Return the per-phase dead time voltage from a sweep of d axis
+    voltage at a fixed electrical phase of 0.
+
+    There, phase A carries the current I and phases B and C each carry
+    -I/2, so each phase loses the dead time voltage Vdt with the sign
+    of its current.  In the amplitude invariant d axis that is a loss
+    of 2/3 * (Vdt + Vdt / 2 + Vdt / 2) = 4/3 * Vdt, which appears as
+    the voltage intercept of the V-I line."""
+    intercept_V = regression.linear_regression(currents, voltages)[0]
+    return 0.75 * intercept_V
+
+
+def _calculate_cogging_table(forward, reverse, size, period=1):
+    """Return the cogging current at each of `size` evenly spaced
+    positions within 1 / `period` of a revolution.
+
+    `forward` and `reverse` are lists of (position, q_A) samples from
+    constant velocity sweeps in each direction.  Friction has opposite
+    signs in the two, so averaging the directions leaves the position
+    dependent cogging, and the mean over a period is removed.  Every
+    period of the revolution is averaged into the same table."""
+    def bin_means(samples):
+        totals = [0.0] * size
+        counts = [0] * size
+        for position, q_A in samples:
+            phase = (position * period) % 65536
+            index = int(round(phase * size / 65536.0)) % size
+            totals[index] += q_A
+            counts[index] += 1
+        if min(counts) == 0:
+            raise RuntimeError(
+                'Cogging sweep did not visit every position, ' +
+                'try a lower --cal-cogging-speed')
+        return [x / c for x, c in zip(totals, counts)]
+
+    combined = [0.5 * (f + r) for f, r in
+                zip(bin_means(forward), bin_means(reverse))]
+    mean = sum(combined) / len(combined)
+    return [x - mean for x in combined]
+
+
+def _calculate_current_gains(resistance_ohm, inductance_H, bw_hz):
+    """Return the (kp, ki) of the current loop which cancels the
+    motor's electrical pole, leaving a first order response of the
+    given bandwidth."""
+    w = 2.0 * math.pi * bw_hz
+    return w * inductance_H, w * resistance_ohm
+
+
 class FlashDataBlock:
     def __init__(self, address=-1, data=b""):
         self.address = address
@@ -287,11 +401,76 @@ def _verify_blocks(expected, message):
         raise RuntimeError(f"verify returned wrong data at {expected.address:x}, {expected.data.hex()} != {actual_data}")
 
 
+def _split_flash_writes(sections, max_size):
+    for address, data in sections:
+        offset = 0
+        while offset < len(data):
+            this_address = address + offset
+            # Keep each write after the first aligned to a flash
+            # double-word, so that it can be programmed whole, and
+            # within a single page.
+            this_size = min(max_size - (this_address % 8),
+                            FLASH_PAGE_SIZE - (this_address % FLASH_PAGE_SIZE),
+                            len(data) - offset)
+            yield this_address, data[offset:offset + this_size]
+            offset += this_size
+
+
+def _page_images(sections):
+    """Return a dictionary mapping the address of every flash page
+    touched by sections to its expected contents.  Bytes not covered
+    are left erased."""
+    result = {}
+    for address, data in sections:
+        for offset in range(len(data)):
+            this_address = address + offset
+            page = this_address - (this_address % FLASH_PAGE_SIZE)
+            if page not in result:
+                result[page] = bytearray(b'\xff' * FLASH_PAGE_SIZE)
+            result[page][this_address - page] = data[offset]
+    return result
+
+
+class FlashProgress:
+    """Shows the flash progress of every device on a single line."""
+
+    def __init__(self, verbose):
+        self.verbose = verbose
+        self._status = {}
+        self._width = 0
+
+    def update(self, target_id, type, address):
+        if self.verbose:
+            return
+        self._status[target_id] = f"{type:9s} {address:08x}"
+        self._draw()
+
+    def log(self, target_id, message):
+        """Print a complete line for one target without garbling the
+        progress line."""
+        if self._width:
+            # Blank out the progress line, then draw it again below.
+            print(" " * self._width, end="\r")
+        print(f"{target_id}: {message}", flush=True)
+        if self._width:
+            self._draw()
+
+    def _draw(self):
+        line = "  ".join(f"{key}: {value}"
+                         for key, value in sorted(self._status.items()))
+        line = f"flash: {line}"
+        self._width = len(line)
+        print(line, end="\r", flush=True)
+
+
 class Stream:
-    def __init__(self, args, target_id, transport):
+    def __init__(self, args, target_id, transport, flash_progress=None):
         self.args = args
+        self.target_id = target_id
+        self.flash_progress = flash_progress or FlashProgress(args.verbose)
         self.controller = moteus.Controller(target_id, transport=transport)
-        self.stream = moteus.Stream(self.controller, verbose=args.verbose)
+        self.stream = moteus.Stream(self.controller, verbose=args.verbose,
+                                    max_window=args.diagnostic_window)
 
     async def do_console(self):
         console_stdin = aiostream.AioStream(sys.stdin.buffer.raw)
@@ -367,6 +546,55 @@ class Stream:
                 print(f" {line}")
             print()
 
+    async def read_config_blob(self):
+        """Return the configuration as last written to flash."""
+        info = await self.command("confb info", allow_any_response=True)
+        fields = info.split(b' ')
+        if len(fields) != 2:
+            raise RuntimeError(f"unexpected confb response '{info}'")
+        size, expected = int(fields[0]), int(fields[1], 16)
+
+        result = b''
+        for offset in range(0, size, CONFIG_BLOB_CHUNK):
+            this_size = min(CONFIG_BLOB_CHUNK, size - offset)
+            data = await self.command(f"confb read {offset:x} {this_size:x}",
+                                      allow_any_response=True)
+            if data.startswith(b'ERR'):
+                raise moteus.CommandError(data.decode('latin1'))
+            result += bytes.fromhex(data.decode('latin1'))
+
+        if zlib.crc32(result) != expected:
+            raise RuntimeError("configuration blob read back corrupted")
+        return result
+
+    async def do_dump_config_blob(self, blob_file):
+        schema_hash = _config_schema_hash(await self.command("conf enumerate"))
+        blob = await self.read_config_blob()
+        with open(blob_file, "wb") as f:
+            f.write(_encode_config_blob(schema_hash, blob))
+        print(f"Wrote {len(blob)} bytes of configuration to {blob_file}")
+
+    async def do_write_config_blob(self, blob_file):
+        schema_hash, blob = _decode_config_blob(open(blob_file, "rb").read())
+        if len(blob) % 8 != 0:
+            raise RuntimeError("configuration blob is not whole double-words")
+
+        device_hash = _config_schema_hash(await self.command("conf enumerate"))
+        if device_hash != schema_hash:
+            raise RuntimeError(
+                f"configuration schema {schema_hash:08x} does not match " +
+                f"device {device_hash:08x}, use --write-config instead")
+
+        await self.command("confb erase")
+        for offset in range(0, len(blob), CONFIG_BLOB_CHUNK):
+            chunk = blob[offset:offset + CONFIG_BLOB_CHUNK]
+            await self.command(f"confb write {offset:x} {chunk.hex()}")
+
+        if await self.read_config_blob() != blob:
+            raise RuntimeError("configuration blob did not verify")
+
+        await self.command("conf load")
+
     async def do_flash(self, elffile):
         elf = _read_elf(elffile, [".text", ".ARM.extab", ".ARM.exidx",
                                   ".data", ".ccmram", ".isr_vector"])
@@ -410,9 +638,24 @@ class Stream:
         await self.write_message("d flash")
         await self.stream.readline()
 
+        # Bootloaders which support binary writes also support the
+        # CRC commands, and return an error for unknown ones.
+        probe = await self.command("crc 8010000 0", allow_any_response=True)
+        binary = probe.startswith(b"CRC")
+
+        # The page CRCs must be read while the flash is still locked.
+        pages = None
+        if binary and not self.args.full_flash:
+            pages = await self.find_changed_pages(elf.sections)
+
         await self.command("unlock")
-        await self.write_flash(elf.sections)
-        await self.command("lock")
+        if binary:
+            await self.write_flash_binary(elf.sections, pages)
+            await self.command("lock")
+            await self.verify_flash_crc(elf.sections)
+        else:
+            await self.write_flash(elf.sections)
+            await self.command("lock")
         # This will reset the controller, so we don't expect a response.
         await self.write_message("reset")
 
@@ -421,10 +664,8 @@ class Stream:
         if not self.args.bootloader_active and not self.args.no_restore_config:
             await self.restore_config(upgrade.fix_config(old_config))
 
-    def _emit_flash_progress(self, ctx, type):
-        if self.args.verbose:
-            return
-        print(f"flash: {type:15s}  {ctx.current_address:08x}", end="\r", flush=True)
+    def _emit_flash_progress(self, address, type):
+        self.flash_progress.update(self.target_id, type, address)
 
     async def write_flash(self, elfs):
         write_ctx = FlashContext(elfs)
@@ -433,7 +674,7 @@ class Stream:
             cmd = f"w {next_block.address:x} {next_block.data.hex()}"
 
             result = await self.command(cmd)
-            self._emit_flash_progress(write_ctx, "flashing")
+            self._emit_flash_progress(write_ctx.current_address, "flashing")
             done = write_ctx.advance_block()
             if done:
                 break
@@ -445,21 +686,113 @@ class Stream:
             result = await self.command(cmd, allow_any_response=True)
             # Emit progress first, to make it easier to see where
             # things go wrong.
-            self._emit_flash_progress(verify_ctx, "verifying")
+            self._emit_flash_progress(verify_ctx.current_address, "verifying")
             _verify_blocks(expected_block, result)
             done = verify_ctx.advance_block()
             if done:
                 break
 
+    async def find_changed_pages(self, sections):
+        images = _page_images(sections)
+        page_addresses = sorted(images.keys())
+
+        changed = set()
+        i = 0
+        while i < len(page_addresses):
+            # Request runs of consecutive pages together.
+            start = page_addresses[i]
+            count = 1
+            while (count < MAX_PAGE_CRCS and
+                   i + count < len(page_addresses) and
+                   page_addresses[i + count] == start + count * FLASH_PAGE_SIZE):
+                count += 1
+
+            result = await self.command(f"pcrc {start:x} {count:x}",
+                                        allow_any_response=True)
+            fields = result.decode('latin1').split(' ')
+            if fields[0] != 'PCRC' or len(fields) != count + 1:
+                raise RuntimeError(f"unexpected pcrc response '{result}'")
+            for index, field in enumerate(fields[1:]):
+                address = start + index * FLASH_PAGE_SIZE
+                if int(field, 16) != zlib.crc32(images[address]):
+                    changed.add(address)
+            i += count
+
+        self.flash_progress.log(
+            self.target_id,
+            f"{len(changed)} of {len(page_addresses)} pages changed")
+        return changed
+
+    async def write_flash_binary(self, sections, pages=None):
+        """Program sections, limited to the given set of page addresses
+        if pages is not None."""
+        transport = self.controller._get_transport()
+        writes = [
+            (address, data) for address, data in
+            _split_flash_writes(sections, moteus.MAX_FLASH_WRITE_SIZE)
+            if (pages is None or
+                (address - (address % FLASH_PAGE_SIZE)) in pages)]
+        window = self.args.flash_window
+
+        for i in range(0, len(writes), window):
+            group = writes[i:i + window]
+            # Only the last write of each group waits for an
+            # acknowledgement, which covers the whole group.
+            commands = [
+                self.controller.make_flash_write(
+                    address, data, query=(j == len(group) - 1))
+                for j, (address, data) in enumerate(group)]
+            results = await transport.cycle(commands)
+
+            last_address, last_data = group[-1]
+            ack = results[-1]
+            self._emit_flash_progress(last_address, "flashing")
+            if ack is None:
+                raise RuntimeError(f"no flash acknowledgement at {last_address:x}")
+            if ack.status != 0:
+                raise RuntimeError(f"flash write error {ack.status} before {last_address:x}")
+            if ack.writes is not None and ack.writes != len(group):
+                raise RuntimeError(
+                    f"flash writes lost, {ack.writes} of {len(group)} " +
+                    f"received before {last_address:x}")
+            if ack.end_address != last_address + len(last_data):
+                raise RuntimeError(
+                    f"flash writes lost, {ack.end_address:x} != " +
+                    f"{last_address + len(last_data):x}")
+
+    async def verify_flash_crc(self, sections):
+        for address, data in sections:
+            self._emit_flash_progress(address, "verifying")
+            result = await self.command(f"crc {address:x} {len(data):x}",
+                                        allow_any_response=True)
+            fields = result.decode('latin1').split(' ')
+            if len(fields) != 2 or fields[0] != 'CRC':
+                raise RuntimeError(f"unexpected crc response '{result}'")
+            actual = int(fields[1], 16)
+            expected = zlib.crc32(data)
+            if actual != expected:
+                raise RuntimeError(
+                    f"verify failed for {address:x}, crc {actual:08x} != {expected:08x}")
+
     async def check_for_fault(self):
         servo_stats = await self.read_data("servo_stats")
         if servo_stats.mode == 1:
             raise RuntimeError(f"Controller reported fault: {int(servo_stats.fault)}")
 
     async def restore_config(self, old_config):
+        # The configuration in flash survives the upgrade.  So when
+        # the set of values is unchanged, only those which differ from
+        # what was loaded at startup need to be set.
+        current_config = await self.command("conf enumerate")
+        current_lines = set()
+        if _config_schema_hash(current_config) == _config_schema_hash(old_config):
+            current_lines = set(line.strip()
+                                for line in current_config.split(b'\n'))
+
         new_config = []
         for line in old_config.split(b'\n'):
-            if len(line.strip()) == 0:
+            line = line.strip()
+            if len(line) == 0 or line in current_lines:
                 continue
             new_config.append(b'conf set ' + line + b'\n')
         await self.write_config_stream(io.BytesIO(b''.join(new_config)))
@@ -471,10 +804,12 @@ class Stream:
         unwrapped_position_scale = \
             await self.read_config_double("motor.unwrapped_position_scale")
 
-        # We have 3 things to calibrate.
+        # We have 4 things to calibrate.
         #  1) The encoder to phase mapping
         #  2) The winding resistance
-        #  3) The Kv rating of the motor.
+        #  3) Optionally, the inductance, and from it and the
+        #     resistance, the current loop gains
+        #  4) The Kv rating of the motor.
 
         print("Starting calibration process")
         await self.check_for_fault()
@@ -482,9 +817,22 @@ class Stream:
         cal_result = await self.calibrate_encoder_mapping()
         await self.check_for_fault()
 
-        winding_resistance = await self.calibrate_winding_resistance()
+        winding_resistance, deadtime_V = \
+            await self.calibrate_winding_resistance()
         await self.check_for_fault()
 
+        # Older firmware has no "d ind", and the measured gains would
+        # replace any existing tuning of servo.pid_dq, so both are
+        # only done when asked for.
+        inductance = None
+        pid_dq = None
+        if self.args.cal_inductance or self.args.cal_bw_hz > 0.0:
+            inductance = await self.calibrate_inductance()
+            await self.check_for_fault()
+
+            pid_dq = await self.calibrate_current_loop(
+                winding_resistance, inductance)
+
         v_per_hz = await self.calibrate_kv_rating(unwrapped_position_scale)
         await self.check_for_fault()
 
@@ -506,12 +854,16 @@ class Stream:
             'device_info' : device_info,
             'calibration' : cal_result.to_json(),
             'winding_resistance' : winding_resistance,
+            'deadtime_comp_V' : deadtime_V,
+            'pid_dq' : pid_dq,
             'v_per_hz' : v_per_hz,
             # We measure voltage to the center, not peak-to-peak, thus
             # the extra 0.5.
             'kv' : (0.5 * 60.0 / v_per_hz),
             'unwrapped_position_scale' : unwrapped_position_scale
         }
+        if inductance is not None:
+            report['inductance_H'] = inductance
 
         log_filename = f"moteus-cal-{device_info['serial_number']}-{now.strftime('%Y%m%dT%H%M%S.%f')}.log"
 
@@ -532,8 +884,13 @@ class Stream:
 
         await self.command("d stop")
         await asyncio.sleep(0.1)
+
+        if self.args.cal_onboard:
+            return await self.calibrate_encoder_mapping_onboard()
+
+        binary = ' b1' if self.args.cal_binary else ''
         await self.write_message(
-            (f"d cal {self.args.cal_power} s{self.args.cal_speed}"))
+            (f"d cal {self.args.cal_power} s{self.args.cal_speed}{binary}"))
 
         cal_data = b''
         index = 0
@@ -542,6 +899,16 @@ class Stream:
             if not self.args.verbose:
                 print("Calibrating {} ".format("/-\\|"[index]), end='\r', flush=True)
                 index = (index + 1) % 4
+            if line.startswith(b'CALB '):
+                # A block of binary samples follows.  We convert them
+                # to the text form, so that --cal-raw files are the
+                # same either way.
+                count = int(line[5:])
+                block = await self.stream.read(
+                    count * ce.BINARY_ENTRY.size, block=True)
+                for entry in ce.parse_binary(block):
+                    cal_data += ce.format_entry(entry).encode('latin1') + b'\n'
+                continue
             cal_data += (line + b'\n')
             if line.startswith(b'CAL done'):
                 break
@@ -556,7 +923,7 @@ class Stream:
                 f.write(cal_data)
 
         cal_file = ce.parse_file(io.BytesIO(cal_data))
-        cal_result = ce.calibrate(cal_file)
+        cal_result = ce.calibrate(cal_file, offset_size=self.args.cal_offset_size)
 
         if cal_result.errors:
             raise RuntimeError(f"Error(s) calibrating: {cal_result.errors}")
@@ -566,11 +933,55 @@ class Stream:
             await self.command(f"conf set motor.poles {cal_result.poles}")
             await self.command("conf set motor.invert {}".format(
                 1 if cal_result.invert else 0))
+            await self.command(
+                f"conf set motor.offset_size {len(cal_result.offset)}")
             for i, offset in enumerate(cal_result.offset):
                 await self.command(f"conf set motor.offset.{i} {offset}")
 
         return cal_result
 
+    async def calibrate_encoder_mapping_onboard(self):
+        # The controller computes and applies the table itself, so
+        # only the results need to come back.
+        await self.command(
+            f"conf set motor.offset_size {self.args.cal_offset_size}")
+        await self.write_message(
+            (f"d cal {self.args.cal_power} s{self.args.cal_speed} o1"))
+
+        cal_result = ce.CalibrationResult()
+        offset = {}
+        index = 0
+        while True:
+            line = (await self.stream.readline()).strip()
+            if not self.args.verbose:
+                print("Calibrating {} ".format("/-\\|"[index]), end='\r', flush=True)
+                index = (index + 1) % 4
+            if line.startswith(b'CALR '):
+                fields = dict(x.split(b'=') for x in line.split(b' ')[1:])
+                cal_result.poles = int(fields[b'poles'])
+                cal_result.invert = int(fields[b'invert']) != 0
+                cal_result.ratio = int(fields[b'ratio']) * 0.001
+                continue
+            if line.startswith(b'CALO '):
+                _, entry, value = line.split(b' ')
+                offset[int(entry)] = int(value) * 1e-6
+                continue
+            if line.startswith(b'CAL done'):
+                break
+            if line.startswith(b'CAL start'):
+                continue
+            if line.startswith(b'CAL'):
+                raise RuntimeError(f'Error calibrating: {line}')
+
+        cal_result.offset = [offset[i] for i in range(len(offset))]
+
+        if self.args.cal_no_update:
+            # The controller has already applied the result, so
+            # restore what is in flash.
+            await self.command("conf load")
+
+        return cal_result
+
     async def find_current(self, voltage):
         assert voltage < 3.0
         assert voltage >= 0.0
@@ -601,16 +1012,76 @@ class Stream:
     async def calibrate_winding_resistance(self):
         print("Calculating winding resistance")
 
+        # Any existing dead time compensation would hide the very
+        # offset we are measuring.
+        original_deadtime_V = \
+            await self.read_config_double("servo.deadtime_comp_V")
+        await self.command("conf set servo.deadtime_comp_V 0")
+
         ratios = [ 0.5, 0.6, 0.7, 0.85, 1.0 ]
         voltages = [x * self.args.cal_voltage for x in ratios]
         currents = [await self.find_current(voltage) for voltage in voltages]
 
         winding_resistance = _calculate_winding_resistance(voltages, currents)
+        deadtime_V = _calculate_deadtime_voltage(voltages, currents)
+        print(f"deadtime_comp_V={deadtime_V}")
 
         if not self.args.cal_no_update:
             await self.command(f"conf set motor.resistance_ohm {winding_resistance}")
 
-        return winding_resistance
+        if not self.args.cal_no_update and self.args.cal_deadtime:
+            await self.command(f"conf set servo.deadtime_comp_V {deadtime_V}")
+        else:
+            await self.command(
+                f"conf set servo.deadtime_comp_V {original_deadtime_V}")
+
+        return winding_resistance, deadtime_V
+
+    async def calibrate_inductance(self):
+        print("Calculating inductance")
+
+        voltage = self.args.cal_voltage
+        period = self.args.cal_ind_period
+
+        await self.command(f"d ind {voltage:.3f} {period}")
+
+        # Let the current settle into its triangle wave, then average
+        # over a fixed interval.
+        await asyncio.sleep(0.3)
+        start = await self.read_data("servo_stats")
+        await asyncio.sleep(1.0)
+        end = await self.read_data("servo_stats")
+
+        await self.command("d stop")
+        await asyncio.sleep(0.1)
+
+        count = end.meas_ind_count - start.meas_ind_count
+        di_dt = end.meas_ind_integrator - start.meas_ind_integrator
+        if count <= 0 or di_dt <= 0.0:
+            raise RuntimeError(
+                "Inductance measurement produced no current change")
+
+        inductance = voltage * count / di_dt
+        print(f"inductance={inductance}H")
+
+        if not self.args.cal_no_update:
+            await self.command(f"conf set motor.inductance_H {inductance}")
+
+        return inductance
+
+    async def calibrate_current_loop(self, resistance, inductance):
+        if self.args.cal_bw_hz <= 0.0:
+            return None
+
+        kp, ki = _calculate_current_gains(
+            resistance, inductance, self.args.cal_bw_hz)
+        print(f"pid_dq kp={kp} ki={ki} ({self.args.cal_bw_hz}Hz)")
+
+        if not self.args.cal_no_update:
+            await self.command(f"conf set servo.pid_dq.kp {kp}")
+            await self.command(f"conf set servo.pid_dq.ki {ki}")
+
+        return { 'kp' : kp, 'ki' : ki, 'bw_hz' : self.args.cal_bw_hz }
 
     async def find_speed(self, voltage):
         assert voltage < 1.0
@@ -658,6 +1129,96 @@ class Stream:
 
         return v_per_hz
 
+    async def sample_cogging_sweep(self, velocity, duration_s):
+        await self.command(
+            f"d pos nan {velocity} {self.args.cal_cogging_max_torque}")
+
+        # Let the velocity settle before recording.
+        await asyncio.sleep(0.5)
+
+        samples = []
+        end = time.time() + duration_s
+        while time.time() < end:
+            data = await self.read_data("servo_stats")
+            samples.append((data.position, data.q_A))
+
+        return samples
+
+    async def do_calibrate_cogging(self):
+        print("This will move the motor slowly in both directions, " +
+              "for best results, it should be unloaded!")
+        await asyncio.sleep(2.0)
+
+        size = self.args.cal_cogging_size
+        period = 1
+        if self.args.cal_cogging_slots:
+            poles = int(await self.read_config_double("motor.poles"))
+            slots = self.args.cal_cogging_slots
+            period = slots * poles // math.gcd(slots, poles)
+        print(f"Cogging table of {size} entries, repeated {period} " +
+              "times per revolution")
+
+        unwrapped_position_scale = \
+            await self.read_config_double("motor.unwrapped_position_scale")
+        original_position_min = await self.read_config_double("servopos.position_min")
+        original_position_max = await self.read_config_double("servopos.position_max")
+
+        # The limits are restored even if the sweep fails, so that a
+        # fault or interruption does not leave the servo unbounded.
+        try:
+            await self.command("conf set servopos.position_min NaN")
+            await self.command("conf set servopos.position_max NaN")
+            # The sweep must measure the motor without any existing
+            # compensation.
+            await self.command("conf set motor.cogging_size 0")
+            await self.check_for_fault()
+
+            # Commands are at the output, the speed is given at the motor.
+            velocity = self.args.cal_cogging_speed * unwrapped_position_scale
+            duration_s = self.args.cal_cogging_revs / self.args.cal_cogging_speed
+
+            print("Sweeping forward")
+            forward = await self.sample_cogging_sweep(velocity, duration_s)
+            await self.check_for_fault()
+            print("Sweeping reverse")
+            reverse = await self.sample_cogging_sweep(-velocity, duration_s)
+            await self.check_for_fault()
+        finally:
+            await self.command("d stop")
+
+            await self.command(f"conf set servopos.position_min {original_position_min}")
+            await self.command(f"conf set servopos.position_max {original_position_max}")
+
+        table = _calculate_cogging_table(forward, reverse, size, period)
+        print(f"Peak cogging current {max(abs(x) for x in table):.3f}A " +
+              f"from {len(forward) + len(reverse)} samples")
+
+        if self.args.cal_no_update:
+            await self.command("conf load")
+        else:
+            for index, value in enumerate(table):
+                await self.command(f"conf set motor.cogging_A.{index} {value}")
+            await self.command(f"conf set motor.cogging_period {period}")
+            await self.command(f"conf set motor.cogging_size {size}")
+            print("Saving to persistent storage")
+            await self.command("conf write")
+
+        device_info = await self.get_device_info()
+        now = datetime.datetime.utcnow()
+        report = {
+            'timestamp' : now.strftime('%Y-%m-%d %H:%M:%S.%f'),
+            'device_info' : device_info,
+            'cogging_A' : table,
+            'cogging_period' : period,
+        }
+
+        log_filename = f"moteus-cogging-{device_info['serial_number']}-{now.strftime('%Y%m%dT%H%M%S.%f')}.log"
+        print(f"REPORT: {log_filename}")
+
+        with open(os.path.join(_get_log_directory(), log_filename), "w") as fp:
+            json.dump(report, fp, indent=2)
+            fp.write("\n")
+
     async def do_restore_calibration(self, filename):
         report = json.load(open(filename, "r"))
 
@@ -674,10 +1235,19 @@ class Stream:
             f"conf set motor.poles {cal_result['poles']}")
         await self.command(
             f"conf set motor.invert {1 if cal_result['invert'] else 0}")
+        await self.command(
+            f"conf set motor.offset_size {len(cal_result['offset'])}")
         for index, offset in enumerate(cal_result['offset']):
             await self.command(f"conf set motor.offset.{index} {offset}")
 
         await self.command(f"conf set motor.resistance_ohm {report['winding_resistance']}")
+        if 'inductance_H' in report:
+            await self.command(f"conf set motor.inductance_H {report['inductance_H']}")
+        if self.args.cal_deadtime and 'deadtime_comp_V' in report:
+            await self.command(f"conf set servo.deadtime_comp_V {report['deadtime_comp_V']}")
+        if report.get('pid_dq', None):
+            await self.command(f"conf set servo.pid_dq.kp {report['pid_dq']['kp']}")
+            await self.command(f"conf set servo.pid_dq.ki {report['pid_dq']['ki']}")
         await self.command(f"conf set motor.v_per_hz {report['v_per_hz']}")
         await self.command("conf write")
 
@@ -696,11 +1266,33 @@ class Runner:
         self.transport = moteus.get_singleton_transport(self.args)
         targets = await self.find_targets()
 
+        if self.args.parallel and self.args.flash:
+            await self.flash_parallel(targets)
+            return
+
         for target in targets:
             if self._discovered:
                 print(f"Target: {target}")
             await self.run_action(target)
 
+    async def flash_parallel(self, targets):
+        # Each target has its own stream, and the transport serializes
+        # individual frames, so the devices' traffic is interleaved.
+        progress = FlashProgress(self.args.verbose)
+        results = await asyncio.gather(
+            *[Stream(self.args, target, self.transport,
+                     flash_progress=progress).do_flash(self.args.flash)
+              for target in targets],
+            return_exceptions=True)
+        print()
+
+        failures = [(target, result) for target, result in zip(targets, results)
+                    if isinstance(result, Exception)]
+        for target, error in failures:
+            print(f"Target {target}: flash failed: {error}")
+        if failures:
+            raise RuntimeError(f"{len(failures)} of {len(targets)} targets failed")
+
     async def find_targets(self):
         if self.cmdline_targets:
             return self.cmdline_targets
@@ -711,8 +1303,8 @@ class Runner:
         for i in range(1, 127):
             c = moteus.Controller(id=i, transport=self.transport)
             try:
-                _ = await asyncio.wait_for(c.query(), 0.01)
-                result.append(i)
+                if await asyncio.wait_for(c.query(), 0.01) is not None:
+                    result.append(i)
             except asyncio.TimeoutError:
                 pass
 
@@ -733,10 +1325,16 @@ class Runner:
             await stream.do_zero_offset()
         elif self.args.write_config:
             await stream.do_write_config(self.args.write_config)
+        elif self.args.dump_config_blob:
+            await stream.do_dump_config_blob(self.args.dump_config_blob)
+        elif self.args.write_config_blob:
+            await stream.do_write_config_blob(self.args.write_config_blob)
         elif self.args.flash:
             await stream.do_flash(self.args.flash)
         elif self.args.calibrate:
             await stream.do_calibrate()
+        elif self.args.calibrate_cogging:
+            await stream.do_calibrate_cogging()
         elif self.args.restore_cal:
             await stream.do_restore_calibration(self.args.restore_cal)
         else:
@@ -750,6 +1348,9 @@ async def async_main():
         '-t', '--target', type=str, action='append', default=[],
         help='destination address(es) (default: autodiscover)')
     parser.add_argument('-v', '--verbose', action='store_true')
+    parser.add_argument(
+        '--diagnostic-window', type=int, default=8,
+        help='maximum diagnostic reads to keep in flight at once')
 
     moteus.make_transport_args(parser)
 
@@ -765,6 +1366,10 @@ async def async_main():
                        help='emit all configuration to the console')
     group.add_argument('--write-config', metavar='FILE',
                        help='write the given configuration')
+    group.add_argument('--dump-config-blob', metavar='FILE',
+                       help='save the stored configuration in binary form')
+    group.add_argument('--write-config-blob', metavar='FILE',
+                       help='store and load a binary configuration')
     group.add_argument('--flash', metavar='FILE',
                        help='write the given elf file to flash')
 
@@ -772,6 +1377,14 @@ async def async_main():
                         help='do not restore config after flash')
     parser.add_argument('--bootloader-active', action='store_true',
                         help='bootloader is already active')
+    parser.add_argument('--flash-window', metavar='N',
+                        type=_bounded_int(1, MAX_FLASH_WINDOW), default=2,
+                        help='number of binary flash writes per ' +
+                        f'acknowledgement, at most {MAX_FLASH_WINDOW}')
+    parser.add_argument('--parallel', action='store_true',
+                        help='flash all targets concurrently')
+    parser.add_argument('--full-flash', action='store_true',
+                        help='program every page, even those which are unchanged')
 
     group.add_argument('--calibrate', action='store_true',
                         help='calibrate the motor, requires full freedom of motion')
@@ -783,8 +1396,41 @@ async def async_main():
                         help='speed in electrical rps')
     parser.add_argument('--cal-voltage', metavar='V', type=float, default=0.45,
                         help='maximum voltage when measuring resistance')
+    parser.add_argument('--cal-deadtime', action='store_true',
+                        help='also apply the measured dead time compensation')
+    parser.add_argument('--cal-ind-period', metavar='N', type=int, default=4,
+                        help='control cycles in each half of the inductance square wave')
+    parser.add_argument('--cal-inductance', action='store_true',
+                        help='also measure the motor inductance, requires "d ind"')
+    parser.add_argument('--cal-bw-hz', metavar='HZ', type=float, default=0.0,
+                        help='current loop bandwidth to tune pid_dq for, ' +
+                        'implies --cal-inductance, 0 to leave unchanged')
     parser.add_argument('--cal-raw', metavar='FILE', type=str,
                         help='write raw calibration data')
+    parser.add_argument('--cal-binary', action='store_true',
+                        help='have the controller report calibration data in binary blocks')
+    parser.add_argument('--cal-offset-size', metavar='N',
+                        type=_bounded_int(1, MAX_OFFSET_SIZE), default=64,
+                        help='number of entries in the encoder offset table ' +
+                        f'(max {MAX_OFFSET_SIZE})')
+    parser.add_argument('--cal-onboard', action='store_true',
+                        help='compute the encoder calibration on the controller')
+
+    group.add_argument('--calibrate-cogging', action='store_true',
+                        help='learn the cogging feedforward table')
+    parser.add_argument('--cal-cogging-speed', metavar='HZ', type=float, default=0.05,
+                        help='speed of the cogging sweep in motor revolutions per second')
+    parser.add_argument('--cal-cogging-revs', metavar='N', type=float, default=2.0,
+                        help='motor revolutions to record in each direction')
+    parser.add_argument('--cal-cogging-size', metavar='N',
+                        type=_bounded_int(1, MAX_COGGING_SIZE), default=64,
+                        help='number of entries in the cogging table ' +
+                        f'(max {MAX_COGGING_SIZE})')
+    parser.add_argument('--cal-cogging-slots', metavar='N', type=int, default=0,
+                        help='stator slots, so the table need only span one ' +
+                        'cogging period, 0 to span a revolution')
+    parser.add_argument('--cal-cogging-max-torque', metavar='NM', type=float, default=1.0,
+                        help='maximum torque during the cogging sweep')
 
     group.add_argument('--restore-cal', metavar='FILE', type=str,
                         help='restore calibration from logged data')
@@ -17,6 +17,12 @@ import sys
 
 can = None
 
+REPLY_TIMEOUT_S = 0.5
+
+# The first byte of a periodic broadcast, moteus.BROADCAST.
+_BROADCAST = b'\x63'
+TX_RETRY_S = 0.0005
+
 class PythonCan:
     '''Implements a 'Transport' on top of python-can.'''
 
@@ -49,40 +55,104 @@ class PythonCan:
         self._reader = can.AsyncBufferedReader()
         self._notifier = can.Notifier(self._can, [self._reader],
                                       loop=asyncio.get_event_loop())
+        self._cycle_lock = asyncio.Lock()
         self._setup = True
 
     async def cycle(self, commands):
+        """Send all the given commands at once, then collect the
+        replies to those which require one.
+
+        As for the fdcanusb, the result has one entry for each
+        command, in the same order, holding the result of its parse
+        method.  Commands which do not require a reply, and replies
+        which do not arrive in time, are returned as None."""
         self._maybe_setup()
 
-        result = []
-        for x in commands:
-            reply = await self._do_command(x)
-            if reply is not None:
-                result.append(reply)
+        # As with the fdcanusb, a cycle must fully complete in between
+        # cancellation points, so that later replies are not matched
+        # to the wrong command.
+        return await asyncio.shield(self._do_cycle_shield(commands))
+
+    async def _do_cycle_shield(self, commands):
+        # We only permit one outstanding cycle at a time.
+        async with self._cycle_lock:
+            return await self._do_cycle(commands)
+
+    async def _do_cycle(self, commands):
+        loop = asyncio.get_event_loop()
+
+        # Any device should definitely respond within this much time
+        # of being sent its frame, otherwise it is having serious
+        # problems.
+        deadline = loop.time() + REPLY_TIMEOUT_S
+
+        # Every frame is queued before we look for any replies, so
+        # that the bus is kept busy.
+        for command in commands:
+            await self._send(self._make_message(command), deadline)
+
+        result = [None] * len(commands)
+
+        # The indices of the commands still awaiting a reply, by the
+        # id of the device which will send it.
+        outstanding = {}
+        for index, command in enumerate(commands):
+            if command.reply_required:
+                outstanding.setdefault(command.destination, []).append(index)
+
+        while outstanding:
+            remaining = deadline - loop.time()
+            if remaining <= 0:
+                break
+            try:
+                message = await asyncio.wait_for(
+                    self._reader.get_message(), remaining)
+            except asyncio.TimeoutError:
+                break
+
+            if message.data[:1] == _BROADCAST:
+                # Periodic broadcasts are never the reply to a command.
+                continue
+
+            source = (message.arbitration_id >> 8) & 0x7f
+            indices = outstanding.get(source)
+            if not indices:
+                # Nothing was waiting for this, maybe it is the late
+                # reply to a cycle which timed out.
+                continue
+
+            index = indices.pop(0)
+            if not indices:
+                del outstanding[source]
+            result[index] = commands[index].parse(message)
 
         return result
 
-    async def _do_command(self, command):
-        await self.write(command)
-
-        if not command.reply_required:
-            return None
-
-        reply = await self._reader.get_message()
-
-        return command.parse(reply)
-
-    async def write(self, command):
+    def _make_message(self, command):
         reply_required = command.reply_required
         arbitration_id = command.destination + (0x8000 if reply_required else 0)
-        message = can.Message(arbitration_id=arbitration_id,
-                              is_extended_id=(arbitration_id >= 0x7ff),
-                              dlc=len(command.data),
-                              data=bytearray(command.data),
-                              is_fd=True,
-                              bitrate_switch=True)
-
-        self._can.send(message)
+        return can.Message(arbitration_id=arbitration_id,
+                           is_extended_id=(arbitration_id >= 0x7ff),
+                           dlc=len(command.data),
+                           data=bytearray(command.data),
+                           is_fd=True,
+                           bitrate_switch=True)
+
+    async def _send(self, message, deadline):
+        loop = asyncio.get_event_loop()
+        while True:
+            try:
+                self._can.send(message)
+                return
+            except can.CanError:
+                # The transmit queue is full, give it a chance to
+                # drain.
+                if loop.time() > deadline:
+                    raise
+                await asyncio.sleep(TX_RETRY_S)
+
+    async def write(self, command):
+        self._can.send(self._make_message(command))
 
     async def read(self):
         self._maybe_setup()
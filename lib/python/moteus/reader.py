@@ -12,8 +12,11 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import array
 import collections
 import enum
+import io
+import mmap
 import struct
 
 
@@ -468,3 +471,275 @@ class Type:
         except IndexError:
             raise RuntimeError("Unknown type: {}".format(type_index))
         return this_type(schema_stream, **kwargs)
+
+
+def _fixed_format(type_class):
+    '''Return a numpy dtype description for values of this type, or
+    None if they do not always have the same size.'''
+    if isinstance(type_class, BooleanType):
+        return '?'
+    elif isinstance(type_class, FixedIntType):
+        return '<i{}'.format(type_class.field_size)
+    elif isinstance(type_class, FixedUIntType):
+        return '<u{}'.format(type_class.field_size)
+    elif isinstance(type_class, Float32Type):
+        return '<f4'
+    elif isinstance(type_class, Float64Type):
+        return '<f8'
+    elif isinstance(type_class, (TimestampType, DurationType)):
+        return '<i8'
+    elif isinstance(type_class, EnumType):
+        return _fixed_format(type_class.type_class)
+    elif isinstance(type_class, FixedArrayType):
+        item = _fixed_format(type_class.type_class)
+        if item is None:
+            return None
+        return (item, (type_class.size,))
+    elif isinstance(type_class, ObjectType):
+        result = []
+        for field in type_class.fields:
+            if isinstance(field.type_class, NullType):
+                continue
+            item = _fixed_format(field.type_class)
+            if item is None:
+                return None
+            result.append((field.name, item))
+        return result
+    return None
+
+
+def _import_numpy():
+    # numpy is only needed for bulk decoding, so it is not a hard
+    # dependency of this module.
+    import numpy
+    return numpy
+
+
+def _int64_array(numpy, values, start, end):
+    return numpy.asarray(memoryview(values)[start:end], dtype=numpy.int64)
+
+
+def _read_varuint(data, pos):
+    result = 0
+    shift = 0
+    while True:
+        if pos >= len(data):
+            raise EOFError()
+        value = data[pos]
+        pos += 1
+        result |= (value & 0x7f) << shift
+        shift += 7
+        if value < 0x80:
+            return result, pos
+        if shift >= 64:
+            raise ParseError("invalid varuint")
+
+
+class FileRecord:
+    '''The schema and data block locations of one record in a log.'''
+
+    def __init__(self, identifier, name, schema):
+        self.identifier = identifier
+        self.name = name
+        self.schema = schema
+
+        self._fixed = _fixed_format(schema)
+        self._dtype = None
+
+        # The offset and size of the serialized data within each
+        # block, in file order.
+        self.offsets = array.array('q')
+        self.sizes = array.array('q')
+        self.timestamps = array.array('q')
+        self.compressed = False
+
+    def __len__(self):
+        return len(self.offsets)
+
+    @property
+    def dtype(self):
+        '''The numpy dtype of one instance, or None if this record can
+        not be decoded in bulk.'''
+        if not self._fixed or not isinstance(self._fixed, list):
+            return None
+        if self._dtype is None:
+            self._dtype = _import_numpy().dtype(self._fixed)
+        return self._dtype
+
+
+class FileReader:
+    '''Reads a log written by mjlib::telemetry::FileWriter.
+
+    The file is memory mapped, and records whose schema has a fixed
+    size layout are decoded in bulk into numpy column arrays, one per
+    field.  Nested objects are flattened with their names joined by
+    '.', and timestamps and durations are converted to seconds.'''
+
+    HEADER = b'TLOG0003'
+
+    BLOCK_SCHEMA = 1
+    BLOCK_DATA = 2
+
+    DATA_PREVIOUS_OFFSET = 1 << 0
+    DATA_TIMESTAMP = 1 << 1
+    DATA_CHECKSUM = 1 << 2
+    DATA_SNAPPY = 1 << 4
+
+    TIMESTAMP = '__timestamp'
+
+    GATHER_SIZE = 65536
+
+    def __init__(self, filename):
+        self._fd = open(filename, 'rb')
+        header = self._fd.read(len(self.HEADER))
+        if header != self.HEADER:
+            self._fd.close()
+            raise ParseError("not a TLOG0003 file")
+
+        self._mmap = mmap.mmap(self._fd.fileno(), 0, access=mmap.ACCESS_READ)
+        self._by_id = {}
+        self.records = {}
+        self._index()
+
+    def close(self):
+        self._mmap.close()
+        self._fd.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def _index(self):
+        data = self._mmap
+        size = len(data)
+
+        # The header flags follow the magic.
+        _, pos = _read_varuint(data, len(self.HEADER))
+
+        by_id = self._by_id
+        while pos < size:
+            try:
+                block_type, pos = _read_varuint(data, pos)
+                block_size, pos = _read_varuint(data, pos)
+            except EOFError:
+                break
+
+            block_end = pos + block_size
+            if block_end > size:
+                # The writer was interrupted part way through a block.
+                break
+
+            if block_type == self.BLOCK_DATA:
+                identifier, p = _read_varuint(data, pos)
+                flags, p = _read_varuint(data, p)
+                record = by_id.get(identifier)
+                if record is not None:
+                    if flags & self.DATA_PREVIOUS_OFFSET:
+                        _, p = _read_varuint(data, p)
+                    if flags & self.DATA_TIMESTAMP:
+                        record.timestamps.append(
+                            struct.unpack_from('<q', data, p)[0])
+                        p += 8
+                    if flags & self.DATA_CHECKSUM:
+                        p += 4
+                    if flags & self.DATA_SNAPPY:
+                        record.compressed = True
+                    record.offsets.append(p)
+                    record.sizes.append(block_end - p)
+            elif block_type == self.BLOCK_SCHEMA:
+                identifier, p = _read_varuint(data, pos)
+                _, p = _read_varuint(data, p)  # flags
+                name_size, p = _read_varuint(data, p)
+                name = bytes(data[p:p + name_size]).decode('utf8')
+                p += name_size
+                schema = Type.from_binary(io.BytesIO(data[p:block_end]))
+                record = FileRecord(identifier, name, schema)
+                by_id[identifier] = record
+                self.records[name] = record
+
+            pos = block_end
+
+    def _get(self, name):
+        try:
+            return self.records[name]
+        except KeyError:
+            raise ParseError("unknown record: {}".format(name))
+
+    def read_records(self, name):
+        '''Yield each instance of a record decoded one at a time, for
+        those whose layout cannot be decoded in bulk.'''
+        record = self._get(name)
+        if record.compressed:
+            raise ParseError("compressed records are not supported")
+        for offset, size in zip(record.offsets, record.sizes):
+            yield record.schema.read(
+                Stream(io.BytesIO(self._mmap[offset:offset + size])))
+
+    def _gather(self, record, start, end):
+        numpy = _import_numpy()
+        dtype = record.dtype
+        sizes = _int64_array(numpy, record.sizes, start, end)
+        if numpy.any(sizes != dtype.itemsize):
+            raise ParseError(
+                "record {} has data of unexpected size".format(record.name))
+
+        offsets = _int64_array(numpy, record.offsets, start, end)
+        base = numpy.frombuffer(self._mmap, dtype=numpy.uint8)
+        columns = numpy.arange(dtype.itemsize)
+
+        result = numpy.empty(len(offsets), dtype=dtype)
+        result_bytes = result.view(numpy.uint8).reshape(-1, dtype.itemsize)
+
+        # The gather index is 8 bytes for every byte copied, so it is
+        # only formed for a bounded number of instances at a time.
+        for i in range(0, len(offsets), self.GATHER_SIZE):
+            chunk = offsets[i:i + self.GATHER_SIZE]
+            result_bytes[i:i + len(chunk)] = base[chunk[:, None] + columns]
+        return result
+
+    def _flatten(self, schema, values, prefix, result):
+        for field in schema.fields:
+            if isinstance(field.type_class, NullType):
+                continue
+
+            name = prefix + field.name
+            column = values[field.name]
+            if isinstance(field.type_class, ObjectType):
+                self._flatten(field.type_class, column, name + '.', result)
+            elif isinstance(field.type_class, (TimestampType, DurationType)):
+                result[name] = column * 1e-6
+            else:
+                result[name] = column
+
+    def _columns(self, record, start, end):
+        numpy = _import_numpy()
+        if record.compressed or record.dtype is None:
+            raise ParseError(
+                "record {} does not have a fixed layout".format(record.name))
+
+        result = {}
+        if len(record.timestamps) == len(record):
+            result[self.TIMESTAMP] = _int64_array(
+                numpy, record.timestamps, start, end) * 1e-6
+
+        self._flatten(record.schema, self._gather(record, start, end),
+                      '', result)
+        return result
+
+    def read(self, name):
+        '''Return a dictionary mapping each field of a record to a numpy
+        array with one entry per instance.  If the blocks carried
+        timestamps, they are available as TIMESTAMP.'''
+        record = self._get(name)
+        return self._columns(record, 0, len(record))
+
+    def iter_chunks(self, name, chunk_size=100000):
+        '''Like read, but yields the columns in pieces of at most
+        chunk_size instances, so that the whole of a large log need
+        not be held in memory at once.'''
+        record = self._get(name)
+        for start in range(0, len(record), chunk_size):
+            yield self._columns(
+                record, start, min(len(record), start + chunk_size))
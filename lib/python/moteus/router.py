@@ -13,10 +13,55 @@
 # limitations under the License.
 
 import asyncio
+import collections
+
+
+class BusStats:
+    """Timing and error counts for the cycles sent through one target
+    of a Router.
+
+    Attributes:
+      ids: the ids served by this target
+      cycles: the number of cycles which completed
+      frames: the number of commands sent in those cycles
+      errors: the number of cycles which raised an exception
+      last_latency_s, max_latency_s: the wall time taken by a completed
+        cycle
+    """
+
+    def __init__(self, ids):
+        self.ids = list(ids)
+        self.cycles = 0
+        self.frames = 0
+        self.errors = 0
+        self.total_latency_s = 0.0
+        self.last_latency_s = 0.0
+        self.max_latency_s = 0.0
+
+    @property
+    def mean_latency_s(self):
+        return self.total_latency_s / self.cycles if self.cycles else 0.0
+
+    def _update(self, frames, latency_s):
+        self.cycles += 1
+        self.frames += frames
+        self.total_latency_s += latency_s
+        self.last_latency_s = latency_s
+        self.max_latency_s = max(self.max_latency_s, latency_s)
+
+    def __repr__(self):
+        return (f'ids={self.ids} cycles={self.cycles} ' +
+                f'errors={self.errors} ' +
+                f'mean={self.mean_latency_s * 1e3:.3f}ms ' +
+                f'max={self.max_latency_s * 1e3:.3f}ms')
+
 
 class Router:
     """This dispatches multiplex commands and responses to multiple
     destinations depending upon id.
+
+    Each destination, usually one per CAN bus, is cycled in parallel,
+    and statistics are kept for each.
     """
 
     def __init__(self, destinations):
@@ -30,31 +75,64 @@ class Router:
             for id_num in ids:
                 self._id_map[id_num] = target
 
-        self._readers = []
+        self.stats = [BusStats(ids) for _, ids in self._destinations]
+
+        # The outstanding read for each target, and any messages
+        # which were received while returning another.
+        self._readers = {}
+        self._read_queue = collections.deque()
+
+    def reset_stats(self):
+        self.stats = [BusStats(ids) for _, ids in self._destinations]
+
+    async def _timed_cycle(self, stats, target, commands):
+        loop = asyncio.get_event_loop()
+        start = loop.time()
+        try:
+            result = await target.cycle(commands)
+        except Exception:
+            stats.errors += 1
+            raise
+        stats._update(len(commands), loop.time() - start)
+        return result
 
     async def cycle(self, commands):
         arguments = [
-            (target, [x for x in commands if x.destination in these_ids])
-            for target, these_ids in self._destinations
+            (stats, target, [x for x in commands if x.destination in these_ids])
+            for stats, (target, these_ids) in zip(self.stats, self._destinations)
         ]
-        arguments = [x for x in arguments if len(x[1])]
-        tasks = [x[0].cycle(x[1]) for x in arguments]
-        results = await asyncio.gather(*tasks)
+        arguments = [x for x in arguments if len(x[2])]
+        tasks = [self._timed_cycle(*x) for x in arguments]
+
+        # Every bus is allowed to finish before any error is reported,
+        # so that none is left with a cycle in progress.
+        results = await asyncio.gather(*tasks, return_exceptions=True)
+        for result in results:
+            if isinstance(result, BaseException):
+                raise result
         return sum(results, [])
 
     async def write(self, command):
-        await self._id_map[command.id].write(command)
+        await self._id_map[command.destination].write(command)
 
     async def read(self):
-        targets = list(self._destinations.keys())
-        for reader in self._readers:
-            del(targets[targets.find(reader.target)])
-
-        for target in targets:
-            self._readers.append(
-                ayncio.create_task(target.read()))
-            self._readers[-1].target = target
-
-        done, self._readers = asyncio.wait(
-            self._readers, return_when=asyncio.FIRST_COMPLETED)
-        return done[0].result()
+        """Return the next message received from any target."""
+        if self._read_queue:
+            return self._read_queue.popleft()
+
+        for target, _ in self._destinations:
+            if target not in self._readers:
+                self._readers[target] = asyncio.create_task(target.read())
+
+        done, _ = await asyncio.wait(
+            self._readers.values(), return_when=asyncio.FIRST_COMPLETED)
+
+        # Keep the order of the destinations, so that results are
+        # deterministic when several are ready at once.
+        for target, _ in self._destinations:
+            task = self._readers.get(target)
+            if task in done:
+                del self._readers[target]
+                self._read_queue.append(task.result())
+
+        return self._read_queue.popleft()
@@ -0,0 +1,74 @@
+# Copyright 2020 Josh Pieper, jjp@pobox.com.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+'''Decode the output of the "d scope dump" diagnostic command.'''
+
+import struct
+
+
+class Capture:
+    '''A decoded scope capture.
+
+    Members:
+     * names - the name of each recorded signal
+     * rate_hz - the rate at which samples were recorded
+     * trigger_index - the index of the triggering sample, or None if
+       the capture was stopped before completing
+     * data - a dictionary mapping each name to a list of samples
+    '''
+
+    def __init__(self, names, rate_hz, trigger_index, data):
+        self.names = names
+        self.rate_hz = rate_hz
+        self.trigger_index = trigger_index
+        self.data = data
+
+    def times(self):
+        '''Return the time of each sample in seconds relative to the
+        trigger.'''
+        offset = self.trigger_index or 0
+        count = len(self.data[self.names[0]]) if self.names else 0
+        return [(i - offset) / self.rate_hz for i in range(count)]
+
+
+def is_header(line):
+    return line.startswith('scope ')
+
+
+def parse(lines):
+    '''Decode a capture from the lines of a "d scope dump" response.
+
+    The first line must be the header, and any trailing "OK" is
+    ignored.'''
+
+    header = lines[0].split()
+    if header[0] != 'scope':
+        raise RuntimeError(f'not a scope header: {lines[0]}')
+
+    channels, frames, trigger_index, rate_hz = [int(x) for x in header[1:5]]
+    names = header[5:5+channels]
+    if len(names) != channels:
+        raise RuntimeError(f'malformed scope header: {lines[0]}')
+
+    raw = b''.join(bytes.fromhex(line[2:])
+                   for line in lines[1:] if line.startswith('s '))
+    values = struct.unpack(f'<{len(raw) // 4}f', raw[:len(raw) // 4 * 4])
+    if len(values) != channels * frames:
+        raise RuntimeError(
+            f'expected {channels * frames} values, got {len(values)}')
+
+    data = {name: list(values[i::channels]) for i, name in enumerate(names)}
+
+    return Capture(names, rate_hz,
+                   trigger_index if trigger_index >= 0 else None, data)
@@ -2174,23 +2174,54 @@ class CalibrateEncoderTest(unittest.TestCase):
             "CAL done",
         ]])
 
-        f = ce.parse_file(io.BytesIO(source_data))
-        r = ce.calibrate(f)
+        # The vectorized implementation must give the same results.
+        implementations = [False] + ([True] if ce.numpy else [])
+        for use_numpy in implementations:
+            with self.subTest(use_numpy=use_numpy):
+                f = ce.parse_file(io.BytesIO(source_data))
+                r = ce.calibrate(f, use_numpy=use_numpy)
 
-        self.assertEqual(r.total_delta, 65396)
-        self.assertEqual(r.total_phase, 1371500)
-        self.assertEqual(r.poles, 42)
-        self.assertAlmostEqual(r.ratio, 20.97223, places=4)
-        self.assertEqual(r.invert, False)
+                self.assertEqual(r.total_delta, 65396)
+                self.assertEqual(r.total_phase, 1371500)
+                self.assertEqual(r.poles, 42)
+                self.assertAlmostEqual(r.ratio, 20.97223, places=4)
+                self.assertEqual(r.invert, False)
 
-        expected_offset = [
-            -1.798549103458447, -1.811379523626072, -1.805294180172147, -1.8011223623091335, -1.8072266681976663, -1.802935292708252, -1.7932796556312116, -1.7797599487653086, -1.7763179147431267, -1.7561483998999696, -1.7227260889874956, -1.7135130515648826, -1.7046370416419523, -1.671571646917353, -1.6534517027123297, -1.6537104532083624, -1.6403659479214128, -1.6229389533231826, -1.6296608041397613, -1.6307848492960184, -1.6135349333001368, -1.611045558267521, -1.618682394825924, -1.6194285680078326, -1.6199676038188693, -1.6312172052899867, -1.649039703426978, -1.662612057090875, -1.6641016579058345, -1.695620211247406, -1.7215804898467948, -1.7322177527843252, -1.7591219920303467, -1.7985475441932028, -1.8065387921066358, -1.8033372237585914, -1.8457340269540765, -1.8565382835143285, -1.8458403622088224, -1.8496352500184017, -1.8567334516602472, -1.8388430830055087, -1.8348447670389014, -1.8329196242288592, -1.822870807575053, -1.8185803257927147, -1.8028937439828203, -1.8001108514437671, -1.8006882087715548, -1.7865153609935431, -1.7783243117692595, -1.789280573714942, -1.773446481545797, -1.744976105378369, -1.7644318479001213, -1.759651832691024, -1.736244208146276, -1.754710228869251, -1.7663183257060535, -1.7464357858917559, -1.7560638706530587, -1.7754112919830354, -1.7729037660508866, -1.777688530084951
-        ]
-        self.assertEqual(len(r.offset), 64)
+                expected_offset = [
+                    -1.798549103458447, -1.811379523626072, -1.805294180172147, -1.8011223623091335, -1.8072266681976663, -1.802935292708252, -1.7932796556312116, -1.7797599487653086, -1.7763179147431267, -1.7561483998999696, -1.7227260889874956, -1.7135130515648826, -1.7046370416419523, -1.671571646917353, -1.6534517027123297, -1.6537104532083624, -1.6403659479214128, -1.6229389533231826, -1.6296608041397613, -1.6307848492960184, -1.6135349333001368, -1.611045558267521, -1.618682394825924, -1.6194285680078326, -1.6199676038188693, -1.6312172052899867, -1.649039703426978, -1.662612057090875, -1.6641016579058345, -1.695620211247406, -1.7215804898467948, -1.7322177527843252, -1.7591219920303467, -1.7985475441932028, -1.8065387921066358, -1.8033372237585914, -1.8457340269540765, -1.8565382835143285, -1.8458403622088224, -1.8496352500184017, -1.8567334516602472, -1.8388430830055087, -1.8348447670389014, -1.8329196242288592, -1.822870807575053, -1.8185803257927147, -1.8028937439828203, -1.8001108514437671, -1.8006882087715548, -1.7865153609935431, -1.7783243117692595, -1.789280573714942, -1.773446481545797, -1.744976105378369, -1.7644318479001213, -1.759651832691024, -1.736244208146276, -1.754710228869251, -1.7663183257060535, -1.7464357858917559, -1.7560638706530587, -1.7754112919830354, -1.7729037660508866, -1.777688530084951
+                ]
+                self.assertEqual(len(r.offset), 64)
 
-        for i, (a, b) in enumerate(zip(r.offset, expected_offset)):
-            self.assertAlmostEqual(a, b, places=4, msg=f"index={i}")
+                for i, (a, b) in enumerate(zip(r.offset, expected_offset)):
+                    self.assertAlmostEqual(a, b, places=4, msg=f"index={i}")
 
+                # A larger table should contain the same values at the points
+                # it shares with the default one.
+                f = ce.parse_file(io.BytesIO(source_data))
+                r = ce.calibrate(f, offset_size=256, use_numpy=use_numpy)
+                self.assertEqual(len(r.offset), 256)
+
+                for i, b in enumerate(expected_offset):
+                    self.assertAlmostEqual(r.offset[i * 4], b, places=4, msg=f"index={i}")
+
+
+    def test_parse_binary(self):
+        data = (ce.BINARY_ENTRY.pack(1, 1300, 35332, 323, -1235, 4321) +
+                ce.BINARY_ENTRY.pack(2, 23, 4, 5, 6, 8))
+        entries = ce.parse_binary(data)
+        self.assertEqual(len(entries), 2)
+        self.assertEqual(entries[0].direction, 1)
+        self.assertEqual(entries[0].phase, 1300)
+        self.assertEqual(entries[0].encoder, 35332)
+        self.assertEqual(entries[0].i2, -1.235)
+
+        self.assertEqual(ce.format_entry(entries[0]),
+                         '1 1300 35332 i1=323 i2=-1235 i3=4321')
+
+        f = ce.make_file(entries)
+        self.assertEqual(len(f.phase_up), 1)
+        self.assertEqual(len(f.phase_down), 1)
+        self.assertEqual(f.phase_down[0].i3, 0.008)
 
 if __name__ == '__main__':
     unittest.main()
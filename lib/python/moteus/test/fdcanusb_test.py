@@ -0,0 +1,133 @@
+#!/usr/bin/python3 -B
+
+# Copyright 2020 Josh Pieper, jjp@pobox.com.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import asyncio
+import unittest
+import unittest.mock
+
+from moteus import Command
+import moteus.fdcanusb as fdcanusb
+
+
+class FakeSerial:
+    '''Acknowledges every frame, and answers those requesting a reply
+    from the device they were sent to, in the order given by
+    reply_order.'''
+
+    def __init__(self, port=None, baudrate=None):
+        self.written = []
+        self.reply_order = None
+        self._data = b''
+        self._event = asyncio.Event()
+
+    def write(self, data):
+        self.written.append(data)
+
+    async def drain(self):
+        replies = []
+        for line in self.written:
+            fields = line.split(b' ')
+            bus_id = int(fields[2], 16)
+            self._data += b'OK\r\n'
+            if bus_id & 0x8000:
+                replies.append(b'rcv %04X %s E B F\r\n' % (
+                    (bus_id & 0x7f) << 8, fields[3].strip()))
+        if self.reply_order is not None:
+            replies = [replies[i] for i in self.reply_order]
+        self._data += b''.join(replies)
+        self.written = []
+        self._event.set()
+
+    async def read(self, size, block=True):
+        while not self._data:
+            self._event.clear()
+            await self._event.wait()
+        result, self._data = self._data[:size], self._data[size:]
+        return result
+
+
+def _make_command(destination, data, reply_required=True):
+    result = Command()
+    result.destination = destination
+    result.reply_required = reply_required
+    result.data = data
+    result.parse = lambda message: (message.arbitration_id, message.data)
+    return result
+
+
+class FdcanusbTest(unittest.TestCase):
+    async def run_pipelined(self):
+        with unittest.mock.patch.object(
+                fdcanusb.aioserial, 'AioSerial', FakeSerial):
+            dut = fdcanusb.Fdcanusb(path='fake')
+
+        # Replies arrive in a different order than they were requested.
+        dut._serial.reply_order = [2, 0, 1]
+
+        result = await dut.cycle([
+            _make_command(1, b'\x01'),
+            _make_command(2, b'\x02', reply_required=False),
+            _make_command(3, b'\x03'),
+            _make_command(4, b'\x04'),
+        ])
+
+        self.assertEqual(result, [
+            (0x100, b'\x01'),
+            None,
+            (0x300, b'\x03'),
+            (0x400, b'\x04'),
+        ])
+
+    def test_pipelined(self):
+        asyncio.get_event_loop().run_until_complete(self.run_pipelined())
+
+    async def run_timeout(self):
+        with unittest.mock.patch.object(
+                fdcanusb.aioserial, 'AioSerial', FakeSerial):
+            dut = fdcanusb.Fdcanusb(path='fake')
+
+        # The second device never answers, which leaves just its
+        # reply missing.
+        dut._serial.reply_order = [0]
+
+        result = await dut.cycle([
+            _make_command(1, b'\x01'),
+            _make_command(2, b'\x02'),
+        ])
+        self.assertEqual(result, [(0x100, b'\x01'), None])
+
+    def test_timeout(self):
+        asyncio.get_event_loop().run_until_complete(self.run_timeout())
+
+    async def run_broadcast(self):
+        with unittest.mock.patch.object(
+                fdcanusb.aioserial, 'AioSerial', FakeSerial):
+            dut = fdcanusb.Fdcanusb(path='fake')
+
+        # The fake echoes the data back, so the first device appears to
+        # answer with a broadcast, which must not be taken as its reply.
+        result = await dut.cycle([
+            _make_command(1, b'\x63\x01'),
+            _make_command(2, b'\x02'),
+        ])
+        self.assertEqual(result, [None, (0x200, b'\x02')])
+
+    def test_broadcast(self):
+        asyncio.get_event_loop().run_until_complete(self.run_broadcast())
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -15,10 +15,13 @@
 # limitations under the License.
 
 
+import asyncio
 import math
+import struct
 import unittest
 
 import moteus.moteus as mot
+import moteus.multiplex as mp
 
 
 class CanMessage:
@@ -36,6 +39,70 @@ class MoteusTest(unittest.TestCase):
         self.assertEqual(result.source, 0)
         self.assertEqual(result.reply_required, False)
 
+    def test_make_template_query(self):
+        dut = mot.Controller(id=3)
+        result = dut.make_template_query()
+        self.assertEqual(result.data, bytes([0x60]))
+        self.assertEqual(result.destination, 3)
+        self.assertEqual(result.reply_required, True)
+
+        # The default reply layout.
+        reply = dut._parser(CanMessage(data=bytes([
+            0x24, 0x04, 0x00,
+            0x0a, 0x00,
+            0x10, 0x02,
+            0x00, 0xfe,
+            0x20, 0x00,
+            0x23, 0x0d,
+            0x20, 0x30, 0x00,
+        ])))
+        self.assertEqual(reply.id, 3)
+        self.assertEqual(reply.values[mot.Register.MODE], 10)
+        self.assertAlmostEqual(reply.values[mot.Register.POSITION], 0.0528)
+        self.assertAlmostEqual(reply.values[mot.Register.VELOCITY], -0.128)
+        self.assertAlmostEqual(reply.values[mot.Register.TORQUE], 0.32)
+        self.assertAlmostEqual(reply.values[mot.Register.VOLTAGE], 16.0)
+        self.assertAlmostEqual(reply.values[mot.Register.TEMPERATURE], 48.0)
+        self.assertEqual(reply.values[mot.Register.FAULT], 0)
+
+    def test_make_group_position(self):
+        result = mot.make_group_position(
+            [(0.5, 1.0, -0.5), (0.0, 0.0, 0.0)], reply_slots=[1])
+        self.assertEqual(result.destination, 0x7f)
+        self.assertEqual(result.reply_required, False)
+        self.assertEqual(result.data, bytes([
+            0x61, 0x02, 0x00,
+            0x0a, 0x88, 0x13, 0xa0, 0x0f, 0xce, 0xff,
+            0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        ]))
+
+        with self.assertRaises(RuntimeError):
+            mot.make_group_position([(0., 0., 0.)] * 9)
+
+    def test_make_clock_sync(self):
+        result = mot.make_clock_sync(0x1_0000_0102)
+        self.assertEqual(result.destination, 0x7f)
+        self.assertEqual(result.reply_required, False)
+        self.assertEqual(result.data, bytes([0x62, 0x02, 0x01, 0x00, 0x00]))
+
+    def test_parse_broadcast(self):
+        # mode and position as int16
+        reply = bytes([0x26, 0x00, 0x0a, 0x00, 0x10, 0x27])
+        result = mot.parse_broadcast(bytes([0x63]) + reply)
+        self.assertEqual(result, mot.parse_reply(reply))
+        self.assertAlmostEqual(result[mot.Register.POSITION], 1.0)
+
+        # A reply which is not a broadcast is refused.
+        self.assertIsNone(mot.parse_broadcast(reply))
+
+    def test_make_position_apply_time(self):
+        dut = mot.Controller()
+        result = dut.make_position(position=0.5, apply_time=0xfffffffe)
+        self.assertEqual(result.data, bytes([
+            0x01, 0x00, 0x0a,
+            0x0d, 0x20, 0x00, 0x00, 0x00, 0x3f,
+            0x09, 0x29, 0xfe, 0xff, 0xff, 0xff]))
+
     def test_make_position(self):
         dut = mot.Controller()
         result = dut.make_position(
@@ -127,6 +194,35 @@ class MoteusTest(unittest.TestCase):
         self.assertEqual(parsed.id, 1)
         self.assertEqual(parsed.data, b'DEFG')
 
+    def test_make_flash_write(self):
+        dut = mot.Controller()
+        result = dut.make_flash_write(0x08010008, b'\x01\x02', query=True)
+        self.assertEqual(
+            result.data,
+            bytes([0x40, 0x02, 0x06,
+                   0x08, 0x00, 0x01, 0x08,
+                   0x01, 0x02]))
+        self.assertEqual(result.reply_required, True)
+
+        self.assertIsNone(result.parse(CanMessage()))
+
+        parsed = result.parse(CanMessage(data=bytes([
+            0x41, 0x02, 0x05,
+            0x0a, 0x00, 0x01, 0x08,
+            0x00])))
+        self.assertEqual(parsed.id, 1)
+        self.assertEqual(parsed.end_address, 0x0801000a)
+        self.assertEqual(parsed.status, 0)
+        self.assertIsNone(parsed.writes)
+
+        # Newer bootloaders also count the writes they received.
+        parsed = result.parse(CanMessage(data=bytes([
+            0x41, 0x02, 0x06,
+            0x0a, 0x00, 0x01, 0x08,
+            0x00, 0x03, 0x50, 0x50, 0x50])))
+        self.assertEqual(parsed.end_address, 0x0801000a)
+        self.assertEqual(parsed.writes, 3)
+
     def test_make_current(self):
         dut = mot.Controller()
         result = dut.make_current(d_A = 1.0, q_A = 2.0)
@@ -138,6 +234,170 @@ class MoteusTest(unittest.TestCase):
                    0x00, 0x00, 0x80, 0x3f,
             ]))
 
+    def test_compiled_reply_parser(self):
+        dut = mot.Controller()
+        parser = mot.compile_reply_parser(dut._query_data)
+        self.assertIsInstance(parser, mot.CompiledReplyParser)
+
+        reply = bytes([
+            0x24, 0x04, 0x00,
+            0x0a, 0x00,
+            0x10, 0x02,
+            0x00, 0x80,
+            0x20, 0x00,
+            0x23, 0x0d,
+            0x20, 0x30, 0x00,
+            0x50, 0x50,
+        ])
+        expected = mot.parse_reply(reply)
+        result = parser(reply)
+        self.assertEqual(result.keys(), expected.keys())
+        self.assertEqual(result[mot.Register.MODE], 10)
+        self.assertAlmostEqual(result[mot.Register.POSITION], 0.0528)
+        self.assertTrue(math.isnan(result[mot.Register.VELOCITY]))
+        self.assertAlmostEqual(result[mot.Register.TORQUE], 0.32)
+        self.assertAlmostEqual(result[mot.Register.VOLTAGE], 16.0)
+        self.assertEqual(result[mot.Register.FAULT], 0)
+
+        # Any other layout is decoded by the generic parser.
+        other = bytes([0x24, 0x04, 0x00,
+                       0x0a, 0x00, 0x10, 0x02, 0x00, 0x00, 0x20, 0x00,
+                       0x31, 0x0d, 0x01])
+        self.assertEqual(parser(other), mot.parse_reply(other))
+
+    def test_compiled_reply_parser_resolutions(self):
+        qr = mot.QueryResolution()
+        qr.position = mp.F32
+        qr.q_current = mp.INT32
+        qr.d_current = mp.INT32
+        dut = mot.Controller(query_resolution=qr)
+        parser = mot.compile_reply_parser(dut._query_data)
+        self.assertIsInstance(parser, mot.CompiledReplyParser)
+
+        reply = (bytes([0x25, 0x00]) + struct.pack('<h', 10) +
+                 bytes([0x2d, 0x01]) + struct.pack('<f', 1.5) +
+                 bytes([0x26, 0x02]) + struct.pack('<hh', 100, -200) +
+                 bytes([0x2a, 0x04]) + struct.pack('<ii', 1000, -2000) +
+                 bytes([0x23, 0x0d, 0x20, 0x80, 0x00]))
+        self.assertEqual(parser._struct.size, len(reply))
+        result = parser(reply)
+        expected = mot.parse_reply(reply)
+        self.assertEqual(result.keys(), expected.keys())
+        self.assertTrue(math.isnan(result[mot.Register.TEMPERATURE]))
+        del expected[mot.Register.TEMPERATURE]
+        for key, value in expected.items():
+            self.assertAlmostEqual(result[key], value)
+
+        # Queries which do not consist only of known reads cannot be
+        # compiled.
+        self.assertIs(mot.compile_reply_parser(bytes([0x11, 0x40])),
+                      mot.parse_reply)
+
+    def test_position_template(self):
+        pr = mot.PositionResolution()
+        pr.velocity = mp.INT16
+        pr.kp_scale = mp.INT8
+        pr.watchdog_timeout = mp.INT16
+        dut = mot.Controller(id=4, position_resolution=pr)
+
+        template = dut.make_position_template(
+            position=True, velocity=True, kp_scale=True,
+            watchdog_timeout=True, query=True)
+        self.assertEqual(template.names,
+                         ['position', 'velocity', 'kp_scale', 'watchdog_timeout'])
+
+        for values in [
+                dict(position=0.5, velocity=-1.25, kp_scale=0.3,
+                     watchdog_timeout=0.1),
+                dict(position=math.nan, velocity=1000.0, kp_scale=-2.0,
+                     watchdog_timeout=math.nan)]:
+            expected = dut.make_position(query=True, **values)
+            result = template.make(**values)
+            self.assertEqual(result.data, expected.data)
+            self.assertEqual(result.destination, 4)
+            self.assertEqual(result.reply_required, True)
+            self.assertIs(result.parse, expected.parse)
+
+    def test_current_template(self):
+        dut = mot.Controller()
+        template = dut.make_current_template()
+        self.assertEqual(template.make(d_A=1.0, q_A=2.0).data,
+                         dut.make_current(d_A=1.0, q_A=2.0).data)
+
+    def test_register_scale(self):
+        rs = mot.RegisterScale()
+        rs.position = 10.0
+        pr = mot.PositionResolution()
+        pr.position = mp.INT16
+        pr.velocity = mp.INT16
+        dut = mot.Controller(position_resolution=pr, register_scale=rs)
+
+        # 20 revolutions is out of range for the default INT16 position.
+        result = dut.make_position(position=20.0, velocity=0.5)
+        self.assertEqual(
+            result.data,
+            bytes([0x01, 0x00, 0x0a,
+                   0x06, 0x20,
+                   0x20, 0x4e,
+                   0xd0, 0x07]))
+
+        template = dut.make_position_template(position=True, velocity=True)
+        self.assertEqual(template.make(position=20.0, velocity=0.5).data,
+                         result.data)
+
+        reply = bytes([
+            0x24, 0x04, 0x00,
+            0x0a, 0x00,
+            0x20, 0x4e,
+            0x00, 0x00,
+            0x00, 0x00,
+            0x23, 0x0d,
+            0x20, 0x30, 0x00,
+        ])
+        parsed = dut._parser(CanMessage(data=reply)).values
+        self.assertAlmostEqual(parsed[mot.Register.POSITION], 20.0)
+        self.assertEqual(parsed, mot.parse_reply(reply, rs))
+        self.assertAlmostEqual(mot.parse_reply(reply)[mot.Register.POSITION],
+                               2.0)
+
+    def test_stream_window(self):
+        class Transport:
+            def __init__(self, data):
+                self.data = data
+                self.cycles = []
+
+            async def cycle(self, commands):
+                self.cycles.append(len(commands))
+                result = []
+                for command in commands:
+                    self.assertEqual(command.data[0], mp.STREAM_CLIENT_POLL)
+                    size = command.data[2]
+                    this_data, self.data = self.data[:size], self.data[size:]
+                    result.append(command.parse(CanMessage(data=bytes(
+                        [mp.STREAM_SERVER_DATA, 1, len(this_data)]) +
+                        this_data)))
+                return result
+
+        data = bytes(range(256)) * 4
+        transport = Transport(data)
+        transport.assertEqual = self.assertEqual
+        stream = mot.Stream(mot.Controller(transport=transport), max_window=4)
+
+        run = asyncio.get_event_loop().run_until_complete
+
+        result = run(stream.read(len(data)))
+        self.assertEqual(result, data)
+        # The window grows while every reply is full.
+        self.assertEqual(transport.cycles, [1, 2, 4, 4, 4, 2])
+
+        # And drops back to one poll once the controller runs out.
+        transport.data = b'abc\n'
+        transport.cycles = []
+        self.assertEqual(run(stream.readline()), b'abc')
+        transport.data = b'OK\n'
+        self.assertEqual(run(stream.readline()), b'OK')
+        self.assertEqual(transport.cycles, [4, 1])
+
 
 if __name__ == '__main__':
     unittest.main()
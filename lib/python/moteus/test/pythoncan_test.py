@@ -0,0 +1,160 @@
+#!/usr/bin/python3 -B
+
+# Copyright 2020 Josh Pieper, jjp@pobox.com.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import asyncio
+import types
+import unittest
+
+from moteus import Command
+import moteus.pythoncan as pythoncan
+
+
+class FakeMessage:
+    def __init__(self, arbitration_id=0, data=b'', **kwargs):
+        self.arbitration_id = arbitration_id
+        self.data = bytes(data)
+
+
+class FakeReader:
+    def __init__(self):
+        self.queue = asyncio.Queue()
+
+    async def get_message(self):
+        return await self.queue.get()
+
+
+class FakeBus:
+    '''Answers every frame requesting a reply from the device it was
+    sent to, once all of a batch has been sent, in the order given by
+    reply_order.  The first full_count sends fail as if the transmit
+    queue were full.'''
+
+    def __init__(self, *args, **kwargs):
+        self.sent = []
+        self.reply_order = None
+        self.full_count = 0
+        self.reader = None
+
+    def send(self, message):
+        if self.full_count:
+            self.full_count -= 1
+            raise FakeCanError()
+        self.sent.append(message)
+        if len(self.sent) == 1:
+            asyncio.get_event_loop().call_soon(self._reply)
+
+    def _reply(self):
+        replies = [FakeMessage((x.arbitration_id & 0x7f) << 8, x.data)
+                   for x in self.sent if x.arbitration_id & 0x8000]
+        if self.reply_order is not None:
+            replies = [replies[i] for i in self.reply_order]
+        for reply in replies:
+            self.reader.queue.put_nowait(reply)
+        self.sent = []
+
+
+class FakeCanError(Exception):
+    pass
+
+
+def _fake_notifier(bus, listeners, loop=None):
+    bus.reader = listeners[0]
+
+
+_FAKE_CAN = types.SimpleNamespace(
+    rc={},
+    Bus=FakeBus,
+    Message=FakeMessage,
+    AsyncBufferedReader=FakeReader,
+    Notifier=_fake_notifier,
+    CanError=FakeCanError,
+)
+
+
+def _make_command(destination, data, reply_required=True):
+    result = Command()
+    result.destination = destination
+    result.reply_required = reply_required
+    result.data = data
+    result.parse = lambda message: (message.arbitration_id, message.data)
+    return result
+
+
+class PythonCanTest(unittest.TestCase):
+    def setUp(self):
+        pythoncan.can = _FAKE_CAN
+
+    def tearDown(self):
+        pythoncan.can = None
+
+    async def run_batched(self):
+        dut = pythoncan.PythonCan()
+
+        # Replies arrive in a different order than they were requested.
+        dut._can.reply_order = [2, 0, 1]
+        dut._can.full_count = 2
+
+        result = await dut.cycle([
+            _make_command(1, b'\x01'),
+            _make_command(2, b'\x02', reply_required=False),
+            _make_command(3, b'\x03'),
+            _make_command(4, b'\x04'),
+        ])
+
+        # Every command has a result, even those with no reply.
+        self.assertEqual(result, [
+            (0x100, b'\x01'),
+            None,
+            (0x300, b'\x03'),
+            (0x400, b'\x04'),
+        ])
+
+    def test_batched(self):
+        asyncio.get_event_loop().run_until_complete(self.run_batched())
+
+    async def run_timeout(self):
+        dut = pythoncan.PythonCan()
+
+        # The second device never answers, which leaves just its
+        # reply missing.
+        dut._can.reply_order = [0]
+
+        result = await dut.cycle([
+            _make_command(1, b'\x01'),
+            _make_command(2, b'\x02'),
+        ])
+        self.assertEqual(result, [(0x100, b'\x01'), None])
+
+    def test_timeout(self):
+        asyncio.get_event_loop().run_until_complete(self.run_timeout())
+
+    async def run_broadcast(self):
+        dut = pythoncan.PythonCan()
+
+        # The fake echoes the data back, so the first device appears to
+        # answer with a broadcast, which must not be taken as its reply.
+        result = await dut.cycle([
+            _make_command(1, b'\x63\x01'),
+            _make_command(2, b'\x02'),
+        ])
+        self.assertEqual(result, [None, (0x200, b'\x02')])
+
+    def test_broadcast(self):
+        asyncio.get_event_loop().run_until_complete(self.run_broadcast())
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -16,6 +16,9 @@
 
 
 import io
+import os
+import struct
+import tempfile
 import unittest
 
 from moteus import reader
@@ -106,5 +109,104 @@ class ReaderTest(unittest.TestCase):
         self.assertEqual(actual_value, 10)
 
 
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+
+def _varuint(value):
+    result = bytearray()
+    while True:
+        if value < 0x80:
+            result.append(value)
+            return bytes(result)
+        result.append((value & 0x7f) | 0x80)
+        value >>= 7
+
+
+def _string(value):
+    return _varuint(len(value)) + value.encode('utf8')
+
+
+def _object_schema(fields):
+    result = bytes([16, 0])
+    for name, schema in fields:
+        result += _varuint(0) + _string(name) + _varuint(0) + schema + bytes([0])
+    return result + _varuint(0) + _string('') + _varuint(0) + bytes([0, 0])
+
+
+def _block(block_type, content):
+    return _varuint(block_type) + _varuint(len(content)) + content
+
+
+class FileReaderTest(unittest.TestCase):
+    def setUp(self):
+        servo_schema = _object_schema([
+            ('count', bytes([4, 2])),
+            ('torque', bytes([7])),
+            ('inner', _object_schema([('x', bytes([8]))])),
+            ('span', bytes([23])),
+        ])
+        text_schema = _object_schema([('text', bytes([10]))])
+
+        data = reader.FileReader.HEADER + _varuint(0)
+        data += _block(1, _varuint(1) + _varuint(0) + _string('servo') +
+                       servo_schema)
+        data += _block(1, _varuint(2) + _varuint(0) + _string('text') +
+                       text_schema)
+        for i in range(10):
+            data += _block(2, _varuint(1) + _varuint(2) +
+                           struct.pack('<q', 1000000 + i * 1000) +
+                           struct.pack('<Hfdq', i, 0.5 * i, -i, i * 2000))
+            if i % 3 == 0:
+                data += _block(2, _varuint(2) + _varuint(0) +
+                               _string('msg{}'.format(i)))
+        # A partially written block at the end is ignored.
+        data += _varuint(2) + _varuint(100) + bytes([1, 0])
+
+        fd, self.filename = tempfile.mkstemp()
+        with os.fdopen(fd, 'wb') as f:
+            f.write(data)
+
+    def tearDown(self):
+        os.remove(self.filename)
+
+    def test_read_records(self):
+        with reader.FileReader(self.filename) as dut:
+            self.assertEqual(sorted(dut.records.keys()), ['servo', 'text'])
+            self.assertEqual(len(dut.records['servo']), 10)
+
+            texts = [x.text for x in dut.read_records('text')]
+            self.assertEqual(texts, ['msg0', 'msg3', 'msg6', 'msg9'])
+
+            servo = list(dut.read_records('servo'))
+            self.assertEqual(servo[4].count, 4)
+            self.assertEqual(servo[4].torque, 2.0)
+            self.assertEqual(servo[4].inner.x, -4.0)
+            self.assertAlmostEqual(servo[4].span, 0.008)
+
+    @unittest.skipIf(numpy is None, "numpy is not available")
+    def test_read_columns(self):
+        with reader.FileReader(self.filename) as dut:
+            columns = dut.read('servo')
+            self.assertEqual(sorted(columns.keys()),
+                             ['__timestamp', 'count', 'inner.x', 'span',
+                              'torque'])
+            self.assertEqual(list(columns['count']), list(range(10)))
+            self.assertEqual(columns['torque'][3], 1.5)
+            self.assertEqual(columns['inner.x'][9], -9.0)
+            self.assertAlmostEqual(columns['span'][2], 0.004)
+            self.assertAlmostEqual(columns[reader.FileReader.TIMESTAMP][1],
+                                   1.001)
+
+            chunks = list(dut.iter_chunks('servo', chunk_size=4))
+            self.assertEqual([len(x['count']) for x in chunks], [4, 4, 2])
+            self.assertEqual(list(chunks[2]['count']), [8, 9])
+
+            with self.assertRaises(reader.ParseError):
+                dut.read('text')
+
+
 if __name__ == '__main__':
     unittest.main()
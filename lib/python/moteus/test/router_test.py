@@ -22,10 +22,17 @@ from moteus import Router, Command
 class FakeTarget:
     def __init__(self, nonce):
         self.nonce = nonce
+        self.fail = False
+        self.messages = asyncio.Queue()
 
     async def cycle(self, commands):
+        if self.fail:
+            raise RuntimeError('bus failure')
         return [(self.nonce, x) for x in commands]
 
+    async def read(self):
+        return (self.nonce, await self.messages.get())
+
 
 class RouterTest(unittest.TestCase):
     async def run_basic(self):
@@ -52,6 +59,57 @@ class RouterTest(unittest.TestCase):
     def test_basic(self):
         asyncio.get_event_loop().run_until_complete(self.run_basic())
 
+    async def run_stats(self):
+        a1 = FakeTarget('n1')
+        a2 = FakeTarget('n2')
+        dut = Router([(a1, [3, 6]), (a2, [1, 4])])
+
+        cmd1 = Command()
+        cmd1.destination = 3
+        cmd2 = Command()
+        cmd2.destination = 6
+        cmd3 = Command()
+        cmd3.destination = 1
+
+        await dut.cycle([cmd1, cmd2, cmd3])
+        await dut.cycle([cmd1])
+
+        self.assertEqual(dut.stats[0].ids, [3, 6])
+        self.assertEqual(dut.stats[0].cycles, 2)
+        self.assertEqual(dut.stats[0].frames, 3)
+        self.assertEqual(dut.stats[1].cycles, 1)
+        self.assertEqual(dut.stats[1].frames, 1)
+
+        a2.fail = True
+        with self.assertRaises(RuntimeError):
+            await dut.cycle([cmd1, cmd3])
+
+        # The healthy bus still completed its cycle.
+        self.assertEqual(dut.stats[0].cycles, 3)
+        self.assertEqual(dut.stats[0].errors, 0)
+        self.assertEqual(dut.stats[1].errors, 1)
+
+    def test_stats(self):
+        asyncio.get_event_loop().run_until_complete(self.run_stats())
+
+    async def run_read(self):
+        a1 = FakeTarget('n1')
+        a2 = FakeTarget('n2')
+        dut = Router([(a1, [3, 6]), (a2, [1, 4])])
+
+        a2.messages.put_nowait('m1')
+        self.assertEqual(await dut.read(), ('n2', 'm1'))
+
+        a1.messages.put_nowait('m2')
+        a2.messages.put_nowait('m3')
+        a1.messages.put_nowait('m4')
+        results = [await dut.read() for _ in range(3)]
+        self.assertEqual(sorted(results),
+                         [('n1', 'm2'), ('n1', 'm4'), ('n2', 'm3')])
+
+    def test_read(self):
+        asyncio.get_event_loop().run_until_complete(self.run_read())
+
 
 if __name__ == '__main__':
     unittest.main()
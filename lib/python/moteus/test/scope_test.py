@@ -0,0 +1,54 @@
+#!/usr/bin/python3 -B
+
+# Copyright 2020 Josh Pieper, jjp@pobox.com.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import struct
+import unittest
+
+import moteus.scope as scope
+
+
+def _hex(*values):
+    return 's ' + struct.pack(f'<{len(values)}f', *values).hex()
+
+
+class ScopeTest(unittest.TestCase):
+    def test_basic(self):
+        lines = [
+            'scope 2 3 1 40000 d_A q_A',
+            _hex(1.0, 2.0, 3.0, 4.0),
+            _hex(5.0, 6.0),
+            'OK',
+        ]
+
+        self.assertTrue(scope.is_header(lines[0]))
+        result = scope.parse(lines)
+        self.assertEqual(result.names, ['d_A', 'q_A'])
+        self.assertEqual(result.rate_hz, 40000)
+        self.assertEqual(result.trigger_index, 1)
+        self.assertEqual(result.data['d_A'], [1.0, 3.0, 5.0])
+        self.assertEqual(result.data['q_A'], [2.0, 4.0, 6.0])
+        self.assertEqual(result.times(), [-1 / 40000, 0.0, 1 / 40000])
+
+    def test_incomplete(self):
+        result = scope.parse(['scope 1 1 -1 1000 bus_V', _hex(24.0)])
+        self.assertIsNone(result.trigger_index)
+
+        with self.assertRaises(RuntimeError):
+            scope.parse(['scope 1 2 -1 1000 bus_V', _hex(24.0)])
+
+
+if __name__ == '__main__':
+    unittest.main()
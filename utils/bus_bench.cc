@@ -0,0 +1,190 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/bus_bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+#include "mjlib/base/assert.h"
+
+namespace moteus {
+namespace client {
+
+namespace {
+int64_t SteadyNowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SteadySleepUntil(int64_t time_us) {
+  std::this_thread::sleep_until(
+      std::chrono::steady_clock::time_point(
+          std::chrono::microseconds(time_us)));
+}
+}
+
+BusBench::BusBench(Transport* transport, const Options& options)
+    : BusBench(transport, options, SteadyNowUs, SteadySleepUntil) {}
+
+BusBench::BusBench(Transport* transport, const Options& options,
+                   Clock clock, Sleep sleep)
+    : transport_(transport),
+      options_(options),
+      clock_(clock),
+      sleep_(sleep) {
+  for (const int id : options_.ids) {
+    Controller::Options controller_options;
+    controller_options.id = id;
+    controllers_.emplace_back(controller_options);
+  }
+  for (const int weight : options_.mix) {
+    MJ_ASSERT(weight >= 0);
+    total_weight_ += weight;
+  }
+  MJ_ASSERT(total_weight_ > 0);
+}
+
+BusBench::FrameKind BusBench::kind(int64_t cycle, size_t index) const {
+  int slot = static_cast<int>(
+      (cycle * static_cast<int64_t>(controllers_.size()) +
+       static_cast<int64_t>(index)) % total_weight_);
+  for (int i = 0; i < kNumKinds; i++) {
+    if (slot < options_.mix[i]) { return static_cast<FrameKind>(i); }
+    slot -= options_.mix[i];
+  }
+  MJ_ASSERT(false);
+  return kQuery;
+}
+
+void BusBench::MakeFrame(FrameKind kind, const Controller& controller,
+                         Command* command) const {
+  PositionCommand position;
+  position.position = std::numeric_limits<double>::quiet_NaN();
+  position.velocity = 0.0;
+  position.maximum_torque = 0.0;
+
+  switch (kind) {
+    case kQuery: {
+      controller.MakeQuery(command);
+      return;
+    }
+    case kCommand:
+    case kCommandQuery: {
+      controller.MakePosition(position, command, kind == kCommandQuery);
+      return;
+    }
+    case kTunnel: {
+      controller.MakeDiagnosticRead(command);
+      return;
+    }
+    case kNumKinds: {
+      break;
+    }
+  }
+  MJ_ASSERT(false);
+}
+
+BusBench::Result BusBench::Run() {
+  Result result;
+
+  const size_t size = controllers_.size();
+  std::vector<Command> commands(size);
+  std::vector<Reply> replies(size);
+  std::vector<int64_t> latencies;
+  latencies.reserve(
+      static_cast<size_t>(std::max<int64_t>(0, options_.cycles)));
+
+  const int64_t period_us =
+      (options_.rate_hz > 0.0) ?
+      static_cast<int64_t>(std::round(1e6 / options_.rate_hz)) : 0;
+
+  const int64_t start_us = clock_();
+  int64_t next_us = start_us;
+
+  for (int64_t cycle = 0; cycle < options_.cycles; cycle++) {
+    for (size_t i = 0; i < size; i++) {
+      MakeFrame(kind(cycle, i), controllers_[i], &commands[i]);
+      result.frames_sent++;
+      result.bytes += static_cast<int64_t>(commands[i].size);
+      if (commands[i].reply_required) { result.replies_expected++; }
+    }
+
+    const int64_t cycle_start_us = clock_();
+    const size_t received =
+        transport_->Cycle(commands.data(), size, replies.data());
+    const int64_t cycle_end_us = clock_();
+
+    result.replies_received += static_cast<int64_t>(received);
+    for (size_t i = 0; i < size; i++) {
+      if (replies[i].valid) {
+        result.bytes += static_cast<int64_t>(replies[i].size);
+      }
+    }
+    latencies.push_back(cycle_end_us - cycle_start_us);
+    result.cycles++;
+
+    if (period_us > 0) {
+      next_us += period_us;
+      if (cycle_end_us > next_us) {
+        // Rather than trying to catch up, start again from now.
+        result.overruns++;
+        next_us = cycle_end_us;
+      } else {
+        sleep_(next_us);
+      }
+    }
+  }
+
+  const int64_t end_us = clock_();
+
+  // The commands leave every controller in position mode, so stop
+  // them all again.  This is not counted in the result.
+  for (size_t i = 0; i < size; i++) {
+    controllers_[i].MakeStop(&commands[i]);
+  }
+  transport_->Cycle(commands.data(), size, replies.data());
+
+  result.dropped = result.replies_expected - result.replies_received;
+  result.elapsed_s = static_cast<double>(end_us - start_us) / 1e6;
+  if (result.elapsed_s > 0.0) {
+    result.frames_per_s =
+        static_cast<double>(result.frames_sent + result.replies_received) /
+        result.elapsed_s;
+    result.bytes_per_s = static_cast<double>(result.bytes) / result.elapsed_s;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  result.latency_p50_us = Percentile(latencies, 0.50);
+  result.latency_p90_us = Percentile(latencies, 0.90);
+  result.latency_p99_us = Percentile(latencies, 0.99);
+  result.latency_max_us = Percentile(latencies, 1.0);
+
+  return result;
+}
+
+double BusBench::Percentile(const std::vector<int64_t>& sorted,
+                            double fraction) {
+  if (sorted.empty()) { return 0.0; }
+  const double rank = std::ceil(fraction * static_cast<double>(sorted.size()));
+  const size_t index = static_cast<size_t>(
+      std::max(1.0, std::min(static_cast<double>(sorted.size()), rank))) - 1;
+  return static_cast<double>(sorted[index]);
+}
+
+}
+}
@@ -0,0 +1,116 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "utils/moteus_client.h"
+#include "utils/moteus_transport.h"
+
+namespace moteus {
+namespace client {
+
+/// Loads a bus with a fixed mix of frames to a set of controllers,
+/// and measures how it copes.
+///
+/// Each cycle sends one frame to every id in a single
+/// Transport::Cycle.  The kind of each frame is chosen from the mix
+/// in proportion to its weights, round robin, so that the same
+/// options always produce the same traffic.  Commands are position
+/// mode with a maximum torque of 0, which have the size of a real
+/// command but cannot move anything.  Every controller is sent a
+/// stop once the run is complete.
+class BusBench {
+ public:
+  enum FrameKind {
+    kQuery,
+    kCommand,
+    kCommandQuery,
+    kTunnel,
+    kNumKinds,
+  };
+
+  struct Options {
+    std::vector<int> ids = {1};
+
+    // 0 runs each cycle as soon as the previous one finishes.
+    double rate_hz = 100.0;
+    int64_t cycles = 1000;
+
+    // The relative number of each frame kind, indexed by FrameKind.
+    int mix[kNumKinds] = { 1, 0, 1, 0 };
+  };
+
+  struct Result {
+    int64_t cycles = 0;
+    // Cycles which took longer than the period.
+    int64_t overruns = 0;
+
+    int64_t frames_sent = 0;
+    int64_t replies_expected = 0;
+    int64_t replies_received = 0;
+    int64_t dropped = 0;
+    // Payload bytes, in both directions.
+    int64_t bytes = 0;
+
+    double elapsed_s = 0.0;
+    double frames_per_s = 0.0;
+    double bytes_per_s = 0.0;
+
+    // From starting a cycle to the last of its replies, in
+    // microseconds.
+    double latency_p50_us = 0.0;
+    double latency_p90_us = 0.0;
+    double latency_p99_us = 0.0;
+    double latency_max_us = 0.0;
+  };
+
+  /// Returns the current time in microseconds.
+  using Clock = std::function<int64_t()>;
+  /// Waits until the given time from Clock.
+  using Sleep = std::function<void(int64_t)>;
+
+  BusBench(Transport*, const Options&);
+  BusBench(Transport*, const Options&, Clock, Sleep);
+
+  /// The kind of frame sent to ids[index] in @p cycle.
+  FrameKind kind(int64_t cycle, size_t index) const;
+
+  Result Run();
+
+  /// The nearest rank @p fraction percentile of @p sorted.
+  static double Percentile(const std::vector<int64_t>& sorted,
+                           double fraction);
+
+ private:
+  void MakeFrame(FrameKind, const Controller&, Command*) const;
+
+  Transport* const transport_;
+  const Options options_;
+  const Clock clock_;
+  const Sleep sleep_;
+
+  std::vector<Controller> controllers_;
+  int total_weight_ = 0;
+};
+
+/// Runs the benchmark from command line arguments, and prints the
+/// result.
+int BusBenchMain(int argc, char** argv);
+
+}
+}
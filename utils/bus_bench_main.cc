@@ -0,0 +1,95 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <memory>
+#include <string>
+
+#include <fmt/format.h>
+
+#include "mjlib/base/clipp.h"
+#include "mjlib/base/system_error.h"
+
+#include "utils/bus_bench.h"
+
+namespace moteus {
+namespace client {
+
+int BusBenchMain(int argc, char** argv) {
+  BusBench::Options options;
+  options.ids.clear();
+
+  std::string transport_type = "fdcanusb";
+  FdcanusbTransport::Options fdcanusb;
+  SocketCanTransport::Options socketcan;
+  int64_t timeout_us = 10000;
+
+  auto group = clipp::group(
+      clipp::option("transport") &
+      clipp::value("TYPE", transport_type).doc("one of [fdcanusb,socketcan]"),
+      clipp::option("path") & clipp::value("PATH", fdcanusb.path),
+      clipp::option("interface") & clipp::value("IFACE", socketcan.interface),
+      clipp::option("timeout-us") & clipp::value("US", timeout_us),
+      clipp::option("id", "t") & clipp::values("ID", options.ids),
+      clipp::option("rate-hz") & clipp::value("HZ", options.rate_hz).doc(
+          "cycles per second, 0 for as fast as possible"),
+      clipp::option("cycles") & clipp::value("N", options.cycles),
+      clipp::option("query") &
+      clipp::value("W", options.mix[BusBench::kQuery]),
+      clipp::option("command") &
+      clipp::value("W", options.mix[BusBench::kCommand]),
+      clipp::option("command-query") &
+      clipp::value("W", options.mix[BusBench::kCommandQuery]),
+      clipp::option("tunnel") &
+      clipp::value("W", options.mix[BusBench::kTunnel])
+  );
+  mjlib::base::ClippParse(argc, argv, group);
+
+  if (options.ids.empty()) { options.ids.push_back(1); }
+
+  std::unique_ptr<Transport> transport;
+  if (transport_type == "fdcanusb") {
+    fdcanusb.reply_timeout_us = timeout_us;
+    transport = std::make_unique<FdcanusbTransport>(fdcanusb);
+  } else if (transport_type == "socketcan") {
+    socketcan.reply_timeout_us = timeout_us;
+    transport = std::make_unique<SocketCanTransport>(socketcan);
+  } else {
+    throw mjlib::base::system_error::einval(
+        "unknown transport: " + transport_type);
+  }
+
+  BusBench bench(transport.get(), options);
+  const auto r = bench.Run();
+
+  fmt::print("cycles            {} ({} overruns)\n", r.cycles, r.overruns);
+  fmt::print("elapsed           {:.3f} s\n", r.elapsed_s);
+  fmt::print("frames            {} sent, {} of {} replies, {} dropped "
+             "({:.3f}%)\n",
+             r.frames_sent, r.replies_received, r.replies_expected,
+             r.dropped,
+             (r.replies_expected > 0) ?
+             (100.0 * static_cast<double>(r.dropped) /
+              static_cast<double>(r.replies_expected)) : 0.0);
+  fmt::print("throughput        {:.1f} frames/s, {:.1f} payload bytes/s\n",
+             r.frames_per_s, r.bytes_per_s);
+  fmt::print("cycle latency us  p50 {:.0f}  p90 {:.0f}  p99 {:.0f}  "
+             "max {:.0f}\n",
+             r.latency_p50_us, r.latency_p90_us, r.latency_p99_us,
+             r.latency_max_us);
+
+  return (r.dropped == 0) ? 0 : 1;
+}
+
+}
+}
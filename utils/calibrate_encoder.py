@@ -86,7 +86,7 @@ def _make_error(message):
     return result
 
 
-def perform_calibration(data, show_plots=False):
+def perform_calibration(data, show_plots=False, offset_size=64):
     # Things we need to figure out from this data:
     #  * whether it is inverted or not
     #  * number of poles
@@ -178,7 +178,7 @@ def perform_calibration(data, show_plots=False):
     avg_window = int(len(err) / result['poles'])
     avg_err = [windowed_avg(err, i, avg_window) for i in range(len(err))]
 
-    offset_x = list(range(0, 65536, 65536 // 64))
+    offset_x = [i * 65536 / offset_size for i in range(offset_size)]
     offset_y = numpy.interp(offset_x, interp_x, avg_err)
 
     result['offset'] = list(offset_y)
@@ -207,6 +207,8 @@ def perform_calibration(data, show_plots=False):
 def main():
     parser = argparse.ArgumentParser(description=__doc__)
     parser.add_argument('--poles', type=float, default=24, help='number of poles')
+    parser.add_argument('--offset-size', type=int, default=64,
+                        help='number of entries in the offset table (max 256)')
     parser.add_argument('file', help='input file')
     parser.add_argument('-o', '--output', default='-',
                         help='file with output configuration')
@@ -216,7 +218,8 @@ def main():
     with open(args.file, 'r') as fd:
         data = read_file(fd)
 
-    calibration = perform_calibration(data, show_plots=True)
+    calibration = perform_calibration(
+        data, show_plots=True, offset_size=args.offset_size)
     print(calibration)
 
     # Now print out the commands necessary to install this config.
@@ -225,6 +228,8 @@ def main():
     print('conf set motor.poles {}'.format(calibration['poles']), file=stream)
     print('conf set motor.invert {}'.format(1 if calibration['invert'] else 0),
           file=stream)
+    print('conf set motor.offset_size {}'.format(len(calibration['offset'])),
+          file=stream)
     for index, value in enumerate(calibration['offset']):
         print('conf set motor.offset.{} {}'.format(index, value), file=stream)
 
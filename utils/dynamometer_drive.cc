@@ -16,6 +16,11 @@
 ///
 /// Drive a dynamometer test fixture.
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <set>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -69,7 +74,8 @@ struct Options {
   double max_test_time_s = 1200.0;
 
   double max_torque_Nm = 0.5;
-
+  // The period at which each telemetry channel is logged.
+  int telemetry_period_ms = 50;
 
   // The different cycles we can do and their options.
   bool static_torque_ripple = false;
@@ -77,6 +83,22 @@ struct Options {
 
   bool pwm_cycle_overrun = false;
 
+  // Characterization cycles used by the regression suite.
+  bool position_step = false;
+  double position_step_size = 0.25;
+  int position_step_count = 5;
+
+  bool current_step = false;
+  double current_step_A = 2.0;
+
+  bool max_speed = false;
+  double max_speed_target = 50.0;
+  double max_speed_time_s = 3.0;
+
+  bool thermal_rise = false;
+  double thermal_rise_torque_Nm = 0.3;
+  double thermal_rise_time_s = 60.0;
+
   // Different functional validation cycles.
   bool validate_pwm_mode = false;
   bool validate_current_mode = false;
@@ -86,6 +108,15 @@ struct Options {
   bool validate_position_wraparound = false;
   bool validate_stay_within = false;
 
+  // Measure register round trip latency through the client, for each
+  // combination of servo count, resolution, and query size.
+  bool benchmark_latency = false;
+  int benchmark_samples = 1000;
+  // A comma separated list of the ids to benchmark, the first N of
+  // which are used when testing N servos.  If empty, only dut_id is
+  // used.
+  std::string benchmark_ids;
+
   template <typename Archive>
   void Serialize(Archive* a) {
     a->Visit(MJ_NVP(fixture_id));
@@ -96,12 +127,25 @@ struct Options {
     a->Visit(MJ_NVP(log));
     a->Visit(MJ_NVP(max_test_time_s));
     a->Visit(MJ_NVP(max_torque_Nm));
+    a->Visit(MJ_NVP(telemetry_period_ms));
 
     a->Visit(MJ_NVP(static_torque_ripple));
     a->Visit(MJ_NVP(static_torque_ripple_speed));
 
     a->Visit(MJ_NVP(pwm_cycle_overrun));
 
+    a->Visit(MJ_NVP(position_step));
+    a->Visit(MJ_NVP(position_step_size));
+    a->Visit(MJ_NVP(position_step_count));
+    a->Visit(MJ_NVP(current_step));
+    a->Visit(MJ_NVP(current_step_A));
+    a->Visit(MJ_NVP(max_speed));
+    a->Visit(MJ_NVP(max_speed_target));
+    a->Visit(MJ_NVP(max_speed_time_s));
+    a->Visit(MJ_NVP(thermal_rise));
+    a->Visit(MJ_NVP(thermal_rise_torque_Nm));
+    a->Visit(MJ_NVP(thermal_rise_time_s));
+
     a->Visit(MJ_NVP(validate_pwm_mode));
     a->Visit(MJ_NVP(validate_current_mode));
     a->Visit(MJ_NVP(validate_position_basic));
@@ -109,6 +153,10 @@ struct Options {
     a->Visit(MJ_NVP(validate_position_lowspeed));
     a->Visit(MJ_NVP(validate_position_wraparound));
     a->Visit(MJ_NVP(validate_stay_within));
+
+    a->Visit(MJ_NVP(benchmark_latency));
+    a->Visit(MJ_NVP(benchmark_samples));
+    a->Visit(MJ_NVP(benchmark_ids));
   }
 };
 
@@ -128,6 +176,49 @@ struct TorqueTransducer {
   }
 };
 
+struct LatencyResult {
+  static constexpr int kBuckets = 40;
+  static constexpr int kBucketUs = 100;
+
+  boost::posix_time::ptime timestamp;
+
+  int32_t servo_count = 0;
+  // 0=int8, 1=int16, 2=int32, 3=float
+  int32_t resolution = 0;
+  int32_t query_registers = 0;
+
+  int32_t samples = 0;
+  int32_t errors = 0;
+
+  double min_us = 0.0;
+  double mean_us = 0.0;
+  double p50_us = 0.0;
+  double p99_us = 0.0;
+  double max_us = 0.0;
+  double cycle_rate_hz = 0.0;
+
+  // Each bucket counts the round trips taking up to kBucketUs longer
+  // than the previous.  The final bucket also holds all those longer.
+  std::array<uint32_t, kBuckets> histogram = {};
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(timestamp));
+    a->Visit(MJ_NVP(servo_count));
+    a->Visit(MJ_NVP(resolution));
+    a->Visit(MJ_NVP(query_registers));
+    a->Visit(MJ_NVP(samples));
+    a->Visit(MJ_NVP(errors));
+    a->Visit(MJ_NVP(min_us));
+    a->Visit(MJ_NVP(mean_us));
+    a->Visit(MJ_NVP(p50_us));
+    a->Visit(MJ_NVP(p99_us));
+    a->Visit(MJ_NVP(max_us));
+    a->Visit(MJ_NVP(cycle_rate_hz));
+    a->Visit(MJ_NVP(histogram));
+  }
+};
+
 void ExceptionRethrower(std::exception_ptr ptr) {
   if (ptr) {
     std::rethrow_exception(ptr);
@@ -284,7 +375,8 @@ class Controller {
         if (log_ids_.count(name) != 0) { break; }
       }
 
-      co_await Command(fmt::format("tel rate {} 50", name));
+      co_await Command(fmt::format("tel rate {} {}",
+                                   name, options_.telemetry_period_ms));
 
       // Now wait for this to have data.
       while (true) {
@@ -302,6 +394,17 @@ class Controller {
     co_return;
   }
 
+  /// Return the text value of the given configuration item.
+  boost::asio::awaitable<std::string> ReadConfig(const std::string& name) {
+    config_value_.reset();
+    config_value_wanted_ = true;
+    co_await WriteMessage(fmt::format("conf get {}", name));
+    while (!config_value_) {
+      co_await SomethingReceived();
+    }
+    co_return *config_value_;
+  }
+
   boost::asio::awaitable<void> WriteMessage(const std::string& message) {
     if (options_.verbose) {
       fmt::print("> {}\n", message);
@@ -394,6 +497,10 @@ class Controller {
             HandleServoStats(servo_stats_reader_->Read(data));
           }
         }
+      } else if (config_value_wanted_) {
+        // "conf get" replies with just the value.
+        config_value_ = line;
+        config_value_wanted_ = false;
       } else {
         fmt::print("Ignoring unknown line: {}\n", line);
       }
@@ -438,6 +545,9 @@ class Controller {
   io::ErrorCallback received_callback_;
   io::ErrorCallback ok_callback_;
 
+  bool config_value_wanted_ = false;
+  std::optional<std::string> config_value_;
+
   std::optional<ServoStatsReader> servo_stats_reader_;
   ServoStats servo_stats_;
 };
@@ -519,6 +629,13 @@ class Application {
   }
 
   boost::asio::awaitable<void> Task() {
+    if (options_.benchmark_latency) {
+      // This needs nothing but the client, so none of the fixture is
+      // initialized.
+      co_await RunLatencyBenchmark();
+      co_return;
+    }
+
     co_await Init();
 
     const auto expiration =
@@ -550,6 +667,14 @@ class Application {
       co_await RunStaticTorqueRipple();
     } else if (options_.pwm_cycle_overrun) {
       co_await RunPwmCycleOverrun();
+    } else if (options_.position_step) {
+      co_await RunPositionStep();
+    } else if (options_.current_step) {
+      co_await RunCurrentStep();
+    } else if (options_.max_speed) {
+      co_await RunMaxSpeed();
+    } else if (options_.thermal_rise) {
+      co_await RunThermalRise();
     } else if (options_.validate_pwm_mode) {
       co_await ValidatePwmMode();
     } else if (options_.validate_current_mode) {
@@ -673,6 +798,114 @@ class Application {
     co_return;
   }
 
+  boost::asio::awaitable<void> RunPositionStep() {
+    // The fixture is left free, so this measures the DUT's own
+    // position loop against nothing but the fixture's inertia.
+    co_await fixture_->Command("d stop");
+    co_await dut_->Command("d stop");
+    co_await dut_->Command("d index 0");
+
+    co_await dut_->Command(
+        fmt::format("d pos 0 0 {}", options_.max_torque_Nm));
+    co_await Sleep(1.0);
+
+    for (int i = 0; i < options_.position_step_count; i++) {
+      fmt::print("Step {}/{}\n", i + 1, options_.position_step_count);
+
+      co_await dut_->Command(
+          fmt::format("d pos {} 0 {}",
+                      options_.position_step_size, options_.max_torque_Nm));
+      co_await Sleep(1.0);
+      co_await dut_->Command(
+          fmt::format("d pos 0 0 {}", options_.max_torque_Nm));
+      co_await Sleep(1.0);
+    }
+
+    co_await dut_->Command("d stop");
+  }
+
+  boost::asio::awaitable<void> RunCurrentStep() {
+    co_await dut_->Command("d stop");
+    co_await CommandFixtureRigid();
+    co_await fixture_->Command("d index 0");
+    co_await fixture_->Command(
+        fmt::format("d pos 0 0 {}", options_.max_torque_Nm));
+    co_await Sleep(0.5);
+
+    // Each step starts from a held 0A command, rather than from
+    // stopped, so that the step itself is visible in the log.
+    co_await dut_->Command("d dq 0 0");
+    co_await Sleep(0.5);
+
+    for (double current : { options_.current_step_A,
+                            -options_.current_step_A }) {
+      fmt::print("Current {}\n", current);
+      co_await dut_->Command(fmt::format("d dq 0 {}", current));
+      co_await Sleep(1.0);
+      co_await dut_->Command("d dq 0 0");
+      co_await Sleep(0.5);
+    }
+
+    co_await dut_->Command("d stop");
+    co_await fixture_->Command("d stop");
+  }
+
+  boost::asio::awaitable<void> RunMaxSpeed() {
+    co_await fixture_->Command("d stop");
+    co_await dut_->Command("d stop");
+
+    const auto position_min =
+        co_await dut_->ReadConfig("servopos.position_min");
+    const auto position_max =
+        co_await dut_->ReadConfig("servopos.position_max");
+    co_await dut_->Command("conf set servopos.position_min nan");
+    co_await dut_->Command("conf set servopos.position_max nan");
+
+    for (double sign : { 1.0, -1.0 }) {
+      co_await dut_->Command(
+          fmt::format("d pos nan {} {}",
+                      sign * options_.max_speed_target,
+                      options_.max_torque_Nm));
+
+      StatusPrinter status_printer(this, fmt::format("SPEED({})", sign));
+      co_await Sleep(options_.max_speed_time_s);
+
+      co_await dut_->Command("d stop");
+      // Let it coast down before reversing.
+      co_await Sleep(2.0);
+    }
+
+    co_await dut_->Command(
+        fmt::format("conf set servopos.position_min {}", position_min));
+    co_await dut_->Command(
+        fmt::format("conf set servopos.position_max {}", position_max));
+  }
+
+  boost::asio::awaitable<void> RunThermalRise() {
+    co_await dut_->Command("d stop");
+    co_await CommandFixtureRigid();
+    co_await fixture_->Command("d index 0");
+    co_await fixture_->Command(
+        fmt::format("d pos 0 0 {}", options_.max_torque_Nm));
+    co_await Sleep(1.0);
+
+    const double torque = options_.thermal_rise_torque_Nm;
+    co_await dut_->Command(
+        fmt::format("d pos nan 0 {} p0 d0 f{}", std::abs(torque), torque));
+
+    {
+      StatusPrinter status_printer(this, "THERMAL");
+      co_await Sleep(options_.thermal_rise_time_s);
+    }
+
+    co_await dut_->Command("d stop");
+    co_await fixture_->Command("d stop");
+
+    if (dut_->servo_stats().mode == ServoStats::kFault) {
+      throw mjlib::base::system_error::einval("DUT faulted during thermal rise");
+    }
+  }
+
   struct PwmResult {
     double phase = 0.0;
     double voltage = 0.0;
@@ -1499,6 +1732,133 @@ class Application {
     co_return;
   }
 
+  boost::asio::awaitable<void> Transmit(const mp::AsioClient::Request* request,
+                                        mp::AsioClient::Reply* reply) {
+    auto operation = [&](io::ErrorCallback callback) {
+      client_->AsyncTransmit(request, reply, std::move(callback));
+    };
+
+    co_await async_initiate<
+      decltype(boost::asio::use_awaitable),
+      void(boost::system::error_code)>(operation, boost::asio::use_awaitable);
+  }
+
+  boost::asio::awaitable<void> RunLatencyBenchmark() {
+    std::vector<int> ids;
+    if (options_.benchmark_ids.empty()) {
+      ids.push_back(options_.dut_id);
+    } else {
+      std::vector<std::string> fields;
+      boost::split(fields, options_.benchmark_ids, boost::is_any_of(","));
+      for (const auto& field : fields) {
+        ids.push_back(std::stoi(field));
+      }
+    }
+
+    log_registrar_.Register("latency", &latency_signal_);
+
+    fmt::print("{:>6s} {:>4s} {:>4s} {:>8s} {:>8s} {:>8s} {:>8s} {:>9s} {:>6s}\n",
+               "servos", "res", "regs", "p50_us", "p99_us", "max_us",
+               "mean_us", "rate_hz", "errors");
+
+    for (size_t servo_count = 1; servo_count <= ids.size(); servo_count++) {
+      for (int resolution : {0, 1, 2, 3}) {
+        for (int query_registers : {1, 4, 8, 14}) {
+          mp::AsioClient::Request request;
+          for (size_t i = 0; i < servo_count; i++) {
+            request.push_back({});
+            request.back().id = ids[i];
+            request.back().request.ReadMultiple(
+                0, query_registers, resolution);
+          }
+
+          const auto result = co_await MeasureLatency(request);
+
+          LatencyResult data = result;
+          data.timestamp = mjlib::io::Now(executor_.context());
+          data.servo_count = servo_count;
+          data.resolution = resolution;
+          data.query_registers = query_registers;
+          latency_signal_(&data);
+
+          fmt::print("{:6d} {:4d} {:4d} {:8.0f} {:8.0f} {:8.0f} {:8.0f} {:9.1f} {:6d}\n",
+                     data.servo_count, data.resolution, data.query_registers,
+                     data.p50_us, data.p99_us, data.max_us, data.mean_us,
+                     data.cycle_rate_hz, data.errors);
+        }
+      }
+    }
+
+    co_return;
+  }
+
+  boost::asio::awaitable<LatencyResult> MeasureLatency(
+      const mp::AsioClient::Request& request) {
+    LatencyResult result;
+
+    std::vector<double> latencies_us;
+    latencies_us.reserve(options_.benchmark_samples);
+
+    mp::AsioClient::Reply reply;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < options_.benchmark_samples; i++) {
+      reply.clear();
+
+      const auto before = std::chrono::steady_clock::now();
+      try {
+        co_await Transmit(&request, &reply);
+      } catch (boost::system::system_error&) {
+        // A failed cycle is just one more error, the sweep goes on.
+        result.errors++;
+        continue;
+      }
+      const auto after = std::chrono::steady_clock::now();
+
+      // Every servo must have sent something back.
+      std::set<int> replied;
+      for (const auto& item : reply) { replied.insert(item.id); }
+      if (replied.size() != request.size()) {
+        result.errors++;
+        continue;
+      }
+
+      const double latency_us =
+          std::chrono::duration<double, std::micro>(after - before).count();
+      latencies_us.push_back(latency_us);
+
+      const int bucket = std::min<int>(
+          LatencyResult::kBuckets - 1,
+          static_cast<int>(latency_us / LatencyResult::kBucketUs));
+      result.histogram[bucket]++;
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    result.samples = latencies_us.size();
+    result.cycle_rate_hz =
+        options_.benchmark_samples /
+        std::chrono::duration<double>(end - start).count();
+
+    if (latencies_us.empty()) { co_return result; }
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    const auto percentile = [&](double fraction) {
+      const size_t index = std::min<size_t>(
+          latencies_us.size() - 1,
+          static_cast<size_t>(fraction * latencies_us.size()));
+      return latencies_us[index];
+    };
+
+    result.min_us = latencies_us.front();
+    result.max_us = latencies_us.back();
+    result.p50_us = percentile(0.50);
+    result.p99_us = percentile(0.99);
+    double total = 0.0;
+    for (const double value : latencies_us) { total += value; }
+    result.mean_us = total / latencies_us.size();
+
+    co_return result;
+  }
+
   boost::asio::awaitable<void> Sleep(double seconds) {
     boost::asio::deadline_timer timer(executor_);
     timer.expires_from_now(mjlib::base::ConvertSecondsToDuration(seconds));
@@ -1653,6 +2013,7 @@ class Application {
   std::optional<Controller> dut_;
 
   boost::signals2::signal<void (const TorqueTransducer*)> torque_signal_;
+  boost::signals2::signal<void (const LatencyResult*)> latency_signal_;
 
   double torque_tare_total_ = 0.0;
   double torque_tare_count_ = 0;
@@ -0,0 +1,407 @@
+#!/usr/bin/python3
+
+# Copyright 2020 Josh Pieper, jjp@pobox.com.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Run a fixed set of characterization cycles on the dynamometer,
+reduce each to a few metrics, and compare them against the stored
+baseline for the motor configuration under test.
+
+Baselines live in utils/dyno_baselines/<config>.json, where <config>
+is the stem of the file from configs/ which was applied to the DUT.
+Each metric records its baseline value, a tolerance, and whether
+'lower' or 'higher' values are better.  Only changes in the bad
+direction which exceed the tolerance count as regressions.
+"""
+
+import argparse
+import datetime
+import json
+import math
+import os
+import subprocess
+import sys
+import tempfile
+
+import mjlib.telemetry.file_reader as file_reader
+
+from bazel_tools.tools.python.runfiles import runfiles
+
+RUNFILES = runfiles.Create()
+MOTEUS_TOOL = RUNFILES.Rlocation(
+    "com_github_mjbots_moteus/utils/moteus_tool")
+DYNAMOMETER_DRIVE = RUNFILES.Rlocation(
+    "com_github_mjbots_moteus/utils/dynamometer_drive")
+
+# When run through 'bazel run', baselines are updated in the source
+# tree rather than the runfiles.
+BASELINE_DIR = os.path.join(
+    os.environ.get('BUILD_WORKSPACE_DIRECTORY',
+                   os.path.join(os.path.dirname(__file__), '..')),
+    'utils', 'dyno_baselines')
+
+# The fraction of the baseline value allowed when creating a new
+# baseline.
+DEFAULT_TOLERANCE = 0.10
+
+
+def _mean(values):
+    return sum(values) / len(values)
+
+
+def _std(values):
+    mean = _mean(values)
+    return math.sqrt(sum((x - mean) ** 2 for x in values) / len(values))
+
+
+def _find_regions(data, predicate):
+    '''Return the contiguous runs of @p data for which @p predicate is
+    truthy.'''
+    result = []
+    current = []
+    for d in data:
+        if predicate(d):
+            current.append(d)
+        elif current:
+            result.append(current)
+            current = []
+    if current:
+        result.append(current)
+    return result
+
+
+def _find_runs(data, key):
+    '''Return the contiguous runs of @p data over which @p key is the
+    same value, other than None.'''
+    result = []
+    current = []
+    current_key = None
+    for d in data:
+        this_key = key(d)
+        if current and this_key != current_key:
+            result.append(current)
+            current = []
+        if this_key is not None:
+            current.append(d)
+        current_key = this_key
+    if current:
+        result.append(current)
+    return result
+
+
+def _between(data, begin, end):
+    return [x for x in data if x.timestamp >= begin and x.timestamp < end]
+
+
+def analyze_torque_ripple(data):
+    '''Report the worst case ripple over each of the tested constant
+    torques.'''
+    cmds = data["dut_servo_cmd"]
+    regions = _find_regions(
+        cmds, lambda x: x.data.mode.value == 10)
+
+    stds = []
+    pkpks = []
+    for region in regions:
+        # Skip the startup transients.
+        begin = region[0].timestamp + 4.0
+        end = region[-1].timestamp
+        torques = [x.data.torque_Nm for x in
+                   _between(data["torque"], begin, end)]
+        if len(torques) < 10:
+            continue
+        stds.append(_std(torques))
+        pkpks.append(max(torques) - min(torques))
+
+    if not stds:
+        raise RuntimeError("no torque ripple regions found")
+
+    return {
+        'ripple_std_Nm': max(stds),
+        'ripple_pkpk_Nm': max(pkpks),
+    }
+
+
+def analyze_step(cmds, stats, command_field, measured_field,
+                 stopped_value=None):
+    '''Find each change in the commanded value and measure the 10-90%
+    rise time and the overshoot of the response.
+
+    Commands in the stopped mode are treated as @p stopped_value, or
+    break the sequence of steps if it is None.'''
+    rise_times = []
+    overshoots = []
+
+    def command(item):
+        if item.data.mode.value == 0:
+            return stopped_value
+        return getattr(item.data, command_field)
+
+    steps = []
+    previous = None
+    for item in cmds:
+        value = command(item)
+        if (previous is not None and value is not None and
+            math.isfinite(value) and value != previous):
+            steps.append((item.timestamp, previous, value))
+        previous = value
+
+    for index, (start, old, new) in enumerate(steps):
+        end = steps[index + 1][0] if index + 1 < len(steps) else start + 1.0
+        response = _between(stats, start, end)
+        if len(response) < 3:
+            continue
+
+        delta = new - old
+        def fraction(x):
+            return (getattr(x.data, measured_field) - old) / delta
+
+        t10 = next((x.timestamp for x in response if fraction(x) >= 0.1), None)
+        t90 = next((x.timestamp for x in response if fraction(x) >= 0.9), None)
+        if t10 is None or t90 is None:
+            continue
+        rise_times.append(t90 - t10)
+        overshoots.append(max(0.0, max(fraction(x) for x in response) - 1.0))
+
+    if not rise_times:
+        raise RuntimeError(f"no {command_field} steps found")
+
+    return _mean(rise_times), max(overshoots)
+
+
+def analyze_position_step(data):
+    rise_time, overshoot = analyze_step(
+        data["dut_servo_cmd"], data["dut_servo_stats"],
+        'position', 'unwrapped_position')
+    return {
+        'position_rise_time_s': rise_time,
+        'position_overshoot': overshoot,
+    }
+
+
+def analyze_current_step(data):
+    # The current loop settles in well under a millisecond, faster
+    # than telemetry can be logged, so its bandwidth is bounded from
+    # the settled tracking error and the apparent rise time.
+    cmds = data["dut_servo_cmd"]
+    stats = data["dut_servo_stats"]
+    # Each non-zero current command held for a while.
+    runs = _find_runs(
+        cmds, lambda x: (x.data.i_q_A if x.data.mode.value == 9 and
+                         x.data.i_q_A != 0.0 else None))
+
+    errors = []
+    for run in runs:
+        begin = run[0].timestamp + 0.2
+        end = run[-1].timestamp
+        target = run[-1].data.i_q_A
+        errors.extend(abs(x.data.q_A - target)
+                      for x in _between(stats, begin, end))
+
+    if not errors:
+        raise RuntimeError("no current steps found")
+
+    # The current is 0 whenever the DUT is stopped.
+    rise_time, _ = analyze_step(cmds, stats, 'i_q_A', 'q_A',
+                                stopped_value=0.0)
+    return {
+        'current_error_A': _mean(errors),
+        'current_rise_time_s': rise_time,
+    }
+
+
+def analyze_max_speed(data):
+    velocities = [abs(x.data.velocity) for x in data["dut_servo_stats"]
+                  if x.data.mode.value == 10]
+    return {
+        'max_speed_Hz': max(velocities),
+    }
+
+
+def analyze_thermal_rise(data):
+    stats = [x for x in data["dut_servo_stats"]
+             if math.isfinite(x.data.filt_fet_temp_C)]
+    active = [x for x in stats if x.data.mode.value == 10]
+    if not active:
+        raise RuntimeError("no thermal rise region found")
+    start = active[0]
+    end = active[-1]
+    return {
+        'thermal_rise_C': end.data.filt_fet_temp_C - start.data.filt_fet_temp_C,
+        'thermal_rate_C_per_s': (
+            (end.data.filt_fet_temp_C - start.data.filt_fet_temp_C) /
+            max(1.0, end.timestamp - start.timestamp)),
+    }
+
+
+# name, dynamometer_drive arguments, analysis, and the direction in
+# which each resulting metric is better.
+CYCLES = [
+    ('torque_ripple', ['--static_torque_ripple', '1'],
+     analyze_torque_ripple,
+     {'ripple_std_Nm': 'lower', 'ripple_pkpk_Nm': 'lower'}),
+    ('position_step', ['--position_step', '1', '--telemetry_period_ms', '5'],
+     analyze_position_step,
+     {'position_rise_time_s': 'lower', 'position_overshoot': 'lower'}),
+    ('current_step', ['--current_step', '1', '--telemetry_period_ms', '2'],
+     analyze_current_step,
+     {'current_error_A': 'lower', 'current_rise_time_s': 'lower'}),
+    ('max_speed', ['--max_speed', '1', '--telemetry_period_ms', '10'],
+     analyze_max_speed,
+     {'max_speed_Hz': 'higher'}),
+    ('thermal_rise', ['--thermal_rise', '1', '--telemetry_period_ms', '100'],
+     analyze_thermal_rise,
+     {'thermal_rise_C': 'lower', 'thermal_rate_C_per_s': 'lower'}),
+]
+
+
+def dyno(args, log_prefix, target):
+    log = tempfile.NamedTemporaryFile(
+        prefix='{}-moteus_dyno_regression-{}-'.format(
+            datetime.datetime.now().isoformat(), log_prefix),
+        suffix='.log',
+        delete=False)
+    subprocess.run(args = [DYNAMOMETER_DRIVE,
+                           '--torque_transducer', '/dev/ttyUSB0',
+                           '--dut_id', str(target),
+                           '--log', log.name] + list(args),
+                   check = True)
+    return log.name
+
+
+def load_log(filename):
+    fr = file_reader.FileReader(filename)
+    return fr.get(["torque", "dut_servo_cmd", "dut_servo_stats"])
+
+
+def compare(metrics, baseline):
+    '''@return a list of (name, value, baseline, status) tuples'''
+    result = []
+    for name, value in sorted(metrics.items()):
+        if name not in baseline:
+            result.append((name, value, None, 'new'))
+            continue
+
+        expected = baseline[name]
+        limit = expected['value'] + (
+            expected['tolerance'] if expected['better'] == 'lower'
+            else -expected['tolerance'])
+        if expected['better'] == 'lower':
+            ok = value <= limit
+        else:
+            ok = value >= limit
+        result.append((name, value, expected['value'],
+                       'ok' if ok else 'REGRESSION'))
+    return result
+
+
+def make_baseline(metrics, directions):
+    return {
+        name: {
+            'value': value,
+            'tolerance': abs(value) * DEFAULT_TOLERANCE,
+            'better': directions[name],
+        }
+        for name, value in metrics.items()
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('config', type=str,
+                        help='motor configuration file from configs/')
+    parser.add_argument('--target', '-t', type=int, default=1,
+                        help='id of the DUT')
+    parser.add_argument('--cycle', action='append', default=[],
+                        choices=[x[0] for x in CYCLES],
+                        help='only run the given cycles')
+    parser.add_argument('--analyze', nargs='*', default=[],
+                        metavar='CYCLE=LOG',
+                        help='analyze existing logs instead of running')
+    parser.add_argument('--baseline-dir', default=BASELINE_DIR)
+    parser.add_argument('--update-baseline', action='store_true',
+                        help='record the results as the new baseline')
+    parser.add_argument('--results', type=str,
+                        help='write all results as JSON to this file')
+    args = parser.parse_args()
+
+    config_name = os.path.splitext(os.path.basename(args.config))[0]
+    baseline_file = os.path.join(args.baseline_dir, config_name + '.json')
+    baseline = {}
+    if os.path.exists(baseline_file):
+        with open(baseline_file) as f:
+            baseline = json.load(f)
+
+    existing_logs = dict(x.split('=', 1) for x in args.analyze)
+
+    if not existing_logs:
+        subprocess.run(args = [
+            MOTEUS_TOOL, '--target', str(args.target),
+            '--write-config', args.config], check = True)
+
+    metrics = {}
+    directions = {}
+    logs = {}
+    for name, cycle_args, analyze, cycle_directions in CYCLES:
+        if args.cycle and name not in args.cycle:
+            continue
+        if existing_logs and name not in existing_logs:
+            continue
+
+        print(f"** CYCLE {name}")
+        log_name = (existing_logs.get(name) or
+                    dyno(cycle_args, name, args.target))
+        logs[name] = log_name
+        try:
+            metrics.update(analyze(load_log(log_name)))
+        except:
+            print("Failing log: {}".format(log_name))
+            raise
+        directions.update(cycle_directions)
+
+    comparison = compare(metrics, baseline)
+
+    print("** RESULTS")
+    for name, value, expected, status in comparison:
+        expected_str = f'{expected:.4g}' if expected is not None else '-'
+        print(f'{name:24s} {value:10.4g} {expected_str:>10s}  {status}')
+    print()
+
+    if args.results:
+        with open(args.results, 'w') as f:
+            json.dump({
+                'config': config_name,
+                'time': datetime.datetime.now().isoformat(),
+                'logs': logs,
+                'metrics': metrics,
+                'comparison': [
+                    {'name': name, 'value': value, 'baseline': expected,
+                     'status': status}
+                    for name, value, expected, status in comparison],
+            }, f, indent=2)
+
+    if args.update_baseline:
+        baseline.update(make_baseline(metrics, directions))
+        os.makedirs(args.baseline_dir, exist_ok=True)
+        with open(baseline_file, 'w') as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+        print(f"Updated {baseline_file}")
+        return
+
+    if any(x[3] == 'REGRESSION' for x in comparison):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
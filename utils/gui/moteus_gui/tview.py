@@ -52,6 +52,7 @@ else:
 import asyncqt
 
 import moteus.reader as reader
+import moteus.scope as scope
 
 
 LEFT_LEGEND_LOC = 3
@@ -60,7 +61,10 @@ RIGHT_LEGEND_LOC = 2
 DEFAULT_RATE = 100
 MAX_HISTORY_SIZE = 100
 MAX_SEND = 61
-POLL_TIMEOUT_S = 0.1
+
+PLOT_REDRAW_RATE = 10
+PLOT_INITIAL_SIZE = 1024
+PLOT_MAX_SIZE = 1 << 20
 
 # TODO jpieper: Factor these out of tplot.py
 def _get_data(value, name):
@@ -133,8 +137,15 @@ class PlotItem(object):
         self.plot_widget = plot_widget
         self.name = name
         self.line = None
-        self.xdata = []
-        self.ydata = []
+
+        # Samples are held in a ring buffer, which grows only until it
+        # can hold the whole history.
+        self.xdata = numpy.zeros(PLOT_INITIAL_SIZE)
+        self.ydata = numpy.zeros(PLOT_INITIAL_SIZE)
+        self.start = 0
+        self.size = 0
+        self.dirty = False
+
         self.connection = signal.connect(self._handle_update)
 
     def _make_line(self):
@@ -160,6 +171,15 @@ class PlotItem(object):
             self.axis.legend(loc=self.axis.legend_loc)
         self.plot_widget.canvas.draw()
 
+    def _grow(self):
+        capacity = len(self.xdata)
+        order = (self.start + numpy.arange(self.size)) % capacity
+        self.xdata = numpy.concatenate(
+            [self.xdata[order], numpy.zeros(capacity)])
+        self.ydata = numpy.concatenate(
+            [self.ydata[order], numpy.zeros(capacity)])
+        self.start = 0
+
     def _handle_update(self, value):
         if self.plot_widget.paused:
             return
@@ -168,29 +188,65 @@ class PlotItem(object):
             self._make_line()
 
         now = time.time()
-        self.xdata.append(now)
-        self.ydata.append(value)
-
-        # Remove elements from the beginning until there is at most
-        # one before the window.
-        oldest_time = now - self.plot_widget.history_s
-        oldest_index = None
-        for i in range(len(self.xdata)):
-            if self.xdata[i] >= oldest_time:
-                oldest_index = i - 1
-                break
-
-        if oldest_index and oldest_index > 1:
-            self.xdata = self.xdata[oldest_index:]
-            self.ydata = self.ydata[oldest_index:]
-
-        self.line.set_data(self.xdata, self.ydata)
+        capacity = len(self.xdata)
+        if self.size == capacity:
+            oldest = self.xdata[self.start]
+            if (oldest >= now - self.plot_widget.history_s and
+                capacity < PLOT_MAX_SIZE):
+                self._grow()
+                capacity = len(self.xdata)
+            else:
+                self.start = (self.start + 1) % capacity
+                self.size -= 1
 
-        self.axis.relim()
-        self.axis.autoscale()
+        index = (self.start + self.size) % capacity
+        self.xdata[index] = now
+        self.ydata[index] = float(value)
+        self.size += 1
+        self.dirty = True
 
         self.plot_widget.data_update()
 
+    def _ordered(self):
+        end = self.start + self.size
+        if end <= len(self.xdata):
+            return self.xdata[self.start:end], self.ydata[self.start:end]
+        end -= len(self.xdata)
+        return (numpy.concatenate([self.xdata[self.start:], self.xdata[:end]]),
+                numpy.concatenate([self.ydata[self.start:], self.ydata[:end]]))
+
+    def redraw(self, now, columns):
+        '''Update the line from the samples within the history window,
+        reduced to a minimum and maximum for each of @p columns.'''
+        self.dirty = False
+        if self.line is None:
+            return
+
+        xdata, ydata = self._ordered()
+
+        # Keep at most one sample before the window.
+        oldest_index = max(0, numpy.searchsorted(
+            xdata, now - self.plot_widget.history_s) - 1)
+        xdata = xdata[oldest_index:]
+        ydata = ydata[oldest_index:]
+
+        per_bin = len(xdata) // max(1, columns)
+        if per_bin > 2:
+            bins = len(xdata) // per_bin
+            used = bins * per_bin
+            shaped = ydata[:used].reshape(bins, per_bin)
+            imin = numpy.argmin(shaped, axis=1)
+            imax = numpy.argmax(shaped, axis=1)
+            offsets = numpy.arange(bins) * per_bin
+            index = numpy.stack([numpy.minimum(imin, imax),
+                                 numpy.maximum(imin, imax)],
+                                axis=1) + offsets[:, None]
+            index = numpy.concatenate(
+                [index.reshape(-1), numpy.arange(used, len(xdata))])
+            xdata = xdata[index]
+            ydata = ydata[index]
+
+        self.line.set_data(xdata, ydata)
 
 class PlotWidget(QtWidgets.QWidget):
     COLORS = 'rbgcmyk'
@@ -202,7 +258,10 @@ class PlotWidget(QtWidgets.QWidget):
         self.next_color = 0
         self.paused = False
 
-        self.last_draw_time = 0.0
+        self.items = []
+        self.redraw_timer = QtCore.QTimer(self)
+        self.redraw_timer.setInterval(int(1000 / PLOT_REDRAW_RATE))
+        self.redraw_timer.timeout.connect(self._handle_redraw)
 
         self.figure = matplotlib.figure.Figure()
         self.canvas = FigureCanvas(self.figure)
@@ -241,17 +300,37 @@ class PlotWidget(QtWidgets.QWidget):
                 self.right_axis.legend_loc = RIGHT_LEGEND_LOC
             axis = self.right_axis
         item = PlotItem(axis, self, name, signal)
+        self.items.append(item)
         return item
 
     def remove_plot(self, item):
+        self.items.remove(item)
         item.remove()
 
     def data_update(self):
+        # Drawing happens at a fixed rate from _handle_redraw, no
+        # matter how quickly data arrives.
+        if not self.redraw_timer.isActive():
+            self.redraw_timer.start()
+
+    def _handle_redraw(self):
+        dirty = [x for x in self.items if x.dirty]
+        if not dirty:
+            self.redraw_timer.stop()
+            return
+
         now = time.time()
-        elapsed = now - self.last_draw_time
-        if elapsed > 0.1:
-            self.last_draw_time = now
-            self.canvas.draw()
+        columns = max(1, int(self.canvas.width()))
+        for item in dirty:
+            item.redraw(now, columns)
+
+        for axis in [self.left_axis, self.right_axis]:
+            if axis is None:
+                continue
+            axis.relim()
+            axis.autoscale()
+
+        self.canvas.draw_idle()
 
     def _get_axes_keys(self):
         result = []
@@ -382,6 +461,32 @@ def _get_item_root(item):
     return item.text(0)
 
 
+class ScopeWindow(QtWidgets.QWidget):
+    '''Display one decoded capture from "d scope dump".'''
+
+    def __init__(self, title, capture, parent=None):
+        QtWidgets.QWidget.__init__(self, parent)
+        self.setWindowTitle(title)
+
+        self.figure = matplotlib.figure.Figure()
+        self.canvas = FigureCanvas(self.figure)
+        self.toolbar = qt_backend.NavigationToolbar2QT(self.canvas, self)
+
+        axis = self.figure.add_subplot(111)
+        axis.grid()
+        times = capture.times()
+        for name in capture.names:
+            axis.plot(times, capture.data[name], label=name)
+        if capture.trigger_index is not None:
+            axis.axvline(0.0, color='k', linestyle=':')
+        axis.set_xlabel('time from trigger (s)')
+        axis.legend(loc=LEFT_LEGEND_LOC)
+
+        layout = QtWidgets.QVBoxLayout(self)
+        layout.addWidget(self.toolbar, 0)
+        layout.addWidget(self.canvas, 1)
+
+
 class DeviceStream:
     def __init__(self, transport, controller):
         self._write_data = b''
@@ -395,32 +500,24 @@ class DeviceStream:
     def write(self, data):
         self._write_data += data
 
-    async def maybe_emit_one(self):
+    def make_write(self):
+        '''Return a command sending the next piece of pending data, or
+        None if there is none.'''
         if len(self._write_data) == 0:
-            return
+            return None
 
         to_write, self._write_data = (
             self._write_data[0:MAX_SEND], self._write_data[MAX_SEND:])
-        await self.transport.write(self.controller.make_diagnostic_write(to_write))
-
-    def process_message(self, message):
-        data = message.data
-
-        if len(data) < 3:
-            return False
+        return self.controller.make_diagnostic_write(to_write)
 
-        if data[0] != 0x41:
-            return False
-        if data[1] != 1:
-            return False
-        if data[2] > MAX_SEND:
-            return False
-        datalen = data[2]
-        if datalen > (len(data) - 3):
+    def process_data(self, data):
+        '''Accept the payload of a diagnostic read reply, as decoded by
+        moteus.parse_diagnostic_data.'''
+        if not data:
             return False
 
-        self._read_data += data[3:3+datalen]
-        return datalen > 0
+        self._read_data += data
+        return True
 
     def _read_maybe_empty_line(self):
         first_newline = min((self._read_data.find(c) for c in b'\r\n'
@@ -464,6 +561,7 @@ class Device:
     STATE_TELEMETRY = 2
     STATE_SCHEMA = 3
     STATE_DATA = 4
+    STATE_SCOPE = 5
 
     def __init__(self, number, transport, console, prefix,
                  config_tree_item, data_tree_item):
@@ -485,6 +583,8 @@ class Device:
         self._schema_name = None
         self._config_tree_items = {}
         self._config_callback = None
+        self._scope_lines = []
+        self._scope_windows = []
 
         self._start_time = None
 
@@ -503,12 +603,12 @@ class Device:
             self.update_telemetry(callback)
         self.update_config(after_config)
 
-    def process_message(self, message):
+    def process_result(self, result):
         now = time.time()
         if self._start_time and (now - self._start_time < 0.2):
             return False
 
-        any_data_read = self._stream.process_message(message)
+        any_data_read = self._stream.process_data(result.data)
 
         while True:
             old_len = len(self._stream._read_data)
@@ -522,12 +622,10 @@ class Device:
 
         return any_data_read
 
-    async def emit_any_writes(self):
-        await self._stream.maybe_emit_one()
-
-    async def poll(self):
-        await self._transport.write(self.controller.make_diagnostic_read())
+    def make_write(self):
+        return self._stream.make_write()
 
+    def make_poll(self):
         if self._start_time is not None:
             now = time.time()
             if now - self._start_time > 0.2:
@@ -535,6 +633,8 @@ class Device:
                 self._setup_device(None)
                 self._start_time = None
 
+        return self.controller.make_diagnostic_read()
+
     def write(self, data):
         self._stream.write(data)
 
@@ -555,6 +655,8 @@ class Device:
             self._handle_schema()
         elif self._serial_state == self.STATE_DATA:
             self._handle_data()
+        elif self._serial_state == self.STATE_SCOPE:
+            self._handle_scope()
         else:
             assert False
 
@@ -576,10 +678,38 @@ class Device:
             self._serial_state = self.STATE_DATA
             self._schema_name = line.split(' ', 1)[1].strip()
             display = False
+        elif scope.is_header(line):
+            self._serial_state = self.STATE_SCOPE
+            self._scope_lines = [line]
 
         if display:
             self._console.add_text(self._prefix + line + '\n')
 
+    def _handle_scope(self):
+        line = self._get_serial_line()
+        if not line:
+            return
+
+        line = line.decode('latin1')
+        if line.startswith('s '):
+            self._scope_lines.append(line)
+            return
+
+        # Anything else ends the capture.
+        self._serial_state = self.STATE_LINE
+        self._console.add_text(self._prefix + line + '\n')
+
+        lines, self._scope_lines = self._scope_lines, []
+        try:
+            capture = scope.parse(lines)
+        except RuntimeError as e:
+            self._console.add_text(self._prefix + str(e) + '\n')
+            return
+
+        window = ScopeWindow('scope {}'.format(self.number), capture)
+        window.show()
+        self._scope_windows.append(window)
+
     def _get_serial_line(self):
         result = self._stream.read_line()
         return result
@@ -886,18 +1016,6 @@ class TviewMainWindow():
         self.console._control.setFocus()
         self._open()
 
-    async def _dispatch_until(self, predicate):
-        while True:
-            message = await self.transport.read()
-            source_id = (message.arbitration_id >> 8) & 0xff
-            any_data_read = False
-            for device in self.devices:
-                if device.number == source_id:
-                    any_data_read = device.process_message(message)
-                    break
-            if predicate(message):
-                return any_data_read
-
     async def _run_transport(self):
         any_data_read = False
         while True:
@@ -907,41 +1025,57 @@ class TviewMainWindow():
 
             any_data_read = await self._run_transport_iteration()
 
-    async def _run_transport_iteration(self):
+    async def _cycle(self, commands):
+        # The transport leaves the replies of devices which did not
+        # answer as None, so those alone are backed off.
+        results = await self.transport.cycle(commands)
+        return {x.id: x for x in results if x is not None}
+
+    def _dispatch(self, devices, results):
         any_data_read = False
+        for device in devices:
+            result = results.get(device.number)
+            if result is None:
+                # Mark this device as error-full, which will then
+                # result in backoff in polling.
+                device.error_count = min(1000, device.error_count + 1)
+                device.poll_count = device.error_count
+                continue
 
-        # First, do writes from all devices.  This ensures that the
-        # writes will go out at approximately the same time.
-        for device in self.devices:
-            await device.emit_any_writes()
+            device.error_count = 0
+            device.poll_count = 0
+            if device.process_result(result):
+                any_data_read = True
+        return any_data_read
 
-        # Then poll for new data.  Back off from unresponsive devices
-        # so that they don't disrupt everything.
+    async def _run_transport_iteration(self):
+        # The writes and polls for every device go out in a single
+        # cycle, so the time each takes does not depend upon how many
+        # devices there are.
+        commands = [x.make_write() for x in self.devices]
+        commands = [x for x in commands if x is not None]
+
+        # Back off from unresponsive devices so that they don't
+        # disrupt everything.
+        to_poll = []
         for device in self.devices:
             if device.poll_count:
                 device.poll_count -= 1
                 continue
+            to_poll.append(device)
+            commands.append(device.make_poll())
 
-            await device.poll()
-
-            try:
-                this_data_read = await asyncio.wait_for(
-                    self._dispatch_until(
-                        lambda x: (x.arbitration_id >> 8) & 0xff == device.number),
-                    timeout = POLL_TIMEOUT_S)
+        if not commands:
+            return False
 
-                device.error_count = 0
-                device.poll_count = 0
+        try:
+            results = await self._cycle(commands)
+        except asyncio.TimeoutError:
+            # The adapter itself did not respond, so every device
+            # backs off.
+            results = {}
 
-                if this_data_read:
-                    any_data_read = True
-            except asyncio.TimeoutError:
-                # Mark this device as error-full, which will then
-                # result in backoff in polling.
-                device.error_count = min(1000, device.error_count + 1)
-                device.poll_count = device.error_count
-
-        return any_data_read
+        return self._dispatch(to_poll, results)
 
     def make_writer(self, devices, line):
         def write():
@@ -0,0 +1,492 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/moteus_client.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#include "mjlib/base/assert.h"
+
+namespace moteus {
+namespace client {
+
+namespace {
+constexpr uint8_t kWriteBase = 0x00;
+constexpr uint8_t kReadBase = 0x10;
+constexpr uint8_t kReplyBase = 0x20;
+constexpr uint8_t kNop = 0x50;
+constexpr uint8_t kStreamClientPoll = 0x42;
+
+constexpr size_t kResolutionSize[] = { 1, 2, 4, 4 };
+
+constexpr double kMax[] = {
+  127.0,
+  32767.0,
+  2147483647.0,
+};
+
+/// Reads primitive values out of a reply, tracking whether it ran
+/// out of data.
+class FrameReader {
+ public:
+  FrameReader(const uint8_t* data, size_t size, const RegisterScale& scale)
+      : data_(data), size_(size), scale_(scale) {}
+
+  const RegisterScale& scale() const { return scale_; }
+
+  bool done() const { return offset_ >= size_; }
+
+  bool ReadUint8(uint8_t* value) {
+    if (offset_ >= size_) { return false; }
+    *value = data_[offset_++];
+    return true;
+  }
+
+  bool ReadVaruint(uint32_t* value) {
+    uint32_t result = 0;
+    int shift = 0;
+    for (int i = 0; i < 5; i++) {
+      uint8_t this_byte = 0;
+      if (!ReadUint8(&this_byte)) { return false; }
+      result |= static_cast<uint32_t>(this_byte & 0x7f) << shift;
+      shift += 7;
+      if ((this_byte & 0x80) == 0) {
+        *value = result;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Read a value, with the most negative integer decoded as NaN.
+  bool ReadMapped(Resolution resolution,
+                  double int8_scale, double int16_scale, double int32_scale,
+                  double* value) {
+    const size_t size = kResolutionSize[resolution];
+    if (offset_ + size > size_) { return false; }
+    const uint8_t* const ptr = &data_[offset_];
+    offset_ += size;
+
+    switch (resolution) {
+      case kInt8: {
+        int8_t v;
+        std::memcpy(&v, ptr, sizeof(v));
+        *value = (v == -128) ? QueryResult::kNaN : v * int8_scale;
+        return true;
+      }
+      case kInt16: {
+        int16_t v;
+        std::memcpy(&v, ptr, sizeof(v));
+        *value = (v == -32768) ? QueryResult::kNaN : v * int16_scale;
+        return true;
+      }
+      case kInt32: {
+        int32_t v;
+        std::memcpy(&v, ptr, sizeof(v));
+        *value = (v == std::numeric_limits<int32_t>::min()) ?
+            QueryResult::kNaN : v * int32_scale;
+        return true;
+      }
+      case kFloat: {
+        float v;
+        std::memcpy(&v, ptr, sizeof(v));
+        *value = v;
+        return true;
+      }
+      case kIgnore: {
+        break;
+      }
+    }
+    return false;
+  }
+
+  bool ReadInt(Resolution resolution, int* value) {
+    double result = 0.0;
+    if (!ReadMapped(resolution, 1.0, 1.0, 1.0, &result)) { return false; }
+    *value = std::isfinite(result) ? static_cast<int>(result) : -1;
+    return true;
+  }
+
+ private:
+  const uint8_t* const data_;
+  const size_t size_;
+  const RegisterScale& scale_;
+  size_t offset_ = 0;
+};
+
+bool ParseRegister(FrameReader* reader, uint32_t reg, Resolution resolution,
+                   QueryResult* result) {
+  const auto& scale = reader->scale();
+  auto read = [&](double int8_scale, double int16_scale, double int32_scale,
+                  double multiplier, double* value) {
+    return reader->ReadMapped(resolution,
+                              int8_scale * multiplier,
+                              int16_scale * multiplier,
+                              int32_scale * multiplier,
+                              value);
+  };
+
+  switch (static_cast<Register>(reg)) {
+    case Register::kMode: {
+      return reader->ReadInt(resolution, &result->mode);
+    }
+    case Register::kPosition: {
+      return read(0.01, 0.0001, 0.00001, scale.position, &result->position);
+    }
+    case Register::kVelocity: {
+      return read(0.1, 0.00025, 0.00001, scale.velocity, &result->velocity);
+    }
+    case Register::kTorque: {
+      return read(0.5, 0.01, 0.001, scale.torque, &result->torque);
+    }
+    case Register::kQCurrent: {
+      return read(1.0, 0.1, 0.001, scale.current, &result->q_current);
+    }
+    case Register::kDCurrent: {
+      return read(1.0, 0.1, 0.001, scale.current, &result->d_current);
+    }
+    case Register::kRezeroState: {
+      return reader->ReadInt(resolution, &result->rezero_state);
+    }
+    case Register::kVoltage: {
+      return read(0.5, 0.1, 0.001, scale.voltage, &result->voltage);
+    }
+    case Register::kTemperature: {
+      return read(1.0, 0.1, 0.001, scale.temperature, &result->temperature);
+    }
+    case Register::kFault: {
+      return reader->ReadInt(resolution, &result->fault);
+    }
+    default: {
+      break;
+    }
+  }
+
+  // We still need to skip over registers we do not know.
+  double ignored = 0.0;
+  return reader->ReadMapped(resolution, 1.0, 1.0, 1.0, &ignored);
+}
+}
+
+bool ParseQueryResult(const uint8_t* data, size_t size, QueryResult* result,
+                      const RegisterScale& scale) {
+  FrameReader reader(data, size, scale);
+
+  while (!reader.done()) {
+    uint8_t cmd = 0;
+    reader.ReadUint8(&cmd);
+    if (cmd == kNop) { continue; }
+
+    if (cmd < kReplyBase || cmd >= (kReplyBase + 0x10)) {
+      // Anything else is an error of some sort.
+      return false;
+    }
+
+    const auto resolution = static_cast<Resolution>((cmd >> 2) & 0x03);
+    uint8_t count = cmd & 0x03;
+    if (count == 0 && !reader.ReadUint8(&count)) { return false; }
+    if (count == 0) { continue; }
+
+    uint32_t reg = 0;
+    if (!reader.ReadVaruint(&reg)) { return false; }
+
+    for (uint8_t i = 0; i < count; i++) {
+      if (!ParseRegister(&reader, reg + i, resolution, result)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+void FrameWriter::Write(const void* data, size_t size) {
+  MJ_ASSERT(command_->size + size <= command_->data.size());
+  std::memcpy(&command_->data[command_->size], data, size);
+  command_->size += size;
+}
+
+void FrameWriter::WriteInt8(int8_t value) { Write(&value, sizeof(value)); }
+void FrameWriter::WriteInt16(int16_t value) { Write(&value, sizeof(value)); }
+void FrameWriter::WriteInt32(int32_t value) { Write(&value, sizeof(value)); }
+void FrameWriter::WriteFloat(float value) { Write(&value, sizeof(value)); }
+
+void FrameWriter::WriteVaruint(uint32_t value) {
+  do {
+    uint8_t this_byte = value & 0x7f;
+    value >>= 7;
+    this_byte |= value ? 0x80 : 0x00;
+    Write(&this_byte, 1);
+  } while (value);
+}
+
+void FrameWriter::WriteBytes(const uint8_t* data, size_t size) {
+  Write(data, size);
+}
+
+void FrameWriter::WriteMapped(
+    double value,
+    double int8_scale, double int16_scale, double int32_scale,
+    Resolution resolution) {
+  if (resolution == kFloat) {
+    WriteFloat(static_cast<float>(value));
+    return;
+  }
+
+  const double scales[] = { int8_scale, int16_scale, int32_scale };
+  const double max = kMax[resolution];
+  const double scaled =
+      !std::isfinite(value) ? -(max + 1.0) :
+      std::max(-max, std::min(max, value / scales[resolution]));
+
+  switch (resolution) {
+    case kInt8: { WriteInt8(static_cast<int8_t>(scaled)); break; }
+    case kInt16: { WriteInt16(static_cast<int16_t>(scaled)); break; }
+    case kInt32: { WriteInt32(static_cast<int32_t>(scaled)); break; }
+    default: { MJ_ASSERT(false); }
+  }
+}
+
+void FrameWriter::WritePosition(double value, Resolution resolution) {
+  const double m = scale_.position;
+  WriteMapped(value, 0.01 * m, 0.0001 * m, 0.00001 * m, resolution);
+}
+
+void FrameWriter::WriteVelocity(double value, Resolution resolution) {
+  const double m = scale_.velocity;
+  WriteMapped(value, 0.1 * m, 0.00025 * m, 0.00001 * m, resolution);
+}
+
+void FrameWriter::WriteTorque(double value, Resolution resolution) {
+  const double m = scale_.torque;
+  WriteMapped(value, 0.5 * m, 0.01 * m, 0.001 * m, resolution);
+}
+
+void FrameWriter::WritePwm(double value, Resolution resolution) {
+  WriteMapped(value, 1.0 / 127.0, 1.0 / 32767.0, 1.0 / 2147483647.0,
+              resolution);
+}
+
+void FrameWriter::WriteTime(double value, Resolution resolution) {
+  const double m = scale_.time;
+  WriteMapped(value, 0.01 * m, 0.001 * m, 0.000001 * m, resolution);
+}
+
+void FrameWriter::WriteCurrent(double value, Resolution resolution) {
+  const double m = scale_.current;
+  WriteMapped(value, 1.0 * m, 0.1 * m, 0.001 * m, resolution);
+}
+
+bool WriteCombiner::MaybeWrite() {
+  const size_t this_offset = offset_;
+  offset_++;
+
+  const auto this_resolution = resolutions_[this_offset];
+  if (current_resolution_ == this_resolution) {
+    // We don't need to write any register operations here, and the
+    // value should go out only if requested.
+    return this_resolution != kIgnore;
+  }
+
+  current_resolution_ = this_resolution;
+
+  if (this_resolution == kIgnore) {
+    // We are now in a block of ignores.
+    return false;
+  }
+
+  size_t count = 1;
+  for (size_t i = this_offset + 1;
+       i < size_ && resolutions_[i] == this_resolution; i++) {
+    count++;
+  }
+
+  const uint8_t write_command =
+      base_command_ | static_cast<uint8_t>(this_resolution * 4);
+
+  if (count <= 3) {
+    // Use the shorthand formulation.
+    writer_->WriteInt8(write_command + count);
+  } else {
+    // Nope, the long form.
+    writer_->WriteInt8(write_command);
+    writer_->WriteInt8(count);
+  }
+  writer_->WriteVaruint(start_register_ + this_offset);
+  return true;
+}
+
+Controller::Controller() : Controller(Options()) {}
+
+Controller::Controller(const Options& options) : options_(options) {
+  FrameWriter writer(&query_);
+  const auto& qr = options_.query_resolution;
+
+  {
+    const Resolution resolutions[] = {
+      qr.mode,
+      qr.position,
+      qr.velocity,
+      qr.torque,
+      qr.q_current,
+      qr.d_current,
+    };
+    WriteCombiner combiner(&writer, kReadBase, uint32_t(Register::kMode),
+                           resolutions, std::size(resolutions));
+    for (size_t i = 0; i < std::size(resolutions); i++) {
+      combiner.MaybeWrite();
+    }
+  }
+  {
+    const Resolution resolutions[] = {
+      qr.rezero_state,
+      qr.voltage,
+      qr.temperature,
+      qr.fault,
+    };
+    WriteCombiner combiner(&writer, kReadBase,
+                           uint32_t(Register::kRezeroState),
+                           resolutions, std::size(resolutions));
+    for (size_t i = 0; i < std::size(resolutions); i++) {
+      combiner.MaybeWrite();
+    }
+  }
+}
+
+void Controller::StartCommand(Command* command, bool query) const {
+  command->destination = options_.id;
+  command->source = options_.source;
+  command->reply_required = query;
+  command->size = 0;
+}
+
+void Controller::FinishCommand(Command* command, bool query) const {
+  if (!query) { return; }
+  FrameWriter(command).WriteBytes(query_.data.data(), query_.size);
+}
+
+void Controller::MakeQuery(Command* command) const {
+  StartCommand(command, true);
+  FinishCommand(command, true);
+}
+
+void Controller::MakeStop(Command* command, bool query) const {
+  StartCommand(command, query);
+
+  FrameWriter writer(command);
+  writer.WriteInt8(kWriteBase | 0x01);
+  writer.WriteInt8(uint8_t(Register::kMode));
+  writer.WriteInt8(uint8_t(Mode::kStopped));
+
+  FinishCommand(command, query);
+}
+
+void Controller::MakeDiagnosticRead(Command* command,
+                                    uint8_t max_length) const {
+  StartCommand(command, true);
+
+  FrameWriter writer(command);
+  writer.WriteInt8(kStreamClientPoll);
+  // The diagnostic channel.
+  writer.WriteInt8(1);
+  writer.WriteInt8(max_length);
+}
+
+void Controller::MakePosition(const PositionCommand& position,
+                              Command* command, bool query) const {
+  StartCommand(command, query);
+
+  FrameWriter writer(command, options_.register_scale);
+  writer.WriteInt8(kWriteBase | 0x01);
+  writer.WriteInt8(uint8_t(Register::kMode));
+  writer.WriteInt8(uint8_t(Mode::kPosition));
+
+  const auto& pr = options_.position_resolution;
+  auto maybe = [](const std::optional<double>& value, Resolution resolution) {
+    return value ? resolution : kIgnore;
+  };
+  const Resolution resolutions[] = {
+    maybe(position.position, pr.position),
+    maybe(position.velocity, pr.velocity),
+    maybe(position.feedforward_torque, pr.feedforward_torque),
+    maybe(position.kp_scale, pr.kp_scale),
+    maybe(position.kd_scale, pr.kd_scale),
+    maybe(position.maximum_torque, pr.maximum_torque),
+    maybe(position.stop_position, pr.stop_position),
+    maybe(position.watchdog_timeout, pr.watchdog_timeout),
+  };
+
+  WriteCombiner combiner(&writer, kWriteBase,
+                         uint32_t(Register::kCommandPosition),
+                         resolutions, std::size(resolutions));
+
+  if (combiner.MaybeWrite()) {
+    writer.WritePosition(*position.position, pr.position);
+  }
+  if (combiner.MaybeWrite()) {
+    writer.WriteVelocity(*position.velocity, pr.velocity);
+  }
+  if (combiner.MaybeWrite()) {
+    writer.WriteTorque(*position.feedforward_torque, pr.feedforward_torque);
+  }
+  if (combiner.MaybeWrite()) {
+    writer.WritePwm(*position.kp_scale, pr.kp_scale);
+  }
+  if (combiner.MaybeWrite()) {
+    writer.WritePwm(*position.kd_scale, pr.kd_scale);
+  }
+  if (combiner.MaybeWrite()) {
+    writer.WriteTorque(*position.maximum_torque, pr.maximum_torque);
+  }
+  if (combiner.MaybeWrite()) {
+    writer.WritePosition(*position.stop_position, pr.stop_position);
+  }
+  if (combiner.MaybeWrite()) {
+    writer.WriteTime(*position.watchdog_timeout, pr.watchdog_timeout);
+  }
+
+  FinishCommand(command, query);
+}
+
+void Controller::MakeCurrent(const CurrentCommand& current,
+                             Command* command, bool query) const {
+  StartCommand(command, query);
+
+  FrameWriter writer(command, options_.register_scale);
+  writer.WriteInt8(kWriteBase | 0x01);
+  writer.WriteInt8(uint8_t(Register::kMode));
+  writer.WriteInt8(uint8_t(Mode::kCurrent));
+
+  // The register map has the Q current first in this grouping,
+  // unlike everywhere else.
+  const auto& cr = options_.current_resolution;
+  const Resolution resolutions[] = { cr.q_A, cr.d_A };
+  WriteCombiner combiner(&writer, kWriteBase,
+                         uint32_t(Register::kCommandQCurrent),
+                         resolutions, std::size(resolutions));
+
+  if (combiner.MaybeWrite()) {
+    writer.WriteCurrent(current.q_A, cr.q_A);
+  }
+  if (combiner.MaybeWrite()) {
+    writer.WriteCurrent(current.d_A, cr.d_A);
+  }
+
+  FinishCommand(command, query);
+}
+
+}
+}
@@ -0,0 +1,301 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+
+/// @file
+///
+/// Constructs and decodes register protocol frames for moteus
+/// controllers, mirroring the python moteus.Controller.  Nothing here
+/// allocates, so commands may be rebuilt on every cycle of a high
+/// rate control loop.
+
+namespace moteus {
+namespace client {
+
+enum Resolution : uint8_t {
+  kInt8 = 0,
+  kInt16 = 1,
+  kInt32 = 2,
+  kFloat = 3,
+  kIgnore = 4,
+};
+
+enum class Register : uint16_t {
+  kMode = 0x000,
+  kPosition = 0x001,
+  kVelocity = 0x002,
+  kTorque = 0x003,
+  kQCurrent = 0x004,
+  kDCurrent = 0x005,
+  kRezeroState = 0x00c,
+  kVoltage = 0x00d,
+  kTemperature = 0x00e,
+  kFault = 0x00f,
+
+  kCommandQCurrent = 0x01c,
+  kCommandDCurrent = 0x01d,
+
+  kCommandPosition = 0x020,
+  kCommandVelocity = 0x021,
+  kCommandFeedforwardTorque = 0x022,
+  kCommandKpScale = 0x023,
+  kCommandKdScale = 0x024,
+  kCommandPositionMaxTorque = 0x025,
+  kCommandStopPosition = 0x026,
+  kCommandTimeout = 0x027,
+};
+
+enum class Mode : uint8_t {
+  kStopped = 0,
+  kFault = 1,
+  kPwm = 5,
+  kVoltage = 6,
+  kVoltageFoc = 7,
+  kVoltageDq = 8,
+  kCurrent = 9,
+  kPosition = 10,
+  kTimeout = 11,
+  kZeroVelocity = 12,
+  kStayWithin = 13,
+};
+
+struct QueryResolution {
+  Resolution mode = kInt16;
+  Resolution position = kInt16;
+  Resolution velocity = kInt16;
+  Resolution torque = kInt16;
+  Resolution q_current = kIgnore;
+  Resolution d_current = kIgnore;
+  Resolution rezero_state = kIgnore;
+  Resolution voltage = kInt8;
+  Resolution temperature = kInt8;
+  Resolution fault = kInt8;
+};
+
+struct PositionResolution {
+  Resolution position = kFloat;
+  Resolution velocity = kFloat;
+  Resolution feedforward_torque = kFloat;
+  Resolution kp_scale = kFloat;
+  Resolution kd_scale = kFloat;
+  Resolution maximum_torque = kFloat;
+  Resolution stop_position = kFloat;
+  Resolution watchdog_timeout = kFloat;
+};
+
+struct CurrentResolution {
+  Resolution d_A = kFloat;
+  Resolution q_A = kFloat;
+};
+
+/// Multiplies the value of one integer LSB for each kind of
+/// register.  These must match the controller's register_scale
+/// configuration, exactly as moteus.RegisterScale.
+struct RegisterScale {
+  double position = 1.0;
+  double velocity = 1.0;
+  double torque = 1.0;
+  double current = 1.0;
+  double voltage = 1.0;
+  double temperature = 1.0;
+  double time = 1.0;
+};
+
+/// Any value which is not set is omitted from the frame, leaving the
+/// controller's default in effect.
+struct PositionCommand {
+  std::optional<double> position;
+  std::optional<double> velocity;
+  std::optional<double> feedforward_torque;
+  std::optional<double> kp_scale;
+  std::optional<double> kd_scale;
+  std::optional<double> maximum_torque;
+  std::optional<double> stop_position;
+  std::optional<double> watchdog_timeout;
+};
+
+struct CurrentCommand {
+  double d_A = 0.0;
+  double q_A = 0.0;
+};
+
+/// A single CAN-FD frame destined for one controller.
+struct Command {
+  static constexpr size_t kMaxSize = 64;
+
+  uint8_t destination = 1;
+  uint8_t source = 0;
+  bool reply_required = false;
+
+  std::array<uint8_t, kMaxSize> data = {};
+  size_t size = 0;
+};
+
+/// A frame received in response to a Command.
+struct Reply {
+  bool valid = false;
+  uint8_t source = 0;
+  uint8_t destination = 0;
+
+  std::array<uint8_t, Command::kMaxSize> data = {};
+  size_t size = 0;
+};
+
+/// The decoded contents of a reply.  Registers which were not present
+/// are left as NaN, or -1 for the integer ones.
+struct QueryResult {
+  static constexpr double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+  int mode = -1;
+  double position = kNaN;
+  double velocity = kNaN;
+  double torque = kNaN;
+  double q_current = kNaN;
+  double d_current = kNaN;
+  int rezero_state = -1;
+  double voltage = kNaN;
+  double temperature = kNaN;
+  int fault = -1;
+};
+
+/// Decode the register values in a reply.
+///
+/// @return false if the reply was malformed, in which case @p result
+/// holds whatever was decoded before the error.
+bool ParseQueryResult(const uint8_t* data, size_t size, QueryResult* result,
+                      const RegisterScale& scale = RegisterScale());
+
+inline bool ParseQueryResult(const Reply& reply, QueryResult* result,
+                             const RegisterScale& scale = RegisterScale()) {
+  return ParseQueryResult(reply.data.data(), reply.size, result, scale);
+}
+
+/// Appends multiplex protocol primitives to a Command.
+class FrameWriter {
+ public:
+  FrameWriter(Command* command, const RegisterScale& scale = RegisterScale())
+      : command_(command), scale_(scale) {}
+
+  void WriteInt8(int8_t value);
+  void WriteInt16(int16_t value);
+  void WriteInt32(int32_t value);
+  void WriteFloat(float value);
+  void WriteVaruint(uint32_t value);
+  void WriteBytes(const uint8_t* data, size_t size);
+
+  /// Write @p value scaled for the integer resolutions, with NaN
+  /// mapped to the most negative integer.
+  void WriteMapped(double value,
+                   double int8_scale, double int16_scale, double int32_scale,
+                   Resolution resolution);
+
+  void WritePosition(double value, Resolution);
+  void WriteVelocity(double value, Resolution);
+  void WriteTorque(double value, Resolution);
+  void WritePwm(double value, Resolution);
+  void WriteTime(double value, Resolution);
+  void WriteCurrent(double value, Resolution);
+
+ private:
+  void Write(const void* data, size_t size);
+
+  Command* const command_;
+  const RegisterScale scale_;
+};
+
+/// Groups consecutive registers of the same resolution into a single
+/// subframe, exactly as moteus.multiplex.WriteCombiner does.
+class WriteCombiner {
+ public:
+  WriteCombiner(FrameWriter* writer,
+                uint8_t base_command,
+                uint32_t start_register,
+                const Resolution* resolutions,
+                size_t size)
+      : writer_(writer),
+        base_command_(base_command),
+        start_register_(start_register),
+        resolutions_(resolutions),
+        size_(size) {}
+
+  /// Advance to the next register, emitting a subframe header if
+  /// needed.
+  ///
+  /// @return true if a value should be written for this register
+  bool MaybeWrite();
+
+ private:
+  FrameWriter* const writer_;
+  const uint8_t base_command_;
+  const uint32_t start_register_;
+  const Resolution* const resolutions_;
+  const size_t size_;
+
+  size_t offset_ = 0;
+  int current_resolution_ = -1;
+};
+
+/// Builds commands for a single moteus controller.
+class Controller {
+ public:
+  struct Options {
+    int id = 1;
+    int source = 0;
+
+    QueryResolution query_resolution;
+    PositionResolution position_resolution;
+    CurrentResolution current_resolution;
+
+    RegisterScale register_scale;
+  };
+
+  Controller();
+  Controller(const Options&);
+
+  int id() const { return options_.id; }
+
+  void MakeQuery(Command*) const;
+  void MakeStop(Command*, bool query = false) const;
+  /// Poll the diagnostic tunnel for up to @p max_length bytes.
+  void MakeDiagnosticRead(Command*, uint8_t max_length = 48) const;
+  void MakePosition(const PositionCommand&, Command*,
+                    bool query = false) const;
+  void MakeCurrent(const CurrentCommand&, Command*,
+                   bool query = false) const;
+
+  /// Decode a reply using this controller's register scales.
+  bool ParseReply(const Reply& reply, QueryResult* result) const {
+    return ParseQueryResult(reply, result, options_.register_scale);
+  }
+
+ private:
+  void StartCommand(Command*, bool query) const;
+  void FinishCommand(Command*, bool query) const;
+
+  const Options options_;
+
+  // The query subframes are computed once, and appended as-is.
+  Command query_;
+};
+
+}
+}
@@ -0,0 +1,345 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/moteus_transport.h"
+
+#include <fcntl.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+
+#include "mjlib/base/system_error.h"
+
+namespace moteus {
+namespace client {
+
+namespace {
+constexpr uint8_t kNop = 0x50;
+
+int64_t GetNowUs() {
+  struct timespec ts = {};
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/// @return the number of milliseconds poll should wait to reach
+/// @p deadline_us, rounded up so that we do not spin.
+int PollTimeoutMs(int64_t deadline_us) {
+  const int64_t remaining = deadline_us - GetNowUs();
+  if (remaining <= 0) { return 0; }
+  return static_cast<int>((remaining + 999) / 1000);
+}
+
+/// CAN-FD frames may only have certain lengths.
+size_t RoundUpDlc(size_t size) {
+  if (size <= 8) { return size; }
+  if (size <= 12) { return 12; }
+  if (size <= 16) { return 16; }
+  if (size <= 20) { return 20; }
+  if (size <= 24) { return 24; }
+  if (size <= 32) { return 32; }
+  if (size <= 48) { return 48; }
+  return 64;
+}
+
+uint32_t ArbitrationId(const Command& command) {
+  return (command.reply_required ? 0x8000 : 0x0000) |
+      (static_cast<uint32_t>(command.source) << 8) |
+      command.destination;
+}
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') { return c - '0'; }
+  if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+  if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+  return -1;
+}
+
+const char kHex[] = "0123456789abcdef";
+}
+
+bool Transport::MatchReply(const Command* commands, size_t size,
+                           Reply* replies, const Reply& reply) {
+  for (size_t i = 0; i < size; i++) {
+    if (!commands[i].reply_required || replies[i].valid) { continue; }
+    if (commands[i].destination != reply.source) { continue; }
+    replies[i] = reply;
+    replies[i].valid = true;
+    return true;
+  }
+  return false;
+}
+
+SocketCanTransport::SocketCanTransport() : SocketCanTransport(Options()) {}
+
+SocketCanTransport::SocketCanTransport(const Options& options)
+    : options_(options) {
+  fd_ = ::socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (fd_ < 0) {
+    throw mjlib::base::system_error::syserrno("opening CAN socket");
+  }
+
+  struct ifreq ifr = {};
+  std::strncpy(ifr.ifr_name, options_.interface.c_str(), IFNAMSIZ - 1);
+  if (::ioctl(fd_, SIOCGIFINDEX, &ifr) < 0) {
+    throw mjlib::base::system_error::syserrno(
+        "finding CAN interface " + options_.interface);
+  }
+
+  const int enable_canfd = 1;
+  if (::setsockopt(fd_, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+                   &enable_canfd, sizeof(enable_canfd)) != 0) {
+    throw mjlib::base::system_error::syserrno("enabling CAN-FD");
+  }
+
+  struct sockaddr_can addr = {};
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (::bind(fd_, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) < 0) {
+    throw mjlib::base::system_error::syserrno("binding CAN socket");
+  }
+}
+
+SocketCanTransport::~SocketCanTransport() {
+  if (fd_ >= 0) { ::close(fd_); }
+}
+
+size_t SocketCanTransport::Cycle(const Command* commands, size_t size,
+                                 Reply* replies) {
+  size_t expected = 0;
+  for (size_t i = 0; i < size; i++) {
+    const auto& command = commands[i];
+    replies[i].valid = false;
+    if (command.reply_required) { expected++; }
+
+    struct canfd_frame frame = {};
+    frame.can_id = ArbitrationId(command);
+    if (frame.can_id > 0x7ff) { frame.can_id |= CAN_EFF_FLAG; }
+    frame.len = RoundUpDlc(command.size);
+    frame.flags = CANFD_BRS;
+    std::memcpy(frame.data, command.data.data(), command.size);
+    std::memset(&frame.data[command.size], kNop, frame.len - command.size);
+
+    if (::write(fd_, &frame, CANFD_MTU) != CANFD_MTU) {
+      throw mjlib::base::system_error::syserrno("sending CAN frame");
+    }
+  }
+
+  const int64_t deadline_us = GetNowUs() + options_.reply_timeout_us;
+  size_t result = 0;
+  while (result < expected) {
+    struct pollfd pfd = {};
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    const int timeout_ms = PollTimeoutMs(deadline_us);
+    const int poll_result = ::poll(&pfd, 1, timeout_ms);
+    if (poll_result < 0) {
+      if (errno == EINTR) { continue; }
+      throw mjlib::base::system_error::syserrno("polling CAN socket");
+    }
+    if (poll_result == 0) { break; }
+
+    struct canfd_frame frame = {};
+    const auto nbytes = ::read(fd_, &frame, sizeof(frame));
+    if (nbytes < 0) {
+      throw mjlib::base::system_error::syserrno("reading CAN socket");
+    }
+    if (nbytes != CANFD_MTU && nbytes != CAN_MTU) { continue; }
+
+    Reply reply;
+    reply.source = (frame.can_id >> 8) & 0x7f;
+    reply.destination = frame.can_id & 0x7f;
+    reply.size = std::min<size_t>(frame.len, reply.data.size());
+    std::memcpy(reply.data.data(), frame.data, reply.size);
+
+    if (MatchReply(commands, size, replies, reply)) { result++; }
+  }
+
+  return result;
+}
+
+FdcanusbTransport::FdcanusbTransport() : FdcanusbTransport(Options()) {}
+
+FdcanusbTransport::FdcanusbTransport(const Options& options)
+    : options_(options) {
+  fd_ = ::open(options_.path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd_ < 0) {
+    throw mjlib::base::system_error::syserrno(
+        "opening fdcanusb " + options_.path);
+  }
+
+  struct termios tio = {};
+  if (::tcgetattr(fd_, &tio) == 0) {
+    // This may not be a terminal at all, in which case we just use it
+    // as is.
+    ::cfmakeraw(&tio);
+    ::tcsetattr(fd_, TCSANOW, &tio);
+  }
+}
+
+FdcanusbTransport::~FdcanusbTransport() {
+  if (fd_ >= 0) { ::close(fd_); }
+}
+
+void FdcanusbTransport::WriteAll(const char* data, size_t size) {
+  while (size) {
+    const auto written = ::write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        struct pollfd pfd = {};
+        pfd.fd = fd_;
+        pfd.events = POLLOUT;
+        ::poll(&pfd, 1, -1);
+        continue;
+      }
+      throw mjlib::base::system_error::syserrno("writing fdcanusb");
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+size_t FdcanusbTransport::Cycle(const Command* commands, size_t size,
+                                Reply* replies) {
+  // The fdcanusb acts on each line as it arrives, so they are sent in
+  // batches as large as our buffer.
+  size_t tx_size = 0;
+  for (size_t i = 0; i < size; i++) {
+    const auto& command = commands[i];
+    replies[i].valid = false;
+
+    if (tx_size + 15 + command.size * 2 > tx_buffer_.size()) {
+      WriteAll(tx_buffer_.data(), tx_size);
+      tx_size = 0;
+    }
+
+    char* ptr = &tx_buffer_[tx_size];
+    std::memcpy(ptr, "can send ", 9);
+    ptr += 9;
+    const uint32_t id = ArbitrationId(command);
+    for (int shift = 12; shift >= 0; shift -= 4) {
+      *ptr++ = kHex[(id >> shift) & 0x0f];
+    }
+    *ptr++ = ' ';
+    for (size_t j = 0; j < command.size; j++) {
+      *ptr++ = kHex[command.data[j] >> 4];
+      *ptr++ = kHex[command.data[j] & 0x0f];
+    }
+    *ptr++ = '\n';
+    tx_size = ptr - tx_buffer_.data();
+  }
+  WriteAll(tx_buffer_.data(), tx_size);
+
+  const int64_t deadline_us = GetNowUs() + options_.reply_timeout_us;
+  size_t oks_remaining = size;
+  size_t result = 0;
+  size_t expected = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (commands[i].reply_required) { expected++; }
+  }
+
+  while (oks_remaining || result < expected) {
+    if (HandleLine(commands, size, replies, &oks_remaining, &result)) {
+      continue;
+    }
+
+    struct pollfd pfd = {};
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    const int timeout_ms = PollTimeoutMs(deadline_us);
+    const int poll_result = ::poll(&pfd, 1, timeout_ms);
+    if (poll_result < 0) {
+      if (errno == EINTR) { continue; }
+      throw mjlib::base::system_error::syserrno("polling fdcanusb");
+    }
+    if (poll_result == 0) { break; }
+
+    if (rx_size_ == rx_buffer_.size()) {
+      // A line this long can only be garbage.
+      rx_size_ = 0;
+    }
+    const auto nbytes = ::read(fd_, &rx_buffer_[rx_size_],
+                               rx_buffer_.size() - rx_size_);
+    if (nbytes < 0) {
+      if (errno == EAGAIN || errno == EINTR) { continue; }
+      throw mjlib::base::system_error::syserrno("reading fdcanusb");
+    }
+    rx_size_ += nbytes;
+  }
+
+  return result;
+}
+
+bool FdcanusbTransport::HandleLine(
+    const Command* commands, size_t size, Reply* replies,
+    size_t* oks_remaining, size_t* result) {
+  const char* const start = rx_buffer_.data();
+  const char* const end = start + rx_size_;
+  const char* newline = start;
+  while (newline != end && *newline != '\r' && *newline != '\n') {
+    newline++;
+  }
+  if (newline == end) { return false; }
+
+  const std::string_view line(start, newline - start);
+
+  if (line.substr(0, 2) == "OK") {
+    if (*oks_remaining) { (*oks_remaining)--; }
+  } else if (line.substr(0, 4) == "rcv ") {
+    // rcv <id> <hexdata> [flags...]
+    size_t pos = 4;
+    uint32_t id = 0;
+    for (; pos < line.size() && line[pos] != ' '; pos++) {
+      id = (id << 4) | std::max(0, HexValue(line[pos]));
+    }
+    pos++;
+
+    Reply reply;
+    reply.source = (id >> 8) & 0x7f;
+    reply.destination = id & 0x7f;
+    for (; (pos + 1) < line.size() && line[pos] != ' ' &&
+             reply.size < reply.data.size(); pos += 2) {
+      reply.data[reply.size++] =
+          (std::max(0, HexValue(line[pos])) << 4) |
+          std::max(0, HexValue(line[pos + 1]));
+    }
+
+    if (MatchReply(commands, size, replies, reply)) { (*result)++; }
+  } else if (!line.empty()) {
+    throw mjlib::base::system_error::einval(
+        "unexpected fdcanusb response: " + std::string(line));
+  }
+
+  // Consume the line, along with its terminator.
+  const size_t consumed = (newline - start) + 1;
+  std::memmove(rx_buffer_.data(), &rx_buffer_[consumed], rx_size_ - consumed);
+  rx_size_ -= consumed;
+  return true;
+}
+
+}
+}
@@ -0,0 +1,103 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <string>
+
+#include "utils/moteus_client.h"
+
+namespace moteus {
+namespace client {
+
+/// Sends commands to, and collects replies from, a set of moteus
+/// controllers.
+class Transport {
+ public:
+  virtual ~Transport() {}
+
+  /// Send all of @p commands back to back, then wait until each which
+  /// requires a reply has received one, or the reply timeout elapses.
+  ///
+  /// @p replies must have room for @p size entries.  Entry i holds
+  /// the reply to commands[i], and is left invalid when none was
+  /// required or none arrived in time.
+  ///
+  /// @return the number of valid replies
+  virtual size_t Cycle(const Command* commands, size_t size,
+                       Reply* replies) = 0;
+
+  /// Assign a received frame to the first command from @p commands
+  /// which was sent to its source and has not yet been answered.
+  ///
+  /// @return true if some command was waiting for it
+  static bool MatchReply(const Command* commands, size_t size,
+                         Reply* replies, const Reply& reply);
+};
+
+/// Communicates through a Linux SocketCAN interface with CAN-FD
+/// enabled.
+class SocketCanTransport : public Transport {
+ public:
+  struct Options {
+    std::string interface = "can0";
+    int64_t reply_timeout_us = 10000;
+  };
+
+  SocketCanTransport();
+  SocketCanTransport(const Options&);
+  ~SocketCanTransport() override;
+
+  size_t Cycle(const Command* commands, size_t size, Reply* replies) override;
+
+ private:
+  const Options options_;
+  int fd_ = -1;
+};
+
+/// Communicates through an mjbots fdcanusb.
+class FdcanusbTransport : public Transport {
+ public:
+  struct Options {
+    std::string path = "/dev/fdcanusb";
+    int64_t reply_timeout_us = 10000;
+  };
+
+  FdcanusbTransport();
+  FdcanusbTransport(const Options&);
+  ~FdcanusbTransport() override;
+
+  size_t Cycle(const Command* commands, size_t size, Reply* replies) override;
+
+ private:
+  void WriteAll(const char* data, size_t size);
+
+  /// @return true if a complete line was handled
+  bool HandleLine(const Command* commands, size_t size, Reply* replies,
+                  size_t* oks_remaining, size_t* result);
+
+  const Options options_;
+  int fd_ = -1;
+
+  // "can send xxxx " plus the hex data and a newline, for each of a
+  // batch of commands.
+  std::array<char, 32 * (15 + Command::kMaxSize * 2)> tx_buffer_ = {};
+
+  std::array<char, 1024> rx_buffer_ = {};
+  size_t rx_size_ = 0;
+};
+
+}
+}
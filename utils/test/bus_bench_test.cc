@@ -0,0 +1,151 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/bus_bench.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace moteus::client;
+
+namespace {
+/// Answers every frame which requires a reply, except every
+/// drop_every'th, taking 100us per frame of simulated time.
+class FakeTransport : public Transport {
+ public:
+  size_t Cycle(const Command* commands, size_t size,
+               Reply* replies) override {
+    size_t result = 0;
+    last_frames.clear();
+    for (size_t i = 0; i < size; i++) {
+      replies[i] = {};
+      *now_us += 100;
+      kinds.push_back(commands[i].data[0]);
+      last_frames.push_back(std::vector<uint8_t>(
+          commands[i].data.begin(),
+          commands[i].data.begin() + commands[i].size));
+      if (!commands[i].reply_required) { continue; }
+      count++;
+      if (drop_every && (count % drop_every) == 0) { continue; }
+      replies[i].valid = true;
+      replies[i].source = commands[i].destination;
+      replies[i].size = 10;
+      result++;
+    }
+    return result;
+  }
+
+  int64_t* now_us = nullptr;
+  int drop_every = 0;
+  int count = 0;
+  std::vector<uint8_t> kinds;
+  std::vector<std::vector<uint8_t>> last_frames;
+};
+
+struct Fixture {
+  Fixture() {
+    transport.now_us = &now_us;
+  }
+
+  BusBench::Result Run(const BusBench::Options& options) {
+    BusBench dut(&transport, options,
+                 [this]() { return now_us; },
+                 [this](int64_t time_us) { now_us = time_us; });
+    return dut.Run();
+  }
+
+  int64_t now_us = 0;
+  FakeTransport transport;
+};
+}
+
+BOOST_AUTO_TEST_CASE(BusBenchMixTest) {
+  FakeTransport transport;
+  BusBench::Options options;
+  options.ids = {1, 2, 3};
+  options.mix[BusBench::kQuery] = 1;
+  options.mix[BusBench::kCommand] = 0;
+  options.mix[BusBench::kCommandQuery] = 2;
+  options.mix[BusBench::kTunnel] = 1;
+  BusBench dut(&transport, options);
+
+  // The mix is applied across the ids and cycles in turn.
+  BOOST_TEST(dut.kind(0, 0) == BusBench::kQuery);
+  BOOST_TEST(dut.kind(0, 1) == BusBench::kCommandQuery);
+  BOOST_TEST(dut.kind(0, 2) == BusBench::kCommandQuery);
+  BOOST_TEST(dut.kind(1, 0) == BusBench::kTunnel);
+  BOOST_TEST(dut.kind(1, 1) == BusBench::kQuery);
+}
+
+BOOST_AUTO_TEST_CASE(BusBenchRunTest) {
+  Fixture f;
+  f.transport.drop_every = 5;
+
+  BusBench::Options options;
+  options.ids = {1, 2};
+  options.mix[BusBench::kQuery] = 1;
+  options.mix[BusBench::kCommand] = 1;
+  options.mix[BusBench::kCommandQuery] = 0;
+  options.mix[BusBench::kTunnel] = 0;
+  options.rate_hz = 1000.0;
+  options.cycles = 100;
+
+  const auto result = f.Run(options);
+  BOOST_TEST(result.cycles == 100);
+  BOOST_TEST(result.overruns == 0);
+  BOOST_TEST(result.frames_sent == 200);
+  // Only the queries need a reply.
+  BOOST_TEST(result.replies_expected == 100);
+  BOOST_TEST(result.replies_received == 80);
+  BOOST_TEST(result.dropped == 20);
+  // Paced at 1ms per cycle.
+  BOOST_TEST(result.elapsed_s == 0.1);
+  BOOST_TEST(result.latency_p50_us == 200.0);
+  BOOST_TEST(result.latency_max_us == 200.0);
+
+  // The queries and position commands alternate.
+  BOOST_TEST(f.transport.kinds[0] == 0x14);
+  BOOST_TEST(f.transport.kinds[1] == 0x01);
+
+  // Finally, every controller is stopped.
+  const std::vector<uint8_t> stop = { 0x01, 0x00, 0x00 };
+  BOOST_TEST(f.transport.last_frames.size() == 2);
+  for (const auto& frame : f.transport.last_frames) {
+    BOOST_TEST(frame == stop);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(BusBenchOverrunTest) {
+  Fixture f;
+
+  BusBench::Options options;
+  options.ids = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+  // A cycle takes 1.2ms, so cannot keep up with 1kHz.
+  options.rate_hz = 1000.0;
+  options.cycles = 10;
+
+  const auto result = f.Run(options);
+  BOOST_TEST(result.overruns == 10);
+  BOOST_TEST(result.dropped == 0);
+  BOOST_TEST(result.elapsed_s == 0.012);
+}
+
+BOOST_AUTO_TEST_CASE(BusBenchPercentileTest) {
+  std::vector<int64_t> values;
+  for (int i = 1; i <= 100; i++) { values.push_back(i); }
+  BOOST_TEST(BusBench::Percentile(values, 0.5) == 50.0);
+  BOOST_TEST(BusBench::Percentile(values, 0.99) == 99.0);
+  BOOST_TEST(BusBench::Percentile(values, 1.0) == 100.0);
+  BOOST_TEST(BusBench::Percentile(values, 0.0) == 1.0);
+  BOOST_TEST(BusBench::Percentile({}, 0.5) == 0.0);
+}
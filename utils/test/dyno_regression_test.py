@@ -0,0 +1,120 @@
+#!/usr/bin/python3
+
+# Copyright 2020 Josh Pieper, jjp@pobox.com.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import types
+import unittest
+
+import utils.dyno_regression as dut
+
+
+STOPPED = 0
+CURRENT = 9
+POSITION = 10
+
+
+def _item(timestamp, **kwargs):
+    mode = kwargs.pop('mode', None)
+    data = types.SimpleNamespace(**kwargs)
+    if mode is not None:
+        data.mode = types.SimpleNamespace(value=mode)
+    return types.SimpleNamespace(timestamp=timestamp, data=data)
+
+
+def _first_order(times, start, old, new, tau):
+    '''A first order response from old to new beginning at start.'''
+    result = []
+    for t in times:
+        if t < start:
+            result.append(old)
+        else:
+            result.append(new + (old - new) * 2.718281828 ** (-(t - start) / tau))
+    return result
+
+
+class DynoRegressionTest(unittest.TestCase):
+    def test_find_runs(self):
+        data = [_item(i, value=x) for i, x in enumerate(
+            [None, 1, 1, 2, None, 2, 2])]
+        runs = dut._find_runs(data, lambda x: x.data.value)
+        self.assertEqual([[x.timestamp for x in run] for run in runs],
+                         [[1, 2], [3], [5, 6]])
+
+    def test_analyze_step(self):
+        times = [i * 0.001 for i in range(2000)]
+        cmds = [_item(t, mode=POSITION, position=(0.0 if t < 0.5 else 1.0))
+                for t in times]
+        measured = _first_order(times, 0.5, 0.0, 1.0, 0.01)
+        stats = [_item(t, unwrapped_position=x)
+                 for t, x in zip(times, measured)]
+
+        rise_time, overshoot = dut.analyze_step(
+            cmds, stats, 'position', 'unwrapped_position')
+        # 10-90% of a first order response is tau * ln(9).
+        self.assertAlmostEqual(rise_time, 0.01 * 2.1972, delta=0.002)
+        self.assertAlmostEqual(overshoot, 0.0)
+
+    def test_analyze_step_stopped(self):
+        # A step out of the stopped mode is only found if stopped has
+        # a value.
+        cmds = [_item(0.0, mode=STOPPED, i_q_A=0.0),
+                _item(0.5, mode=CURRENT, i_q_A=2.0)]
+        stats = [_item(0.5 + i * 0.001, q_A=(0.0 if i < 5 else 2.2))
+                 for i in range(100)]
+
+        with self.assertRaises(RuntimeError):
+            dut.analyze_step(cmds, stats, 'i_q_A', 'q_A')
+
+        rise_time, overshoot = dut.analyze_step(
+            cmds, stats, 'i_q_A', 'q_A', stopped_value=0.0)
+        self.assertAlmostEqual(rise_time, 0.0)
+        self.assertAlmostEqual(overshoot, 0.1)
+
+    def test_analyze_current_step(self):
+        # As commanded by dynamometer_drive: a held 0A, then +-2A
+        # steps each returning to 0A, then stopped.
+        cmds = []
+        commands = [(0.0, CURRENT, 0.0), (0.5, CURRENT, 2.0),
+                    (1.5, CURRENT, 0.0), (2.0, CURRENT, -2.0),
+                    (3.0, CURRENT, 0.0), (3.5, STOPPED, 0.0)]
+        times = [i * 0.001 for i in range(4000)]
+        for t in times:
+            _, mode, value = [x for x in commands if x[0] <= t][-1]
+            cmds.append(_item(t, mode=mode, i_q_A=value))
+        stats = [_item(t, q_A=x.data.i_q_A + 0.05)
+                 for t, x in zip(times, cmds)]
+
+        result = dut.analyze_current_step({
+            'dut_servo_cmd': cmds,
+            'dut_servo_stats': stats,
+        })
+        self.assertAlmostEqual(result['current_error_A'], 0.05)
+        self.assertAlmostEqual(result['current_rise_time_s'], 0.0)
+
+    def test_compare(self):
+        baseline = dut.make_baseline(
+            {'rise_s': 1.0, 'speed_Hz': 100.0},
+            {'rise_s': 'lower', 'speed_Hz': 'higher'})
+        self.assertAlmostEqual(baseline['rise_s']['tolerance'], 0.1)
+
+        result = dut.compare(
+            {'rise_s': 1.05, 'speed_Hz': 80.0, 'other': 3.0}, baseline)
+        self.assertEqual([(x[0], x[3]) for x in result],
+                         [('other', 'new'), ('rise_s', 'ok'),
+                          ('speed_Hz', 'REGRESSION')])
+
+
+if __name__ == '__main__':
+    unittest.main()
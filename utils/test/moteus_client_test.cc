@@ -0,0 +1,183 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/moteus_client.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include "utils/moteus_transport.h"
+
+using namespace moteus::client;
+
+namespace {
+std::string Hexify(const Command& command) {
+  const char kHex[] = "0123456789abcdef";
+  std::string result;
+  for (size_t i = 0; i < command.size; i++) {
+    result += kHex[command.data[i] >> 4];
+    result += kHex[command.data[i] & 0x0f];
+  }
+  return result;
+}
+}
+
+// The expected frames are those produced by the python
+// moteus.Controller for the same arguments.
+BOOST_AUTO_TEST_CASE(ControllerQueryTest) {
+  Controller::Options options;
+  options.id = 3;
+  Controller dut(options);
+
+  Command command;
+  dut.MakeQuery(&command);
+  BOOST_TEST(command.destination == 3);
+  BOOST_TEST(command.reply_required == true);
+  BOOST_TEST(Hexify(command) == "140400130d");
+
+  dut.MakeStop(&command);
+  BOOST_TEST(command.reply_required == false);
+  BOOST_TEST(Hexify(command) == "010000");
+
+  dut.MakeDiagnosticRead(&command);
+  BOOST_TEST(command.reply_required == true);
+  BOOST_TEST(Hexify(command) == "420130");
+}
+
+BOOST_AUTO_TEST_CASE(ControllerPositionTest) {
+  {
+    Controller dut;
+    Command command;
+    PositionCommand position;
+    position.position = 1.0;
+    position.velocity = 0.5;
+    dut.MakePosition(position, &command, true);
+    BOOST_TEST(Hexify(command) ==
+               "01000a0e200000803f0000003f140400130d");
+  }
+
+  {
+    Controller::Options options;
+    options.position_resolution.position = kInt16;
+    options.position_resolution.velocity = kInt16;
+    options.position_resolution.kp_scale = kInt8;
+    Controller dut(options);
+
+    Command command;
+    PositionCommand position;
+    position.position = std::numeric_limits<double>::quiet_NaN();
+    position.velocity = -0.5;
+    position.feedforward_torque = 0.25;
+    position.kp_scale = 0.5;
+    dut.MakePosition(position, &command);
+    BOOST_TEST(Hexify(command) == "01000a0620008030f80d220000803e01233f");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ControllerCurrentTest) {
+  Controller dut;
+  Command command;
+  CurrentCommand current;
+  current.d_A = 1.0;
+  current.q_A = 2.0;
+  dut.MakeCurrent(current, &command);
+  BOOST_TEST(Hexify(command) == "0100090e1c000000400000803f");
+}
+
+BOOST_AUTO_TEST_CASE(ParseQueryResultTest, *boost::unit_test::tolerance(1e-6)) {
+  const uint8_t data[] = {
+    0x24, 0x04, 0x00, 0x0a, 0x00, 0xf4, 0xff, 0x10, 0x00, 0x32, 0x00,
+    0x23, 0x0d, 0x18, 0x1e, 0x00,
+    0x50,
+  };
+
+  QueryResult result;
+  BOOST_TEST(ParseQueryResult(data, sizeof(data), &result));
+  BOOST_TEST(result.mode == 10);
+  BOOST_TEST(result.position == -0.0012);
+  BOOST_TEST(result.velocity == 0.004);
+  BOOST_TEST(result.torque == 0.5);
+  BOOST_TEST(std::isnan(result.q_current));
+  BOOST_TEST(result.voltage == 12.0);
+  BOOST_TEST(result.temperature == 30.0);
+  BOOST_TEST(result.fault == 0);
+
+  // A truncated reply is reported, but keeps what was decoded.
+  QueryResult truncated;
+  BOOST_TEST(!ParseQueryResult(data, 6, &truncated));
+  BOOST_TEST(truncated.mode == 10);
+  BOOST_TEST(std::isnan(truncated.position));
+}
+
+BOOST_AUTO_TEST_CASE(RegisterScaleTest, *boost::unit_test::tolerance(1e-6)) {
+  Controller::Options options;
+  options.position_resolution.position = kInt16;
+  options.register_scale.position = 10.0;
+  Controller dut(options);
+
+  Command command;
+  PositionCommand position;
+  position.position = 12.5;
+  dut.MakePosition(position, &command);
+  // 12.5 / 0.001 == 12500 == 0x30d4
+  BOOST_TEST(Hexify(command) == "01000a0520d430");
+
+  Reply reply;
+  const uint8_t data[] = { 0x25, 0x01, 0xd4, 0x30 };
+  std::memcpy(reply.data.data(), data, sizeof(data));
+  reply.size = sizeof(data);
+
+  QueryResult result;
+  BOOST_TEST(dut.ParseReply(reply, &result));
+  BOOST_TEST(result.position == 12.5);
+
+  // Without the scale the same bytes decode as the default range.
+  QueryResult unscaled;
+  BOOST_TEST(ParseQueryResult(reply, &unscaled));
+  BOOST_TEST(unscaled.position == 1.25);
+}
+
+BOOST_AUTO_TEST_CASE(MatchReplyTest) {
+  Command commands[3];
+  commands[0].destination = 1;
+  commands[0].reply_required = true;
+  commands[1].destination = 2;
+  commands[1].reply_required = false;
+  commands[2].destination = 1;
+  commands[2].reply_required = true;
+
+  Reply replies[3];
+  Reply reply;
+  reply.source = 1;
+  reply.size = 1;
+
+  reply.data[0] = 5;
+  BOOST_TEST(Transport::MatchReply(commands, 3, replies, reply));
+  reply.data[0] = 6;
+  BOOST_TEST(Transport::MatchReply(commands, 3, replies, reply));
+  BOOST_TEST(!Transport::MatchReply(commands, 3, replies, reply));
+
+  BOOST_TEST(replies[0].valid);
+  BOOST_TEST(replies[0].data[0] == 5);
+  BOOST_TEST(!replies[1].valid);
+  BOOST_TEST(replies[2].valid);
+  BOOST_TEST(replies[2].data[0] == 6);
+
+  reply.source = 2;
+  BOOST_TEST(!Transport::MatchReply(commands, 3, replies, reply));
+}